@@ -0,0 +1,1345 @@
+/*
+ * WinRAR Shell Extension - core benchmarks
+ *
+ * Times the portable core's hot paths: path splitting and extension
+ * matching (every right-click, every walked file), list lines and command
+ * lines, the menu instance lifecycle (and its heap use per right-click),
+ * CRC-32, inflate/deflate and tar reading (zip checks and conversion),
+ * tar.gz to zip conversion against extracting and zipping the files, the
+ * latency of handing a list over by temp file, pipe and memfd (Linux), the
+ * menu icon's premultiply (against the loop it replaced) and the
+ * filters.txt path filter, alone and in front of zipping a selection, an
+ * incremental re-zip of that selection, a simulated batch through the
+ * per-device slots, a jobs-by-threads matrix of zip batches with
+ * deflate standing in for WinRAR, and the zip check's CRC pass across
+ * 1 .. all cores.
+ *
+ *   core_bench                      print "name value unit" lines
+ *   core_bench --check FILE [TOL]   also fail if a result is below TOL
+ *                                   (default 0.5) times its FILE value
+ *
+ * The output is the baseline format: redirect it into bench/baseline*.txt
+ * to record new baselines. Values are best-of-several rates, higher is
+ * better, except the "per click" heap counts, which have no baseline.
+ * Checks are skipped in builds without NDEBUG (not optimized).
+ *
+ * With CORE_BENCH_PATHS_ONLY only the wchar_t benchmarks that stay out of
+ * the C library are run, for the 16-bit wchar_t builds (see CMakeLists.txt).
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L  // clock_gettime
+#endif
+
+#include "../core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+static double Now(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+static uint32_t g_seed = 0x9E3779B9u;
+
+static uint32_t Random(void)
+{
+    g_seed ^= g_seed << 13;
+    g_seed ^= g_seed >> 17;
+    g_seed ^= g_seed << 5;
+    return g_seed;
+}
+
+// Keeps results alive so the work isn't optimized away
+static volatile size_t g_sink;
+
+//=============================================================================
+// Timing and results
+//=============================================================================
+#define TRIALS       5
+#define TRIAL_TIME   0.04
+#define MAX_RESULTS  48
+
+typedef struct {
+    const char* name;
+    double value;
+    const char* unit;
+} Result;
+
+static Result g_results[MAX_RESULTS];
+static int g_nResults;
+
+typedef void (*BenchFn)(void);
+
+static void AddResult(const char* name, double value, const char* unit)
+{
+    printf("%-20s %10.1f %s\n", name, value, unit);
+    fflush(stdout);
+    if (g_nResults < MAX_RESULTS)
+    {
+        g_results[g_nResults].name = name;
+        g_results[g_nResults].value = value;
+        g_results[g_nResults].unit = unit;
+        g_nResults++;
+    }
+}
+
+// Best rate over TRIALS runs of at least TRIAL_TIME seconds each. work is
+// the amount (bytes, items) one call handles; scale converts to the unit.
+static double Measure(const char* name, BenchFn fn, double work, double scale, const char* unit)
+{
+    double best = 0;
+
+    fn();  // Warm up caches and lazily built tables
+    for (int trial = 0; trial < TRIALS; trial++)
+    {
+        double start = Now(), elapsed;
+        size_t calls = 0;
+        do
+        {
+            fn();
+            calls++;
+            elapsed = Now() - start;
+        } while (elapsed < TRIAL_TIME);
+
+        double rate = work * (double)calls / elapsed / scale;
+        if (rate > best) best = rate;
+    }
+    AddResult(name, best, unit);
+    return best;
+}
+
+// Lines of "name value [unit]"; '#' starts a comment
+static int CheckBaseline(const char* path, double tolerance)
+{
+    FILE* f = fopen(path, "r");
+    char line[256];
+    int failed = 0, compared = 0;
+
+    if (!f)
+    {
+        fprintf(stderr, "can't open %s\n", path);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        char name[64];
+        double baseline;
+        if (line[0] == '#' || sscanf(line, "%63s %lf", name, &baseline) != 2)
+            continue;
+
+        for (int i = 0; i < g_nResults; i++)
+        {
+            if (strcmp(g_results[i].name, name) != 0) continue;
+            compared++;
+            if (g_results[i].value < baseline * tolerance)
+            {
+                fprintf(stderr, "%s: %.1f %s, baseline %.1f (limit %.1f)\n", name,
+                        g_results[i].value, g_results[i].unit, baseline, baseline * tolerance);
+                failed = 1;
+            }
+        }
+    }
+    fclose(f);
+
+    if (compared < g_nResults)
+        fprintf(stderr, "note: %d of %d results have no baseline\n", g_nResults - compared, g_nResults);
+    return !failed;
+}
+
+//=============================================================================
+// Paths
+//=============================================================================
+#define N_PATHS  1024
+
+static wchar_t g_PathText[N_PATHS * 160];
+static const wchar_t* g_Paths[N_PATHS];
+static size_t g_PathChars;
+
+static const wchar_t g_Extensions[][EXTENSION_CHARS] = {
+    L".rar", L".zip", L".7z", L".tar", L".gz", L".tgz", L".bz2", L".xz", L".cab", L".iso",
+};
+
+// Explorer-like paths: a few folders, a name, mostly an extension
+static void MakePaths(void)
+{
+    static const wchar_t* folders[] = { L"C:\\Users\\someone", L"Documents", L"Projects",
+                                        L"node_modules", L"src", L"Release Notes 2024",
+                                        L"D:\\Archive", L"build.output", L"x" };
+    static const wchar_t* extensions[] = { L".txt", L".rar", L".ZIP", L".cpp", L".h", L".tar.gz",
+                                           L"", L".jpeg", L".part1.rar" };
+    wchar_t* p = g_PathText;
+
+    for (int i = 0; i < N_PATHS; i++)
+    {
+        const wchar_t* start = p;
+        int depth = 1 + (int)(Random() % 6);
+
+        for (int d = 0; d < depth; d++)
+        {
+            for (const wchar_t* s = folders[Random() % 9]; *s; s++) *p++ = *s;
+            *p++ = L'\\';
+        }
+        for (int k = 3 + (int)(Random() % 20); k > 0; k--)
+            *p++ = (wchar_t)(L'a' + Random() % 26);
+        for (const wchar_t* s = extensions[Random() % 9]; *s; s++) *p++ = *s;
+        *p++ = L'\0';
+
+        g_Paths[i] = start;
+        g_PathChars += (size_t)(p - start - 1);
+    }
+}
+
+static void BenchSplitPath(void)
+{
+    size_t total = 0;
+    for (int i = 0; i < N_PATHS; i++)
+    {
+        PathSpans spans;
+        SplitPath(g_Paths[i], &spans);
+        total += spans.extStart;
+    }
+    g_sink += total;
+}
+
+static void BenchMatchExtension(void)
+{
+    size_t total = 0;
+    for (int i = 0; i < N_PATHS; i++)
+        total += (size_t)MatchesExtension(g_Paths[i], g_Extensions,
+                                           (int)(sizeof(g_Extensions) / sizeof(g_Extensions[0])));
+    g_sink += total;
+}
+
+static wchar_t g_FoldA[4096], g_FoldB[4096];
+
+static void BenchEqualsIgnoreCase(void)
+{
+    g_sink += (size_t)EqualsIgnoreCase(g_FoldA, g_FoldB, 4096);
+}
+
+#if !defined(CORE_BENCH_PATHS_ONLY)
+//=============================================================================
+// List files and command lines
+//=============================================================================
+static uint16_t g_ListBuffer[N_PATHS * 162];
+
+static void BenchListLines(void)
+{
+    size_t used = 0;
+    for (int i = 0; i < N_PATHS; i++)
+        used += EncodeListLine(g_Paths[i], g_ListBuffer + used, sizeof(g_ListBuffer) / 2 - used);
+    g_sink += used;
+}
+
+static void BenchCommandLine(void)
+{
+    wchar_t zipPath[CORE_MAX_PATH];
+    wchar_t command[2 * CORE_MAX_PATH + 64];
+    size_t total = 0;
+
+    for (int i = 0; i < 64; i++)
+    {
+        total += (size_t)MakeZipPath(L"C:\\Users\\someone\\Documents", L"Projects", zipPath);
+        total += (size_t)FormatListCommand(command, sizeof(command) / sizeof(command[0]),
+                                           L"C:\\Program Files\\WinRAR\\WinRAR.exe", L"a -afzip -ep1 -ibck",
+                                           zipPath, L"C:\\Users\\someone\\AppData\\Local\\Temp\\wrq1234.lst");
+    }
+    g_sink += total;
+}
+
+//=============================================================================
+// Menu instances
+//=============================================================================
+// Explorer makes a context menu instance for every right-click. A stream of
+// selections goes through the pooled, arena-backed lifecycle of main.c and
+// through the layout it replaced (one zeroed instance with five MAX_PATH
+// buffers and a MAX_PATH slot per selectable item), one right-click at a
+// time, counting heap allocations and bytes. Sizes use this build's wchar_t.
+#define MENU_CLICKS       4096
+#define MENU_MAX_ITEMS    256       // MAX_SELECTED_ITEMS
+#define MENU_ROOT_CHARS   33        // ROOT_NAME_CHARS
+
+typedef struct BenchMenu {
+    struct BenchMenu* next;         // Pool link
+    void* vtables[2];
+    long cRef;
+    int64_t traceStart;
+    Arena arena;
+    const wchar_t* strings[5];
+    const wchar_t** paths;
+    unsigned counts[3];
+    int selType;
+} BenchMenu;                        // The fields of ExtractContextMenu
+
+#define MENU_OLD_SIZE  ((5 + MENU_MAX_ITEMS) * CORE_MAX_PATH * sizeof(wchar_t) + 64)
+
+static unsigned g_ClickItems[MENU_CLICKS];
+static size_t g_ClickFirst[MENU_CLICKS];    // Into g_ClickLens
+static size_t g_ClickLens[MENU_CLICKS * 16];
+static BenchMenu* g_MenuPool;
+static int g_MenuPoolDepth;
+static size_t g_HeapAllocs, g_HeapBytes;
+
+static void* CountedAlloc(size_t bytes)
+{
+    g_HeapAllocs++;
+    g_HeapBytes += bytes;
+    return calloc(1, bytes);
+}
+
+// Mostly single items, some small multi-selections, a few large ones
+static void MakeClicks(void)
+{
+    size_t used = 0;
+
+    for (int i = 0; i < MENU_CLICKS; i++)
+    {
+        uint32_t r = Random() % 100;
+        unsigned n = (r < 85) ? 1 : (r < 97) ? 2 + Random() % 15 : 17 + Random() % (MENU_MAX_ITEMS - 16);
+        if (used + n > sizeof(g_ClickLens) / sizeof(g_ClickLens[0]))
+            n = 1;
+
+        g_ClickItems[i] = n;
+        g_ClickFirst[i] = used;
+        for (unsigned j = 0; j < n; j++)
+            g_ClickLens[used++] = 20 + Random() % 120;
+    }
+}
+
+static BenchMenu* MenuCreate(void)
+{
+    BenchMenu* m = g_MenuPool;
+
+    if (!m)
+        return CountedAlloc(sizeof(BenchMenu));
+
+    g_MenuPool = m->next;
+    g_MenuPoolDepth--;
+    Arena arena = m->arena;
+    memset(m, 0, sizeof(*m));
+    m->arena = arena;
+    return m;
+}
+
+// What ReadSelection takes from the arena
+static void MenuInitialize(BenchMenu* m, const size_t* lens, unsigned n)
+{
+    size_t bytes = SelectionArenaSize(lens, n, 3, MENU_ROOT_CHARS);
+
+    if (bytes > m->arena.size)
+    {
+        free(m->arena.base);
+        m->arena.base = CountedAlloc(bytes);
+        m->arena.size = bytes;
+    }
+    m->arena.used = 0;
+
+    m->paths = ArenaAlloc(&m->arena, n * sizeof(wchar_t*));
+    for (unsigned i = 0; i < n; i++)
+    {
+        wchar_t* path = ArenaAlloc(&m->arena, (lens[i] + 1) * sizeof(wchar_t));
+        path[lens[i]] = L'\0';
+        m->paths[i] = path;
+    }
+    for (int i = 0; i < 3; i++)
+        m->strings[i] = ArenaAlloc(&m->arena, (lens[0] + 1) * sizeof(wchar_t));
+    m->counts[0] = n;
+}
+
+static void MenuRelease(BenchMenu* m)
+{
+    if (m->arena.base && m->arena.size > MENU_ARENA_KEEP)
+    {
+        free(m->arena.base);
+        m->arena.base = NULL;
+        m->arena.size = 0;
+    }
+
+    if (g_MenuPoolDepth < MENU_POOL_DEPTH)
+    {
+        m->next = g_MenuPool;
+        g_MenuPool = m;
+        g_MenuPoolDepth++;
+    }
+    else
+    {
+        free(m->arena.base);
+        free(m);
+    }
+}
+
+static void FreeMenuPool(void)
+{
+    while (g_MenuPool)
+    {
+        BenchMenu* m = g_MenuPool;
+        g_MenuPool = m->next;
+        free(m->arena.base);
+        free(m);
+    }
+    g_MenuPoolDepth = 0;
+}
+
+static void BenchMenuLifecycle(void)
+{
+    for (int i = 0; i < MENU_CLICKS; i++)
+    {
+        BenchMenu* m = MenuCreate();
+        MenuInitialize(m, g_ClickLens + g_ClickFirst[i], g_ClickItems[i]);
+        g_sink += m->arena.used;
+        MenuRelease(m);
+    }
+}
+
+static void BenchMenuLifecycleOld(void)
+{
+    for (int i = 0; i < MENU_CLICKS; i++)
+    {
+        uint8_t* m = CountedAlloc(MENU_OLD_SIZE);
+        m[MENU_OLD_SIZE - 1] = (uint8_t)g_ClickItems[i];
+        g_sink += m[64];
+        free(m);
+    }
+}
+
+// Allocations and bytes per right-click over one pass, starting cold
+static void MeasureMenuHeap(void)
+{
+    FreeMenuPool();
+    g_HeapAllocs = g_HeapBytes = 0;
+    BenchMenuLifecycle();
+    AddResult("menu_allocs", (double)g_HeapAllocs / MENU_CLICKS, "per click");
+    AddResult("menu_bytes", (double)g_HeapBytes / MENU_CLICKS, "per click");
+
+    g_HeapAllocs = g_HeapBytes = 0;
+    BenchMenuLifecycleOld();
+    AddResult("menu_allocs_old", (double)g_HeapAllocs / MENU_CLICKS, "per click");
+    AddResult("menu_bytes_old", (double)g_HeapBytes / MENU_CLICKS, "per click");
+}
+
+//=============================================================================
+// Codecs
+//=============================================================================
+#define DATA_SIZE  (1 << 20)
+
+static uint8_t* g_Text;          // Word soup: compresses like source code or logs
+static uint8_t* g_Packed;
+static size_t g_PackedLen;
+static uint8_t* g_Tar;
+static size_t g_TarLen;
+static Inflater g_Inflater;
+static Deflater g_Deflater;
+
+static int CountSink(void* context, const uint8_t* data, size_t len)
+{
+    (void)data;
+    *(size_t*)context += len;
+    return 1;
+}
+
+static int StoreSink(void* context, const uint8_t* data, size_t len)
+{
+    (void)context;
+    memcpy(g_Packed + g_PackedLen, data, len);
+    g_PackedLen += len;
+    return 1;
+}
+
+static void MakeText(void)
+{
+    static const char* words[] = { "the ", "return ", "int ", "if (", "status", " = ", "0;\n",
+                                   "WinRAR ", "archive", ".zip ", "{\n", "}\n", "    ", "const ",
+                                   "wchar_t* ", "path", "size_t ", "len", ", ", "error: " };
+    size_t pos = 0;
+
+    while (pos < DATA_SIZE)
+    {
+        const char* w = words[Random() % 20];
+        while (*w && pos < DATA_SIZE) g_Text[pos++] = (uint8_t)*w++;
+    }
+}
+
+static void BenchCrc32(void)
+{
+    g_sink += Crc32Update(0, g_Text, DATA_SIZE);
+}
+
+static void BenchDeflate(void)
+{
+    size_t written = 0;
+    DeflateInit(&g_Deflater, CountSink, &written);
+    DeflateWrite(&g_Deflater, g_Text, DATA_SIZE);
+    DeflateFinish(&g_Deflater);
+    g_sink += written;
+}
+
+static void BenchInflate(void)
+{
+    size_t written = 0;
+    Inflate(&g_Inflater, g_Packed, g_PackedLen, NULL, CountSink, &written);
+    g_sink += written;
+}
+
+// 64 members of 16 KB
+static void MakeTar(void)
+{
+    uint8_t* h = g_Tar;
+
+    for (int i = 0; i < 64; i++, h += 512 + 16384)
+    {
+        memset(h, 0, 512);
+        snprintf((char*)h, 100, "folder/file%02d.txt", i);
+        memcpy(h + 100, "0000644", 8);
+        memcpy(h + 124, "00000040000", 12);
+        memcpy(h + 136, "14000000000", 12);
+        h[156] = '0';
+        memcpy(h + 257, "ustar", 6);
+        memcpy(h + 263, "00", 2);
+
+        unsigned sum = 0;
+        memset(h + 148, ' ', 8);
+        for (int k = 0; k < 512; k++) sum += h[k];
+        snprintf((char*)h + 148, 8, "%06o", sum);
+        h[155] = ' ';
+
+        memcpy(h + 512, g_Text + i * 16384, 16384);
+    }
+    memset(h, 0, 1024);
+    g_TarLen = (size_t)(h + 1024 - g_Tar);
+}
+
+static int TarBegin(void* context, const char* name, size_t nameLen, uint64_t size, int64_t mtime, int isDir)
+{
+    (void)context; (void)name; (void)size; (void)mtime; (void)isDir;
+    g_sink += nameLen;
+    return 1;
+}
+
+static int TarEnd(void* context)
+{
+    (void)context;
+    return 1;
+}
+
+static void BenchTar(void)
+{
+    static TarReader reader;
+    size_t read = 0;
+    TarHandler handler = { TarBegin, CountSink, TarEnd, &read };
+
+    TarInit(&reader, &handler);
+    // Pieces the size of ConvertThreadProc's reads
+    for (size_t pos = 0; pos < g_TarLen; pos += 65536)
+        TarFeed(&reader, g_Tar + pos, g_TarLen - pos < 65536 ? g_TarLen - pos : 65536);
+    g_sink += read;
+}
+
+//=============================================================================
+// Conversion
+//=============================================================================
+// "Convert to .zip" against "Extract to" followed by zipping the folder, on
+// the tar above gzipped. Both inflate, read the tar and deflate each file
+// with its CRC; extracting first also writes the files to the temp folder
+// and reads them back. The conversion runs on one thread here, where
+// ConvertThreadProc overlaps the reading and the writing on two.
+static uint8_t* g_TarGz;
+static size_t g_TarGzLen;
+static char g_TempDir[512];
+
+static struct {
+    Deflater deflater;
+    uint32_t crc;
+    size_t out;
+    FILE* file;             // File being extracted
+    int files;              // Extracted so far
+} g_Conv;
+
+static int AppendTarGz(void* context, const uint8_t* data, size_t len)
+{
+    (void)context;
+    memcpy(g_TarGz + g_TarGzLen, data, len);
+    g_TarGzLen += len;
+    return 1;
+}
+
+static void PutLE32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+
+static void MakeTarGz(void)
+{
+    static const uint8_t header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 255 };
+#if defined(_WIN32)
+    const char* dir = getenv("TEMP");
+    const char* fallback = ".";
+#else
+    const char* dir = getenv("TMPDIR");
+    const char* fallback = "/tmp";
+#endif
+
+    memcpy(g_TarGz, header, 10);
+    g_TarGzLen = 10;
+    DeflateInit(&g_Deflater, AppendTarGz, NULL);
+    DeflateWrite(&g_Deflater, g_Tar, g_TarLen);
+    DeflateFinish(&g_Deflater);
+    PutLE32(g_TarGz + g_TarGzLen, Crc32Update(0, g_Tar, g_TarLen));
+    PutLE32(g_TarGz + g_TarGzLen + 4, (uint32_t)g_TarLen);
+    g_TarGzLen += 8;
+
+    snprintf(g_TempDir, sizeof(g_TempDir), "%s", (dir && dir[0]) ? dir : fallback);
+}
+
+static int ZipBegin(void* context, const char* name, size_t nameLen, uint64_t size, int64_t mtime, int isDir)
+{
+    (void)context; (void)name; (void)nameLen; (void)size; (void)mtime; (void)isDir;
+    g_Conv.crc = 0;
+    DeflateInit(&g_Conv.deflater, CountSink, &g_Conv.out);
+    return 1;
+}
+
+static int ZipData(void* context, const uint8_t* data, size_t len)
+{
+    (void)context;
+    g_Conv.crc = Crc32Update(g_Conv.crc, data, len);
+    return DeflateWrite(&g_Conv.deflater, data, len);
+}
+
+static int ZipEnd(void* context)
+{
+    (void)context;
+    g_sink += g_Conv.crc;
+    return DeflateFinish(&g_Conv.deflater);
+}
+
+static void ExtractedPath(int index, char* path, size_t cap)
+{
+    snprintf(path, cap, "%s/core_bench_%d.tmp", g_TempDir, index);
+}
+
+static int ExtractBegin(void* context, const char* name, size_t nameLen, uint64_t size, int64_t mtime, int isDir)
+{
+    char path[600];
+    (void)context; (void)name; (void)nameLen; (void)size; (void)mtime; (void)isDir;
+    ExtractedPath(g_Conv.files, path, sizeof(path));
+    g_Conv.file = fopen(path, "wb");
+    return g_Conv.file != NULL;
+}
+
+static int ExtractData(void* context, const uint8_t* data, size_t len)
+{
+    (void)context;
+    return fwrite(data, 1, len, g_Conv.file) == len;
+}
+
+static int ExtractEnd(void* context)
+{
+    (void)context;
+    int ok = fclose(g_Conv.file) == 0;
+    g_Conv.file = NULL;
+    g_Conv.files++;
+    return ok;
+}
+
+static void BenchConvert(void)
+{
+    static TarReader reader;
+    TarHandler handler = { ZipBegin, ZipData, ZipEnd, NULL };
+
+    g_Conv.out = 0;
+    TarInit(&reader, &handler);
+    Inflate(&g_Inflater, g_TarGz + 10, g_TarGzLen - 18, NULL, TarFeed, &reader);
+    g_sink += g_Conv.out;
+}
+
+static void BenchExtractThenZip(void)
+{
+    static TarReader reader;
+    static uint8_t buffer[65536];
+    TarHandler handler = { ExtractBegin, ExtractData, ExtractEnd, NULL };
+    char path[600];
+
+    g_Conv.out = 0;
+    g_Conv.files = 0;
+    TarInit(&reader, &handler);
+    Inflate(&g_Inflater, g_TarGz + 10, g_TarGzLen - 18, NULL, TarFeed, &reader);
+
+    for (int i = 0; i < g_Conv.files; i++)
+    {
+        ExtractedPath(i, path, sizeof(path));
+        FILE* f = fopen(path, "rb");
+        if (!f) continue;
+
+        size_t n;
+        ZipBegin(NULL, NULL, 0, 0, 0, 0);
+        while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+            ZipData(NULL, buffer, n);
+        ZipEnd(NULL);
+        fclose(f);
+        remove(path);
+    }
+    g_sink += g_Conv.out;
+}
+
+static void MeasureConvert(void)
+{
+    MakeTarGz();
+
+    // Skipped if the temp folder can't be written
+    BenchExtractThenZip();
+    if (g_Conv.files != 64)
+    {
+        fprintf(stderr, "note: can't write to %s, conversion not compared\n", g_TempDir);
+        return;
+    }
+
+    double convert = Measure("convert", BenchConvert, (double)g_TarLen, 1e6, "MB/s");
+    double extract = Measure("extract_then_zip", BenchExtractThenZip, (double)g_TarLen, 1e6, "MB/s");
+    AddResult("convert_speedup", convert / extract, "x");
+}
+
+#if defined(__linux__)
+//=============================================================================
+// List handoff
+//=============================================================================
+// A list of the N_PATHS paths handed over through each transport and read
+// back by name, as the archiver would: open, the write of the list, the
+// open and read of its path, close. The reader is this process rather than
+// a started archiver, so the rates are the transports' own latency. The
+// file's depends on what the temp folder is (tmpfs, disk), so there are no
+// baselines.
+static size_t g_ListSize;
+static ListTransport g_Transport;
+
+static void BenchListHandoff(void)
+{
+    static uint8_t buffer[65536];
+    ListHandoff h;
+    ssize_t n;
+
+    if (!ListHandoffOpen(&h, g_Transport, g_ListBuffer, g_ListSize, g_TempDir))
+        return;
+    int fd = open(h.path, O_RDONLY);
+    if (fd >= 0)
+    {
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+            g_sink += (size_t)n;
+        close(fd);
+    }
+    ListHandoffServe(&h);
+    ListHandoffClose(&h);
+}
+
+static void MeasureListHandoff(void)
+{
+    static const char* const names[3] = { "list_file", "list_pipe", "list_memfd" };
+    double rates[3];
+    ListHandoff h;
+
+    g_ListSize = 0;
+    for (int i = 0; i < N_PATHS; i++)
+        g_ListSize += EncodeListLine(g_Paths[i], g_ListBuffer + g_ListSize,
+                                     sizeof(g_ListBuffer) / 2 - g_ListSize);
+    g_ListSize *= sizeof(uint16_t);
+
+    for (int t = 0; t < 3; t++)
+    {
+        // A pipe that can't take the whole list would need a reader alongside
+        g_Transport = (ListTransport)t;
+        if (!ListHandoffOpen(&h, g_Transport, g_ListBuffer, g_ListSize, g_TempDir) || h.pendingSize)
+        {
+            fprintf(stderr, "note: %s not available, list handoff not compared\n", names[t]);
+            ListHandoffClose(&h);
+            return;
+        }
+        ListHandoffClose(&h);
+        rates[t] = Measure(names[t], BenchListHandoff, 1, 1e3, "khandoffs/s");
+    }
+    AddResult("list_pipe_speedup", rates[LIST_PIPE] / rates[LIST_FILE], "x");
+    AddResult("list_memfd_speedup", rates[LIST_MEMFD] / rates[LIST_FILE], "x");
+}
+#endif
+
+//=============================================================================
+// Path filter
+//=============================================================================
+static PathFilter g_Filter;
+
+// The kind of filters.txt a source tree gets
+static void MakeFilter(void)
+{
+    static wchar_t rules[] = L"# build output and dependencies\n"
+                             L"node_modules\n"
+                             L"build.output/\n"
+                             L"**/Release Notes 2024/x\n"
+                             L"*.tmp\n"
+                             L"*.obj\n"
+                             L"*.pdb\n"
+                             L"*.jpeg\n"
+                             L"!keep*.jpeg\n"
+                             L"/D:/Archive\n"
+                             L".vs\n"
+                             L"Thumbs.db\n";
+    CompileFilter(&g_Filter, rules, NULL);
+}
+
+static int Allowed(const wchar_t* path)
+{
+    StateSet s;
+    FilterStart(&g_Filter, &s);
+    FilterFeed(&g_Filter, &s, path, wcslen(path));
+    return FilterAllows(&g_Filter, &s);
+}
+
+static void BenchFilterMatch(void)
+{
+    size_t kept = 0;
+    for (int i = 0; i < N_PATHS; i++)
+        kept += (size_t)Allowed(g_Paths[i]);
+    g_sink += kept;
+}
+
+// A selection of N_PATHS 1 KB files zipped whole, and zipped after the
+// filter: rates are over the whole selection, so the ratio of the two is
+// the end-to-end gain
+static void ArchiveSelection(int filtered)
+{
+    size_t written = 0;
+    for (int i = 0; i < N_PATHS; i++)
+    {
+        if (filtered && !Allowed(g_Paths[i])) continue;
+        DeflateInit(&g_Deflater, CountSink, &written);
+        DeflateWrite(&g_Deflater, g_Text + (size_t)i * (DATA_SIZE / N_PATHS), DATA_SIZE / N_PATHS);
+        DeflateFinish(&g_Deflater);
+    }
+    g_sink += written;
+}
+
+static void BenchArchiveAll(void)
+{
+    ArchiveSelection(0);
+}
+
+static void BenchArchiveFiltered(void)
+{
+    ArchiveSelection(1);
+}
+
+// Incremental re-zip of the same selection with 1% of its files modified:
+// the sidecar diff (size and mtime per entry, in the same sorted order)
+// and the changed files zipped again. The rate is over the whole
+// selection, so against archive_all it's the speedup. Not modelled: the
+// walk, which both do, and WinRAR's start.
+static uint64_t g_Stamps[N_PATHS];
+static uint64_t g_SidecarStamps[N_PATHS];
+
+static void MakeStamps(void)
+{
+    for (int i = 0; i < N_PATHS; i++)
+    {
+        g_Stamps[i] = ((uint64_t)Random() << 32) | Random();
+        g_SidecarStamps[i] = g_Stamps[i];
+    }
+    for (int i = 0; i < N_PATHS / 100; i++)
+        g_Stamps[Random() % N_PATHS]++;
+}
+
+static void BenchRezipChanged(void)
+{
+    size_t written = 0;
+    for (int i = 0; i < N_PATHS; i++)
+    {
+        if (g_Stamps[i] == g_SidecarStamps[i]) continue;
+        DeflateInit(&g_Deflater, CountSink, &written);
+        DeflateWrite(&g_Deflater, g_Text + (size_t)i * (DATA_SIZE / N_PATHS), DATA_SIZE / N_PATHS);
+        DeflateFinish(&g_Deflater);
+    }
+    g_sink += written;
+}
+
+//=============================================================================
+// Device scheduling
+//=============================================================================
+// A batch of WinRAR tasks over two hard disks, an SSD and a share, run
+// through a discrete-event simulation: once with the per-device slots the
+// dispatcher uses, once with up to SIM_NAIVE_SLOTS tasks at once whatever
+// their devices. Streams sharing a hard disk lose bandwidth to seeks. The
+// makespan ratio goes into the results as sched_speedup; device_schedule
+// is the rate of the simulation with the slot accounting itself.
+#define SIM_TASKS        48
+#define SIM_DEVICES      4
+#define SIM_NAIVE_SLOTS  4
+
+static const DeviceKind g_SimKinds[SIM_DEVICES] = { DEVICE_HDD, DEVICE_HDD, DEVICE_SSD, DEVICE_NETWORK };
+static const unsigned g_SimLimits[DEVICE_KINDS] = { 1, 4, 2 };
+
+typedef struct {
+    DeviceKey devices[2];
+    unsigned nDevices;
+    double remaining;       // MB
+} SimTask;
+
+static SimTask g_SimTasks[SIM_TASKS];
+static double g_SimSizes[SIM_TASKS];
+
+// Paths are "<device digit>:\..."
+static int SimResolve(void* context, const wchar_t* path, DeviceKey* dev)
+{
+    (void)context;
+    dev->id = (uint32_t)(path[0] - L'0');
+    dev->kind = g_SimKinds[dev->id];
+    return 1;
+}
+
+static void MakeSimTasks(void)
+{
+    static const wchar_t* paths[SIM_DEVICES] = { L"0:\\src", L"1:\\data", L"2:\\fast", L"3:\\share" };
+    for (int i = 0; i < SIM_TASKS; i++)
+    {
+        SimTask* t = &g_SimTasks[i];
+        t->nDevices = ResolveTaskDevices(SimResolve, NULL, g_SimLimits, paths[Random() % SIM_DEVICES],
+                                         paths[Random() % SIM_DEVICES], t->devices);
+        g_SimSizes[i] = 50 + Random() % 450;
+    }
+}
+
+// MB/s each of k streams gets from a device
+static double StreamRate(DeviceKind kind, unsigned k)
+{
+    switch (kind)
+    {
+    case DEVICE_SSD:     return (k <= 4) ? 400 : 1600.0 / k;
+    case DEVICE_NETWORK: return 110.0 / k;
+    default:             return 150.0 / (k * (1 + 0.6 * (k - 1)));
+    }
+}
+
+// Simulated seconds to run every task, oldest first
+static double Simulate(int perDevice)
+{
+    static DeviceSlots slots;
+    int running[SIM_TASKS], nRunning = 0, done = 0;
+    int pending[SIM_TASKS], nPending = SIM_TASKS;
+    double now = 0;
+
+    memset(&slots, 0, sizeof(slots));
+    for (int i = 0; i < SIM_TASKS; i++)
+    {
+        g_SimTasks[i].remaining = g_SimSizes[i];
+        pending[i] = i;
+    }
+
+    while (done < SIM_TASKS)
+    {
+        // Start whatever may start, oldest first
+        for (int p = 0; p < nPending; )
+        {
+            SimTask* t = &g_SimTasks[pending[p]];
+            int start = perDevice ? TryAcquireDevices(&slots, t->devices, t->nDevices)
+                                  : nRunning < SIM_NAIVE_SLOTS;
+            if (start)
+            {
+                running[nRunning++] = pending[p];
+                memmove(pending + p, pending + p + 1, (size_t)(--nPending - p) * sizeof(int));
+            }
+            else
+            {
+                p++;
+            }
+        }
+
+        // Streams per device, then each task's rate and the next to finish
+        unsigned streams[SIM_DEVICES] = {0};
+        double rates[SIM_TASKS], step = 1e30;
+        for (int r = 0; r < nRunning; r++)
+        {
+            const SimTask* t = &g_SimTasks[running[r]];
+            for (unsigned d = 0; d < t->nDevices; d++)
+                streams[t->devices[d].id]++;
+        }
+        for (int r = 0; r < nRunning; r++)
+        {
+            const SimTask* t = &g_SimTasks[running[r]];
+            rates[r] = 1e30;
+            for (unsigned d = 0; d < t->nDevices; d++)
+            {
+                double rate = StreamRate(t->devices[d].kind, streams[t->devices[d].id]);
+                if (rate < rates[r]) rates[r] = rate;
+            }
+            if (t->remaining / rates[r] < step) step = t->remaining / rates[r];
+        }
+
+        now += step;
+        for (int r = 0; r < nRunning; )
+        {
+            SimTask* t = &g_SimTasks[running[r]];
+            t->remaining -= rates[r] * step;
+            if (t->remaining <= 1e-9)
+            {
+                if (perDevice) ReleaseDevices(&slots, t->devices, t->nDevices);
+                running[r] = running[--nRunning];
+                rates[r] = rates[nRunning];
+                done++;
+            }
+            else
+            {
+                r++;
+            }
+        }
+    }
+    return now;
+}
+
+static void BenchDeviceSchedule(void)
+{
+    g_sink += (size_t)Simulate(1);
+}
+
+//=============================================================================
+// Threads
+//=============================================================================
+#define MAX_BENCH_THREADS 64
+
+typedef void (*ThreadFn)(int index);
+
+static ThreadFn g_ThreadFn;
+
+#if defined(_WIN32)
+static DWORD WINAPI ThreadMain(LPVOID param)
+{
+    g_ThreadFn((int)(intptr_t)param);
+    return 0;
+}
+#else
+static void* ThreadMain(void* param)
+{
+    g_ThreadFn((int)(intptr_t)param);
+    return NULL;
+}
+#endif
+
+// fn(0) .. fn(n - 1) at once, fn(0) on this thread; one that can't get a
+// thread runs here too
+static void RunThreads(ThreadFn fn, int n)
+{
+#if defined(_WIN32)
+    HANDLE threads[MAX_BENCH_THREADS];
+#else
+    pthread_t threads[MAX_BENCH_THREADS];
+#endif
+    int started[MAX_BENCH_THREADS];
+
+    g_ThreadFn = fn;
+    for (int i = 1; i < n; i++)
+    {
+#if defined(_WIN32)
+        threads[i] = CreateThread(NULL, 0, ThreadMain, (LPVOID)(intptr_t)i, 0, NULL);
+        started[i] = threads[i] != NULL;
+#else
+        started[i] = pthread_create(&threads[i], NULL, ThreadMain, (void*)(intptr_t)i) == 0;
+#endif
+        if (!started[i]) fn(i);
+    }
+    fn(0);
+    for (int i = 1; i < n; i++)
+    {
+        if (!started[i]) continue;
+#if defined(_WIN32)
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+}
+
+static int CountCores(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int n = (int)si.dwNumberOfProcessors;
+#else
+    int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return (n < 1) ? 1 : (n > 16) ? 16 : n;
+}
+
+// Hands out 0, 1, 2 ... across threads
+static long TakeNext(volatile long* next)
+{
+#if defined(_WIN32)
+    return InterlockedIncrement(next) - 1;
+#else
+    return __atomic_fetch_add(next, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+//=============================================================================
+// Batch matrix
+//=============================================================================
+// A batch of 1, 2 or 4 zip jobs run at once, each with 1 thread, the cores
+// left per job (what the profile picks for RAR's -mt) or all cores. The
+// stand-in archiver is the core's deflate, a job's threads taking its
+// 16 KB files in turn. The rate is over the whole batch. These scale with
+// the machine, so they're reported but have no baseline.
+#define MATRIX_FILE   16384
+#define MATRIX_FILES  64            // Per job: 1 MB
+
+static Deflater* g_ThreadDeflaters;
+static int g_MatrixJobs, g_MatrixThreads;
+static volatile size_t g_ThreadSinks[MAX_BENCH_THREADS];
+
+static void MatrixWorker(int index)
+{
+    int job = index / g_MatrixThreads, thread = index % g_MatrixThreads;
+    size_t written = 0;
+
+    for (int f = thread; f < MATRIX_FILES; f += g_MatrixThreads)
+    {
+        size_t offset = ((size_t)job * MATRIX_FILES + (size_t)f) * MATRIX_FILE % DATA_SIZE;
+        DeflateInit(&g_ThreadDeflaters[index], CountSink, &written);
+        DeflateWrite(&g_ThreadDeflaters[index], g_Text + offset, MATRIX_FILE);
+        DeflateFinish(&g_ThreadDeflaters[index]);
+    }
+    g_ThreadSinks[index] = written;
+}
+
+static void BenchMatrix(void)
+{
+    RunThreads(MatrixWorker, g_MatrixJobs * g_MatrixThreads);
+}
+
+static void MeasureMatrix(void)
+{
+    static char names[3][3][24];
+    int cores = CountCores();
+
+    g_ThreadDeflaters = malloc(MAX_BENCH_THREADS * sizeof(Deflater));
+    if (!g_ThreadDeflaters)
+        return;
+
+    for (int j = 0; j < 3; j++)
+    {
+        int threads[3] = { 1, 0, cores };
+        g_MatrixJobs = 1 << j;
+        threads[1] = (cores / g_MatrixJobs > 1) ? cores / g_MatrixJobs : 1;
+        for (int t = 0; t < 3; t++)
+        {
+            static const char* labels[3] = { "t1", "tauto", "tall" };
+            g_MatrixThreads = threads[t];
+            snprintf(names[j][t], sizeof(names[j][t]), "batch_j%d_%s", g_MatrixJobs, labels[t]);
+            Measure(names[j][t], BenchMatrix, (double)g_MatrixJobs * MATRIX_FILES * MATRIX_FILE, 1e6, "MB/s");
+        }
+    }
+    free(g_ThreadDeflaters);
+}
+
+//=============================================================================
+// Zip check scaling
+//=============================================================================
+// The [Zip] Verify pass: a thread per core takes entries one at a time and
+// runs them through CRC-32. Entries are 4 KB to 256 KB slices of the text,
+// so the work is uneven like a real archive's. Reported for 1, 2, 4 ...
+// threads up to the core count, plus the speedup of the most over 1. These
+// scale with the machine, so they have no baseline.
+#define CHECK_ENTRIES  256
+
+static size_t g_CheckOffsets[CHECK_ENTRIES], g_CheckSizes[CHECK_ENTRIES];
+static volatile long g_CheckNext;
+static int g_CheckThreads;
+
+static void MakeCheckEntries(void)
+{
+    for (int i = 0; i < CHECK_ENTRIES; i++)
+    {
+        g_CheckSizes[i] = 4096 + Random() % (256 * 1024 - 4096);
+        g_CheckOffsets[i] = Random() % (DATA_SIZE - g_CheckSizes[i]);
+    }
+}
+
+static void CheckWorker(int index)
+{
+    uint32_t crcs = 0;
+    long i;
+
+    while ((i = TakeNext(&g_CheckNext)) < CHECK_ENTRIES)
+        crcs ^= Crc32Update(0, g_Text + g_CheckOffsets[i], g_CheckSizes[i]);
+    g_ThreadSinks[index] = crcs;
+}
+
+static void BenchZipCheck(void)
+{
+    g_CheckNext = 0;
+    RunThreads(CheckWorker, g_CheckThreads);
+}
+
+static void MeasureZipCheck(void)
+{
+    static char names[8][24];
+    int cores = CountCores(), n = 0;
+    double total = 0, single = 0, best = 0;
+
+    MakeCheckEntries();
+    for (int i = 0; i < CHECK_ENTRIES; i++)
+        total += (double)g_CheckSizes[i];
+
+    for (int threads = 1; n < 8; threads *= 2)
+    {
+        g_CheckThreads = (threads < cores) ? threads : cores;
+        snprintf(names[n], sizeof(names[n]), "zip_check_t%d", g_CheckThreads);
+        double rate = Measure(names[n++], BenchZipCheck, total, 1e6, "MB/s");
+        if (g_CheckThreads == 1) single = rate;
+        if (rate > best) best = rate;
+        if (g_CheckThreads == cores) break;
+    }
+    AddResult("zip_check_scaling", best / single, "x");
+}
+
+//=============================================================================
+// Pixels
+//=============================================================================
+static uint8_t g_Pixels[256 * 256 * 4];
+
+// Runs over its own output; alpha is left alone, so every pass does the
+// same work
+static void BenchPremultiply(void)
+{
+    PremultiplyAlpha(g_Pixels, 256 * 256);
+    g_sink += g_Pixels[4 * 1000];
+}
+
+// The loop main.c had before PremultiplyAlpha, as the reference for
+// premultiply_speedup
+static void BenchPremultiplyScalar(void)
+{
+    uint8_t* p = g_Pixels;
+    for (int i = 0; i < 256 * 256; i++)
+    {
+        uint8_t a = p[3];
+        if (a < 255)
+        {
+            p[0] = (uint8_t)((p[0] * a) / 255);
+            p[1] = (uint8_t)((p[1] * a) / 255);
+            p[2] = (uint8_t)((p[2] * a) / 255);
+        }
+        p += 4;
+    }
+    g_sink += g_Pixels[4 * 1000];
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    const char* baseline = NULL;
+    double tolerance = 0.5;
+
+    if (argc >= 3 && strcmp(argv[1], "--check") == 0)
+    {
+        baseline = argv[2];
+        if (argc >= 4) tolerance = atof(argv[3]);
+    }
+    else if (argc != 1)
+    {
+        fprintf(stderr, "usage: %s [--check BASELINE [TOLERANCE]]\n", argv[0]);
+        return 2;
+    }
+
+    MakePaths();
+    for (int i = 0; i < 4096; i++)
+    {
+        g_FoldA[i] = (wchar_t)(L'A' + i % 26);
+        g_FoldB[i] = (wchar_t)(L'a' + i % 26);
+    }
+
+    Measure("split_path", BenchSplitPath, (double)g_PathChars * sizeof(wchar_t), 1e6, "MB/s");
+    Measure("match_extension", BenchMatchExtension, N_PATHS, 1e6, "Mpaths/s");
+    Measure("equals_ignore_case", BenchEqualsIgnoreCase, 4096 * sizeof(wchar_t), 1e6, "MB/s");
+
+#if !defined(CORE_BENCH_PATHS_ONLY)
+    Measure("list_lines", BenchListLines, N_PATHS, 1e6, "Mlines/s");
+    Measure("command_line", BenchCommandLine, 64, 1e6, "Mcommands/s");
+
+    MakeClicks();
+    MeasureMenuHeap();
+    double menu = Measure("menu_lifecycle", BenchMenuLifecycle, MENU_CLICKS, 1e6, "Mclicks/s");
+    double menuOld = Measure("menu_lifecycle_old", BenchMenuLifecycleOld, MENU_CLICKS, 1e6, "Mclicks/s");
+    AddResult("menu_speedup", menu / menuOld, "x");
+    FreeMenuPool();
+
+    g_Text = malloc(DATA_SIZE);
+    g_Packed = malloc(DATA_SIZE + DATA_SIZE / 8);
+    g_Tar = malloc(64 * (512 + 16384) + 1024);
+    g_TarGz = malloc(64 * (512 + 16384) + 1024 + 4096);
+    if (!g_Text || !g_Packed || !g_Tar || !g_TarGz)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    MakeText();
+    Crc32Init();
+    DeflateInit(&g_Deflater, StoreSink, NULL);
+    DeflateWrite(&g_Deflater, g_Text, DATA_SIZE);
+    DeflateFinish(&g_Deflater);
+    MakeTar();
+    for (size_t i = 0; i < sizeof(g_Pixels); i++)
+        g_Pixels[i] = (uint8_t)Random();
+
+    Measure("crc32", BenchCrc32, DATA_SIZE, 1e6, "MB/s");
+    Measure("deflate", BenchDeflate, DATA_SIZE, 1e6, "MB/s");
+    Measure("inflate", BenchInflate, DATA_SIZE, 1e6, "MB/s");
+    Measure("tar_read", BenchTar, (double)g_TarLen, 1e6, "MB/s");
+    MeasureConvert();
+#if defined(__linux__)
+    MeasureListHandoff();
+#endif
+    double premultiply = Measure("premultiply", BenchPremultiply, 256 * 256, 1e6, "Mpixels/s");
+    double premultiplyScalar = Measure("premultiply_scalar", BenchPremultiplyScalar, 256 * 256, 1e6, "Mpixels/s");
+    AddResult("premultiply_speedup", premultiply / premultiplyScalar, "x");
+
+    MakeFilter();
+    Measure("filter_match", BenchFilterMatch, N_PATHS, 1e6, "Mpaths/s");
+    Measure("archive_all", BenchArchiveAll, DATA_SIZE, 1e6, "MB/s");
+    Measure("archive_filtered", BenchArchiveFiltered, DATA_SIZE, 1e6, "MB/s");
+    MakeStamps();
+    Measure("rezip_1pct", BenchRezipChanged, DATA_SIZE, 1e6, "MB/s");
+
+    MakeSimTasks();
+    Measure("device_schedule", BenchDeviceSchedule, SIM_TASKS, 1e6, "Mtasks/s");
+    AddResult("sched_speedup", Simulate(0) / Simulate(1), "x");
+
+    MeasureMatrix();
+    MeasureZipCheck();
+#endif
+
+    if (!baseline)
+        return 0;
+#if !defined(NDEBUG)
+    printf("not an optimized build, baseline check skipped\n");
+    return 0;
+#else
+    return CheckBaseline(baseline, tolerance) ? 0 : 1;
+#endif
+}
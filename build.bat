@@ -24,11 +24,11 @@ echo Building WinRARShellExtQuickExtract.dll...
 call "%VSDIR%\VC\Auxiliary\Build\vcvars64.bat" >nul
 
 cl /nologo /O2 /W3 /LD /DUNICODE /D_UNICODE ^
-   "%PROJECT_DIR%main.c" ^
+   "%PROJECT_DIR%main.c" "%PROJECT_DIR%core.c" ^
    /Fo:"%BUILD_DIR%\\" ^
    /Fe:"%BUILD_DIR%\WinRARShellExtQuickExtract.dll" ^
    /link /DEF:"%PROJECT_DIR%WinRARShellExtQuickExtract.def" ^
-   ole32.lib shell32.lib advapi32.lib user32.lib shlwapi.lib comctl32.lib gdi32.lib
+   ole32.lib shell32.lib advapi32.lib user32.lib shlwapi.lib comctl32.lib gdi32.lib shcore.lib
 
 if %errorlevel% neq 0 (
     echo Build failed!
@@ -0,0 +1,2434 @@
+/*
+ * WinRAR Shell Extension - portable core
+ *
+ * See core.h. No Windows headers in here; the Linux list handoff, device
+ * resolver and priority knobs are the only platform code.
+ */
+
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE  // major(), minor(), statfs(), syscall(), mkstemp()
+#endif
+
+#include "core.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CORE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CORE_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// The vector scans compare 16-bit lanes, so they need a 16-bit wchar_t
+#if (defined(CORE_AVX2) || defined(CORE_SSE2)) && WCHAR_MAX <= 0xFFFF
+#define CORE_VECTOR_PATHS
+#endif
+
+static wchar_t FoldAscii(wchar_t c)
+{
+    return (c >= L'A' && c <= L'Z') ? (wchar_t)(c + (L'a' - L'A')) : c;
+}
+
+//=============================================================================
+// Path spans
+//=============================================================================
+// One pass over the path tracks the last separator ('\', '/', ':'), the last
+// '.' and the last space; the spans follow from those. A dot only starts the
+// extension if it's in the file name and no space comes after it, like
+// PathFindExtension.
+static void FinishSpans(size_t length, ptrdiff_t lastSep, ptrdiff_t lastDot, ptrdiff_t lastSpace,
+                        PathSpans* spans)
+{
+    spans->length = length;
+    spans->nameStart = (size_t)(lastSep + 1);
+    spans->extStart = (lastDot > lastSep && lastDot > lastSpace) ? (size_t)lastDot : length;
+}
+
+#if !defined(CORE_VECTOR_PATHS)
+static void SplitPathScalar(const wchar_t* path, PathSpans* spans)
+{
+    ptrdiff_t lastSep = -1, lastDot = -1, lastSpace = -1;
+    ptrdiff_t i = 0;
+
+    for (; path[i]; i++)
+    {
+        wchar_t c = path[i];
+        if (c == L'\\' || c == L'/' || c == L':') lastSep = i;
+        else if (c == L'.') lastDot = i;
+        else if (c == L' ') lastSpace = i;
+    }
+    FinishSpans((size_t)i, lastSep, lastDot, lastSpace, spans);
+}
+#endif
+
+#if defined(CORE_VECTOR_PATHS)
+static unsigned LowestBit(uint32_t m)
+{
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanForward(&i, m);
+    return i;
+#else
+    return (unsigned)__builtin_ctz(m);
+#endif
+}
+
+static unsigned HighestBit(uint32_t m)
+{
+#if defined(_MSC_VER)
+    unsigned long i;
+    _BitScanReverse(&i, m);
+    return i;
+#else
+    return 31u - (unsigned)__builtin_clz(m);
+#endif
+}
+
+// Byte masks (two bits per character) of one aligned block
+typedef struct {
+    uint32_t seps;
+    uint32_t dots;
+    uint32_t spaces;
+    uint32_t zeros;
+} BlockMasks;
+
+#if defined(CORE_AVX2)
+#define PATH_BLOCK 32
+#define BLOCK_LANES 0xFFFFFFFFu
+
+static void ScanBlock(const void* block, BlockMasks* m)
+{
+    __m256i v = _mm256_load_si256((const __m256i*)block);
+    __m256i seps = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi16(v, _mm256_set1_epi16(L'\\')),
+                        _mm256_cmpeq_epi16(v, _mm256_set1_epi16(L'/'))),
+        _mm256_cmpeq_epi16(v, _mm256_set1_epi16(L':')));
+
+    m->seps = (uint32_t)_mm256_movemask_epi8(seps);
+    m->dots = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, _mm256_set1_epi16(L'.')));
+    m->spaces = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, _mm256_set1_epi16(L' ')));
+    m->zeros = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, _mm256_setzero_si256()));
+}
+#else
+#define PATH_BLOCK 16
+#define BLOCK_LANES 0xFFFFu
+
+static void ScanBlock(const void* block, BlockMasks* m)
+{
+    __m128i v = _mm_load_si128((const __m128i*)block);
+    __m128i seps = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi16(v, _mm_set1_epi16(L'\\')),
+                     _mm_cmpeq_epi16(v, _mm_set1_epi16(L'/'))),
+        _mm_cmpeq_epi16(v, _mm_set1_epi16(L':')));
+
+    m->seps = (uint32_t)_mm_movemask_epi8(seps);
+    m->dots = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_set1_epi16(L'.')));
+    m->spaces = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_set1_epi16(L' ')));
+    m->zeros = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_setzero_si128()));
+}
+#endif
+
+// Aligned loads never cross a page, so reading the whole block around the
+// start and the terminator is safe; lanes outside the string are masked off.
+static void SplitPathVector(const wchar_t* path, PathSpans* spans)
+{
+    uintptr_t start = (uintptr_t)path;
+    uintptr_t block = start & ~(uintptr_t)(PATH_BLOCK - 1);
+    uint32_t valid = (BLOCK_LANES << (start - block)) & BLOCK_LANES;
+    ptrdiff_t lastSep = -1, lastDot = -1, lastSpace = -1;
+
+    for (;; block += PATH_BLOCK, valid = BLOCK_LANES)
+    {
+        BlockMasks m;
+        ptrdiff_t base = ((ptrdiff_t)block - (ptrdiff_t)start) / 2;  // Character index of the block
+
+        ScanBlock((const void*)block, &m);
+        uint32_t zeros = m.zeros & valid;
+        if (zeros)
+            valid &= (zeros & (0u - zeros)) - 1;  // Bytes before the terminator
+
+        if (m.seps & valid)   lastSep = base + (ptrdiff_t)(HighestBit(m.seps & valid) >> 1);
+        if (m.dots & valid)   lastDot = base + (ptrdiff_t)(HighestBit(m.dots & valid) >> 1);
+        if (m.spaces & valid) lastSpace = base + (ptrdiff_t)(HighestBit(m.spaces & valid) >> 1);
+
+        if (zeros)
+        {
+            FinishSpans((size_t)(base + (ptrdiff_t)(LowestBit(zeros) >> 1)), lastSep, lastDot, lastSpace, spans);
+            return;
+        }
+    }
+}
+#endif
+
+void SplitPath(const wchar_t* path, PathSpans* spans)
+{
+#if defined(CORE_VECTOR_PATHS)
+    SplitPathVector(path, spans);
+#else
+    SplitPathScalar(path, spans);
+#endif
+}
+
+int EqualsIgnoreCase(const wchar_t* a, const wchar_t* b, size_t n)
+{
+    size_t i = 0;
+
+#if defined(CORE_VECTOR_PATHS)
+    // 8 characters per step: add 0x20 to 'A'..'Z' on both sides and compare
+    const __m128i before = _mm_set1_epi16(L'A' - 1);
+    const __m128i after = _mm_set1_epi16(L'Z' + 1);
+    const __m128i caseBit = _mm_set1_epi16(0x20);
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i xUpper = _mm_and_si128(_mm_cmpgt_epi16(x, before), _mm_cmplt_epi16(x, after));
+        __m128i yUpper = _mm_and_si128(_mm_cmpgt_epi16(y, before), _mm_cmplt_epi16(y, after));
+        x = _mm_add_epi16(x, _mm_and_si128(xUpper, caseBit));
+        y = _mm_add_epi16(y, _mm_and_si128(yUpper, caseBit));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(x, y)) != 0xFFFF)
+            return 0;
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        if (FoldAscii(a[i]) != FoldAscii(b[i]))
+            return 0;
+    }
+    return 1;
+}
+
+//=============================================================================
+// Paths and extensions
+//=============================================================================
+static int IsSeparator(wchar_t c)
+{
+    return c == L'\\' || c == L'/';
+}
+
+const wchar_t* FindFileName(const wchar_t* path)
+{
+    PathSpans spans;
+    SplitPath(path, &spans);
+    return path + spans.nameStart;
+}
+
+const wchar_t* FindExtension(const wchar_t* path)
+{
+    PathSpans spans;
+    SplitPath(path, &spans);
+    return path + spans.extStart;
+}
+
+int MatchesExtension(const wchar_t* path, const wchar_t (*extensions)[EXTENSION_CHARS], int count)
+{
+    PathSpans spans;
+    SplitPath(path, &spans);
+
+    const wchar_t* ext = path + spans.extStart;
+    size_t extLen = spans.length - spans.extStart;
+    if (extLen == 0 || extLen >= EXTENSION_CHARS) return 0;
+
+    // Both sides have extLen readable characters: the list entries are
+    // EXTENSION_CHARS long
+    for (int i = 0; i < count; i++)
+    {
+        if (extensions[i][extLen] == L'\0' && EqualsIgnoreCase(ext, extensions[i], extLen))
+            return 1;
+    }
+    return 0;
+}
+
+//=============================================================================
+// Selection and naming
+//=============================================================================
+SelectionType ClassifySelection(unsigned nFiles, unsigned nFolders, int singleIsArchive)
+{
+    if (nFiles + nFolders == 1)
+    {
+        if (singleIsArchive) return SEL_SINGLE_ARCHIVE;
+        return nFolders ? SEL_FOLDERS_ONLY : SEL_NONE;
+    }
+
+    if (nFiles > 0 && nFolders == 0) return SEL_FILES_ONLY;
+    if (nFolders > 0 && nFiles == 0) return SEL_FOLDERS_ONLY;
+    if (nFiles > 0 && nFolders > 0)  return SEL_MIXED;
+    return SEL_NONE;
+}
+
+int MakeExtractDestination(const wchar_t* archivePath, wchar_t* folderName, wchar_t* destFolder)
+{
+    PathSpans spans;
+    SplitPath(archivePath, &spans);
+
+    const wchar_t* name = archivePath + spans.nameStart;
+    size_t dirLen = spans.nameStart;
+    size_t nameLen = spans.extStart - spans.nameStart;
+
+    if (nameLen >= CORE_MAX_PATH || dirLen + nameLen >= CORE_MAX_PATH)
+        return 0;
+
+    wmemcpy(folderName, name, nameLen);
+    folderName[nameLen] = L'\0';
+
+    // The archive's folder keeps its trailing separator: "C:\" + "name"
+    wmemcpy(destFolder, archivePath, dirLen);
+    wmemcpy(destFolder + dirLen, name, nameLen);
+    destFolder[dirLen + nameLen] = L'\0';
+    return 1;
+}
+
+// swprintf that leaves an empty string rather than a truncated one
+static int FormatString(wchar_t* out, size_t cch, const wchar_t* format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    int n = vswprintf(out, cch, format, args);
+    va_end(args);
+
+    if (n < 0 || (size_t)n >= cch)
+    {
+        if (cch) out[0] = L'\0';
+        return 0;
+    }
+    return 1;
+}
+
+int MakeZipPath(const wchar_t* dir, const wchar_t* name, wchar_t* out)
+{
+    size_t dirLen = wcslen(dir);
+    const wchar_t* sep = (dirLen && IsSeparator(dir[dirLen - 1])) ? L"" : L"\\";
+
+    return FormatString(out, CORE_MAX_PATH, L"%ls%ls%ls.zip", dir, sep, name);
+}
+
+//=============================================================================
+// List files and command lines
+//=============================================================================
+size_t EncodeListLine(const wchar_t* path, uint16_t* out, size_t cap)
+{
+    size_t used = 0;
+
+    for (const wchar_t* p = path; *p; p++)
+    {
+        uint32_t c = (uint32_t)*p;
+        if (c > 0xFFFF)
+        {
+            // Only reachable with a 32-bit wchar_t
+            if (used + 2 > cap) return 0;
+            c -= 0x10000;
+            out[used++] = (uint16_t)(0xD800 | (c >> 10));
+            out[used++] = (uint16_t)(0xDC00 | (c & 0x3FF));
+        }
+        else
+        {
+            if (used + 1 > cap) return 0;
+            out[used++] = (uint16_t)c;
+        }
+    }
+
+    if (used + 2 > cap) return 0;
+    out[used++] = L'\r';
+    out[used++] = L'\n';
+    return used;
+}
+
+int FormatListCommand(wchar_t* out, size_t cch, const wchar_t* winrar, const wchar_t* command,
+                      const wchar_t* archive, const wchar_t* listPath)
+{
+    return FormatString(out, cch, L"\"%ls\" %ls \"%ls\" @\"%ls\"",
+                        winrar, command, archive, listPath);
+}
+
+int FormatExtractCommand(wchar_t* out, size_t cch, const wchar_t* winrar, const wchar_t* archive,
+                         const wchar_t* listPath, const wchar_t* destFolder)
+{
+    // The trailing backslash makes WinRAR treat the destination as a folder
+    if (listPath)
+        return FormatString(out, cch, L"\"%ls\" x \"%ls\" @\"%ls\" \"%ls\\\"",
+                            winrar, archive, listPath, destFolder);
+    return FormatString(out, cch, L"\"%ls\" x \"%ls\" \"%ls\\\"",
+                        winrar, archive, destFolder);
+}
+
+#if defined(__linux__)
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ  1031
+#endif
+#define LIST_PIPE_BUFFER  (1024 * 1024)   // Default /proc/sys/fs/pipe-max-size
+
+static int WriteAll(int fd, const uint8_t* p, size_t n)
+{
+    while (n)
+    {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return 0;
+        p += w;
+        n -= (size_t)w;
+    }
+    return 1;
+}
+
+// Pipe: as much as the buffer takes now, the rest is left pending
+static int OpenListPipe(ListHandoff* h, const uint8_t* data, size_t size)
+{
+    int fds[2];
+
+    if (pipe(fds) != 0) return 0;
+    h->fd = fds[0];
+    h->writeFd = fds[1];
+    fcntl(h->writeFd, F_SETFD, FD_CLOEXEC);
+
+    // Grow the buffer to fit the list, up to what any process may ask for
+    if (size > 65536)
+        fcntl(h->writeFd, F_SETPIPE_SZ, (int)(size < LIST_PIPE_BUFFER ? size : LIST_PIPE_BUFFER));
+
+    fcntl(h->writeFd, F_SETFL, O_NONBLOCK);
+    while (size)
+    {
+        ssize_t w = write(h->writeFd, data, size);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && errno == EAGAIN) break;
+        if (w <= 0) return 0;
+        data += w;
+        size -= (size_t)w;
+    }
+    fcntl(h->writeFd, F_SETFL, 0);
+
+    h->pending = data;
+    h->pendingSize = size;
+    if (!size)
+    {
+        close(h->writeFd);
+        h->writeFd = -1;
+    }
+    return 1;
+}
+
+static int OpenListMemfd(ListHandoff* h, const uint8_t* data, size_t size)
+{
+#if defined(SYS_memfd_create)
+    h->fd = (int)syscall(SYS_memfd_create, "list", 0);
+    return h->fd >= 0 && WriteAll(h->fd, data, size) && lseek(h->fd, 0, SEEK_SET) == 0;
+#else
+    (void)h; (void)data; (void)size;
+    return 0;
+#endif
+}
+
+static int OpenListFile(ListHandoff* h, const uint8_t* data, size_t size, const char* tempDir)
+{
+    int n = snprintf(h->path, sizeof(h->path), "%s/wrxXXXXXX", tempDir);
+    if (n < 0 || (size_t)n >= sizeof(h->path))
+    {
+        h->path[0] = '\0';
+        return 0;
+    }
+
+    int fd = mkstemp(h->path);
+    if (fd < 0)
+    {
+        h->path[0] = '\0';
+        return 0;
+    }
+    int ok = WriteAll(fd, data, size);
+    return close(fd) == 0 && ok;
+}
+
+int ListHandoffOpen(ListHandoff* h, ListTransport transport, const void* data, size_t size,
+                    const char* tempDir)
+{
+    int ok = 0;
+
+    memset(h, 0, sizeof(*h));
+    h->transport = transport;
+    h->fd = -1;
+    h->writeFd = -1;
+
+    if (transport == LIST_PIPE)
+        ok = OpenListPipe(h, data, size);
+    else if (transport == LIST_MEMFD)
+        ok = OpenListMemfd(h, data, size);
+    else
+        ok = OpenListFile(h, data, size, tempDir);
+
+    if (ok && h->fd >= 0)
+        snprintf(h->path, sizeof(h->path), "/dev/fd/%d", h->fd);
+    if (!ok)
+        ListHandoffClose(h);
+    return ok;
+}
+
+int ListHandoffServe(ListHandoff* h)
+{
+    // With the parent's copy gone, a child that exits early ends the write
+    if (h->fd >= 0)
+    {
+        close(h->fd);
+        h->fd = -1;
+    }
+    if (h->writeFd < 0) return 1;
+
+    int ok = WriteAll(h->writeFd, h->pending, h->pendingSize);
+    close(h->writeFd);
+    h->writeFd = -1;
+    h->pending = NULL;
+    h->pendingSize = 0;
+    return ok;
+}
+
+void ListHandoffClose(ListHandoff* h)
+{
+    if (h->writeFd >= 0) close(h->writeFd);
+    if (h->fd >= 0) close(h->fd);
+    if (h->transport == LIST_FILE && h->path[0])
+        unlink(h->path);
+    h->fd = -1;
+    h->writeFd = -1;
+    h->pending = NULL;
+    h->pendingSize = 0;
+    h->path[0] = '\0';
+}
+#endif
+
+//=============================================================================
+// Selection arena
+//=============================================================================
+static size_t ArenaAlign(size_t bytes)
+{
+    return (bytes + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+void* ArenaAlloc(Arena* arena, size_t bytes)
+{
+    bytes = ArenaAlign(bytes);
+    if (bytes > arena->size - arena->used)
+        return NULL;
+
+    void* p = arena->base + arena->used;
+    arena->used += bytes;
+    return p;
+}
+
+size_t SelectionArenaSize(const size_t* lens, unsigned n, unsigned copies, size_t rootChars)
+{
+    size_t bytes = ArenaAlign(n * sizeof(wchar_t*)) + ArenaAlign(rootChars * sizeof(wchar_t));
+
+    for (unsigned i = 0; i < n; i++)
+        bytes += ArenaAlign((lens[i] + 1) * sizeof(wchar_t));
+    if (n)
+        bytes += copies * ArenaAlign((lens[0] + 1) * sizeof(wchar_t));
+    return bytes;
+}
+
+//=============================================================================
+// Path filter
+//=============================================================================
+// One state per glob token, plus a start state per rule. A rule's tokens
+// are consecutive bits, so advancing every state at once is a shift by one
+// masked with the states the character may enter.
+#define CLASS_OTHER 0   // Characters no rule mentions
+#define CLASS_SEP   1   // '\' and '/'
+
+typedef enum { TOK_LIT, TOK_ANY, TOK_STAR, TOK_GLOBSTAR, TOK_SEP } GlobTokenType;
+
+typedef struct {
+    uint8_t type;
+    wchar_t ch;
+} GlobToken;
+
+static unsigned FilterClassOf(const PathFilter* f, wchar_t c)
+{
+    if ((uint32_t)c < 128) return f->asciiClass[FoldAscii(c)];
+
+    for (unsigned i = 0; i < f->nOther; i++)
+    {
+        if (f->otherChars[i] == c)
+            return FILTER_MAX_CLASSES - 1 - i;
+    }
+    return CLASS_OTHER;
+}
+
+static void SetBit(StateSet* s, unsigned bit)
+{
+    s->w[bit >> 6] |= 1ull << (bit & 63);
+}
+
+// 0 if c needs a class and none is left: CLASS_OTHER would make the
+// literal match any character no rule mentions
+static int FilterAssignClass(PathFilter* f, wchar_t c)
+{
+    if ((uint32_t)c < 128)
+    {
+        if (f->asciiClass[c] != CLASS_OTHER)
+            return 1;
+        if (f->nClasses >= FILTER_MAX_CLASSES - f->nOther)
+            return 0;
+        f->asciiClass[c] = (uint8_t)f->nClasses++;
+        return 1;
+    }
+
+    // Non-ASCII classes are numbered down from the top of the table
+    for (unsigned i = 0; i < f->nOther; i++)
+    {
+        if (f->otherChars[i] == c) return 1;
+    }
+    if (f->nClasses >= FILTER_MAX_CLASSES - f->nOther)
+        return 0;
+    f->otherChars[f->nOther++] = c;
+    return 1;
+}
+
+// Parse one rule into tokens; returns the token count, 0 to skip the line
+// or maxTokens if it doesn't fit
+static unsigned ParseGlob(wchar_t* line, GlobToken* tokens, unsigned maxTokens, int* include, int* floating)
+{
+    unsigned n = 0;
+    size_t len;
+
+    *include = 0;
+    if (*line == L'!')
+    {
+        *include = 1;
+        line++;
+    }
+
+    for (wchar_t* p = line; *p; p++)
+    {
+        if (*p == L'/') *p = L'\\';
+    }
+
+    // Trailing separators only mark folders - files and folders are treated alike
+    len = wcslen(line);
+    while (len && line[len - 1] == L'\\') line[--len] = L'\0';
+
+    if (*line == L'\\')
+    {
+        *floating = 0;
+        while (*line == L'\\') line++;
+    }
+    else if (wcsncmp(line, L"**\\", 3) == 0)
+    {
+        *floating = 1;
+        line += 3;
+    }
+    else
+    {
+        *floating = (wcschr(line, L'\\') == NULL);
+    }
+
+    for (const wchar_t* p = line; *p && n < maxTokens; p++)
+    {
+        if (*p == L'*')
+        {
+            uint8_t type = TOK_STAR;
+            while (p[1] == L'*')
+            {
+                type = TOK_GLOBSTAR;
+                p++;
+            }
+
+            // Adjacent stars collapse into one state
+            if (n && (tokens[n - 1].type == TOK_STAR || tokens[n - 1].type == TOK_GLOBSTAR))
+            {
+                if (type == TOK_GLOBSTAR) tokens[n - 1].type = TOK_GLOBSTAR;
+                continue;
+            }
+            tokens[n].type = type;
+        }
+        else if (*p == L'?')
+        {
+            tokens[n].type = TOK_ANY;
+        }
+        else if (*p == L'\\')
+        {
+            tokens[n].type = TOK_SEP;
+        }
+        else
+        {
+            tokens[n].type = TOK_LIT;
+            tokens[n].ch = FoldAscii(*p);
+        }
+        n++;
+    }
+
+    if (!*line) return 0;
+    return (n < maxTokens) ? n : maxTokens;
+}
+
+unsigned CompileFilter(PathFilter* f, wchar_t* text, unsigned* skipped)
+{
+    GlobToken tokens[FILTER_MAX_STATES];
+    uint8_t ruleFlags[FILTER_MAX_STATES];
+    unsigned nTokens = 0, nRules = 0, nSkipped = 0;
+
+    memset(f, 0, sizeof(*f));
+
+    // Pass 1: tokenize every rule. Each rule takes a start state plus one
+    // state per token; ruleFlags marks the start states (1) and whether the
+    // rule re-includes (2) or floats (4).
+    f->nClasses = CLASS_SEP + 1;
+    f->asciiClass['\\'] = CLASS_SEP;
+    f->asciiClass['/'] = CLASS_SEP;
+    for (wchar_t* line = text; line && *line; )
+    {
+        wchar_t* next = wcspbrk(line, L"\r\n");
+        if (next)
+        {
+            *next++ = L'\0';
+            while (*next == L'\r' || *next == L'\n') next++;
+        }
+
+        while (*line == L' ' || *line == L'\t') line++;
+        size_t len = wcslen(line);
+        while (len && (line[len - 1] == L' ' || line[len - 1] == L'\t')) line[--len] = L'\0';
+
+        if (*line && *line != L'#')
+        {
+            int include, floating, fits = 0;
+            unsigned n = 0;
+
+            if (nTokens + 1 < FILTER_MAX_STATES)
+            {
+                n = ParseGlob(line, tokens + nTokens + 1, FILTER_MAX_STATES - nTokens - 1,
+                              &include, &floating);
+                if (n == 0)
+                {
+                    line = next;
+                    continue;
+                }
+                fits = (n < FILTER_MAX_STATES - nTokens - 1);
+            }
+            for (unsigned i = 1; i <= n && fits; i++)
+            {
+                if (tokens[nTokens + i].type == TOK_LIT)
+                    fits = FilterAssignClass(f, tokens[nTokens + i].ch);
+            }
+
+            // A rule left out excludes less, which beats one quietly matching more
+            if (fits)
+            {
+                tokens[nTokens].type = TOK_LIT;
+                tokens[nTokens].ch = 0;
+                ruleFlags[nTokens] = (uint8_t)(1 | (include ? 2 : 0) | (floating ? 4 : 0));
+                for (unsigned i = 1; i <= n; i++)
+                    ruleFlags[nTokens + i] = 0;
+                nTokens += n + 1;
+                nRules++;
+            }
+            else
+            {
+                nSkipped++;
+            }
+        }
+        line = next;
+    }
+
+    if (skipped) *skipped = nSkipped;
+    f->nWords = (nTokens + 63) / 64;
+
+    // Pass 2: build the transition masks
+    for (unsigned bit = 0; bit < nTokens; bit++)
+    {
+        uint8_t flags = ruleFlags[bit];
+        const GlobToken* t = &tokens[bit];
+
+        if (flags & 1)
+        {
+            SetBit((flags & 4) ? &f->floatingStarts : &f->anchoredStarts, bit);
+            continue;
+        }
+
+        switch (t->type)
+        {
+        case TOK_LIT:
+            SetBit(&f->advance[FilterClassOf(f, t->ch)], bit);
+            break;
+        case TOK_SEP:
+            SetBit(&f->advance[CLASS_SEP], bit);
+            // "\**\": zero folders leaves the two separators as one
+            if (tokens[bit - 1].type == TOK_GLOBSTAR && tokens[bit - 2].type == TOK_SEP)
+                SetBit(&f->sepSkips, bit);
+            break;
+        case TOK_GLOBSTAR:
+            SetBit(&f->loopSep, bit);
+            SetBit(&f->advance[CLASS_SEP], bit);
+            // fall through
+        case TOK_STAR:
+            SetBit(&f->loopAll, bit);
+            SetBit(&f->stars, bit);
+            // fall through
+        case TOK_ANY:
+            for (unsigned c = 0; c < FILTER_MAX_CLASSES; c++)
+            {
+                if (c != CLASS_SEP) SetBit(&f->advance[c], bit);
+            }
+            break;
+        }
+
+        // Last token of a rule is its final state
+        if (bit + 1 == nTokens || (ruleFlags[bit + 1] & 1))
+        {
+            unsigned start = bit;
+            while (!(ruleFlags[start] & 1)) start--;
+
+            SetBit(&f->finals, bit);
+            if (ruleFlags[start] & 2)
+                SetBit(&f->includeFinals, bit);
+        }
+    }
+
+    return nRules;
+}
+
+// Add the states reachable through '*' without consuming input
+static void FilterClose(const PathFilter* f, StateSet* s)
+{
+    uint64_t carry = 0;
+    for (unsigned i = 0; i < f->nWords; i++)
+    {
+        uint64_t shifted = (s->w[i] << 1) | carry;
+        carry = s->w[i] >> 63;
+        s->w[i] |= shifted & f->stars.w[i];
+    }
+}
+
+// After a separator, a "\**" state may take it as its own closing '\'
+static void FilterSkipFolders(const PathFilter* f, StateSet* s)
+{
+    uint64_t carry = 0;
+    for (unsigned i = 0; i < f->nWords; i++)
+    {
+        uint64_t shifted = (s->w[i] << 1) | carry;
+        carry = s->w[i] >> 63;
+        s->w[i] |= shifted & f->sepSkips.w[i];
+    }
+    FilterClose(f, s);
+}
+
+void FilterStart(const PathFilter* f, StateSet* s)
+{
+    for (unsigned i = 0; i < f->nWords; i++)
+        s->w[i] = f->anchoredStarts.w[i] | f->floatingStarts.w[i];
+    FilterClose(f, s);
+}
+
+void FilterFeed(const PathFilter* f, StateSet* s, const wchar_t* str, size_t len)
+{
+    for (size_t k = 0; k < len; k++)
+    {
+        unsigned cls = FilterClassOf(f, str[k]);
+        int sep = (cls == CLASS_SEP);
+        const StateSet* adv = &f->advance[cls];
+        const StateSet* loop = sep ? &f->loopSep : &f->loopAll;
+        uint64_t carry = 0;
+
+        for (unsigned i = 0; i < f->nWords; i++)
+        {
+            uint64_t shifted = (s->w[i] << 1) | carry;
+            carry = s->w[i] >> 63;
+            s->w[i] = (shifted & adv->w[i]) | (s->w[i] & loop->w[i]);
+            if (sep) s->w[i] |= f->floatingStarts.w[i];
+        }
+        FilterClose(f, s);
+        if (sep) FilterSkipFolders(f, s);
+    }
+}
+
+int FilterAllows(const PathFilter* f, const StateSet* s)
+{
+    for (unsigned i = f->nWords; i-- > 0; )
+    {
+        uint64_t matched = s->w[i] & f->finals.w[i];
+        if (matched)
+        {
+            // The highest final is the last matching rule
+            unsigned bit = 63;
+            while (!(matched >> bit)) bit--;
+            return (int)((f->includeFinals.w[i] >> bit) & 1);
+        }
+    }
+    return 1;
+}
+
+//=============================================================================
+// Device scheduling
+//=============================================================================
+static uint32_t HashPath(const wchar_t* s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+        h = (h ^ (uint32_t)FoldAscii(*s++)) * 16777619u;
+    return h;
+}
+
+static void ResolveOne(DeviceResolver resolve, void* context, const unsigned* limits,
+                       const wchar_t* path, DeviceKey* dev)
+{
+    memset(dev, 0, sizeof(*dev));
+    if (!resolve(context, path, dev))
+    {
+        dev->id = 0xC0000000u | (HashPath(path) & 0x3FFFFFFFu);
+        dev->kind = DEVICE_HDD;
+    }
+    dev->limit = (dev->kind < DEVICE_KINDS && limits[dev->kind]) ? limits[dev->kind] : 1;
+}
+
+unsigned ResolveTaskDevices(DeviceResolver resolve, void* context, const unsigned* limits,
+                            const wchar_t* source, const wchar_t* dest, DeviceKey* devices)
+{
+    ResolveOne(resolve, context, limits, source, &devices[0]);
+    ResolveOne(resolve, context, limits, dest, &devices[1]);
+    return (devices[1].id == devices[0].id) ? 1 : 2;
+}
+
+// NULL if the table is full of busy devices
+static unsigned* FindDeviceSlot(DeviceSlots* s, uint32_t id)
+{
+    for (unsigned i = 0; i < s->nSlots; i++)
+    {
+        if (s->slots[i].id == id)
+            return &s->slots[i].running;
+    }
+
+    // Drop an idle slot if the table is full
+    if (s->nSlots == DEVICE_MAX)
+    {
+        for (unsigned i = 0; i < s->nSlots; i++)
+        {
+            if (s->slots[i].running == 0)
+            {
+                s->slots[i] = s->slots[--s->nSlots];
+                break;
+            }
+        }
+        if (s->nSlots == DEVICE_MAX)
+            return NULL;
+    }
+
+    s->slots[s->nSlots].id = id;
+    s->slots[s->nSlots].running = 0;
+    return &s->slots[s->nSlots++].running;
+}
+
+int TryAcquireDevices(DeviceSlots* s, const DeviceKey* devices, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++)
+    {
+        unsigned* running = FindDeviceSlot(s, devices[i].id);
+        if (running && *running >= devices[i].limit)
+            return 0;
+    }
+    for (unsigned i = 0; i < n; i++)
+    {
+        unsigned* running = FindDeviceSlot(s, devices[i].id);
+        if (running) (*running)++;
+    }
+    return 1;
+}
+
+void ReleaseDevices(DeviceSlots* s, const DeviceKey* devices, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++)
+    {
+        unsigned* running = FindDeviceSlot(s, devices[i].id);
+        if (running && *running) (*running)--;
+    }
+}
+
+#if defined(__linux__)
+// UTF-8 for the file system, from a 16- or 32-bit wchar_t
+static int WideToUtf8(const wchar_t* s, char* out, size_t cap)
+{
+    size_t n = 0;
+
+    for (; *s; s++)
+    {
+        uint32_t c = (uint32_t)*s;
+        if (c >= 0xD800 && c < 0xDC00 && (uint32_t)s[1] >= 0xDC00 && (uint32_t)s[1] < 0xE000)
+            c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)*++s - 0xDC00);
+        if (n + 5 > cap)
+            return 0;
+
+        if (c < 0x80)
+        {
+            out[n++] = (char)c;
+        }
+        else if (c < 0x800)
+        {
+            out[n++] = (char)(0xC0 | (c >> 6));
+            out[n++] = (char)(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            out[n++] = (char)(0xE0 | (c >> 12));
+            out[n++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            out[n++] = (char)(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            out[n++] = (char)(0xF0 | (c >> 18));
+            out[n++] = (char)(0x80 | ((c >> 12) & 0x3F));
+            out[n++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            out[n++] = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    out[n] = '\0';
+    return 1;
+}
+
+// First line of a sysfs attribute
+static int ReadSysfs(const char* path, char* out, int cap)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) return 0;
+    int ok = fgets(out, cap, f) != NULL;
+    fclose(f);
+    return ok;
+}
+
+int ResolveDevicePosix(void* context, const wchar_t* path, DeviceKey* dev)
+{
+    char name[4096], sys[96], line[32];
+    struct stat st;
+    struct statfs fs;
+
+    (void)context;
+    if (!WideToUtf8(path, name, sizeof(name)) || stat(name, &st) != 0)
+        return 0;
+
+    unsigned devMajor = major(st.st_dev), devMinor = minor(st.st_dev);
+    if (statfs(name, &fs) == 0)
+    {
+        switch ((uint32_t)fs.f_type)
+        {
+        case 0x6969u:       // NFS
+        case 0x517Bu:       // SMB
+        case 0xFF534D42u:   // CIFS
+        case 0xFE534D42u:   // SMB2
+        case 0x01021997u:   // 9P
+        case 0x00C36400u:   // Ceph
+            dev->kind = DEVICE_NETWORK;
+            dev->id = 0x80000000u | (((uint32_t)devMajor << 20 | devMinor) & 0x3FFFFFFFu);
+            return 1;
+        }
+    }
+
+    // Partitions share their disk's slots. Devices without a sysfs entry
+    // (tmpfs, overlays) stay what they are, and unknown hardware is
+    // treated like a spinning disk.
+    snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u/partition", devMajor, devMinor);
+    const char* disk = (access(sys, F_OK) == 0) ? "/.." : "";
+    snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u%s/dev", devMajor, devMinor, disk);
+    if (*disk && ReadSysfs(sys, line, sizeof(line)))
+        sscanf(line, "%u:%u", &devMajor, &devMinor);
+
+    dev->kind = DEVICE_HDD;
+    snprintf(sys, sizeof(sys), "/sys/dev/block/%u:%u/queue/rotational", devMajor, devMinor);
+    if (ReadSysfs(sys, line, sizeof(line)) && line[0] == '0')
+        dev->kind = DEVICE_SSD;
+    dev->id = ((uint32_t)devMajor << 20 | devMinor) & 0x3FFFFFFFu;
+    return 1;
+}
+#endif
+
+//=============================================================================
+// QoS policy
+//=============================================================================
+void QosConfigure(QosPolicy* p, unsigned threshold, unsigned hysteresis, unsigned cpuRate)
+{
+    p->threshold = threshold;
+    p->hysteresis = hysteresis;
+    p->cpuRate = cpuRate;
+    if (!p->niceLow) p->niceLow = 10;
+    if (!p->niceIdle) p->niceIdle = 19;
+}
+
+int QosUpdate(QosPolicy* p, unsigned load)
+{
+    int throttle;
+
+    if (p->threshold == 0)
+        throttle = 0;
+    else if (p->throttled)
+        throttle = (load + p->hysteresis >= p->threshold);
+    else
+        throttle = (load >= p->threshold);
+
+    if (throttle == p->throttled)
+        return 0;
+    p->throttled = throttle;
+    return 1;
+}
+
+unsigned QosCpuRate(const QosPolicy* p)
+{
+    if (p->cpuRate == 0 || !p->throttled)
+        return p->cpuRate;
+    return (p->cpuRate >= 8) ? p->cpuRate / 4 : 1;
+}
+
+QosPriority QosPriorityOf(const QosPolicy* p, QosClass qos)
+{
+    if (qos == QOS_FOREGROUND)
+        return QOS_PRIORITY_NORMAL;
+    return p->throttled ? QOS_PRIORITY_IDLE : QOS_PRIORITY_LOW;
+}
+
+int QosMayStart(const QosPolicy* p, QosClass qos, unsigned nBackground)
+{
+    return qos == QOS_FOREGROUND || !p->throttled || nBackground == 0;
+}
+
+#if defined(__linux__)
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_BE     2
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_CLASS_SHIFT  13
+
+int QosApplyPosix(int pid, QosPriority priority, const QosPolicy* p)
+{
+    int nice = 0, ioprio = 0;   // 0: the CPU priority decides the I/O one
+
+    if (priority == QOS_PRIORITY_LOW)
+    {
+        nice = p->niceLow;
+        ioprio = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7;
+    }
+    else if (priority == QOS_PRIORITY_IDLE)
+    {
+        nice = p->niceIdle;
+        ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    }
+
+    int ok = setpriority(PRIO_PROCESS, (id_t)pid, nice) == 0;
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, ioprio) == 0 && ok;
+}
+#endif
+
+//=============================================================================
+// Run statistics
+//=============================================================================
+static int StatsValid(const StatsHeader* h)
+{
+    return h->magic == STATS_MAGIC && h->capacity == STATS_CAPACITY &&
+           h->next < STATS_CAPACITY && h->count <= STATS_CAPACITY;
+}
+
+void StatsAppend(void* file, const StatsRecord* rec)
+{
+    StatsHeader* h = file;
+    StatsRecord* records = (StatsRecord*)(h + 1);
+
+    if (!StatsValid(h))
+    {
+        memset(h, 0, sizeof(*h));
+        h->magic = STATS_MAGIC;
+        h->capacity = STATS_CAPACITY;
+    }
+
+    records[h->next] = *rec;
+    h->next = (h->next + 1) % STATS_CAPACITY;
+    if (h->count < STATS_CAPACITY)
+        h->count++;
+}
+
+int StatsSummarize(const void* file, uint64_t since, StatsSummary* out)
+{
+    const StatsHeader* h = file;
+    const StatsRecord* records = (const StatsRecord*)(h + 1);
+
+    memset(out, 0, sizeof(*out));
+    if (!StatsValid(h))
+        return 0;
+
+    // Oldest first: the ring starts at next once it's full
+    unsigned first = (h->count == STATS_CAPACITY) ? h->next : 0;
+    for (unsigned i = 0; i < h->count; i++)
+    {
+        const StatsRecord* r = &records[(first + i) % STATS_CAPACITY];
+        if (r->finished < since)
+            continue;
+
+        out->runs++;
+        out->wallMs += r->wallMs;
+        if (r->wallMs > out->longestMs)
+            out->longestMs = r->wallMs;
+        if (r->exitCode != 0)
+        {
+            out->failed++;
+            continue;
+        }
+        out->inBytes += r->inBytes;
+        out->outBytes += r->outBytes;
+    }
+    return 1;
+}
+
+unsigned StatsRatioPercent(uint64_t inBytes, uint64_t outBytes)
+{
+    if (!inBytes)
+        return 100;
+    // outBytes * 100 could overflow 64 bits
+    if (outBytes <= UINT64_MAX / 100)
+        return (unsigned)(outBytes * 100 / inBytes);
+    return (unsigned)((double)outBytes * 100 / (double)inBytes);
+}
+
+//=============================================================================
+// Pixels
+//=============================================================================
+// x / 255 rounded down is (x + 1 + (x >> 8)) >> 8 for every x = c * a with
+// c, a in 0..255 (checked exhaustively), and the sum stays below 65536, so
+// the vector paths work in 16-bit lanes. Alpha lanes are multiplied by 255
+// instead of themselves, which leaves them unchanged.
+static uint8_t PremultiplyChannel(unsigned c, unsigned a)
+{
+    unsigned x = c * a;
+    return (uint8_t)((x + 1 + (x >> 8)) >> 8);
+}
+
+#if defined(CORE_AVX2)
+// 8 pixels per step
+static size_t PremultiplyVector(uint8_t* bgra, size_t pixels)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i alphaLanes = _mm256_set1_epi64x(0xFFFF000000000000LL);
+    const __m256i alpha255 = _mm256_set1_epi64x(0x00FF000000000000LL);
+    size_t i = 0;
+
+    for (; i + 8 <= pixels; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(bgra + i * 4));
+        __m256i halves[2] = { _mm256_unpacklo_epi8(v, zero), _mm256_unpackhi_epi8(v, zero) };
+
+        for (int h = 0; h < 2; h++)
+        {
+            __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(halves[h], 0xFF), 0xFF);
+            a = _mm256_or_si256(_mm256_andnot_si256(alphaLanes, a), alpha255);
+            __m256i x = _mm256_mullo_epi16(halves[h], a);
+            x = _mm256_add_epi16(_mm256_add_epi16(x, one), _mm256_srli_epi16(x, 8));
+            halves[h] = _mm256_srli_epi16(x, 8);
+        }
+        _mm256_storeu_si256((__m256i*)(bgra + i * 4), _mm256_packus_epi16(halves[0], halves[1]));
+    }
+    return i;
+}
+#elif defined(CORE_SSE2)
+// 4 pixels per step
+static size_t PremultiplyVector(uint8_t* bgra, size_t pixels)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i alphaLanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    const __m128i alpha255 = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    size_t i = 0;
+
+    for (; i + 4 <= pixels; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(bgra + i * 4));
+        __m128i halves[2] = { _mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero) };
+
+        for (int h = 0; h < 2; h++)
+        {
+            __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(halves[h], 0xFF), 0xFF);
+            a = _mm_or_si128(_mm_andnot_si128(alphaLanes, a), alpha255);
+            __m128i x = _mm_mullo_epi16(halves[h], a);
+            x = _mm_add_epi16(_mm_add_epi16(x, one), _mm_srli_epi16(x, 8));
+            halves[h] = _mm_srli_epi16(x, 8);
+        }
+        _mm_storeu_si128((__m128i*)(bgra + i * 4), _mm_packus_epi16(halves[0], halves[1]));
+    }
+    return i;
+}
+#else
+static size_t PremultiplyVector(uint8_t* bgra, size_t pixels)
+{
+    (void)bgra;
+    (void)pixels;
+    return 0;
+}
+#endif
+
+void PremultiplyAlpha(uint8_t* bgra, size_t pixels)
+{
+    for (size_t i = PremultiplyVector(bgra, pixels); i < pixels; i++)
+    {
+        uint8_t* p = bgra + i * 4;
+        unsigned a = p[3];
+        p[0] = PremultiplyChannel(p[0], a);
+        p[1] = PremultiplyChannel(p[1], a);
+        p[2] = PremultiplyChannel(p[2], a);
+    }
+}
+
+//=============================================================================
+// CRC-32
+//=============================================================================
+// Slicing-by-16: g_Crc32[k][b] is the CRC of byte b followed by k zero bytes,
+// so 16 input bytes cost 16 independent lookups instead of a dependent chain.
+static uint32_t g_Crc32[16][256];
+
+void Crc32Init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ 0xEDB88320u : c >> 1;
+        g_Crc32[0][i] = c;
+    }
+    for (int k = 1; k < 16; k++)
+    {
+        for (int i = 0; i < 256; i++)
+            g_Crc32[k][i] = (g_Crc32[k - 1][i] >> 8) ^ g_Crc32[0][g_Crc32[k - 1][i] & 0xFF];
+    }
+}
+
+static uint32_t Load32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t Crc32Update(uint32_t crc, const void* data, size_t len)
+{
+    const uint8_t* p = data;
+
+    crc = ~crc;
+    for (; len >= 16; len -= 16, p += 16)
+    {
+        uint32_t a = crc ^ Load32(p);
+        uint32_t b = Load32(p + 4);
+        uint32_t c = Load32(p + 8);
+        uint32_t d = Load32(p + 12);
+
+        crc = g_Crc32[15][a & 0xFF] ^ g_Crc32[14][(a >> 8) & 0xFF] ^
+              g_Crc32[13][(a >> 16) & 0xFF] ^ g_Crc32[12][a >> 24] ^
+              g_Crc32[11][b & 0xFF] ^ g_Crc32[10][(b >> 8) & 0xFF] ^
+              g_Crc32[9][(b >> 16) & 0xFF] ^ g_Crc32[8][b >> 24] ^
+              g_Crc32[7][c & 0xFF] ^ g_Crc32[6][(c >> 8) & 0xFF] ^
+              g_Crc32[5][(c >> 16) & 0xFF] ^ g_Crc32[4][c >> 24] ^
+              g_Crc32[3][d & 0xFF] ^ g_Crc32[2][(d >> 8) & 0xFF] ^
+              g_Crc32[1][(d >> 16) & 0xFF] ^ g_Crc32[0][d >> 24];
+    }
+    while (len--)
+        crc = g_Crc32[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+//=============================================================================
+// Inflate
+//=============================================================================
+// Raw deflate (RFC 1951) from a buffer holding the whole stream. Output goes
+// through a ring twice the size of the deflate window and reaches the sink in
+// chunks, so memory use doesn't depend on the entry size.
+#define RING_MASK (INFLATE_RING - 1)
+
+static const uint16_t g_LengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t g_LengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t g_DistBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t g_DistExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Top up the bit buffer to at least 57 bits, or as far as the input goes.
+// Bits past the input read as zero; Consume() catches anyone using them.
+static void Refill(Inflater* z)
+{
+    while (z->nBits <= 56 && z->pos < z->inLen)
+    {
+        z->bits |= (uint64_t)z->in[z->pos++] << z->nBits;
+        z->nBits += 8;
+    }
+}
+
+static int Consume(Inflater* z, unsigned n)
+{
+    if (n > z->nBits) return 0;
+    z->bits >>= n;
+    z->nBits -= n;
+    return 1;
+}
+
+static int ReadBits(Inflater* z, unsigned n, unsigned* value)
+{
+    Refill(z);
+    *value = (unsigned)(z->bits & ((1u << n) - 1));
+    return Consume(z, n);
+}
+
+// Canonical code from code lengths. Returns 0 for an over-subscribed set;
+// incomplete sets are allowed and their unused codes fail in Decode().
+static int BuildHuffman(HuffmanTable* t, const uint8_t* lengths, unsigned n)
+{
+    uint16_t offsets[16];
+    int left = 1;
+
+    memset(t->count, 0, sizeof(t->count));
+    memset(t->fast, 0, sizeof(t->fast));
+    for (unsigned i = 0; i < n; i++)
+        t->count[lengths[i]]++;
+    t->count[0] = 0;
+
+    for (int len = 1; len < 16; len++)
+    {
+        left = (left << 1) - t->count[len];
+        if (left < 0) return 0;
+    }
+
+    offsets[1] = 0;
+    for (int len = 1; len < 15; len++)
+        offsets[len + 1] = (uint16_t)(offsets[len] + t->count[len]);
+
+    // Codes of a length are consecutive in symbol order; short ones also go
+    // into the lookup table, bit-reversed since deflate packs them MSB first
+    unsigned code = 0;
+    for (int len = 1, next = 0; len < 16; len++)
+    {
+        for (unsigned i = 0; i < n; i++)
+        {
+            if (lengths[i] != len) continue;
+
+            t->symbols[offsets[len] + (code - (unsigned)next)] = (uint16_t)i;
+            if (len <= INFLATE_FAST_BITS)
+            {
+                unsigned rev = 0;
+                for (int b = 0; b < len; b++)
+                    rev |= ((code >> b) & 1) << (len - 1 - b);
+                for (unsigned j = rev; j < (1u << INFLATE_FAST_BITS); j += 1u << len)
+                    t->fast[j] = (uint16_t)((i << 4) | (unsigned)len);
+            }
+            code++;
+        }
+        next += t->count[len];
+        next <<= 1;
+        code <<= 1;
+    }
+    return 1;
+}
+
+// Next symbol, or -1 for an unused code or the end of the input
+static int Decode(Inflater* z, const HuffmanTable* t)
+{
+    Refill(z);
+
+    unsigned entry = t->fast[z->bits & ((1u << INFLATE_FAST_BITS) - 1)];
+    if (entry)
+        return Consume(z, entry & 15) ? (int)(entry >> 4) : -1;
+
+    // Longer codes: walk the lengths one bit at a time
+    int code = 0, first = 0, index = 0;
+    for (unsigned len = 1; len < 16; len++)
+    {
+        code |= (int)((z->bits >> (len - 1)) & 1);
+        int count = t->count[len];
+        if (code - first < count)
+            return Consume(z, len) ? t->symbols[index + code - first] : -1;
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+// Hand everything written since the last flush to the sink
+static int Flush(Inflater* z)
+{
+    while (z->flushed < z->written)
+    {
+        size_t at = z->flushed & RING_MASK;
+        size_t len = z->written - z->flushed;
+        if (len > INFLATE_RING - at) len = INFLATE_RING - at;
+        if (!z->sink(z->context, z->ring + at, len))
+            return 0;
+        z->flushed += len;
+    }
+    return 1;
+}
+
+// Keeps at least the deflate window (32K) of history in the ring
+#define FLUSH_AT (INFLATE_RING / 2)
+
+static int StoredBlock(Inflater* z)
+{
+    unsigned len, nlen;
+
+    // Back to a byte boundary, and return whole bytes still in the buffer
+    Consume(z, z->nBits & 7);
+    if (!ReadBits(z, 16, &len) || !ReadBits(z, 16, &nlen) || len != (~nlen & 0xFFFF))
+        return INFLATE_ERROR;
+    z->pos -= z->nBits / 8;
+    z->bits = 0;
+    z->nBits = 0;
+
+    if (len > z->inLen - z->pos) return INFLATE_ERROR;
+    while (len)
+    {
+        size_t at = z->written & RING_MASK;
+        size_t n = INFLATE_RING - at;
+        if (n > len) n = len;
+        if (n > FLUSH_AT) n = FLUSH_AT;
+
+        memcpy(z->ring + at, z->in + z->pos, n);
+        z->pos += n;
+        z->written += n;
+        len -= (unsigned)n;
+        if (z->written - z->flushed >= FLUSH_AT && !Flush(z))
+            return INFLATE_STOPPED;
+    }
+    return INFLATE_DONE;
+}
+
+static int CodesBlock(Inflater* z)
+{
+    for (;;)
+    {
+        int sym = Decode(z, &z->lit);
+        if (sym < 0) return INFLATE_ERROR;
+
+        if (sym < 256)
+        {
+            z->ring[z->written++ & RING_MASK] = (uint8_t)sym;
+        }
+        else if (sym == 256)
+        {
+            return INFLATE_DONE;
+        }
+        else
+        {
+            unsigned extra, len, dist;
+
+            sym -= 257;
+            if (sym >= 29 || !ReadBits(z, g_LengthExtra[sym], &extra)) return INFLATE_ERROR;
+            len = g_LengthBase[sym] + extra;
+
+            sym = Decode(z, &z->dist);
+            if (sym < 0 || sym >= 30 || !ReadBits(z, g_DistExtra[sym], &extra)) return INFLATE_ERROR;
+            dist = g_DistBase[sym] + extra;
+            if (dist > z->written) return INFLATE_ERROR;
+
+            // Byte by byte: the source may overlap what's being written
+            size_t from = z->written - dist;
+            while (len--)
+                z->ring[z->written++ & RING_MASK] = z->ring[from++ & RING_MASK];
+        }
+
+        if (z->written - z->flushed >= FLUSH_AT && !Flush(z))
+            return INFLATE_STOPPED;
+    }
+}
+
+static int FixedTables(Inflater* z)
+{
+    uint8_t lengths[288];
+    unsigned i = 0;
+
+    for (; i < 144; i++) lengths[i] = 8;
+    for (; i < 256; i++) lengths[i] = 9;
+    for (; i < 280; i++) lengths[i] = 7;
+    for (; i < 288; i++) lengths[i] = 8;
+    if (!BuildHuffman(&z->lit, lengths, 288)) return 0;
+
+    for (i = 0; i < 30; i++) lengths[i] = 5;
+    return BuildHuffman(&z->dist, lengths, 30);
+}
+
+static int DynamicTables(Inflater* z)
+{
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    uint8_t lengths[288 + 32] = {0};
+    unsigned nLit, nDist, nCode, value;
+
+    if (!ReadBits(z, 5, &nLit) || !ReadBits(z, 5, &nDist) || !ReadBits(z, 4, &nCode))
+        return 0;
+    nLit += 257;
+    nDist += 1;
+    nCode += 4;
+    if (nLit > 286 || nDist > 30) return 0;
+
+    for (unsigned i = 0; i < nCode; i++)
+    {
+        if (!ReadBits(z, 3, &value)) return 0;
+        lengths[order[i]] = (uint8_t)value;
+    }
+    if (!BuildHuffman(&z->lit, lengths, 19)) return 0;
+
+    // Literal/length and distance lengths form one run-length coded sequence
+    for (unsigned i = 0; i < nLit + nDist; )
+    {
+        int sym = Decode(z, &z->lit);
+        unsigned repeat;
+        uint8_t len = 0;
+
+        if (sym < 0) return 0;
+        if (sym < 16)
+        {
+            lengths[i++] = (uint8_t)sym;
+            continue;
+        }
+        if (sym == 16)
+        {
+            if (i == 0 || !ReadBits(z, 2, &repeat)) return 0;
+            len = lengths[i - 1];
+            repeat += 3;
+        }
+        else if (sym == 17)
+        {
+            if (!ReadBits(z, 3, &repeat)) return 0;
+            repeat += 3;
+        }
+        else
+        {
+            if (!ReadBits(z, 7, &repeat)) return 0;
+            repeat += 11;
+        }
+        if (i + repeat > nLit + nDist) return 0;
+        while (repeat--)
+            lengths[i++] = len;
+    }
+
+    if (lengths[256] == 0) return 0;  // No end-of-block code
+    return BuildHuffman(&z->lit, lengths, nLit) && BuildHuffman(&z->dist, lengths + nLit, nDist);
+}
+
+int Inflate(Inflater* z, const uint8_t* in, size_t inLen, size_t* inUsed,
+            ByteSink sink, void* context)
+{
+    unsigned final, type;
+    int result;
+
+    z->in = in;
+    z->inLen = inLen;
+    z->pos = 0;
+    z->bits = 0;
+    z->nBits = 0;
+    z->written = 0;
+    z->flushed = 0;
+    z->sink = sink;
+    z->context = context;
+
+    do
+    {
+        if (!ReadBits(z, 1, &final) || !ReadBits(z, 2, &type))
+            return INFLATE_ERROR;
+
+        if (type == 0)
+            result = StoredBlock(z);
+        else if (type == 1)
+            result = FixedTables(z) ? CodesBlock(z) : INFLATE_ERROR;
+        else if (type == 2)
+            result = DynamicTables(z) ? CodesBlock(z) : INFLATE_ERROR;
+        else
+            result = INFLATE_ERROR;
+
+        if (result != INFLATE_DONE)
+            return result;
+    } while (!final);
+
+    if (!Flush(z))
+        return INFLATE_STOPPED;
+    if (inUsed)
+        *inUsed = z->pos - z->nBits / 8;
+    return INFLATE_DONE;
+}
+
+//=============================================================================
+// Gzip
+//=============================================================================
+size_t GzipHeaderSize(const uint8_t* in, size_t len)
+{
+    size_t pos = 10;
+
+    if (len < 10 || in[0] != 0x1F || in[1] != 0x8B || in[2] != 8 || (in[3] & 0xE0))
+        return 0;
+
+    if (in[3] & 4)  // FEXTRA
+    {
+        if (len < 12) return 0;
+        pos = 12 + (in[10] | (in[11] << 8));
+    }
+    for (int flag = 8; flag <= 16; flag <<= 1)  // FNAME, FCOMMENT
+    {
+        if (!(in[3] & flag)) continue;
+        while (pos < len && in[pos]) pos++;
+        pos++;
+    }
+    if (in[3] & 2)  // FHCRC
+        pos += 2;
+    return pos <= len ? pos : 0;
+}
+
+//=============================================================================
+// Deflate
+//=============================================================================
+// Matches are found greedily through hash chains and buffered as symbols;
+// every DEFLATE_BLOCK symbols become a block with Huffman codes built from
+// their frequencies.
+#define MIN_MATCH   3
+#define MAX_MATCH   258
+#define MAX_CHAIN   32
+
+static unsigned Reverse(unsigned code, unsigned len)
+{
+    unsigned rev = 0;
+    while (len--)
+    {
+        rev = (rev << 1) | (code & 1);
+        code >>= 1;
+    }
+    return rev;
+}
+
+void DeflateInit(Deflater* d, ByteSink sink, void* context)
+{
+    d->sink = sink;
+    d->context = context;
+    d->failed = 0;
+    d->fill = 0;
+    d->pos = 0;
+    d->bits = 0;
+    d->nBits = 0;
+    d->outLen = 0;
+    d->nSymbols = 0;
+    memset(d->litFreqs, 0, sizeof(d->litFreqs));
+    memset(d->distFreqs, 0, sizeof(d->distFreqs));
+
+    for (unsigned sym = 0; sym < 29; sym++)
+    {
+        for (unsigned len = g_LengthBase[sym]; len < g_LengthBase[sym] + (1u << g_LengthExtra[sym]) && len <= MAX_MATCH; len++)
+            d->lengthSymbols[len] = (uint8_t)sym;
+    }
+    // Distances up to 256 index directly, longer ones by (distance - 1) >> 7
+    for (unsigned sym = 0; sym < 30; sym++)
+    {
+        for (unsigned dist = g_DistBase[sym]; dist < g_DistBase[sym] + (1u << g_DistExtra[sym]); dist++)
+        {
+            if (dist <= 256)
+                d->distSymbols[dist - 1] = (uint8_t)sym;
+            else
+                d->distSymbols[256 + ((dist - 1) >> 7)] = (uint8_t)sym;
+        }
+    }
+    for (size_t i = 0; i < (1 << DEFLATE_HASH_BITS); i++)
+        d->head[i] = -1;
+}
+
+static unsigned DistanceSymbol(const Deflater* d, unsigned dist)
+{
+    return dist <= 256 ? d->distSymbols[dist - 1] : d->distSymbols[256 + ((dist - 1) >> 7)];
+}
+
+static void FlushOut(Deflater* d)
+{
+    if (d->outLen && !d->failed && !d->sink(d->context, d->out, d->outLen))
+        d->failed = 1;
+    d->outLen = 0;
+}
+
+static void PutBits(Deflater* d, unsigned value, unsigned n)
+{
+    d->bits |= (uint64_t)value << d->nBits;
+    d->nBits += n;
+    if (d->nBits >= 32)
+    {
+        uint8_t* out = d->out + d->outLen;
+        out[0] = (uint8_t)d->bits;
+        out[1] = (uint8_t)(d->bits >> 8);
+        out[2] = (uint8_t)(d->bits >> 16);
+        out[3] = (uint8_t)(d->bits >> 24);
+        d->outLen += 4;
+        d->bits >>= 32;
+        d->nBits -= 32;
+        if (d->outLen > DEFLATE_OUT - 4)
+            FlushOut(d);
+    }
+}
+
+// Huffman code lengths of at most limit bits for freqs. Frequencies are
+// halved until the tree is shallow enough. At least two symbols get a code,
+// so the code is always complete.
+static void BuildLengths(const uint32_t* freqs, unsigned n, unsigned limit, uint8_t* lengths)
+{
+    uint32_t weights[286 * 2];
+    uint16_t order[286], parents[286 * 2];
+    unsigned nLeaves = 0;
+
+    for (unsigned i = 0; i < n; i++)
+    {
+        lengths[i] = 0;
+        if (freqs[i]) order[nLeaves++] = (uint16_t)i;
+    }
+    for (unsigned i = 0; nLeaves < 2; i++)
+    {
+        if (!freqs[i]) order[nLeaves++] = (uint16_t)i;
+    }
+
+    for (unsigned shift = 0; ; shift++)
+    {
+        // Leaves sorted by weight (insertion sort: at most 286 of them)
+        for (unsigned i = 0; i < nLeaves; i++)
+        {
+            uint16_t sym = order[i];
+            uint32_t w = freqs[sym] ? ((freqs[sym] - 1) >> shift) + 1 : 1;
+            unsigned j = i;
+            for (; j > 0 && weights[j - 1] > w; j--)
+            {
+                weights[j] = weights[j - 1];
+                order[j] = order[j - 1];
+            }
+            weights[j] = w;
+            order[j] = sym;
+        }
+
+        // Two queues: sorted leaves, and internal nodes, which come out sorted
+        unsigned leaf = 0, node = nLeaves, nNodes = nLeaves;
+        while (nNodes < 2 * nLeaves - 1)
+        {
+            unsigned pick[2];
+            for (int k = 0; k < 2; k++)
+            {
+                if (leaf < nLeaves && (node >= nNodes || weights[leaf] <= weights[node]))
+                    pick[k] = leaf++;
+                else
+                    pick[k] = node++;
+            }
+            weights[nNodes] = weights[pick[0]] + weights[pick[1]];
+            parents[pick[0]] = parents[pick[1]] = (uint16_t)nNodes;
+            nNodes++;
+        }
+
+        // Depths from the root down: parents always come later
+        uint8_t depths[286 * 2];
+        unsigned maxDepth = 0;
+        depths[nNodes - 1] = 0;
+        for (unsigned i = nNodes - 1; i-- > 0; )
+            depths[i] = (uint8_t)(depths[parents[i]] + 1);
+        for (unsigned i = 0; i < nLeaves; i++)
+            if (depths[i] > maxDepth) maxDepth = depths[i];
+
+        if (maxDepth <= limit)
+        {
+            for (unsigned i = 0; i < nLeaves; i++)
+                lengths[order[i]] = depths[i];
+            return;
+        }
+    }
+}
+
+// Canonical codes for the lengths, bit-reversed for output
+static void AssignCodes(const uint8_t* lengths, unsigned n, uint16_t* codes)
+{
+    uint16_t count[16] = {0}, next[16];
+    unsigned code = 0;
+
+    for (unsigned i = 0; i < n; i++)
+        count[lengths[i]]++;
+    count[0] = 0;
+    for (unsigned len = 1; len < 16; len++)
+    {
+        code = (code + count[len - 1]) << 1;
+        next[len] = (uint16_t)code;
+    }
+    for (unsigned i = 0; i < n; i++)
+    {
+        if (lengths[i])
+            codes[i] = (uint16_t)Reverse(next[lengths[i]]++, lengths[i]);
+    }
+}
+
+// Dynamic block header: the code lengths, run-length coded, then Huffman
+// coded themselves
+static void PutBlockHeader(Deflater* d, int final)
+{
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    uint8_t all[286 + 30], runs[286 + 30], runExtra[286 + 30];
+    uint8_t codeLengths[19];
+    uint16_t codeCodes[19];
+    uint32_t codeFreqs[19] = {0};
+    unsigned nLit = 286, nDist = 30, nRuns = 0, nCode = 19;
+
+    while (nLit > 257 && !d->litLengths[nLit - 1]) nLit--;
+    while (nDist > 1 && !d->distLengths[nDist - 1]) nDist--;
+    memcpy(all, d->litLengths, nLit);
+    memcpy(all + nLit, d->distLengths, nDist);
+
+    for (unsigned i = 0; i < nLit + nDist; )
+    {
+        unsigned run = 1;
+        while (i + run < nLit + nDist && all[i + run] == all[i]) run++;
+
+        if (all[i] == 0 && run >= 3)
+        {
+            run = run > 138 ? 138 : run;
+            runs[nRuns] = run >= 11 ? 18 : 17;
+            runExtra[nRuns++] = (uint8_t)(run >= 11 ? run - 11 : run - 3);
+        }
+        else if (all[i] != 0 && run >= 4)
+        {
+            // The length itself, then repeats of it
+            run = run > 7 ? 7 : run;
+            runs[nRuns] = all[i];
+            runExtra[nRuns++] = 0;
+            runs[nRuns] = 16;
+            runExtra[nRuns++] = (uint8_t)(run - 1 - 3);
+        }
+        else
+        {
+            run = 1;
+            runs[nRuns] = all[i];
+            runExtra[nRuns++] = 0;
+        }
+        i += run;
+    }
+
+    for (unsigned i = 0; i < nRuns; i++)
+        codeFreqs[runs[i]]++;
+    BuildLengths(codeFreqs, 19, 7, codeLengths);
+    AssignCodes(codeLengths, 19, codeCodes);
+    while (nCode > 4 && !codeLengths[order[nCode - 1]]) nCode--;
+
+    PutBits(d, final ? 1 : 0, 1);
+    PutBits(d, 2, 2);
+    PutBits(d, nLit - 257, 5);
+    PutBits(d, nDist - 1, 5);
+    PutBits(d, nCode - 4, 4);
+    for (unsigned i = 0; i < nCode; i++)
+        PutBits(d, codeLengths[order[i]], 3);
+
+    for (unsigned i = 0; i < nRuns; i++)
+    {
+        PutBits(d, codeCodes[runs[i]], codeLengths[runs[i]]);
+        if (runs[i] == 16) PutBits(d, runExtra[i], 2);
+        else if (runs[i] == 17) PutBits(d, runExtra[i], 3);
+        else if (runs[i] == 18) PutBits(d, runExtra[i], 7);
+    }
+}
+
+static void PutBlock(Deflater* d, int final)
+{
+    d->litFreqs[256] = 1;
+    BuildLengths(d->litFreqs, 286, 15, d->litLengths);
+    BuildLengths(d->distFreqs, 30, 15, d->distLengths);
+    AssignCodes(d->litLengths, 286, d->litCodes);
+    AssignCodes(d->distLengths, 30, d->distCodes);
+    PutBlockHeader(d, final);
+
+    for (size_t i = 0; i < d->nSymbols; i++)
+    {
+        unsigned len = d->symbolLengths[i], dist = d->symbolDists[i];
+
+        if (!dist)
+        {
+            PutBits(d, d->litCodes[len], d->litLengths[len]);
+            continue;
+        }
+
+        unsigned sym = d->lengthSymbols[len];
+        unsigned dsym = DistanceSymbol(d, dist);
+        PutBits(d, d->litCodes[257 + sym], d->litLengths[257 + sym]);
+        PutBits(d, len - g_LengthBase[sym], g_LengthExtra[sym]);
+        PutBits(d, d->distCodes[dsym], d->distLengths[dsym]);
+        PutBits(d, dist - g_DistBase[dsym], g_DistExtra[dsym]);
+    }
+    PutBits(d, d->litCodes[256], d->litLengths[256]);
+
+    d->nSymbols = 0;
+    memset(d->litFreqs, 0, sizeof(d->litFreqs));
+    memset(d->distFreqs, 0, sizeof(d->distFreqs));
+}
+
+static unsigned Hash3(const uint8_t* p)
+{
+    uint32_t v = p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16);
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+// Encode up to limit, which leaves MAX_MATCH bytes of lookahead unless the
+// input is finished
+static void Compress(Deflater* d, size_t limit)
+{
+    const uint8_t* w = d->window;
+
+    while (d->pos < limit)
+    {
+        size_t pos = d->pos;
+        size_t avail = d->fill - pos;
+        unsigned bestLen = 0, bestDist = 0;
+
+        if (avail >= MIN_MATCH)
+        {
+            unsigned h = Hash3(w + pos);
+            int32_t cand = d->head[h];
+            unsigned maxLen = avail < MAX_MATCH ? (unsigned)avail : MAX_MATCH;
+
+            d->prev[pos & (DEFLATE_WINDOW - 1)] = cand;
+            d->head[h] = (int32_t)pos;
+
+            for (int chain = 0; cand >= 0 && chain < MAX_CHAIN; chain++)
+            {
+                size_t dist = pos - (size_t)cand;
+                if (dist > DEFLATE_WINDOW) break;
+
+                // Only longer matches can beat the best: check its last byte first
+                if (w[cand + bestLen] == w[pos + bestLen])
+                {
+                    unsigned len = 0;
+                    while (len < maxLen && w[cand + len] == w[pos + len]) len++;
+                    if (len > bestLen)
+                    {
+                        bestLen = len;
+                        bestDist = (unsigned)dist;
+                        if (len == maxLen) break;
+                    }
+                }
+
+                int32_t next = d->prev[cand & (DEFLATE_WINDOW - 1)];
+                if (next >= cand) break;  // Overwritten by a newer position
+                cand = next;
+            }
+        }
+
+        if (bestLen >= MIN_MATCH)
+        {
+            d->symbolLengths[d->nSymbols] = (uint16_t)bestLen;
+            d->symbolDists[d->nSymbols++] = (uint16_t)bestDist;
+            d->litFreqs[257 + d->lengthSymbols[bestLen]]++;
+            d->distFreqs[DistanceSymbol(d, bestDist)]++;
+
+            // Positions inside the match go into the hash chains too
+            for (size_t p = pos + 1; p < pos + bestLen && p + MIN_MATCH <= d->fill; p++)
+            {
+                unsigned h = Hash3(w + p);
+                d->prev[p & (DEFLATE_WINDOW - 1)] = d->head[h];
+                d->head[h] = (int32_t)p;
+            }
+            d->pos += bestLen;
+        }
+        else
+        {
+            d->symbolLengths[d->nSymbols] = w[pos];
+            d->symbolDists[d->nSymbols++] = 0;
+            d->litFreqs[w[pos]]++;
+            d->pos++;
+        }
+
+        if (d->nSymbols == DEFLATE_BLOCK)
+            PutBlock(d, 0);
+    }
+}
+
+// Drop the older half of the window
+static void Slide(Deflater* d)
+{
+    memmove(d->window, d->window + DEFLATE_WINDOW, DEFLATE_WINDOW);
+    d->fill -= DEFLATE_WINDOW;
+    d->pos -= DEFLATE_WINDOW;
+
+    for (size_t i = 0; i < (1 << DEFLATE_HASH_BITS); i++)
+        d->head[i] = d->head[i] >= DEFLATE_WINDOW ? d->head[i] - DEFLATE_WINDOW : -1;
+    for (size_t i = 0; i < DEFLATE_WINDOW; i++)
+        d->prev[i] = d->prev[i] >= DEFLATE_WINDOW ? d->prev[i] - DEFLATE_WINDOW : -1;
+}
+
+int DeflateWrite(Deflater* d, const uint8_t* data, size_t len)
+{
+    while (len && !d->failed)
+    {
+        if (d->fill == sizeof(d->window))
+            Slide(d);
+
+        size_t n = sizeof(d->window) - d->fill;
+        if (n > len) n = len;
+        memcpy(d->window + d->fill, data, n);
+        d->fill += n;
+        data += n;
+        len -= n;
+
+        if (d->fill > MAX_MATCH)
+            Compress(d, d->fill - MAX_MATCH);
+    }
+    return !d->failed;
+}
+
+int DeflateFinish(Deflater* d)
+{
+    Compress(d, d->fill);
+    PutBlock(d, 1);
+
+    // Out to a byte boundary
+    while (d->nBits > 0 && !d->failed)
+    {
+        d->out[d->outLen++] = (uint8_t)d->bits;
+        d->bits >>= 8;
+        d->nBits = d->nBits > 8 ? d->nBits - 8 : 0;
+    }
+    FlushOut(d);
+    return !d->failed;
+}
+
+//=============================================================================
+// Tar
+//=============================================================================
+enum { TAR_HEADER, TAR_DATA, TAR_LONGNAME, TAR_PAX, TAR_PADDING, TAR_TRAILER };
+
+#define PAX_PATH   1
+#define PAX_SIZE   2
+#define PAX_MTIME  4
+
+void TarInit(TarReader* t, const TarHandler* handler)
+{
+    t->handler = *handler;
+    t->state = TAR_HEADER;
+    t->status = TAR_MORE;
+    t->fill = 0;
+    t->remaining = 0;
+    t->padding = 0;
+    t->emit = 0;
+    t->nameLen = 0;
+    t->nameTooLong = 0;
+    t->metaLen = 0;
+    t->paxFlags = 0;
+}
+
+// Octal, or base-256 (GNU) when the high bit of the first byte is set
+static uint64_t TarNumber(const uint8_t* field, size_t len)
+{
+    uint64_t value = 0;
+
+    if (field[0] & 0x80)
+    {
+        value = field[0] & 0x3F;
+        for (size_t i = 1; i < len; i++)
+            value = (value << 8) | field[i];
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < len && field[i] == ' ') i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = (value << 3) | (uint64_t)(field[i] - '0');
+    return value;
+}
+
+static int TarChecksumOk(const uint8_t* h)
+{
+    uint32_t sum = 0;
+    int32_t signedSum = 0;
+
+    for (int i = 0; i < 512; i++)
+    {
+        uint8_t c = (i >= 148 && i < 156) ? ' ' : h[i];
+        sum += c;
+        signedSum += (int8_t)c;
+    }
+    uint64_t stored = TarNumber(h + 148, 8);
+    return stored == sum || stored == (uint64_t)(uint32_t)signedSum;
+}
+
+// Turns '\\' into '/' and strips leading "./" and '/'; returns 0 for names to
+// skip (empty, a drive prefix or a ".." component), which would escape the
+// output folder wherever the archive ends up being unpacked
+static int CleanTarName(char** name, size_t* len)
+{
+    char* p = *name;
+    char* end = p + *len;
+
+    for (char* c = p; c < end; c++)
+        if (*c == '\\') *c = '/';
+
+    for (;;)
+    {
+        if (p < end && *p == '/') p++;
+        else if (end - p >= 2 && p[0] == '.' && p[1] == '/') p += 2;
+        else break;
+    }
+    if (end - p == 1 && p[0] == '.') p = end;
+    while (end > p && end[-1] == '/') end--;
+    if (end - p >= 2 && p[1] == ':') return 0;
+
+    for (const char* c = p; c < end; )
+    {
+        const char* s = c;
+        while (c < end && *c != '/') c++;
+        if (c - s == 2 && s[0] == '.' && s[1] == '.') return 0;
+        if (c < end) c++;
+    }
+
+    *name = p;
+    *len = (size_t)(end - p);
+    return *len != 0;
+}
+
+// "<len> <key>=<value>\n" records; path, size and mtime are used
+static void ParsePax(TarReader* t)
+{
+    const char* p = t->meta;
+    const char* end = t->meta + t->metaLen;
+
+    while (p < end)
+    {
+        size_t recLen = 0;
+        const char* q = p;
+        while (q < end && *q >= '0' && *q <= '9') recLen = recLen * 10 + (size_t)(*q++ - '0');
+        if (q >= end || *q != ' ' || recLen == 0 || recLen > (size_t)(end - p)) break;
+
+        const char* key = q + 1;
+        const char* recEnd = p + recLen - 1;  // The '\n'
+        const char* eq = key;
+        while (eq < recEnd && *eq != '=') eq++;
+        if (eq < recEnd)
+        {
+            const char* value = eq + 1;
+            size_t keyLen = (size_t)(eq - key), valueLen = (size_t)(recEnd - value);
+
+            if (keyLen == 4 && memcmp(key, "path", 4) == 0)
+            {
+                if (valueLen < TAR_NAME_MAX)
+                {
+                    memcpy(t->name, value, valueLen);
+                    t->nameLen = valueLen;
+                    t->paxFlags |= PAX_PATH;
+                }
+                else
+                {
+                    t->nameTooLong = 1;
+                }
+            }
+            else if ((keyLen == 4 && memcmp(key, "size", 4) == 0) ||
+                     (keyLen == 5 && memcmp(key, "mtime", 5) == 0))
+            {
+                uint64_t n = 0;
+                for (const char* c = value; c < recEnd && *c >= '0' && *c <= '9'; c++)
+                    n = n * 10 + (uint64_t)(*c - '0');
+                if (keyLen == 4) { t->paxSize = n; t->paxFlags |= PAX_SIZE; }
+                else { t->paxMtime = (int64_t)n; t->paxFlags |= PAX_MTIME; }
+            }
+        }
+        p += recLen;
+    }
+}
+
+// Full header in t->header; sets up the state for the member's data
+static int TarHeader(TarReader* t)
+{
+    const uint8_t* h = t->header;
+    int zero = 1;
+
+    for (int i = 0; i < 512 && zero; i++)
+        zero = (h[i] == 0);
+    if (zero)
+    {
+        t->state = TAR_TRAILER;
+        t->status = TAR_END;
+        return 1;
+    }
+    if (!TarChecksumOk(h))
+        return 0;
+
+    uint64_t size = TarNumber(h + 124, 12);
+    int64_t mtime = (int64_t)TarNumber(h + 136, 12);
+    char type = (char)h[156];
+
+    t->emit = 0;
+    t->remaining = size;
+    t->padding = (512 - (size & 511)) & 511;
+    t->state = TAR_DATA;
+
+    if (type == 'L')
+    {
+        t->state = TAR_LONGNAME;
+        t->nameLen = 0;
+        t->nameTooLong = 0;
+        return 1;
+    }
+    if (type == 'x')
+    {
+        t->state = TAR_PAX;
+        t->metaLen = 0;
+        return 1;
+    }
+
+    // A long name or pax header belongs to this member alone, whatever its type
+    char built[256 + 1 + 100];
+    char* name = t->name;
+    size_t nameLen = t->nameLen;
+    int nameTooLong = t->nameTooLong;
+    if (t->paxFlags & PAX_SIZE)
+    {
+        t->remaining = t->paxSize;
+        t->padding = (512 - (t->paxSize & 511)) & 511;
+    }
+    if (t->paxFlags & PAX_MTIME)
+        mtime = t->paxMtime;
+    t->nameLen = 0;
+    t->nameTooLong = 0;
+    t->paxFlags = 0;
+    t->metaLen = 0;
+
+    if (type != '0' && type != '\0' && type != '7' && type != '5')
+        return 1;  // Skipped: links, devices, global pax headers, ...
+
+    // Its real name is lost; the ustar fields only hold a cut copy
+    if (nameTooLong)
+    {
+        t->nameTooLong = 1;
+        return 0;
+    }
+
+    // Name: long name if one came before, else ustar prefix + name
+    if (!nameLen)
+    {
+        size_t prefixLen = 0, baseLen = 0;
+        if (memcmp(h + 257, "ustar", 5) == 0)
+            while (prefixLen < 155 && h[345 + prefixLen]) prefixLen++;
+        while (baseLen < 100 && h[baseLen]) baseLen++;
+
+        memcpy(built, h + 345, prefixLen);
+        nameLen = prefixLen;
+        if (prefixLen) built[nameLen++] = '/';
+        memcpy(built + nameLen, h, baseLen);
+        nameLen += baseLen;
+        name = built;
+    }
+
+    int isDir = (type == '5') || (nameLen && name[nameLen - 1] == '/');
+    if (!CleanTarName(&name, &nameLen))
+        return 1;
+    if (!t->handler.begin(t->handler.context, name, nameLen, isDir ? 0 : t->remaining, mtime, isDir))
+        return 0;
+    if (isDir)
+        return t->handler.end(t->handler.context);
+
+    t->emit = 1;
+    if (t->remaining == 0)
+    {
+        t->emit = 0;
+        return t->handler.end(t->handler.context);
+    }
+    return 1;
+}
+
+int TarFeed(void* reader, const uint8_t* data, size_t len)
+{
+    TarReader* t = reader;
+
+    while (len && t->status == TAR_MORE)
+    {
+        size_t n;
+
+        switch (t->state)
+        {
+        case TAR_HEADER:
+            n = 512 - t->fill;
+            if (n > len) n = len;
+            memcpy(t->header + t->fill, data, n);
+            t->fill += n;
+            if (t->fill == 512)
+            {
+                t->fill = 0;
+                if (!TarHeader(t))
+                    t->status = TAR_ERROR;
+                else if (t->state != TAR_TRAILER && t->remaining == 0)
+                    t->state = TAR_PADDING;
+            }
+            break;
+
+        case TAR_DATA:
+        case TAR_LONGNAME:
+        case TAR_PAX:
+            n = len < t->remaining ? len : (size_t)t->remaining;
+            if (t->state == TAR_DATA && t->emit)
+            {
+                if (!t->handler.data(t->handler.context, data, n))
+                {
+                    t->status = TAR_ERROR;
+                    return 0;
+                }
+            }
+            else if (t->state == TAR_LONGNAME)
+            {
+                // Terminator included
+                if (t->nameLen + n <= TAR_NAME_MAX)
+                {
+                    memcpy(t->name + t->nameLen, data, n);
+                    t->nameLen += n;
+                }
+                else
+                {
+                    t->nameTooLong = 1;
+                }
+            }
+            else if (t->state == TAR_PAX && t->metaLen + n <= TAR_META_MAX)
+            {
+                memcpy(t->meta + t->metaLen, data, n);
+                t->metaLen += n;
+            }
+            t->remaining -= n;
+
+            if (t->remaining == 0)
+            {
+                if (t->state == TAR_LONGNAME)
+                    while (t->nameLen && t->name[t->nameLen - 1] == '\0') t->nameLen--;
+                else if (t->state == TAR_PAX)
+                    ParsePax(t);
+                else if (t->emit && !t->handler.end(t->handler.context))
+                    t->status = TAR_ERROR;
+                t->emit = 0;
+                t->state = TAR_PADDING;
+            }
+            break;
+
+        default:  // TAR_PADDING
+            n = len < t->padding ? len : (size_t)t->padding;
+            t->padding -= n;
+            if (t->padding == 0)
+                t->state = TAR_HEADER;
+            break;
+        }
+
+        data += n;
+        len -= n;
+    }
+    return t->status != TAR_ERROR;
+}
+
+int TarFinish(const TarReader* t)
+{
+    // Some writers leave out the zero blocks at the end
+    return t->status == TAR_END ||
+           (t->status == TAR_MORE && ((t->state == TAR_HEADER && t->fill == 0) ||
+                                      (t->state == TAR_PADDING && t->padding == 0)));
+}
@@ -0,0 +1,453 @@
+/*
+ * WinRAR Shell Extension - portable core
+ *
+ * The parts of the extension that don't need Windows: archive extension
+ * matching, selection classification and its string arena, archive and
+ * destination naming, list file encoding (and on Linux the handoff of a
+ * list to an archiver), WinRAR command lines, the filters.txt path filter,
+ * the per-device scheduling, QoS policy and statistics of WinRAR runs,
+ * CRC-32, the deflate/gzip/tar codecs behind zip checks and conversion,
+ * and the menu icon's pixel work. Plain C with wchar_t strings, so it also
+ * builds on other platforms (where wchar_t is 32-bit).
+ */
+
+#ifndef WINRAR_QUICKEXTRACT_CORE_H
+#define WINRAR_QUICKEXTRACT_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#define CORE_MAX_PATH    260   // Same as MAX_PATH
+#define MAX_EXTENSIONS   64
+#define EXTENSION_CHARS  16
+
+typedef enum {
+    SEL_NONE = 0,
+    SEL_SINGLE_ARCHIVE,      // Single archive file - show extract option
+    SEL_FILES_ONLY,          // Multiple files (no folders) - show zip to single archive
+    SEL_FOLDERS_ONLY,        // Multiple folders only - show zip each + zip all options
+    SEL_MIXED                // Files and folders mixed - show zip to single archive
+} SelectionType;
+
+// A path split into directory, stem and extension without copying:
+// dir = [0, nameStart), stem = [nameStart, extStart), ext = [extStart, length).
+// '\', '/' and ':' separate components; ext includes its '.'.
+typedef struct {
+    size_t length;
+    size_t nameStart;
+    size_t extStart;        // == length if there's no extension
+} PathSpans;
+
+void SplitPath(const wchar_t* path, PathSpans* spans);
+
+// First n characters equal, ASCII case folded. Both must have n readable characters.
+int EqualsIgnoreCase(const wchar_t* a, const wchar_t* b, size_t n);
+
+const wchar_t* FindFileName(const wchar_t* path);
+const wchar_t* FindExtension(const wchar_t* path);  // Points at the '.', or the terminator
+
+// Case-insensitive (ASCII) match of path's extension against the list
+int MatchesExtension(const wchar_t* path, const wchar_t (*extensions)[EXTENSION_CHARS], int count);
+
+// Menu to offer for a selection. A single item is classified by whether
+// it's an archive (checked first) or a folder.
+SelectionType ClassifySelection(unsigned nFiles, unsigned nFolders, int singleIsArchive);
+
+// "C:\dir\name.rar" -> folderName "name", destFolder "C:\dir\name".
+// Buffers hold CORE_MAX_PATH chars. Returns 0 if a result doesn't fit.
+int MakeExtractDestination(const wchar_t* archivePath, wchar_t* folderName, wchar_t* destFolder);
+
+// "<dir>\<name>.zip" into a CORE_MAX_PATH buffer. Returns 0, leaving an
+// empty string, if it doesn't fit. So do the command line formatters.
+int MakeZipPath(const wchar_t* dir, const wchar_t* name, wchar_t* out);
+
+// One list file line, UTF-16LE with CRLF. Returns the code units written,
+// 0 if out can't hold the line.
+size_t EncodeListLine(const wchar_t* path, uint16_t* out, size_t cap);
+
+// "<winrar>" <command> "<archive>" @"<list>"
+int FormatListCommand(wchar_t* out, size_t cch, const wchar_t* winrar, const wchar_t* command,
+                      const wchar_t* archive, const wchar_t* listPath);
+
+// "<winrar>" x "<archive>" [@"<list>"] "<dest>\"; listPath may be NULL
+int FormatExtractCommand(wchar_t* out, size_t cch, const wchar_t* winrar, const wchar_t* archive,
+                         const wchar_t* listPath, const wchar_t* destFolder);
+
+#if defined(__linux__)
+// An archiver takes its list as a path after '@' and opens it by name.
+// The transports give it one: a file in tempDir, or /dev/fd/N for a pipe
+// or memfd the child inherits across fork/exec. A memfd never touches a
+// filesystem and can be reopened from the start; a pipe holds no copy
+// but is read once, and whatever doesn't fit its buffer is written by
+// ListHandoffServe while the child reads.
+typedef enum {
+    LIST_FILE = 0,
+    LIST_PIPE,
+    LIST_MEMFD
+} ListTransport;
+
+typedef struct {
+    ListTransport transport;
+    int fd;                     // The child's end, inheritable; -1 for a file
+    int writeFd;                // Pipe: write end while data is pending, else -1
+    const uint8_t* pending;     // Pipe: what didn't fit, in the caller's data
+    size_t pendingSize;
+    char path[CORE_MAX_PATH];   // Goes after '@'
+} ListHandoff;
+
+// Put size bytes of an encoded list behind h->path. For a pipe, data must
+// stay valid until ListHandoffServe. Returns 0, with nothing left open,
+// on failure or if tempDir + name doesn't fit.
+int ListHandoffOpen(ListHandoff* h, ListTransport transport, const void* data, size_t size,
+                    const char* tempDir);
+
+// In the parent once the child is started: closes the parent's copy of
+// the child's end and writes a pipe's pending data, blocking until it's
+// read. 0 if the child went away first (with SIGPIPE ignored).
+int ListHandoffServe(ListHandoff* h);
+
+// Closes what's still open and deletes the temp file
+void ListHandoffClose(ListHandoff* h);
+#endif
+
+// A context menu instance keeps its strings in one arena sized to the
+// selection. Released instances are pooled, up to MENU_POOL_DEPTH, and keep
+// an arena of up to MENU_ARENA_KEEP bytes for the next selection.
+#define MENU_POOL_DEPTH    16
+#define MENU_ARENA_KEEP    4096
+
+typedef struct {
+    uint8_t* base;
+    size_t size;
+    size_t used;
+} Arena;
+
+// Next pointer-aligned block, NULL if the arena can't hold it
+void* ArenaAlloc(Arena* arena, size_t bytes);
+
+// Arena bytes for a selection: the pointer table, n paths of lens[i]
+// characters (without terminator), copies more strings as long as the first
+// path, and one of rootChars characters
+size_t SelectionArenaSize(const size_t* lens, unsigned n, unsigned copies, size_t rootChars);
+
+// Include/exclude globs (filters.txt), one per line, '#' starts a comment.
+// Lines starting with '!' re-include what an earlier line excluded; the
+// last matching line wins.
+//   node_modules     - no separator: matches an entry name at any depth
+//   **/bin/Debug     - leading **/ : matches at any depth
+//   build/out        - otherwise anchored at the root of the archive
+// '*' and '?' stay within one path component, '**' crosses them, and
+// "a/**/b" also matches "a/b". ASCII is matched case-insensitively.
+//
+// All rules are compiled into one bit-parallel NFA (one bit per glob token),
+// so a path is matched in a single pass whatever the number of rules. Rules
+// that don't fit (FILTER_MAX_STATES tokens, FILTER_MAX_CLASSES distinct
+// characters) are left out.
+#define FILTER_MAX_WORDS   16
+#define FILTER_MAX_STATES  (FILTER_MAX_WORDS * 64)
+#define FILTER_MAX_CLASSES 256
+
+typedef struct {
+    uint64_t w[FILTER_MAX_WORDS];
+} StateSet;
+
+// Compiled rules, about 36 KB; callers allocate it
+typedef struct {
+    unsigned nWords;
+    unsigned nClasses;
+    uint8_t asciiClass[128];            // Lower-cased ASCII -> class
+    wchar_t otherChars[FILTER_MAX_CLASSES];
+    unsigned nOther;                    // Non-ASCII literals, looked up linearly
+    StateSet loopAll;                   // '*' and '**' states stay on non-separators
+    StateSet loopSep;                   // Only '**' states stay on separators
+    StateSet stars;                     // Reachable from the previous state without input
+    StateSet sepSkips;                  // The '\' of "\**\", also reached right after a separator
+    StateSet anchoredStarts;
+    StateSet floatingStarts;            // Re-armed after every separator
+    StateSet finals;
+    StateSet includeFinals;             // Finals of '!' rules
+    StateSet advance[FILTER_MAX_CLASSES];  // Per class: states entered by consuming it
+} PathFilter;
+
+// Compile the rules in text, which is modified. Returns how many were
+// compiled, 0 if there are none; *skipped (if not NULL) is how many didn't fit.
+unsigned CompileFilter(PathFilter* f, wchar_t* text, unsigned* skipped);
+
+// Match a path piece by piece: FilterStart, then FilterFeed any number of
+// times ('\' and '/' separate components). FilterAllows is 1 if the path
+// fed so far is kept: no rule matched it, or the last one that did is a '!' rule.
+void FilterStart(const PathFilter* f, StateSet* s);
+void FilterFeed(const PathFilter* f, StateSet* s, const wchar_t* str, size_t len);
+int FilterAllows(const PathFilter* f, const StateSet* s);
+
+// WinRAR runs are scheduled per physical device: a task starts once every
+// device it reads or writes runs fewer tasks than that device's limit. A
+// resolver maps a path to its device; DeviceSlots counts what runs where.
+#define DEVICE_MAX 32
+
+typedef enum {
+    DEVICE_HDD = 0,         // Also anything unknown
+    DEVICE_SSD,
+    DEVICE_NETWORK,
+    DEVICE_KINDS
+} DeviceKind;
+
+typedef struct {
+    uint32_t id;            // The same for every path on one physical device
+    DeviceKind kind;
+    unsigned limit;         // Concurrent tasks allowed on it
+} DeviceKey;
+
+// Sets dev->id and dev->kind for the device path lives on; 0 if it can't tell
+typedef int (*DeviceResolver)(void* context, const wchar_t* path, DeviceKey* dev);
+
+typedef struct {
+    struct {
+        uint32_t id;
+        unsigned running;
+    } slots[DEVICE_MAX];
+    unsigned nSlots;
+} DeviceSlots;
+
+// The devices of a task reading source and writing dest into devices[2],
+// with limits[kind] (at least 1) as their limits. A path the resolver
+// can't place gets a device of its own. Returns 1 if both are on one
+// device, else 2.
+unsigned ResolveTaskDevices(DeviceResolver resolve, void* context, const unsigned* limits,
+                            const wchar_t* source, const wchar_t* dest, DeviceKey* devices);
+
+// Take a slot on each of the n devices if all have one free. Returns 0,
+// taking nothing, if one is full. A device that doesn't fit the table
+// (DEVICE_MAX busy devices) isn't limited.
+int TryAcquireDevices(DeviceSlots* s, const DeviceKey* devices, unsigned n);
+void ReleaseDevices(DeviceSlots* s, const DeviceKey* devices, unsigned n);
+
+#if defined(__linux__)
+// Resolver from stat(): st_dev, with partitions mapped to their disk,
+// rotational from sysfs and network filesystems from statfs()
+int ResolveDevicePosix(void* context, const wchar_t* path, DeviceKey* dev);
+#endif
+
+// Foreground tasks are what the user just asked for, background ones are
+// batches. Background tasks run at lowered CPU and I/O priority under a CPU
+// cap. While the system is busier than the threshold they're throttled:
+// idle priority, a quarter of the cap and one background task at a time.
+// Foreground tasks are never held back and start first.
+typedef enum {
+    QOS_FOREGROUND = 0,
+    QOS_BACKGROUND
+} QosClass;
+
+typedef enum {
+    QOS_PRIORITY_NORMAL = 0,
+    QOS_PRIORITY_LOW,
+    QOS_PRIORITY_IDLE
+} QosPriority;
+
+typedef struct {
+    unsigned threshold;     // Busy percent that throttles, 0 for never
+    unsigned hysteresis;    // The throttle lifts below threshold - hysteresis
+    unsigned cpuRate;       // Background CPU cap in percent, 0 for none
+    int niceLow;            // POSIX nice values for QOS_PRIORITY_LOW and _IDLE
+    int niceIdle;
+    int throttled;
+} QosPolicy;
+
+// Set the knobs, keeping the throttle state: a zeroed policy is unthrottled.
+// The nice values start at 10 and 19.
+void QosConfigure(QosPolicy* p, unsigned threshold, unsigned hysteresis, unsigned cpuRate);
+
+// Take a load sample (busy percent of all CPUs). Returns 1 if the throttle
+// switched on or off.
+int QosUpdate(QosPolicy* p, unsigned load);
+
+unsigned QosCpuRate(const QosPolicy* p);                // Cap for the background tasks now
+QosPriority QosPriorityOf(const QosPolicy* p, QosClass qos);
+int QosMayStart(const QosPolicy* p, QosClass qos, unsigned nBackground);
+
+#if defined(__linux__)
+// Apply a priority to a process: nice, plus the best-effort I/O class at
+// its lowest level for LOW and the idle I/O class for IDLE. 0 if either
+// was refused (raising priority back needs privileges).
+int QosApplyPosix(int pid, QosPriority priority, const QosPolicy* p);
+#endif
+
+// stats.bin: a StatsHeader, then a ring of the last STATS_CAPACITY WinRAR
+// runs. Fixed-size fields in the layout the DLL has always written, so the
+// file reads the same on any platform.
+#define STATS_MAGIC     0x31535851u  // "QXS1"
+#define STATS_CAPACITY  1024
+#define STATS_FILE_SIZE (sizeof(StatsHeader) + STATS_CAPACITY * sizeof(StatsRecord))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t capacity;
+    uint32_t next;                  // Slot the next record goes to
+    uint32_t count;
+} StatsHeader;
+
+typedef struct {
+    uint64_t finished;              // FILETIME: 100 ns units since 1601, UTC
+    uint32_t exitCode;
+    uint32_t wallMs;
+    uint64_t inBytes;
+    uint64_t outBytes;              // 0 if unknown
+    uint16_t archive[CORE_MAX_PATH];    // UTF-16, may be empty
+} StatsRecord;
+
+typedef struct {
+    unsigned runs;
+    unsigned failed;                // Non-zero exit code
+    uint64_t inBytes;               // Totals of the runs that succeeded
+    uint64_t outBytes;
+    uint64_t wallMs;
+    uint32_t longestMs;
+} StatsSummary;
+
+// Append to a STATS_FILE_SIZE stats file in memory (mapped), starting it
+// over if it's new or not a stats file
+void StatsAppend(void* file, const StatsRecord* rec);
+
+// Totals of the runs that finished at or after since (FILETIME units).
+// Returns 0, with an empty summary, if file isn't a stats file.
+int StatsSummarize(const void* file, uint64_t since, StatsSummary* out);
+
+// outBytes as a whole percentage of inBytes, 100 without input
+unsigned StatsRatioPercent(uint64_t inBytes, uint64_t outBytes);
+
+// Premultiply 32-bit BGRA pixels by their alpha in place: c = c * a / 255,
+// rounded down, alpha unchanged. Vectorized where the target allows.
+void PremultiplyAlpha(uint8_t* bgra, size_t pixels);
+
+// CRC-32 (zip polynomial). Crc32Init builds the tables and must have run,
+// once, before any Crc32Update. Start with crc = 0.
+void Crc32Init(void);
+uint32_t Crc32Update(uint32_t crc, const void* data, size_t len);
+
+// Raw deflate decoding
+#define INFLATE_RING       65536   // Output ring, twice the deflate window
+#define INFLATE_FAST_BITS  10      // Codes up to this long decode with one lookup
+
+#define INFLATE_DONE       0
+#define INFLATE_STOPPED    1       // The sink returned 0
+#define INFLATE_ERROR      (-1)    // Corrupt or truncated stream
+
+// Receives a byte stream in order, in pieces; returns 0 to stop it
+typedef int (*ByteSink)(void* context, const uint8_t* data, size_t len);
+
+typedef struct {
+    uint16_t fast[1 << INFLATE_FAST_BITS];  // (symbol << 4) | length, 0 for longer codes
+    uint16_t count[16];                     // Codes per length
+    uint16_t symbols[288];                  // Symbols in code order
+} HuffmanTable;
+
+// Decoder state, about 70 KB; callers allocate it
+typedef struct {
+    const uint8_t* in;
+    size_t inLen;
+    size_t pos;
+    uint64_t bits;
+    unsigned nBits;
+    size_t written;             // Total output so far
+    size_t flushed;             // Output already given to the sink
+    ByteSink sink;
+    void* context;
+    HuffmanTable lit;
+    HuffmanTable dist;
+    uint8_t ring[INFLATE_RING];
+} Inflater;
+
+// Decode the deflate stream at the start of in. On INFLATE_DONE, *inUsed
+// (if not NULL) is the compressed size.
+int Inflate(Inflater* z, const uint8_t* in, size_t inLen, size_t* inUsed,
+            ByteSink sink, void* context);
+
+// Size of the gzip member header at in, 0 if there isn't a valid one
+size_t GzipHeaderSize(const uint8_t* in, size_t len);
+
+// Deflate with greedy LZ77 matching and a Huffman code per block: much
+// faster than WinRAR's zip at its usual levels, for data streamed through once.
+#define DEFLATE_WINDOW     32768
+#define DEFLATE_HASH_BITS  15
+#define DEFLATE_BLOCK      16384   // Symbols per block
+#define DEFLATE_OUT        16384
+
+typedef struct {
+    ByteSink sink;
+    void* context;
+    int failed;                 // The sink stopped
+    size_t fill;                // Bytes in window
+    size_t pos;                 // Next byte to encode
+    uint64_t bits;
+    unsigned nBits;
+    size_t outLen;
+    size_t nSymbols;            // In the current block
+    uint16_t symbolLengths[DEFLATE_BLOCK];  // Literal byte, or match length
+    uint16_t symbolDists[DEFLATE_BLOCK];    // 0 for a literal
+    uint32_t litFreqs[286];
+    uint32_t distFreqs[30];
+    uint16_t litCodes[286];     // Current block's codes, bit-reversed
+    uint8_t litLengths[286];
+    uint16_t distCodes[30];
+    uint8_t distLengths[30];
+    uint8_t lengthSymbols[259]; // Match length -> length symbol - 257
+    uint8_t distSymbols[512];   // Distance -> distance symbol, see DistanceSymbol()
+    int32_t head[1 << DEFLATE_HASH_BITS];
+    int32_t prev[DEFLATE_WINDOW];
+    uint8_t window[2 * DEFLATE_WINDOW];
+    uint8_t out[DEFLATE_OUT];
+} Deflater;
+
+// Raw deflate stream to sink. Each call returns 0 once the sink has stopped.
+void DeflateInit(Deflater* d, ByteSink sink, void* context);
+int DeflateWrite(Deflater* d, const uint8_t* data, size_t len);
+int DeflateFinish(Deflater* d);
+
+// Streaming tar (ustar, GNU long names, pax path/size/mtime) reader. Feed it
+// any sized pieces with TarFeed, which is a ByteSink. Regular files and
+// folders are reported; links, devices and names with ".." are skipped.
+// Names are the archive's bytes (UTF-8 for pax) with '/' separators and no
+// leading "./" or '/'. A file or folder whose long name doesn't fit in
+// TAR_NAME_MAX - 1 bytes fails the archive (TAR_ERROR, with nameTooLong set)
+// instead of being reported under a cut or fallback name.
+#define TAR_NAME_MAX  4096
+#define TAR_META_MAX  8192
+
+typedef struct {
+    int (*begin)(void* context, const char* name, size_t nameLen, uint64_t size,
+                 int64_t mtime, int isDir);
+    ByteSink data;
+    int (*end)(void* context);
+    void* context;
+} TarHandler;
+
+typedef struct {
+    TarHandler handler;
+    int state;
+    int status;                 // TAR_MORE, TAR_END or TAR_ERROR
+    uint8_t header[512];
+    size_t fill;
+    uint64_t remaining;         // Data left in the current member
+    uint64_t padding;           // Then this much up to the next 512 bytes
+    int emit;                   // Current member's data goes to the handler
+    size_t nameLen;             // Name from a GNU 'L' or pax header, if any
+    int nameTooLong;            // That name didn't fit in name
+    size_t metaLen;
+    int64_t paxMtime;
+    uint64_t paxSize;
+    int paxFlags;
+    char name[TAR_NAME_MAX];
+    char meta[TAR_META_MAX];
+} TarReader;
+
+#define TAR_MORE   0
+#define TAR_END    1
+#define TAR_ERROR  (-1)
+
+void TarInit(TarReader* t, const TarHandler* handler);
+int TarFeed(void* reader, const uint8_t* data, size_t len);
+// After the last piece: 1 if the archive ended cleanly
+int TarFinish(const TarReader* t);
+
+#endif
@@ -6,6 +6,7 @@
  * - "Zip to <parent>.zip" for multi-file/folder selections
  * - "Zip each folder separately" for multi-folder selections
  * - "Zip all folders to <parent>.zip" for multi-folder selections
+ * - "RAR to <parent>.rar" next to those with [Profile] Format=rar
  *
  * Reads supported extensions from WinRAR's registry.
  */
@@ -20,9 +21,17 @@
 #include <shlwapi.h>
 #include <strsafe.h>
 #include <commoncontrols.h>
+#include <shellscalingapi.h>
+#include <winioctl.h>
+#include <intrin.h>
+#include <stdlib.h>
+
+#include "core.h"
 
 #pragma comment(lib, "shlwapi.lib")
 #pragma comment(lib, "comctl32.lib")
+#pragma comment(lib, "shcore.lib")
+#pragma comment(lib, "synchronization.lib")
 
 // Our CLSID
 static const CLSID CLSID_WinRARExtract = 
@@ -35,13 +44,106 @@ static LONG g_cRef = 0;
 static wchar_t g_WinRARPath[MAX_PATH] = L"C:\\Program Files\\WinRAR\\WinRAR.exe";
 
 // Dynamic archive extensions from WinRAR registry
-#define MAX_EXTENSIONS 64
-static wchar_t g_ArchiveExtensions[MAX_EXTENSIONS][16];
+static wchar_t g_ArchiveExtensions[MAX_EXTENSIONS][EXTENSION_CHARS];
 static int g_NumExtensions = 0;
 
 // Max items we can handle in a multi-selection
 #define MAX_SELECTED_ITEMS 256
 
+// Archive name for items selected in a drive root: volume labels are at
+// most 32 characters
+#define ROOT_NAME_CHARS 33
+
+//=============================================================================
+// Tracing
+//=============================================================================
+// Always-on event log for the right-click path. Each thread writes
+// timestamped begin/end marks into its own ring buffer, so recording is a
+// QueryPerformanceCounter call and a few stores, no locks. Buffers of exited
+// threads are reused. See ExportTrace for getting the data out.
+#define TRACE_EVENTS 1024  // Per thread, power of two
+
+typedef struct {
+    LONGLONG ts;            // QueryPerformanceCounter ticks
+    const char* name;       // Static string
+    char phase;             // 'B'egin, 'E'nd, 'i'nstant
+} TraceRecord;
+
+typedef struct TraceBuffer {
+    struct TraceBuffer* next;
+    volatile LONG owned;    // 0 once the owning thread has exited
+    DWORD tid;
+    volatile LONG head;     // Records written so far
+    TraceRecord records[TRACE_EVENTS];
+} TraceBuffer;
+
+static TraceBuffer* volatile g_TraceBuffers = NULL;
+static DWORD g_TraceFls = FLS_OUT_OF_INDEXES;
+
+static void WINAPI TraceThreadExit(void* data)
+{
+    TraceBuffer* buffer = data;
+    if (buffer)
+        InterlockedExchange(&buffer->owned, 0);
+}
+
+static TraceBuffer* GetTraceBuffer(void)
+{
+    if (g_TraceFls == FLS_OUT_OF_INDEXES)
+        return NULL;
+
+    TraceBuffer* buffer = FlsGetValue(g_TraceFls);
+    if (buffer)
+        return buffer;
+
+    for (buffer = g_TraceBuffers; buffer; buffer = buffer->next)
+    {
+        if (InterlockedCompareExchange(&buffer->owned, 1, 0) == 0)
+            break;
+    }
+
+    if (!buffer)
+    {
+        buffer = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(TraceBuffer));
+        if (!buffer) return NULL;
+        buffer->owned = 1;
+
+        TraceBuffer* head;
+        do
+        {
+            head = g_TraceBuffers;
+            buffer->next = head;
+        } while (InterlockedCompareExchangePointer((PVOID volatile*)&g_TraceBuffers, buffer, head) != head);
+    }
+
+    buffer->tid = GetCurrentThreadId();
+    buffer->head = 0;
+    FlsSetValue(g_TraceFls, buffer);
+    return buffer;
+}
+
+static void TraceMark(const char* name, char phase)
+{
+    TraceBuffer* buffer = GetTraceBuffer();
+    LARGE_INTEGER now;
+
+    if (!buffer) return;
+    QueryPerformanceCounter(&now);
+
+    // Only this thread writes; head is published after the record
+    LONG i = buffer->head;
+    TraceRecord* rec = &buffer->records[i & (TRACE_EVENTS - 1)];
+    rec->ts = now.QuadPart;
+    rec->name = name;
+    rec->phase = phase;
+    InterlockedExchange(&buffer->head, i + 1);
+}
+
+static void TraceBegin(const char* name) { TraceMark(name, 'B'); }
+static void TraceEnd(const char* name)   { TraceMark(name, 'E'); }
+
+static void MaybeExportTrace(LONGLONG startTs, const wchar_t* const* paths, UINT count);
+
 //=============================================================================
 // Read extensions from WinRAR's registry
 //=============================================================================
@@ -88,7 +190,7 @@ static void LoadArchiveExtensions(void)
                 // Only add if Set = 1 (actively associated with WinRAR)
                 if (setVal == 1)
                 {
-                    wcscpy_s(g_ArchiveExtensions[g_NumExtensions], 16, subKeyName);
+                    wcscpy_s(g_ArchiveExtensions[g_NumExtensions], EXTENSION_CHARS, subKeyName);
                     g_NumExtensions++;
                 }
             }
@@ -100,15 +202,7 @@ static void LoadArchiveExtensions(void)
 
 static BOOL IsArchiveFile(const wchar_t* path)
 {
-    const wchar_t* ext = PathFindExtensionW(path);
-    if (!ext || !*ext) return FALSE;
-    
-    for (int i = 0; i < g_NumExtensions; i++)
-    {
-        if (_wcsicmp(ext, g_ArchiveExtensions[i]) == 0)
-            return TRUE;
-    }
-    return FALSE;
+    return MatchesExtension(path, g_ArchiveExtensions, g_NumExtensions);
 }
 
 //=============================================================================
@@ -145,20 +239,7 @@ static HBITMAP IconToBitmap(HICON hIcon, int cx, int cy)
         
         // Pre-multiply alpha
         if (pvBits)
-        {
-            BYTE* p = (BYTE*)pvBits;
-            for (int i = 0; i < cx * cy; i++)
-            {
-                BYTE a = p[3];
-                if (a < 255)
-                {
-                    p[0] = (BYTE)((p[0] * a) / 255);
-                    p[1] = (BYTE)((p[1] * a) / 255);
-                    p[2] = (BYTE)((p[2] * a) / 255);
-                }
-                p += 4;
-            }
-        }
+            PremultiplyAlpha(pvBits, (size_t)cx * cy);
     }
     
     DeleteDC(hdcMem);
@@ -167,62 +248,130 @@ static HBITMAP IconToBitmap(HICON hIcon, int cx, int cy)
     return hBitmap;
 }
 
-static HBITMAP GetWinRARMenuBitmap(void)
+// One bitmap per DPI the menu has been shown at, kept for the DLL's lifetime
+#define MAX_ICON_DPIS 8
+
+typedef struct {
+    UINT dpi;
+    HBITMAP hBitmap;
+} MenuBitmap;
+
+static SRWLOCK g_MenuBitmapLock = SRWLOCK_INIT;
+static MenuBitmap g_MenuBitmaps[MAX_ICON_DPIS];
+static UINT g_nMenuBitmaps = 0;
+
+// DPI of the monitor the menu opens on (Explorer is per-monitor aware).
+// The handler isn't told the owner window, and the foreground window can be
+// on another monitor or belong to another process; the menu pops up at the
+// cursor, so use the monitor under it.
+static UINT GetMenuDpi(void)
 {
-    static HBITMAP s_hBitmap = NULL;
-    
-    if (s_hBitmap) return s_hBitmap;
+    POINT pt;
+    UINT dpiX, dpiY;
+
+    if (GetCursorPos(&pt))
+    {
+        HMONITOR hMonitor = MonitorFromPoint(pt, MONITOR_DEFAULTTONEAREST);
+        if (hMonitor && SUCCEEDED(GetDpiForMonitor(hMonitor, MDT_EFFECTIVE_DPI, &dpiX, &dpiY)))
+            return dpiX;
+    }
+    return GetDpiForSystem();
+}
+
+// Cached bitmap for dpi, or once all slots are taken the closest size.
+// Called with g_MenuBitmapLock held.
+static HBITMAP FindMenuBitmap(UINT dpi)
+{
+    UINT nearest = 0;
+
+    for (UINT i = 0; i < g_nMenuBitmaps; i++)
+    {
+        if (g_MenuBitmaps[i].dpi == dpi)
+            return g_MenuBitmaps[i].hBitmap;
+        if (abs((int)g_MenuBitmaps[i].dpi - (int)dpi) < abs((int)g_MenuBitmaps[nearest].dpi - (int)dpi))
+            nearest = i;
+    }
+    return (g_nMenuBitmaps == MAX_ICON_DPIS) ? g_MenuBitmaps[nearest].hBitmap : NULL;
+}
+
+static HBITMAP GetWinRARMenuBitmap(UINT dpi)
+{
+    AcquireSRWLockShared(&g_MenuBitmapLock);
+    HBITMAP hBitmap = FindMenuBitmap(dpi);
+    ReleaseSRWLockShared(&g_MenuBitmapLock);
+    if (hBitmap) return hBitmap;
     
-    int cx = GetSystemMetrics(SM_CXSMICON);
-    int cy = GetSystemMetrics(SM_CYSMICON);
+    int cx = GetSystemMetricsForDpi(SM_CXSMICON, dpi);
+    int cy = GetSystemMetricsForDpi(SM_CYSMICON, dpi);
     
     HICON hIcon = NULL;
-    ExtractIconExW(g_WinRARPath, 0, NULL, &hIcon, 1);
+    TraceBegin("LoadMenuIcon");
+    SHDefExtractIconW(g_WinRARPath, 0, 0, &hIcon, NULL, cx);
     
     if (hIcon)
     {
-        s_hBitmap = IconToBitmap(hIcon, cx, cy);
+        hBitmap = IconToBitmap(hIcon, cx, cy);
         DestroyIcon(hIcon);
     }
+    TraceEnd("LoadMenuIcon");
+    if (!hBitmap) return NULL;
+
+    // Another thread may have made the same one, or taken the last slot,
+    // meanwhile. Either way ours goes and a cached one is used instead.
+    AcquireSRWLockExclusive(&g_MenuBitmapLock);
+    HBITMAP hCached = FindMenuBitmap(dpi);
+    if (hCached)
+    {
+        DeleteObject(hBitmap);
+        hBitmap = hCached;
+    }
+    else
+    {
+        g_MenuBitmaps[g_nMenuBitmaps].dpi = dpi;
+        g_MenuBitmaps[g_nMenuBitmaps].hBitmap = hBitmap;
+        g_nMenuBitmaps++;
+    }
+    ReleaseSRWLockExclusive(&g_MenuBitmapLock);
     
-    return s_hBitmap;
+    return hBitmap;
 }
 
-//=============================================================================
-// Selection types
-//=============================================================================
-typedef enum {
-    SEL_NONE = 0,
-    SEL_SINGLE_ARCHIVE,      // Single archive file - show extract option
-    SEL_FILES_ONLY,          // Multiple files (no folders) - show zip to single archive
-    SEL_FOLDERS_ONLY,        // Multiple folders only - show zip each + zip all options
-    SEL_MIXED                // Files and folders mixed - show zip to single archive
-} SelectionType;
-
 //=============================================================================
 // Context Menu implementation
 //=============================================================================
+// Most right-clicks are on things we show nothing for, so an instance only
+// carries pointers; the strings live in one arena allocated by Initialize
+// and sized to the selection. Released instances are pooled for reuse
+// (MENU_POOL_DEPTH, MENU_ARENA_KEEP in core.h).
+
 typedef struct {
+    SLIST_ENTRY poolEntry;                  // Used while in g_MenuPool
     IContextMenu3 IContextMenu3_iface;
     IShellExtInit IShellExtInit_iface;
     LONG cRef;
+    LONGLONG traceStart;    // Initialize timestamp, for MaybeExportTrace
+
+    Arena arena;
 
     // For single archive extraction
-    wchar_t szFilePath[MAX_PATH];
-    wchar_t szFolderName[MAX_PATH];
-    wchar_t szDestFolder[MAX_PATH];
+    const wchar_t* pszFilePath;             // The first selected item
+    const wchar_t* pszFolderName;
+    const wchar_t* pszDestFolder;
 
     // For multi-selection operations
-    wchar_t (*szSelectedPaths)[MAX_PATH];  // Dynamically allocated array
+    const wchar_t** ppszSelectedPaths;
     UINT nSelectedCount;
     UINT nFileCount;
     UINT nFolderCount;
-    wchar_t szParentFolder[MAX_PATH];      // Parent folder for naming archives
-    wchar_t szParentName[MAX_PATH];        // Just the parent folder name
+    const wchar_t* pszParentFolder;         // Parent folder for naming archives
+    const wchar_t* pszParentName;           // Just the parent folder name
 
     SelectionType selType;
 } ExtractContextMenu;
 
+static SLIST_HEADER g_MenuPool;
+static volatile LONG g_MenuPoolCount;  // Slots taken in g_MenuPool, at least its depth
+
 static inline ExtractContextMenu* impl_from_IContextMenu3(IContextMenu3* iface) {
     return CONTAINING_RECORD(iface, ExtractContextMenu, IContextMenu3_iface);
 }
@@ -271,11 +420,25 @@ static ULONG STDMETHODCALLTYPE Menu_Release(IContextMenu3* This)
 
     if (cRef == 0)
     {
-        if (self->szSelectedPaths)
+        if (self->arena.base && self->arena.size > MENU_ARENA_KEEP)
+        {
+            HeapFree(GetProcessHeap(), 0, self->arena.base);
+            self->arena.base = NULL;
+            self->arena.size = 0;
+        }
+
+        // Reserve a slot first, so racing releases can't grow the pool past
+        // MENU_POOL_DEPTH
+        if (InterlockedIncrement(&g_MenuPoolCount) <= MENU_POOL_DEPTH)
         {
-            HeapFree(GetProcessHeap(), 0, self->szSelectedPaths);
+            InterlockedPushEntrySList(&g_MenuPool, &self->poolEntry);
+        }
+        else
+        {
+            InterlockedDecrement(&g_MenuPoolCount);
+            if (self->arena.base) HeapFree(GetProcessHeap(), 0, self->arena.base);
+            HeapFree(GetProcessHeap(), 0, self);
         }
-        HeapFree(GetProcessHeap(), 0, self);
         InterlockedDecrement(&g_cRef);
     }
     return cRef;
@@ -288,6 +451,11 @@ static ULONG STDMETHODCALLTYPE Menu_Release(IContextMenu3* This)
 #define IDM_ZIP_TO_SINGLE       1
 #define IDM_ZIP_EACH_FOLDER     2
 #define IDM_ZIP_ALL_FOLDERS     3
+#define IDM_CONVERT_ZIP         4
+#define IDM_RAR_TO_SINGLE       5
+
+static BOOL GetConvertZipPath(const wchar_t* archivePath, wchar_t* zipPath, BOOL* pbTar, BOOL* pbGzip);
+static BOOL IsRarVerbEnabled(void);
 
 // Find WinRAR's menu position to insert after it
 static UINT FindWinRARMenuPosition(HMENU hmenu, UINT defaultPos)
@@ -326,33 +494,57 @@ static HRESULT STDMETHODCALLTYPE Menu_QueryContextMenu(
     if (uFlags & CMF_DEFAULTONLY)
         return MAKE_HRESULT(SEVERITY_SUCCESS, 0, 0);
 
+    TraceBegin("QueryContextMenu");
+    TraceBegin("FindWinRARMenuPosition");
     UINT insertPos = FindWinRARMenuPosition(hmenu, indexMenu);
+    TraceEnd("FindWinRARMenuPosition");
     wchar_t menuText[MAX_PATH + 64];
     MENUITEMINFOW mii = {0};
     mii.cbSize = sizeof(mii);
     mii.fMask = MIIM_STRING | MIIM_ID | MIIM_STATE | MIIM_BITMAP;
     mii.fState = MFS_ENABLED;
-    mii.hbmpItem = GetWinRARMenuBitmap();
+    mii.hbmpItem = GetWinRARMenuBitmap(GetMenuDpi());
 
     switch (self->selType)
     {
     case SEL_SINGLE_ARCHIVE:
         // Original extract functionality
-        StringCchPrintfW(menuText, ARRAYSIZE(menuText), L"Extract to \"%s\\\"", self->szFolderName);
+        StringCchPrintfW(menuText, ARRAYSIZE(menuText), L"Extract to \"%s\\\"", self->pszFolderName);
         mii.wID = idCmdFirst + IDM_EXTRACT;
         mii.dwTypeData = menuText;
         InsertMenuItemW(hmenu, insertPos, TRUE, &mii);
         cmdCount = IDM_EXTRACT + 1;
+
+        // .tar/.gz archives can also be turned into a zip directly
+        wchar_t zipPath[MAX_PATH];
+        if (GetConvertZipPath(self->pszFilePath, zipPath, NULL, NULL))
+        {
+            StringCchPrintfW(menuText, ARRAYSIZE(menuText), L"Convert to \"%s\"", FindFileName(zipPath));
+            mii.wID = idCmdFirst + IDM_CONVERT_ZIP;
+            mii.dwTypeData = menuText;
+            InsertMenuItemW(hmenu, insertPos + 1, TRUE, &mii);
+            cmdCount = IDM_CONVERT_ZIP + 1;
+        }
         break;
 
     case SEL_FILES_ONLY:
     case SEL_MIXED:
         // Zip all selected items to a single archive named after parent folder
-        StringCchPrintfW(menuText, ARRAYSIZE(menuText), L"Zip to \"%s.zip\"", self->szParentName);
+        StringCchPrintfW(menuText, ARRAYSIZE(menuText), L"Zip to \"%s.zip\"", self->pszParentName);
         mii.wID = idCmdFirst + IDM_ZIP_TO_SINGLE;
         mii.dwTypeData = menuText;
         InsertMenuItemW(hmenu, insertPos, TRUE, &mii);
         cmdCount = IDM_ZIP_TO_SINGLE + 1;
+
+        // Same, as a solid RAR archive
+        if (IsRarVerbEnabled())
+        {
+            StringCchPrintfW(menuText, ARRAYSIZE(menuText), L"RAR to \"%s.rar\"", self->pszParentName);
+            mii.wID = idCmdFirst + IDM_RAR_TO_SINGLE;
+            mii.dwTypeData = menuText;
+            InsertMenuItemW(hmenu, insertPos + 1, TRUE, &mii);
+            cmdCount = IDM_RAR_TO_SINGLE + 1;
+        }
         break;
 
     case SEL_FOLDERS_ONLY:
@@ -364,7 +556,7 @@ static HRESULT STDMETHODCALLTYPE Menu_QueryContextMenu(
         else
         {
             // Single folder - show the folder name
-            wchar_t* folderName = PathFindFileNameW(self->szSelectedPaths[0]);
+            const wchar_t* folderName = FindFileName(self->ppszSelectedPaths[0]);
             StringCchPrintfW(menuText, ARRAYSIZE(menuText), L"Zip \"%s\"", folderName);
         }
         mii.wID = idCmdFirst + IDM_ZIP_EACH_FOLDER;
@@ -374,11 +566,20 @@ static HRESULT STDMETHODCALLTYPE Menu_QueryContextMenu(
         // Option 2: Zip all folders to single archive (only if multiple folders)
         if (self->nFolderCount > 1)
         {
-            StringCchPrintfW(menuText, ARRAYSIZE(menuText), L"Zip all to \"%s.zip\"", self->szParentName);
+            StringCchPrintfW(menuText, ARRAYSIZE(menuText), L"Zip all to \"%s.zip\"", self->pszParentName);
             mii.wID = idCmdFirst + IDM_ZIP_ALL_FOLDERS;
             mii.dwTypeData = menuText;
             InsertMenuItemW(hmenu, insertPos + 1, TRUE, &mii);
             cmdCount = IDM_ZIP_ALL_FOLDERS + 1;
+
+            if (IsRarVerbEnabled())
+            {
+                StringCchPrintfW(menuText, ARRAYSIZE(menuText), L"RAR all to \"%s.rar\"", self->pszParentName);
+                mii.wID = idCmdFirst + IDM_RAR_TO_SINGLE;
+                mii.dwTypeData = menuText;
+                InsertMenuItemW(hmenu, insertPos + 2, TRUE, &mii);
+                cmdCount = IDM_RAR_TO_SINGLE + 1;
+            }
         }
         else
         {
@@ -387,14 +588,18 @@ static HRESULT STDMETHODCALLTYPE Menu_QueryContextMenu(
         break;
 
     default:
-        return MAKE_HRESULT(SEVERITY_SUCCESS, 0, 0);
+        break;
     }
 
+    TraceEnd("QueryContextMenu");
+    MaybeExportTrace(self->traceStart, self->ppszSelectedPaths, self->nSelectedCount);
     return MAKE_HRESULT(SEVERITY_SUCCESS, 0, cmdCount);
 }
 
-// Execute WinRAR with the given command line (non-blocking, shows progress window)
-static BOOL ExecuteWinRAR(const wchar_t* cmdLine)
+// Execute WinRAR with the given command line (non-blocking, shows progress window).
+// If phProcess is given the caller owns the returned process handle. With
+// hJob WinRAR runs as a background process inside that job object.
+static BOOL LaunchWinRAR(const wchar_t* cmdLine, const wchar_t* workDir, HANDLE hJob, HANDLE* phProcess)
 {
     STARTUPINFOW si = {0};
     PROCESS_INFORMATION pi = {0};
@@ -406,229 +611,4268 @@ static BOOL ExecuteWinRAR(const wchar_t* cmdLine)
     if (!mutableCmd) return FALSE;
     wcscpy_s(mutableCmd, len, cmdLine);
 
-    BOOL result = CreateProcessW(NULL, mutableCmd, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi);
+    // Background processes start suspended so they're in the job before they do anything
+    DWORD flags = hJob ? (CREATE_SUSPENDED | BELOW_NORMAL_PRIORITY_CLASS) : 0;
+    TraceBegin("CreateProcess");
+    BOOL result = CreateProcessW(NULL, mutableCmd, NULL, NULL, FALSE, flags, NULL, workDir, &si, &pi);
+    TraceEnd("CreateProcess");
 
     HeapFree(GetProcessHeap(), 0, mutableCmd);
 
     if (result)
     {
-        // Don't wait - let WinRAR run independently with its progress window
-        CloseHandle(pi.hProcess);
+        if (hJob)
+        {
+            MEMORY_PRIORITY_INFORMATION memPriority = { MEMORY_PRIORITY_LOW };
+            PROCESS_POWER_THROTTLING_STATE power = {
+                PROCESS_POWER_THROTTLING_CURRENT_VERSION,
+                PROCESS_POWER_THROTTLING_EXECUTION_SPEED,
+                PROCESS_POWER_THROTTLING_EXECUTION_SPEED
+            };
+
+            // Best effort: an unassigned process still runs at lowered priority
+            AssignProcessToJobObject(hJob, pi.hProcess);
+            SetProcessInformation(pi.hProcess, ProcessMemoryPriority, &memPriority, sizeof(memPriority));
+            SetProcessInformation(pi.hProcess, ProcessPowerThrottling, &power, sizeof(power));
+            ResumeThread(pi.hThread);
+        }
+
         CloseHandle(pi.hThread);
+        if (phProcess)
+            *phProcess = pi.hProcess;
+        else
+            CloseHandle(pi.hProcess);  // Don't wait - let WinRAR run independently
     }
     return result;
 }
 
-// Create a temporary list file for WinRAR with all paths
-static BOOL CreateListFile(const wchar_t* listPath, wchar_t (*paths)[MAX_PATH], UINT count)
+//=============================================================================
+// Background threads
+//=============================================================================
+// Anything that waits on WinRAR runs off Explorer's thread. The thread holds
+// a reference on the DLL so it can't be unloaded underneath it.
+static BOOL StartBackgroundThread(LPTHREAD_START_ROUTINE proc, void* param)
 {
-    HANDLE hFile = CreateFileW(listPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
-                               FILE_ATTRIBUTE_TEMPORARY, NULL);
-    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    HMODULE hSelf;
 
-    // Write BOM for Unicode
-    BYTE bom[] = {0xFF, 0xFE};
-    DWORD written;
-    WriteFile(hFile, bom, sizeof(bom), &written, NULL);
+    if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)proc, &hSelf))
+        return FALSE;
 
-    for (UINT i = 0; i < count; i++)
+    InterlockedIncrement(&g_cRef);
+    HANDLE hThread = CreateThread(NULL, 0, proc, param, 0, NULL);
+    if (!hThread)
     {
-        WriteFile(hFile, paths[i], (DWORD)(wcslen(paths[i]) * sizeof(wchar_t)), &written, NULL);
-        WriteFile(hFile, L"\r\n", 4, &written, NULL);
+        InterlockedDecrement(&g_cRef);
+        FreeLibrary(hSelf);
+        return FALSE;
     }
 
-    CloseHandle(hFile);
+    CloseHandle(hThread);
     return TRUE;
 }
 
-static HRESULT STDMETHODCALLTYPE Menu_InvokeCommand(
-    IContextMenu3* This, CMINVOKECOMMANDINFO* pici)
+// Last call of every thread started with StartBackgroundThread
+static void ExitBackgroundThread(void)
 {
-    ExtractContextMenu* self = impl_from_IContextMenu3(This);
+    InterlockedDecrement(&g_cRef);
+    FreeLibraryAndExitThread(g_hModule, 0);
+}
 
-    if (HIWORD(pici->lpVerb) != 0)
-        return E_INVALIDARG;
+//=============================================================================
+// Archive manifest
+//=============================================================================
+// Flat list of everything a zip job adds, built up front so the job knows
+// its file count and size and can hand WinRAR an explicit list instead of
+// letting it recurse with -r.
+#define POOL_BLOCK_CHARS 65536
 
-    UINT cmd = LOWORD(pici->lpVerb);
-    wchar_t cmdLine[32768];  // Large buffer for multiple file paths
-    wchar_t archivePath[MAX_PATH];
-    wchar_t listFilePath[MAX_PATH];
+typedef struct PoolBlock {
+    struct PoolBlock* next;
+    UINT used;
+    wchar_t data[POOL_BLOCK_CHARS];
+} PoolBlock;
 
-    switch (cmd)
+typedef struct {
+    const wchar_t* path;    // Relative to the job's base folder
+    ULONGLONG size;
+    FILETIME mtime;
+    DWORD crc;              // Only known for entries read back from an archive
+    BOOL isDir;             // Only empty folders are listed, files imply their parents
+} ManifestEntry;
+
+typedef struct {
+    ManifestEntry* entries;
+    UINT count;
+    UINT capacity;
+    ULONGLONG totalBytes;
+    PoolBlock* pool;        // Backing store for the entry paths
+} Manifest;
+
+// Copy a string into the pool; pool strings live until the manifest is freed
+static const wchar_t* PoolCopy(PoolBlock** pool, const wchar_t* s, UINT len)
+{
+    PoolBlock* block = *pool;
+
+    if (len + 1 > POOL_BLOCK_CHARS) return NULL;
+
+    if (!block || block->used + len + 1 > POOL_BLOCK_CHARS)
     {
-    case IDM_EXTRACT:
-        // Original extract functionality
-        CreateDirectoryW(self->szDestFolder, NULL);
-        StringCchPrintfW(cmdLine, ARRAYSIZE(cmdLine),
-            L"\"%s\" x \"%s\" \"%s\\\"",
-            g_WinRARPath, self->szFilePath, self->szDestFolder);
-        break;
+        block = HeapAlloc(GetProcessHeap(), 0, sizeof(PoolBlock));
+        if (!block) return NULL;
+        block->next = *pool;
+        block->used = 0;
+        *pool = block;
+    }
 
-    case IDM_ZIP_TO_SINGLE:
-        // Zip all selected files/folders to a single archive named after parent folder
-        StringCchPrintfW(archivePath, ARRAYSIZE(archivePath),
-            L"%s\\%s.zip", self->szParentFolder, self->szParentName);
+    wchar_t* p = block->data + block->used;
+    memcpy(p, s, len * sizeof(wchar_t));
+    p[len] = L'\0';
+    block->used += len + 1;
+    return p;
+}
+
+static BOOL ManifestReserve(Manifest* m, UINT count)
+{
+    if (count <= m->capacity) return TRUE;
 
-        // Create temp list file
-        GetTempPathW(MAX_PATH, listFilePath);
-        StringCchCatW(listFilePath, MAX_PATH, L"winrar_files.lst");
+    // Keeps the doubling below from wrapping, and the byte count from overflowing
+    if (count > min(0x40000000, (SIZE_T)-1 / sizeof(ManifestEntry) / 2)) return FALSE;
 
-        if (!CreateListFile(listFilePath, self->szSelectedPaths, self->nSelectedCount))
-            return E_FAIL;
+    UINT newCap = m->capacity ? m->capacity * 2 : 1024;
+    while (newCap < count) newCap *= 2;
 
-        // Use -r for recursion (in case folders are selected), -ep1 to keep relative paths
-        StringCchPrintfW(cmdLine, ARRAYSIZE(cmdLine),
-            L"\"%s\" a -afzip -r -ep1 \"%s\" @\"%s\"",
-            g_WinRARPath, archivePath, listFilePath);
-        break;
+    ManifestEntry* entries = m->entries
+        ? HeapReAlloc(GetProcessHeap(), 0, m->entries, newCap * sizeof(ManifestEntry))
+        : HeapAlloc(GetProcessHeap(), 0, newCap * sizeof(ManifestEntry));
+    if (!entries) return FALSE;
 
-    case IDM_ZIP_EACH_FOLDER:
-        // Zip each folder to its own archive concurrently (non-blocking)
-        // Each folder's contents go to root of archive (no double folder)
-        for (UINT i = 0; i < self->nSelectedCount; i++)
-        {
-            wchar_t folderPath[MAX_PATH];
-            StringCchCopyW(folderPath, MAX_PATH, self->szSelectedPaths[i]);
+    m->entries = entries;
+    m->capacity = newCap;
+    return TRUE;
+}
 
-            // Get folder name for archive name
-            wchar_t* folderName = PathFindFileNameW(folderPath);
-            wchar_t parentDir[MAX_PATH];
-            StringCchCopyW(parentDir, MAX_PATH, folderPath);
-            PathRemoveFileSpecW(parentDir);
+static BOOL ManifestAdd(Manifest* m, const wchar_t* relPath, UINT len,
+                        ULONGLONG size, FILETIME mtime, BOOL isDir)
+{
+    if (!ManifestReserve(m, m->count + 1)) return FALSE;
+
+    const wchar_t* path = PoolCopy(&m->pool, relPath, len);
+    if (!path) return FALSE;
+
+    ManifestEntry* e = &m->entries[m->count++];
+    e->path = path;
+    e->size = size;
+    e->mtime = mtime;
+    e->crc = 0;
+    e->isDir = isDir;
+    m->totalBytes += size;
+    return TRUE;
+}
 
-            StringCchPrintfW(archivePath, ARRAYSIZE(archivePath),
-                L"%s\\%s.zip", parentDir, folderName);
+// Move all entries (and the strings backing them) from src into dst
+static BOOL ManifestMerge(Manifest* dst, Manifest* src)
+{
+    if (!ManifestReserve(dst, dst->count + src->count)) return FALSE;
 
-            // Use -r for recursion, -ep1 to exclude base folder path
-            StringCchPrintfW(cmdLine, ARRAYSIZE(cmdLine),
-                L"\"%s\" a -afzip -r -ep1 \"%s\" \"%s\\*\"",
-                g_WinRARPath, archivePath, folderPath);
+    memcpy(dst->entries + dst->count, src->entries, src->count * sizeof(ManifestEntry));
+    dst->count += src->count;
+    dst->totalBytes += src->totalBytes;
 
-            ExecuteWinRAR(cmdLine);
-        }
-        return S_OK;
+    // Splice the pool list
+    PoolBlock** tail = &dst->pool;
+    while (*tail) tail = &(*tail)->next;
+    *tail = src->pool;
+    src->pool = NULL;
 
-    case IDM_ZIP_ALL_FOLDERS:
-        // Zip all folders to a single archive
-        StringCchPrintfW(archivePath, ARRAYSIZE(archivePath),
-            L"%s\\%s.zip", self->szParentFolder, self->szParentName);
+    if (src->entries) HeapFree(GetProcessHeap(), 0, src->entries);
+    ZeroMemory(src, sizeof(*src));
+    return TRUE;
+}
 
-        // Create temp list file
-        GetTempPathW(MAX_PATH, listFilePath);
-        StringCchCatW(listFilePath, MAX_PATH, L"winrar_folders.lst");
+static void ManifestFree(Manifest* m)
+{
+    PoolBlock* block = m->pool;
+    while (block)
+    {
+        PoolBlock* next = block->next;
+        HeapFree(GetProcessHeap(), 0, block);
+        block = next;
+    }
+    if (m->entries) HeapFree(GetProcessHeap(), 0, m->entries);
+    ZeroMemory(m, sizeof(*m));
+}
 
-        if (!CreateListFile(listFilePath, self->szSelectedPaths, self->nSelectedCount))
-            return E_FAIL;
+// Manifest files start with a caller-defined header whose first two fields
+// are the magic and the entry count, followed by one record per entry
+typedef struct {
+    DWORD magic;
+    DWORD count;
+} ManifestFileHeader;
 
-        // Use -r for recursion, -ep1 to strip parent path but keep folder names
-        // Result: FolderA/contents, FolderB/contents in archive
-        StringCchPrintfW(cmdLine, ARRAYSIZE(cmdLine),
-            L"\"%s\" a -afzip -r -ep1 \"%s\" @\"%s\"",
-            g_WinRARPath, archivePath, listFilePath);
-        break;
+typedef struct {
+    ULONGLONG size;
+    FILETIME mtime;
+    DWORD crc;
+    WORD pathLen;
+    WORD isDir;
+} ManifestFileRecord;  // Followed by pathLen wchar_t
+
+static BOOL LoadManifestFile(const wchar_t* path, DWORD magic, void* header, DWORD headerSize, Manifest* m)
+{
+    BOOL ok = FALSE;
 
-    default:
-        return E_INVALIDARG;
+    ZeroMemory(m, sizeof(*m));
+
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    LARGE_INTEGER size;
+    BYTE* data = NULL;
+    DWORD read;
+
+    if (GetFileSizeEx(hFile, &size) && size.QuadPart >= headerSize && size.QuadPart < 0x40000000 &&
+        (data = HeapAlloc(GetProcessHeap(), 0, (SIZE_T)size.QuadPart)) != NULL &&
+        ReadFile(hFile, data, (DWORD)size.QuadPart, &read, NULL) && read == size.QuadPart)
+    {
+        const ManifestFileHeader* hdr = (const ManifestFileHeader*)data;
+        const BYTE* p = data + headerSize;
+        const BYTE* end = data + read;
+
+        // The count can't be trusted further than the records that fit in the file
+        memcpy(header, data, headerSize);
+        if (hdr->magic == magic &&
+            hdr->count <= (read - headerSize) / sizeof(ManifestFileRecord) &&
+            ManifestReserve(m, hdr->count))
+        {
+            ok = TRUE;
+            for (DWORD i = 0; i < hdr->count && ok; i++)
+            {
+                ManifestFileRecord rec;
+                if (p + sizeof(rec) > end) { ok = FALSE; break; }
+                memcpy(&rec, p, sizeof(rec));
+                p += sizeof(rec);
+                if (p + rec.pathLen * sizeof(wchar_t) > end) { ok = FALSE; break; }
+
+                ok = ManifestAdd(m, (const wchar_t*)p, rec.pathLen, rec.size, rec.mtime, rec.isDir);
+                if (ok) m->entries[m->count - 1].crc = rec.crc;
+                p += rec.pathLen * sizeof(wchar_t);
+            }
+        }
     }
 
-    if (!ExecuteWinRAR(cmdLine))
-        return E_FAIL;
+    if (data) HeapFree(GetProcessHeap(), 0, data);
+    CloseHandle(hFile);
 
-    return S_OK;
+    if (!ok) ManifestFree(m);
+    return ok;
 }
 
-static HRESULT STDMETHODCALLTYPE Menu_GetCommandString(
-    IContextMenu3* This, UINT_PTR idCmd, UINT uType, UINT* pReserved, LPSTR pszName, UINT cchMax)
+static BOOL SaveManifestFile(const wchar_t* path, void* header, DWORD headerSize,
+                             const Manifest* m, DWORD attributes)
 {
-    const wchar_t* helpTextW = NULL;
-    const char* helpTextA = NULL;
-    const wchar_t* verbW = NULL;
-    const char* verbA = NULL;
+    ((ManifestFileHeader*)header)->count = m->count;
 
-    switch (idCmd)
-    {
-    case IDM_EXTRACT:
-        helpTextW = L"Extract archive to folder";
-        helpTextA = "Extract archive to folder";
-        verbW = L"WinRARExtractTo";
-        verbA = "WinRARExtractTo";
-        break;
-    case IDM_ZIP_TO_SINGLE:
-        helpTextW = L"Zip selected items to archive";
-        helpTextA = "Zip selected items to archive";
-        verbW = L"WinRARZipToSingle";
-        verbA = "WinRARZipToSingle";
-        break;
-    case IDM_ZIP_EACH_FOLDER:
-        helpTextW = L"Zip each folder to its own archive";
-        helpTextA = "Zip each folder to its own archive";
-        verbW = L"WinRARZipEachFolder";
-        verbA = "WinRARZipEachFolder";
-        break;
-    case IDM_ZIP_ALL_FOLDERS:
-        helpTextW = L"Zip all folders to single archive";
-        helpTextA = "Zip all folders to single archive";
-        verbW = L"WinRARZipAllFolders";
-        verbA = "WinRARZipAllFolders";
-        break;
-    default:
-        return E_INVALIDARG;
-    }
+    // Hidden files can't be opened with CREATE_ALWAYS unless the attributes match
+    SetFileAttributesW(path, FILE_ATTRIBUTE_NORMAL);
+    HANDLE hFile = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, attributes, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
 
-    if (uType == GCS_HELPTEXTW)
-    {
-        StringCchCopyW((LPWSTR)pszName, cchMax, helpTextW);
-        return S_OK;
-    }
-    else if (uType == GCS_HELPTEXTA)
-    {
-        StringCchCopyA(pszName, cchMax, helpTextA);
-        return S_OK;
-    }
-    else if (uType == GCS_VERBW)
-    {
-        StringCchCopyW((LPWSTR)pszName, cchMax, verbW);
-        return S_OK;
-    }
-    else if (uType == GCS_VERBA)
+    BYTE buf[65536];
+    DWORD used = 0, written;
+    BOOL ok = WriteFile(hFile, header, headerSize, &written, NULL);
+
+    for (UINT i = 0; i < m->count && ok; i++)
     {
-        StringCchCopyA(pszName, cchMax, verbA);
-        return S_OK;
+        const ManifestEntry* e = &m->entries[i];
+        ManifestFileRecord rec;
+        rec.size = e->size;
+        rec.mtime = e->mtime;
+        rec.crc = e->crc;
+        rec.pathLen = (WORD)wcslen(e->path);
+        rec.isDir = (WORD)e->isDir;
+
+        DWORD recBytes = sizeof(rec) + rec.pathLen * sizeof(wchar_t);
+        if (used + recBytes > sizeof(buf))
+        {
+            ok = WriteFile(hFile, buf, used, &written, NULL);
+            used = 0;
+        }
+        memcpy(buf + used, &rec, sizeof(rec));
+        memcpy(buf + used + sizeof(rec), e->path, rec.pathLen * sizeof(wchar_t));
+        used += recBytes;
     }
+    if (ok && used)
+        ok = WriteFile(hFile, buf, used, &written, NULL);
 
-    return E_INVALIDARG;
+    CloseHandle(hFile);
+    if (!ok) DeleteFileW(path);
+    return ok;
 }
 
 //=============================================================================
-// IContextMenu2/3
+// Settings folder
 //=============================================================================
-static HRESULT STDMETHODCALLTYPE Menu_HandleMenuMsg(
-    IContextMenu3* This, UINT uMsg, WPARAM wParam, LPARAM lParam)
+// Per-user files live in %APPDATA%\WinRARShellExtQuickExtract
+static BOOL GetSettingsPath(const wchar_t* fileName, wchar_t* out)
 {
-    return S_OK;
+    if (FAILED(SHGetFolderPathW(NULL, CSIDL_APPDATA, NULL, SHGFP_TYPE_CURRENT, out)))
+        return FALSE;
+
+    PathAppendW(out, L"WinRARShellExtQuickExtract");
+    if (fileName)
+        PathAppendW(out, fileName);
+    return TRUE;
 }
 
-static HRESULT STDMETHODCALLTYPE Menu_HandleMenuMsg2(
-    IContextMenu3* This, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT* plResult)
+// Integer from settings.ini, e.g. [Zip] Incremental=1
+static UINT GetSettingInt(const wchar_t* section, const wchar_t* key, UINT defaultValue)
 {
-    if (plResult) *plResult = 0;
-    return S_OK;
+    wchar_t path[MAX_PATH];
+
+    if (!GetSettingsPath(L"settings.ini", path))
+        return defaultValue;
+    return GetPrivateProfileIntW(section, key, defaultValue, path);
 }
 
-static IContextMenu3Vtbl MenuVtbl = {
-    Menu_QueryInterface,
-    Menu_AddRef,
-    Menu_Release,
-    Menu_QueryContextMenu,
-    Menu_InvokeCommand,
-    Menu_GetCommandString,
-    Menu_HandleMenuMsg,
-    Menu_HandleMenuMsg2
-};
+// String from settings.ini, e.g. [Profile] Format=rar
+static void GetSettingString(const wchar_t* section, const wchar_t* key, const wchar_t* defaultValue,
+                             wchar_t* out, DWORD cch)
+{
+    wchar_t path[MAX_PATH];
+
+    if (!GetSettingsPath(L"settings.ini", path))
+        StringCchCopyW(out, cch, defaultValue);
+    else
+        GetPrivateProfileStringW(section, key, defaultValue, out, cch, path);
+}
+
+// Read a small text file (UTF-16 with BOM, otherwise UTF-8) as a
+// null-terminated wide string. Free with HeapFree.
+static wchar_t* ReadTextFile(const wchar_t* path)
+{
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return NULL;
+
+    wchar_t* text = NULL;
+    DWORD size = GetFileSize(hFile, NULL);
+    BYTE* raw = (size != INVALID_FILE_SIZE && size < 1024 * 1024)
+        ? HeapAlloc(GetProcessHeap(), 0, size + 2) : NULL;
+    DWORD read = 0;
+
+    if (raw && ReadFile(hFile, raw, size, &read, NULL) && read == size)
+    {
+        if (size >= 2 && raw[0] == 0xFF && raw[1] == 0xFE)
+        {
+            UINT len = (size - 2) / sizeof(wchar_t);
+            text = HeapAlloc(GetProcessHeap(), 0, (len + 1) * sizeof(wchar_t));
+            if (text)
+            {
+                memcpy(text, raw + 2, len * sizeof(wchar_t));
+                text[len] = L'\0';
+            }
+        }
+        else
+        {
+            int skip = (size >= 3 && raw[0] == 0xEF && raw[1] == 0xBB && raw[2] == 0xBF) ? 3 : 0;
+            int len = MultiByteToWideChar(CP_UTF8, 0, (LPCSTR)raw + skip, size - skip, NULL, 0);
+            text = HeapAlloc(GetProcessHeap(), 0, (len + 1) * sizeof(wchar_t));
+            if (text)
+            {
+                MultiByteToWideChar(CP_UTF8, 0, (LPCSTR)raw + skip, size - skip, text, len);
+                text[len] = L'\0';
+            }
+        }
+    }
+
+    if (raw) HeapFree(GetProcessHeap(), 0, raw);
+    CloseHandle(hFile);
+    return text;
+}
+
+//=============================================================================
+// Trace export
+//=============================================================================
+// With [Trace] DumpMs=N in settings.ini, a right-click that takes N ms or
+// more from Initialize to the end of QueryContextMenu writes every thread's
+// trace ring to %APPDATA%\...\trace.json in Chrome trace format (open it in
+// chrome://tracing or Perfetto). DumpMs=1 dumps on every right-click.
+//
+// The selection goes next to it in selection.txt, for tools/selection_replay
+// to run through the portable core elsewhere. UTF-8 lines:
+//   ext .rar           WinRAR's archive extensions, one per line
+//   file C:\a\b.rar    the selected items, in order
+//   dir C:\a\c
+#define TRACE_WRITE_CHUNK 65536
+
+static INIT_ONCE g_TraceInit = INIT_ONCE_STATIC_INIT;
+static UINT g_TraceDumpMs = 0;
+static volatile LONG g_TraceExporting = 0;
+
+static BOOL CALLBACK LoadTraceSettings(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+    g_TraceDumpMs = GetSettingInt(L"Trace", L"DumpMs", 0);
+    return TRUE;
+}
+
+static BOOL FlushTraceText(HANDLE hFile, char* text, size_t* len)
+{
+    DWORD written;
+    BOOL ok = WriteFile(hFile, text, (DWORD)*len, &written, NULL) && written == *len;
+    *len = 0;
+    return ok;
+}
+
+static BOOL WriteSelectionLine(HANDLE hFile, const char* kind, const wchar_t* text)
+{
+    char line[16 + MAX_PATH * 3];
+    size_t len;
+
+    StringCchCopyA(line, ARRAYSIZE(line), kind);
+    len = strlen(line);
+    int n = WideCharToMultiByte(CP_UTF8, 0, text, -1, line + len, (int)(ARRAYSIZE(line) - len - 1), NULL, NULL);
+    if (n <= 0) return TRUE;  // Skip what doesn't convert
+    len += n - 1;
+    line[len++] = '\n';
+    return FlushTraceText(hFile, line, &len);
+}
+
+// paths: the selection as consecutive strings, ended by an empty one
+static void WriteSelectionCapture(const wchar_t* paths)
+{
+    wchar_t path[MAX_PATH];
+
+    if (!GetSettingsPath(L"selection.txt", path))
+        return;
+    HANDLE hFile = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return;
+
+    BOOL ok = TRUE;
+    for (int i = 0; i < g_NumExtensions && ok; i++)
+        ok = WriteSelectionLine(hFile, "ext ", g_ArchiveExtensions[i]);
+    for (const wchar_t* p = paths; *p && ok; p += wcslen(p) + 1)
+    {
+        DWORD attrs = GetFileAttributesW(p);
+        BOOL isDir = attrs != INVALID_FILE_ATTRIBUTES && (attrs & FILE_ATTRIBUTE_DIRECTORY);
+        ok = WriteSelectionLine(hFile, isDir ? "dir " : "file ", p);
+    }
+    CloseHandle(hFile);
+}
+
+static DWORD WINAPI TraceExportThreadProc(LPVOID param)
+{
+    wchar_t path[MAX_PATH];
+    LARGE_INTEGER freq;
+    char* text = HeapAlloc(GetProcessHeap(), 0, TRACE_WRITE_CHUNK);
+    size_t len = 0;
+    DWORD pid = GetCurrentProcessId();
+    BOOL first = TRUE;
+
+    QueryPerformanceFrequency(&freq);
+    HANDLE hFile = (text && GetSettingsPath(L"trace.json", path))
+        ? CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL)
+        : INVALID_HANDLE_VALUE;
+
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        BOOL ok = TRUE;
+
+        StringCchCopyA(text, TRACE_WRITE_CHUNK, "{\"traceEvents\":[\n");
+        len = strlen(text);
+
+        // Writers keep going meanwhile; a record overwritten mid-copy is
+        // at worst one odd event in a diagnostic dump
+        for (TraceBuffer* buffer = g_TraceBuffers; buffer && ok; buffer = buffer->next)
+        {
+            LONG head = buffer->head;
+            LONG i = (head > TRACE_EVENTS) ? head - TRACE_EVENTS : 0;
+
+            for (; i < head && ok; i++)
+            {
+                TraceRecord rec = buffer->records[i & (TRACE_EVENTS - 1)];
+                ULONGLONG us = (ULONGLONG)(rec.ts / freq.QuadPart) * 1000000 +
+                               (ULONGLONG)(rec.ts % freq.QuadPart) * 1000000 / freq.QuadPart;
+
+                if (!rec.name) continue;
+                StringCchPrintfA(text + len, TRACE_WRITE_CHUNK - len,
+                    "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%lu,\"tid\":%lu%s}",
+                    first ? "" : ",\n", rec.name, rec.phase, us, pid, buffer->tid,
+                    rec.phase == 'i' ? ",\"s\":\"t\"" : "");
+                len += strlen(text + len);
+                first = FALSE;
+                if (len > TRACE_WRITE_CHUNK - 512)
+                    ok = FlushTraceText(hFile, text, &len);
+            }
+        }
+
+        if (ok)
+        {
+            StringCchCopyA(text + len, TRACE_WRITE_CHUNK - len, "\n]}\n");
+            len += strlen(text + len);
+            FlushTraceText(hFile, text, &len);
+        }
+        CloseHandle(hFile);
+    }
+
+    if (param)
+    {
+        WriteSelectionCapture(param);
+        HeapFree(GetProcessHeap(), 0, param);
+    }
+    if (text) HeapFree(GetProcessHeap(), 0, text);
+    InterlockedExchange(&g_TraceExporting, 0);
+    ExitBackgroundThread();
+    return 0;
+}
+
+// Called at the end of QueryContextMenu with the Initialize timestamp and
+// the selection
+static void MaybeExportTrace(LONGLONG startTs, const wchar_t* const* paths, UINT count)
+{
+    LARGE_INTEGER now, freq;
+    SIZE_T chars = 1;
+
+    InitOnceExecuteOnce(&g_TraceInit, LoadTraceSettings, NULL, NULL);
+    if (!g_TraceDumpMs || !startTs)
+        return;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    if ((now.QuadPart - startTs) * 1000 / freq.QuadPart < g_TraceDumpMs)
+        return;
+
+    // One dump at a time, written off Explorer's thread
+    if (InterlockedCompareExchange(&g_TraceExporting, 1, 0) != 0)
+        return;
+
+    // The selection is copied: the menu may be gone before the thread runs
+    for (UINT i = 0; i < count; i++)
+        chars += wcslen(paths[i]) + 1;
+    wchar_t* copy = HeapAlloc(GetProcessHeap(), 0, chars * sizeof(wchar_t));
+    if (copy)
+    {
+        wchar_t* p = copy;
+        for (UINT i = 0; i < count; i++)
+        {
+            SIZE_T len = wcslen(paths[i]) + 1;
+            memcpy(p, paths[i], len * sizeof(wchar_t));
+            p += len;
+        }
+        *p = L'\0';
+    }
+
+    if (!StartBackgroundThread(TraceExportThreadProc, copy))
+    {
+        if (copy) HeapFree(GetProcessHeap(), 0, copy);
+        InterlockedExchange(&g_TraceExporting, 0);
+    }
+}
+
+//=============================================================================
+// Path filter (filters.txt)
+//=============================================================================
+// Rules from %APPDATA%\...\filters.txt, compiled by the core (see
+// CompileFilter in core.h). Walks match each folder path once and every
+// entry name on top of it. Rules that don't fit are left out and a
+// notification says how many.
+static INIT_ONCE g_PathFilterOnce = INIT_ONCE_STATIC_INIT;
+static PathFilter* g_PathFilter = NULL;
+
+static void ShowNotification(const wchar_t* title, const wchar_t* text, BOOL warning);
+
+static BOOL CALLBACK LoadPathFilterOnce(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+    wchar_t path[MAX_PATH];
+    wchar_t* text;
+    UINT nSkipped = 0;
+
+    if (!GetSettingsPath(L"filters.txt", path) || !(text = ReadTextFile(path)))
+        return TRUE;
+
+    g_PathFilter = HeapAlloc(GetProcessHeap(), 0, sizeof(PathFilter));
+    if (g_PathFilter && !CompileFilter(g_PathFilter, text, &nSkipped))
+    {
+        HeapFree(GetProcessHeap(), 0, g_PathFilter);
+        g_PathFilter = NULL;
+    }
+    HeapFree(GetProcessHeap(), 0, text);
+
+    if (nSkipped)
+    {
+        wchar_t message[128];
+        StringCchPrintfW(message, ARRAYSIZE(message),
+            L"%u rule(s) don't fit and are ignored: too long, or too many different characters.", nSkipped);
+        ShowNotification(L"filters.txt", message, TRUE);
+    }
+    return TRUE;
+}
+
+// Compiled filters.txt, or NULL when there are no rules. Loaded on first use,
+// like the extension list it only picks up changes after an Explorer restart.
+static const PathFilter* GetPathFilter(void)
+{
+    InitOnceExecuteOnce(&g_PathFilterOnce, LoadPathFilterOnce, NULL, NULL);
+    return g_PathFilter;
+}
+
+//=============================================================================
+// Parallel directory walker
+//=============================================================================
+// Each worker owns a deque of directories still to scan. Workers push and
+// pop at the tail of their own deque and steal from the head of the others
+// when they run dry, so wide trees spread across all cores. Workers with
+// nothing to steal sleep on walk->wakeups until a push or the end of the walk.
+#define MAX_WALK_THREADS 16
+#define WALK_PATH_CHARS  32768
+#define LIST_BUFFER_CHARS (2 * WALK_PATH_CHARS)
+
+typedef struct {
+    SRWLOCK lock;
+    const wchar_t** items;  // Relative folder paths (owned by a worker's manifest pool)
+    UINT head;
+    UINT tail;
+    UINT capacity;
+} WorkDeque;
+
+struct DirWalk;
+
+typedef struct {
+    struct DirWalk* walk;
+    UINT index;
+    WorkDeque deque;
+    Manifest manifest;
+    wchar_t findPath[WALK_PATH_CHARS];
+    wchar_t childPath[WALK_PATH_CHARS];
+} WalkWorker;
+
+typedef struct DirWalk {
+    wchar_t root[WALK_PATH_CHARS];  // Extended-length base folder
+    UINT rootLen;
+    const PathFilter* filter;       // NULL when filters.txt has no rules
+    UINT nWorkers;
+    WalkWorker* workers;
+    volatile LONG pending;          // Folders queued or being scanned
+    volatile LONG wakeups;          // Bumped on every push and when pending hits 0
+    volatile LONG idle;             // Workers parked on wakeups
+    volatile LONG dropped;          // Entries that couldn't be recorded
+} DirWalk;
+
+static BOOL DequePush(WorkDeque* dq, const wchar_t* item)
+{
+    BOOL ok = TRUE;
+
+    AcquireSRWLockExclusive(&dq->lock);
+    if (dq->tail == dq->capacity)
+    {
+        // Compact before growing
+        if (dq->head > 0)
+        {
+            memmove(dq->items, dq->items + dq->head, (dq->tail - dq->head) * sizeof(*dq->items));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        }
+        if (dq->tail == dq->capacity)
+        {
+            UINT newCap = dq->capacity ? dq->capacity * 2 : 256;
+            const wchar_t** items = dq->items
+                ? HeapReAlloc(GetProcessHeap(), 0, (void*)dq->items, newCap * sizeof(*items))
+                : HeapAlloc(GetProcessHeap(), 0, newCap * sizeof(*items));
+            if (items)
+            {
+                dq->items = items;
+                dq->capacity = newCap;
+            }
+            else
+            {
+                ok = FALSE;
+            }
+        }
+    }
+    if (ok) dq->items[dq->tail++] = item;
+    ReleaseSRWLockExclusive(&dq->lock);
+
+    return ok;
+}
+
+// Owner end: newest first keeps the working set local
+static BOOL DequePop(WorkDeque* dq, const wchar_t** item)
+{
+    BOOL ok = FALSE;
+
+    AcquireSRWLockExclusive(&dq->lock);
+    if (dq->tail > dq->head)
+    {
+        *item = dq->items[--dq->tail];
+        ok = TRUE;
+    }
+    ReleaseSRWLockExclusive(&dq->lock);
+
+    return ok;
+}
+
+// Thief end: oldest entries are closest to the root and carry the most work
+static BOOL DequeSteal(WorkDeque* dq, const wchar_t** item)
+{
+    BOOL ok = FALSE;
+
+    if (!TryAcquireSRWLockExclusive(&dq->lock))
+        return FALSE;
+    if (dq->tail > dq->head)
+    {
+        *item = dq->items[dq->head++];
+        ok = TRUE;
+    }
+    ReleaseSRWLockExclusive(&dq->lock);
+
+    return ok;
+}
+
+static BOOL StealWork(WalkWorker* w, const wchar_t** item)
+{
+    DirWalk* walk = w->walk;
+
+    for (UINT i = 1; i < walk->nWorkers; i++)
+    {
+        WalkWorker* victim = &walk->workers[(w->index + i) % walk->nWorkers];
+        if (DequeSteal(&victim->deque, item))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// A parked worker re-reads wakeups before sleeping, so bumping it after the
+// push is enough not to lose the wakeup
+static void WakeIdleWorker(DirWalk* walk)
+{
+    InterlockedIncrement(&walk->wakeups);
+    if (walk->idle)
+        WakeByAddressSingle((PVOID)&walk->wakeups);
+}
+
+static void ScanDirectory(WalkWorker* w, const wchar_t* relDir)
+{
+    DirWalk* walk = w->walk;
+    const PathFilter* filter = walk->filter;
+    size_t relLen = wcslen(relDir);
+    BOOL isEmpty = TRUE;
+    StateSet dirState, childState;
+
+    // Match the folder path once, then only each child's name on top of it
+    if (filter)
+    {
+        FilterStart(filter, &dirState);
+        FilterFeed(filter, &dirState, relDir, relLen);
+        if (relLen) FilterFeed(filter, &dirState, L"\\", 1);
+    }
+
+    if (relLen)
+        StringCchPrintfW(w->findPath, WALK_PATH_CHARS, L"%s\\%s\\*", walk->root, relDir);
+    else
+        StringCchPrintfW(w->findPath, WALK_PATH_CHARS, L"%s\\*", walk->root);
+
+    WIN32_FIND_DATAW fd;
+    HANDLE hFind = FindFirstFileExW(w->findPath, FindExInfoBasic, &fd,
+                                    FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return;  // Unreadable folder - WinRAR would skip it as well
+
+    do
+    {
+        if (fd.cFileName[0] == L'.' &&
+            (fd.cFileName[1] == L'\0' || (fd.cFileName[1] == L'.' && fd.cFileName[2] == L'\0')))
+            continue;
+        isEmpty = FALSE;
+
+        if (filter)
+        {
+            childState = dirState;
+            FilterFeed(filter, &childState, fd.cFileName, wcslen(fd.cFileName));
+            if (!FilterAllows(filter, &childState))
+                continue;
+        }
+
+        HRESULT hr = relLen
+            ? StringCchPrintfW(w->childPath, WALK_PATH_CHARS, L"%s\\%s", relDir, fd.cFileName)
+            : StringCchCopyW(w->childPath, WALK_PATH_CHARS, fd.cFileName);
+        if (FAILED(hr))
+        {
+            InterlockedIncrement(&walk->dropped);
+            continue;
+        }
+        UINT childLen = (UINT)wcslen(w->childPath);
+
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            // Don't follow junctions and symlinks, they can loop back up the tree
+            if (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+                continue;
+
+            const wchar_t* sub = PoolCopy(&w->manifest.pool, w->childPath, childLen);
+            if (!sub)
+            {
+                InterlockedIncrement(&walk->dropped);
+                continue;
+            }
+
+            InterlockedIncrement(&walk->pending);
+            if (DequePush(&w->deque, sub))
+            {
+                WakeIdleWorker(walk);
+            }
+            else
+            {
+                InterlockedDecrement(&walk->pending);
+                InterlockedIncrement(&walk->dropped);
+            }
+        }
+        else
+        {
+            ULONGLONG size = ((ULONGLONG)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+            if (!ManifestAdd(&w->manifest, w->childPath, childLen, size, fd.ftLastWriteTime, FALSE))
+                InterlockedIncrement(&walk->dropped);
+        }
+    } while (FindNextFileW(hFind, &fd));
+
+    FindClose(hFind);
+
+    // Empty folders have to be listed explicitly or they'd be lost with -r-.
+    // Only really empty ones: a folder whose entries were all filtered out
+    // or skipped isn't empty, and stays out of the archive.
+    if (isEmpty && relLen)
+    {
+        FILETIME ft = {0};
+        if (!ManifestAdd(&w->manifest, relDir, (UINT)relLen, 0, ft, TRUE))
+            InterlockedIncrement(&walk->dropped);
+    }
+}
+
+static DWORD WINAPI WalkWorkerProc(LPVOID param)
+{
+    WalkWorker* w = param;
+    DirWalk* walk = w->walk;
+
+    for (;;)
+    {
+        const wchar_t* dir;
+        LONG seen = walk->wakeups;
+
+        if (DequePop(&w->deque, &dir) || StealWork(w, &dir))
+        {
+            ScanDirectory(w, dir);
+            if (InterlockedDecrement(&walk->pending) == 0)
+            {
+                // Last folder done - release everyone parked below
+                InterlockedIncrement(&walk->wakeups);
+                WakeByAddressAll((PVOID)&walk->wakeups);
+            }
+            continue;
+        }
+
+        // Nothing to take - done once no folder is queued or being scanned
+        if (walk->pending == 0)
+            break;
+
+        // Park until something is pushed. Returns at once if a push or the
+        // last decrement happened since seen was read.
+        InterlockedIncrement(&walk->idle);
+        WaitOnAddress(&walk->wakeups, &seen, sizeof(seen), INFINITE);
+        InterlockedDecrement(&walk->idle);
+    }
+    return 0;
+}
+
+// Extended-length form of a folder path, without a trailing backslash,
+// so deep trees aren't cut off at MAX_PATH
+static void GetLongPath(const wchar_t* path, wchar_t* out, UINT cch)
+{
+    if (path[0] == L'\\' && path[1] == L'\\')
+        StringCchPrintfW(out, cch, L"\\\\?\\UNC\\%s", path + 2);
+    else
+        StringCchPrintfW(out, cch, L"\\\\?\\%s", path);
+    PathRemoveBackslashW(out);
+}
+
+static UINT GetWalkThreadCount(void)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+
+    UINT n = si.dwNumberOfProcessors;
+    if (n < 1) n = 1;
+    if (n > MAX_WALK_THREADS) n = MAX_WALK_THREADS;
+    return n;
+}
+
+// Walk baseDir and collect every file below the given roots (names relative
+// to baseDir; an empty root means baseDir itself) into out. filter may be NULL.
+// Fails if anything found couldn't be recorded (out of memory, or a path
+// longer than WALK_PATH_CHARS): the archive would silently lack it.
+static BOOL BuildManifest(const wchar_t* baseDir, wchar_t (*roots)[MAX_PATH], UINT nRoots,
+                          const PathFilter* filter, Manifest* out)
+{
+    DirWalk* walk = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(DirWalk));
+    if (!walk) return FALSE;
+
+    GetLongPath(baseDir, walk->root, WALK_PATH_CHARS);
+    walk->rootLen = (UINT)wcslen(walk->root);
+    walk->filter = filter;
+
+    walk->nWorkers = GetWalkThreadCount();
+    walk->workers = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, walk->nWorkers * sizeof(WalkWorker));
+    if (!walk->workers)
+    {
+        HeapFree(GetProcessHeap(), 0, walk);
+        return FALSE;
+    }
+
+    for (UINT i = 0; i < walk->nWorkers; i++)
+    {
+        walk->workers[i].walk = walk;
+        walk->workers[i].index = i;
+        InitializeSRWLock(&walk->workers[i].deque.lock);
+    }
+
+    // Seed: folders are spread round-robin, files go straight into the manifest.
+    // Explicitly selected items are never filtered out.
+    WalkWorker* first = &walk->workers[0];
+    for (UINT i = 0; i < nRoots; i++)
+    {
+        UINT len = (UINT)wcslen(roots[i]);
+        WIN32_FILE_ATTRIBUTE_DATA fad;
+
+        if (len)
+            StringCchPrintfW(first->findPath, WALK_PATH_CHARS, L"%s\\%s", walk->root, roots[i]);
+        else
+            StringCchCopyW(first->findPath, WALK_PATH_CHARS, walk->root);
+
+        if (!GetFileAttributesExW(first->findPath, GetFileExInfoStandard, &fad))
+            continue;
+
+        if (fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            WalkWorker* w = &walk->workers[i % walk->nWorkers];
+            const wchar_t* dir = PoolCopy(&w->manifest.pool, roots[i], len);
+            if (dir && DequePush(&w->deque, dir))
+                walk->pending++;
+            else
+                walk->dropped++;
+        }
+        else
+        {
+            ULONGLONG size = ((ULONGLONG)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+            if (!ManifestAdd(&first->manifest, roots[i], len, size, fad.ftLastWriteTime, FALSE))
+                walk->dropped++;
+        }
+    }
+
+    // Worker 0 runs on this thread
+    HANDLE threads[MAX_WALK_THREADS] = {0};
+    for (UINT i = 1; i < walk->nWorkers; i++)
+        threads[i] = CreateThread(NULL, 0, WalkWorkerProc, &walk->workers[i], 0, NULL);
+
+    WalkWorkerProc(first);
+
+    for (UINT i = 1; i < walk->nWorkers; i++)
+    {
+        if (threads[i])
+        {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+    }
+
+    BOOL ok = walk->dropped == 0;
+    ZeroMemory(out, sizeof(*out));
+    for (UINT i = 0; i < walk->nWorkers; i++)
+    {
+        if (!ManifestMerge(out, &walk->workers[i].manifest))
+        {
+            ManifestFree(&walk->workers[i].manifest);
+            ok = FALSE;
+        }
+        if (walk->workers[i].deque.items)
+            HeapFree(GetProcessHeap(), 0, (void*)walk->workers[i].deque.items);
+    }
+
+    HeapFree(GetProcessHeap(), 0, walk->workers);
+    HeapFree(GetProcessHeap(), 0, walk);
+
+    if (!ok) ManifestFree(out);
+    return ok;
+}
+
+// Write a manifest as a WinRAR list file. Fails rather than leave a line out.
+static BOOL CreateListFile(const wchar_t* listPath, const Manifest* m)
+{
+    // Batch the writes, manifests can run to millions of lines. Any walked
+    // path fits, with its CRLF.
+    uint16_t* buf = HeapAlloc(GetProcessHeap(), 0, LIST_BUFFER_CHARS * sizeof(uint16_t));
+    if (!buf) return FALSE;
+
+    HANDLE hFile = CreateFileW(listPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_TEMPORARY, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        HeapFree(GetProcessHeap(), 0, buf);
+        return FALSE;
+    }
+
+    size_t used = 0;
+    DWORD written;
+    BOOL ok = TRUE;
+
+    buf[used++] = 0xFEFF;  // BOM for Unicode
+
+    for (UINT i = 0; i < m->count && ok; i++)
+    {
+        size_t len = EncodeListLine(m->entries[i].path, buf + used, LIST_BUFFER_CHARS - used);
+        if (!len && used)
+        {
+            ok = WriteFile(hFile, buf, (DWORD)(used * sizeof(uint16_t)), &written, NULL);
+            used = 0;
+            len = EncodeListLine(m->entries[i].path, buf, LIST_BUFFER_CHARS);
+        }
+        ok = ok && len != 0;
+        used += len;
+    }
+    if (ok && used)
+        ok = WriteFile(hFile, buf, (DWORD)(used * sizeof(uint16_t)), &written, NULL);
+
+    CloseHandle(hFile);
+    HeapFree(GetProcessHeap(), 0, buf);
+    return ok;
+}
+
+//=============================================================================
+// CRC-32
+//=============================================================================
+// The kernel is in core.c; its tables are built on first use
+static INIT_ONCE g_CrcTableOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK InitCrcTableOnce(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+    Crc32Init();
+    return TRUE;
+}
+
+static void EnsureCrcTables(void)
+{
+    InitOnceExecuteOnce(&g_CrcTableOnce, InitCrcTableOnce, NULL, NULL);
+}
+
+static BOOL Crc32File(const wchar_t* path, DWORD* crc)
+{
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                               OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    BYTE* buf = HeapAlloc(GetProcessHeap(), 0, 1024 * 1024);
+    DWORD read;
+    BOOL ok = (buf != NULL);
+
+    EnsureCrcTables();
+    *crc = 0;
+    while (ok && (ok = ReadFile(hFile, buf, 1024 * 1024, &read, NULL)) && read)
+        *crc = Crc32Update(*crc, buf, read);
+
+    if (buf) HeapFree(GetProcessHeap(), 0, buf);
+    CloseHandle(hFile);
+    return ok;
+}
+
+//=============================================================================
+// Zip central directory
+//=============================================================================
+// Read-only view of a finished zip (including zip64), used to pick up the
+// CRCs WinRAR computed. Reading the view raises EXCEPTION_IN_PAGE_ERROR
+// when the disk fails (network share, removed drive): code that touches it
+// runs under __except (InPageErrorFilter(GetExceptionCode())).
+typedef struct {
+    HANDLE hFile;
+    HANDLE hMap;
+    const BYTE* base;
+    ULONGLONG size;
+    ULONGLONG cdOffset;
+    ULONGLONG cdEnd;
+} ZipReader;
+
+typedef struct {
+    const char* name;
+    UINT nameLen;
+    WORD flags;
+    WORD method;
+    DWORD crc;
+    ULONGLONG compSize;
+    ULONGLONG size;
+    ULONGLONG localOffset;
+} ZipEntry;
+
+static inline WORD ReadLE16(const BYTE* p) { return (WORD)(p[0] | (p[1] << 8)); }
+static inline DWORD ReadLE32(const BYTE* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((DWORD)p[3] << 24); }
+static inline ULONGLONG ReadLE64(const BYTE* p) { return ReadLE32(p) | ((ULONGLONG)ReadLE32(p + 4) << 32); }
+
+static int InPageErrorFilter(DWORD code)
+{
+    return code == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH;
+}
+
+static void ZipClose(ZipReader* zr)
+{
+    if (zr->base) UnmapViewOfFile(zr->base);
+    if (zr->hMap) CloseHandle(zr->hMap);
+    if (zr->hFile && zr->hFile != INVALID_HANDLE_VALUE) CloseHandle(zr->hFile);
+    ZeroMemory(zr, sizeof(*zr));
+}
+
+// Sets cdOffset/cdEnd from the end records of the mapped archive
+static BOOL ZipFindDirectory(ZipReader* zr)
+{
+    // End of central directory record, possibly followed by a comment
+    const BYTE* eocd = NULL;
+    ULONGLONG lowest = zr->size > 22 + 65535 ? zr->size - 22 - 65535 : 0;
+    for (ULONGLONG pos = zr->size - 22; ; pos--)
+    {
+        if (ReadLE32(zr->base + pos) == 0x06054b50)
+        {
+            eocd = zr->base + pos;
+            break;
+        }
+        if (pos == lowest) break;
+    }
+    if (!eocd) return FALSE;
+
+    ULONGLONG cdSize = ReadLE32(eocd + 12);
+    zr->cdOffset = ReadLE32(eocd + 16);
+
+    // Zip64 locator sits right before the classic record
+    if ((zr->cdOffset == 0xFFFFFFFF || cdSize == 0xFFFFFFFF || ReadLE16(eocd + 10) == 0xFFFF) &&
+        eocd - zr->base >= 20 && ReadLE32(eocd - 20) == 0x07064b50)
+    {
+        ULONGLONG z64 = ReadLE64(eocd - 20 + 8);
+        if (z64 + 56 > zr->size || ReadLE32(zr->base + z64) != 0x06064b50)
+            return FALSE;
+        cdSize = ReadLE64(zr->base + z64 + 40);
+        zr->cdOffset = ReadLE64(zr->base + z64 + 48);
+    }
+
+    zr->cdEnd = zr->cdOffset + cdSize;
+    return zr->cdOffset <= zr->size && zr->cdEnd <= zr->size;
+}
+
+static BOOL ZipOpen(const wchar_t* path, ZipReader* zr)
+{
+    LARGE_INTEGER size;
+    BOOL found = FALSE;
+
+    ZeroMemory(zr, sizeof(*zr));
+    zr->hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    if (zr->hFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(zr->hFile, &size) || size.QuadPart < 22)
+        goto fail;
+
+    zr->size = size.QuadPart;
+    zr->hMap = CreateFileMappingW(zr->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!zr->hMap) goto fail;
+    zr->base = MapViewOfFile(zr->hMap, FILE_MAP_READ, 0, 0, 0);
+    if (!zr->base) goto fail;
+
+    __try
+    {
+        found = ZipFindDirectory(zr);
+    }
+    __except (InPageErrorFilter(GetExceptionCode()))
+    {
+        found = FALSE;
+    }
+    if (found)
+        return TRUE;
+
+fail:
+    ZipClose(zr);
+    return FALSE;
+}
+
+// Read the central directory entry at *pos and advance past it
+static BOOL ZipNextEntry(const ZipReader* zr, ULONGLONG* pos, ZipEntry* e)
+{
+    const BYTE* p = zr->base + *pos;
+
+    if (*pos + 46 > zr->cdEnd || ReadLE32(p) != 0x02014b50)
+        return FALSE;
+
+    WORD extraLen = ReadLE16(p + 30);
+    e->flags = ReadLE16(p + 8);
+    e->method = ReadLE16(p + 10);
+    e->crc = ReadLE32(p + 16);
+    e->compSize = ReadLE32(p + 20);
+    e->size = ReadLE32(p + 24);
+    e->nameLen = ReadLE16(p + 28);
+    e->localOffset = ReadLE32(p + 42);
+    e->name = (const char*)p + 46;
+
+    ULONGLONG next = *pos + 46 + e->nameLen + extraLen + ReadLE16(p + 32);
+    if (next > zr->cdEnd)
+        return FALSE;
+
+    // Zip64 extended information holds whichever fields overflowed, in order
+    const BYTE* extra = p + 46 + e->nameLen;
+    const BYTE* extraEnd = extra + extraLen;
+    while (extra + 4 <= extraEnd)
+    {
+        WORD id = ReadLE16(extra);
+        WORD len = ReadLE16(extra + 2);
+        const BYTE* field = extra + 4;
+        const BYTE* fieldEnd = field + len;
+        if (fieldEnd > extraEnd) break;
+
+        if (id == 0x0001)
+        {
+            if (e->size == 0xFFFFFFFF && field + 8 <= fieldEnd) { e->size = ReadLE64(field); field += 8; }
+            if (e->compSize == 0xFFFFFFFF && field + 8 <= fieldEnd) { e->compSize = ReadLE64(field); field += 8; }
+            if (e->localOffset == 0xFFFFFFFF && field + 8 <= fieldEnd) { e->localOffset = ReadLE64(field); }
+            break;
+        }
+        extra = fieldEnd;
+    }
+
+    *pos = next;
+    return TRUE;
+}
+
+// Entry name as a Windows relative path; returns FALSE for folder entries
+static BOOL ZipEntryPath(const ZipEntry* e, wchar_t* out, UINT cch)
+{
+    // Bit 11: UTF-8 name, otherwise the OEM code page
+    int len = MultiByteToWideChar((e->flags & 0x800) ? CP_UTF8 : CP_OEMCP, 0,
+                                  e->name, e->nameLen, out, cch - 1);
+    out[len] = L'\0';
+
+    for (int i = 0; i < len; i++)
+    {
+        if (out[i] == L'/') out[i] = L'\\';
+    }
+    return len > 0 && out[len - 1] != L'\\';
+}
+
+//=============================================================================
+// Incremental zip
+//=============================================================================
+// With [Zip] Incremental=1 every archive gets a hidden "<archive>.manifest"
+// sidecar recording what went in (path, size, mtime, CRC). Re-zipping diffs
+// the tree against it: nothing changed -> no WinRAR at all, otherwise only
+// changed entries are re-added and vanished ones deleted.
+#define SIDECAR_MAGIC 0x314D5851  // "QXM1"
+
+typedef struct {
+    DWORD magic;
+    DWORD count;
+    ULONGLONG archiveSize;
+    FILETIME archiveMtime;
+} SidecarHeader;
+
+static int __cdecl CompareManifestEntries(const void* a, const void* b)
+{
+    const ManifestEntry* ea = a;
+    const ManifestEntry* eb = b;
+    return CompareStringOrdinal(ea->path, -1, eb->path, -1, TRUE) - CSTR_EQUAL;
+}
+
+static void ManifestSort(Manifest* m)
+{
+    qsort(m->entries, m->count, sizeof(ManifestEntry), CompareManifestEntries);
+}
+
+// Add an entry whose path stays owned by another manifest
+static BOOL ManifestAddRef(Manifest* m, const ManifestEntry* e)
+{
+    if (!ManifestReserve(m, m->count + 1)) return FALSE;
+    m->entries[m->count++] = *e;
+    m->totalBytes += e->size;
+    return TRUE;
+}
+
+static void GetSidecarPath(const wchar_t* archivePath, wchar_t* out)
+{
+    StringCchPrintfW(out, MAX_PATH, L"%s.manifest", archivePath);
+}
+
+static BOOL GetArchiveStamp(const wchar_t* archivePath, ULONGLONG* size, FILETIME* mtime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+
+    if (!GetFileAttributesExW(archivePath, GetFileExInfoStandard, &fad))
+        return FALSE;
+    *size = ((ULONGLONG)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+    *mtime = fad.ftLastWriteTime;
+    return TRUE;
+}
+
+// Load the sidecar into a sorted manifest, if it still describes the archive as it is on disk
+static BOOL LoadSidecar(const wchar_t* archivePath, Manifest* m)
+{
+    wchar_t path[MAX_PATH];
+    SidecarHeader hdr;
+    ULONGLONG archiveSize;
+    FILETIME archiveMtime;
+
+    ZeroMemory(m, sizeof(*m));
+    if (!GetArchiveStamp(archivePath, &archiveSize, &archiveMtime))
+        return FALSE;
+
+    GetSidecarPath(archivePath, path);
+    if (!LoadManifestFile(path, SIDECAR_MAGIC, &hdr, sizeof(hdr), m))
+        return FALSE;
+
+    if (hdr.archiveSize != archiveSize || CompareFileTime(&hdr.archiveMtime, &archiveMtime) != 0)
+    {
+        ManifestFree(m);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL SaveSidecar(const wchar_t* archivePath, const Manifest* m)
+{
+    wchar_t path[MAX_PATH];
+    SidecarHeader hdr = {0};
+
+    hdr.magic = SIDECAR_MAGIC;
+    if (!GetArchiveStamp(archivePath, &hdr.archiveSize, &hdr.archiveMtime))
+        return FALSE;
+
+    GetSidecarPath(archivePath, path);
+    return SaveManifestFile(path, &hdr, sizeof(hdr), m, FILE_ATTRIBUTE_HIDDEN);
+}
+
+// Copy the CRCs WinRAR stored in the archive onto the (sorted) manifest
+static BOOL FillCrcsFromArchive(const wchar_t* archivePath, Manifest* m)
+{
+    ZipReader zr;
+    Manifest archived = {0};
+    wchar_t name[WALK_PATH_CHARS / 4];
+    ZipEntry e;
+    FILETIME ft = {0};
+
+    BOOL ok = TRUE;
+
+    if (!ZipOpen(archivePath, &zr))
+        return FALSE;
+
+    __try
+    {
+        for (ULONGLONG pos = zr.cdOffset; ZipNextEntry(&zr, &pos, &e); )
+        {
+            if (ZipEntryPath(&e, name, ARRAYSIZE(name)) &&
+                ManifestAdd(&archived, name, (UINT)wcslen(name), e.size, ft, FALSE))
+            {
+                archived.entries[archived.count - 1].crc = e.crc;
+            }
+        }
+    }
+    __except (InPageErrorFilter(GetExceptionCode()))
+    {
+        ok = FALSE;
+    }
+    ZipClose(&zr);
+
+    if (!ok)
+    {
+        ManifestFree(&archived);
+        return FALSE;
+    }
+
+    ManifestSort(&archived);
+    for (UINT i = 0, j = 0; i < m->count && j < archived.count; )
+    {
+        int cmp = CompareManifestEntries(&m->entries[i], &archived.entries[j]);
+        if (cmp == 0)
+            m->entries[i++].crc = archived.entries[j++].crc;
+        else if (cmp < 0)
+            i++;
+        else
+            j++;
+    }
+
+    ManifestFree(&archived);
+    return TRUE;
+}
+
+// Diff the current (sorted) tree against the sidecar. Entries that only got
+// a new timestamp are checked by CRC and count as unchanged. CRCs of
+// unchanged entries carry over into cur; *touched is set if cur differs from
+// the sidecar only in timestamps.
+static BOOL DiffManifests(const wchar_t* baseDir, Manifest* cur, const Manifest* old,
+                          Manifest* changed, Manifest* deleted, BOOL* touched)
+{
+    wchar_t fullPath[WALK_PATH_CHARS];
+    UINT i = 0, j = 0;
+
+    ZeroMemory(changed, sizeof(*changed));
+    ZeroMemory(deleted, sizeof(*deleted));
+    *touched = FALSE;
+
+    while (i < cur->count || j < old->count)
+    {
+        int cmp = (i == cur->count) ? 1 : (j == old->count) ? -1
+                : CompareManifestEntries(&cur->entries[i], &old->entries[j]);
+
+        if (cmp < 0)
+        {
+            if (!ManifestAddRef(changed, &cur->entries[i])) return FALSE;
+            i++;
+            continue;
+        }
+        if (cmp > 0)
+        {
+            if (!ManifestAddRef(deleted, &old->entries[j])) return FALSE;
+            j++;
+            continue;
+        }
+
+        ManifestEntry* c = &cur->entries[i++];
+        const ManifestEntry* o = &old->entries[j++];
+        BOOL same = (c->isDir == o->isDir && c->size == o->size);
+
+        if (same && !c->isDir && CompareFileTime(&c->mtime, &o->mtime) != 0)
+        {
+            DWORD crc;
+            GetLongPath(baseDir, fullPath, ARRAYSIZE(fullPath));
+            StringCchCatW(fullPath, ARRAYSIZE(fullPath), L"\\");
+            StringCchCatW(fullPath, ARRAYSIZE(fullPath), c->path);
+            same = Crc32File(fullPath, &crc) && crc == o->crc;
+            if (same) *touched = TRUE;
+        }
+
+        if (same)
+            c->crc = o->crc;
+        else if (!ManifestAddRef(changed, c))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+//=============================================================================
+// Job statistics
+//=============================================================================
+// Every finished WinRAR run is appended to %APPDATA%\...\stats.bin, a ring
+// of the last STATS_CAPACITY runs updated through a file mapping: exit
+// code, wall time, bytes in and out (layout and totals in core.h). Explorer
+// and file dialogs may all write to it, so updates are serialized by a
+// named mutex. The dispatcher only queues records; one worker thread,
+// started while there are any, writes whatever has queued up under one
+// lock. Records that can't get the mutex within STATS_LOCK_MS are dropped.
+#define STATS_LOCK_MS  5000
+#define NOTIFY_SHOW_MS 10000
+
+typedef struct {
+    SLIST_ENTRY entry;          // In g_StatsQueue
+    StatsRecord rec;
+    BOOL bArchiveIsOutput;      // Its size goes to outBytes, else to inBytes
+} StatsJob;
+
+static SLIST_HEADER g_StatsQueue;
+static volatile LONG g_nStatsQueued;    // Counted before the push; the worker runs while > 0
+
+static ULONGLONG GetFileSize64(const wchar_t* path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+
+    if (!GetFileAttributesExW(path, GetFileExInfoStandard, &fad))
+        return 0;
+    return ((ULONGLONG)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+}
+
+// Append the jobs of a list, oldest first
+static void AppendStatsRecords(StatsJob* jobs)
+{
+    wchar_t path[MAX_PATH];
+
+    if (!GetSettingsPath(NULL, path))
+        return;
+    SHCreateDirectoryExW(NULL, path, NULL);
+    PathAppendW(path, L"stats.bin");
+
+    HANDLE hMutex = CreateMutexW(NULL, FALSE, L"Local\\WinRARShellExtQuickExtractStats");
+    if (!hMutex) return;
+    DWORD wait = WaitForSingleObject(hMutex, STATS_LOCK_MS);
+    if (wait != WAIT_OBJECT_0 && wait != WAIT_ABANDONED)
+    {
+        CloseHandle(hMutex);
+        return;
+    }
+
+    HANDLE hFile = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                               OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        HANDLE hMap = CreateFileMappingW(hFile, NULL, PAGE_READWRITE, 0, (DWORD)STATS_FILE_SIZE, NULL);
+        BYTE* base = hMap ? MapViewOfFile(hMap, FILE_MAP_WRITE, 0, 0, STATS_FILE_SIZE) : NULL;
+        if (base)
+        {
+            for (StatsJob* job = jobs; job; job = (StatsJob*)job->entry.Next)
+                StatsAppend(base, &job->rec);
+            UnmapViewOfFile(base);
+        }
+        if (hMap) CloseHandle(hMap);
+        CloseHandle(hFile);
+    }
+
+    ReleaseMutex(hMutex);
+    CloseHandle(hMutex);
+}
+
+// Take everything queued until the count drops to 0, writing it out or,
+// if write is FALSE, dropping it. A job counted but not pushed yet is
+// waited for.
+static void DrainStatsQueue(BOOL write)
+{
+    for (;;)
+    {
+        PSLIST_ENTRY entry = InterlockedFlushSList(&g_StatsQueue);
+        StatsJob* oldest = NULL;
+        LONG n = 0;
+
+        if (!entry)
+        {
+            if (g_nStatsQueued == 0) return;
+            SwitchToThread();
+            continue;
+        }
+
+        // The list comes newest first
+        while (entry)
+        {
+            StatsJob* job = CONTAINING_RECORD(entry, StatsJob, entry);
+            entry = entry->Next;
+            job->entry.Next = oldest ? &oldest->entry : NULL;
+            oldest = job;
+            n++;
+        }
+
+        if (write)
+        {
+            for (StatsJob* job = oldest; job; job = (StatsJob*)job->entry.Next)
+            {
+                if (!job->rec.archive[0]) continue;
+                ULONGLONG archiveSize = GetFileSize64((const wchar_t*)job->rec.archive);
+                if (job->bArchiveIsOutput)
+                    job->rec.outBytes = archiveSize;
+                else
+                    job->rec.inBytes = archiveSize;
+            }
+            AppendStatsRecords(oldest);
+        }
+        while (oldest)
+        {
+            StatsJob* next = (StatsJob*)oldest->entry.Next;
+            HeapFree(GetProcessHeap(), 0, oldest);
+            oldest = next;
+        }
+
+        if (InterlockedAdd(&g_nStatsQueued, -n) == 0)
+            return;
+    }
+}
+
+static DWORD WINAPI StatsThreadProc(LPVOID param)
+{
+    DrainStatsQueue(TRUE);
+    ExitBackgroundThread();
+    return 0;
+}
+
+static DWORD WINAPI NotifyThreadProc(LPVOID param)
+{
+    NOTIFYICONDATAW* nid = param;
+
+    nid->hWnd = CreateWindowExW(0, L"STATIC", NULL, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, NULL, NULL);
+    if (nid->hWnd)
+    {
+        HICON hIcon = NULL;
+        ExtractIconExW(g_WinRARPath, 0, NULL, &hIcon, 1);
+        nid->hIcon = hIcon ? hIcon : LoadIconW(NULL, IDI_INFORMATION);
+
+        // The balloon goes with the icon, so keep it around for a while
+        if (Shell_NotifyIconW(NIM_ADD, nid))
+        {
+            Sleep(NOTIFY_SHOW_MS);
+            Shell_NotifyIconW(NIM_DELETE, nid);
+        }
+        if (hIcon) DestroyIcon(hIcon);
+        DestroyWindow(nid->hWnd);
+    }
+
+    HeapFree(GetProcessHeap(), 0, nid);
+    ExitBackgroundThread();
+    return 0;
+}
+
+// Tray balloon from a background thread; warning picks the icon
+static void ShowNotification(const wchar_t* title, const wchar_t* text, BOOL warning)
+{
+    NOTIFYICONDATAW* nid = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(NOTIFYICONDATAW));
+    if (!nid) return;
+
+    nid->cbSize = sizeof(*nid);
+    nid->uID = 1;
+    nid->uFlags = NIF_ICON | NIF_TIP | NIF_INFO;
+    nid->dwInfoFlags = warning ? NIIF_WARNING : NIIF_INFO;
+    StringCchCopyW(nid->szTip, ARRAYSIZE(nid->szTip), L"WinRAR");
+    StringCchCopyW(nid->szInfoTitle, ARRAYSIZE(nid->szInfoTitle), title);
+    StringCchCopyW(nid->szInfo, ARRAYSIZE(nid->szInfo), text);
+
+    if (!StartBackgroundThread(NotifyThreadProc, nid))
+        HeapFree(GetProcessHeap(), 0, nid);
+}
+
+// Tray balloon with a batch summary. [Stats] Notify=0 turns it off.
+static void ShowBatchSummary(UINT nJobs, UINT nFailed, UINT nUpToDate, ULONGLONG inBytes,
+                             ULONGLONG outBytes, ULONGLONG wallMs)
+{
+    wchar_t inSize[32], outSize[32], upToDate[48] = L"", text[256];
+
+    if (!GetSettingInt(L"Stats", L"Notify", 1))
+        return;
+
+    StrFormatByteSizeW(inBytes, inSize, ARRAYSIZE(inSize));
+    StrFormatByteSizeW(outBytes, outSize, ARRAYSIZE(outSize));
+    if (nUpToDate)
+        StringCchPrintfW(upToDate, ARRAYSIZE(upToDate), L", %u already up to date", nUpToDate);
+    StringCchPrintfW(text, ARRAYSIZE(text),
+        L"%u of %u archives%s in %u:%02u\n%s -> %s (%u%%)",
+        nJobs - nFailed, nJobs, upToDate, (UINT)(wallMs / 60000), (UINT)(wallMs / 1000 % 60),
+        inSize, outSize, StatsRatioPercent(inBytes, outBytes));
+    ShowNotification(L"WinRAR batch finished", text, nFailed != 0);
+}
+
+//=============================================================================
+// List handoff
+//=============================================================================
+// WinRAR reads its list from a path given after '@', a Unicode file in
+// %TEMP% that's deleted once the job is done. WinRAR opens that path by
+// name, and a second open (a retry, an AV scanner) has to see the same
+// content, so the list always goes through a real file.
+typedef struct {
+    wchar_t szPath[MAX_PATH];   // Goes after '@', empty if there's no list
+} ListChannel;
+
+// Put a manifest where WinRAR can read it as ch->szPath
+static BOOL OpenListChannel(ListChannel* ch, const Manifest* m)
+{
+    wchar_t tempDir[MAX_PATH];
+
+    ch->szPath[0] = L'\0';
+    if (!GetTempPathW(MAX_PATH, tempDir) || !GetTempFileNameW(tempDir, L"wrx", 0, ch->szPath))
+    {
+        ch->szPath[0] = L'\0';
+        return FALSE;
+    }
+    if (CreateListFile(ch->szPath, m))
+        return TRUE;
+
+    DeleteFileW(ch->szPath);
+    ch->szPath[0] = L'\0';
+    return FALSE;
+}
+
+static void CloseListChannel(ListChannel* ch)
+{
+    if (ch->szPath[0])
+        DeleteFileW(ch->szPath);
+    ch->szPath[0] = L'\0';
+}
+
+//=============================================================================
+// Job scheduler
+//=============================================================================
+// Every WinRAR run goes through one dispatcher thread. Each task touches
+// the physical devices of its source and destination, and a device only
+// runs as many tasks at once as it handles well: one per spinning disk by
+// default, more for SSDs and network shares. A task starts as soon as all
+// its devices have a free slot, so jobs on different drives run side by side
+// while jobs on the same disk queue up instead of seeking against each other.
+// Limits come from [Schedule] HddJobs / SsdJobs / NetJobs.
+//
+// Background tasks (big batches) also run below normal priority with low
+// memory priority, EcoQoS and WinRAR's own low I/O priority (-ri), inside a
+// job object capped at [QoS] CpuRate percent of the CPU and optionally
+// [QoS] MemoryMB. While the system is busier than [QoS] LoadThreshold
+// percent the cap drops to a quarter, they go to idle priority and no
+// further background task starts. Foreground tasks are picked first. The
+// policy itself is the core's (QosPolicy).
+#define MAX_RUNNING_TASKS  (MAXIMUM_WAIT_OBJECTS - 1)
+#define LOAD_SAMPLE_MS     1000
+#define LOAD_HYSTERESIS    15
+
+typedef struct WinRARTask {
+    struct WinRARTask* next;
+    wchar_t szCmdLine[1024];
+    wchar_t szWorkDir[MAX_PATH];    // Empty for the default
+    DeviceKey devices[2];
+    UINT nDevices;
+    QosClass qos;
+    const wchar_t* pszArchivePath;  // For the stats file
+    BOOL bArchiveIsOutput;          // Creates/updates the archive rather than reading it
+    ULONGLONG inBytes;              // Bytes added, if bArchiveIsOutput
+    ULONGLONG startTick;
+    DWORD wallMs;                   // Set before onExit
+    // Runs on the dispatcher thread once WinRAR exits, exitCode is
+    // (DWORD)-1 if it couldn't be started. May queue follow-up tasks.
+    void (*onExit)(struct WinRARTask* task, DWORD exitCode);
+    void* context;
+    HANDLE hProcess;
+} WinRARTask;
+
+// DeviceKey ids here: the physical disk number, or a hash for shares and
+// volumes that can't be placed on one disk
+typedef struct {
+    wchar_t szVolume[MAX_PATH];
+    DeviceKey dev;
+} DeviceCacheEntry;
+
+static SRWLOCK g_DeviceCacheLock = SRWLOCK_INIT;
+static DeviceCacheEntry g_DeviceCache[DEVICE_MAX];
+static UINT g_nDeviceCache = 0;
+
+static SRWLOCK g_SchedLock = SRWLOCK_INIT;
+static WinRARTask* g_PendingHead = NULL;
+static WinRARTask* g_PendingTail = NULL;
+static BOOL g_DispatcherActive = FALSE;
+static HANDLE g_hSchedEvent = NULL;         // Set when a task is queued
+
+// Dispatcher thread only
+static WinRARTask* g_Running[MAX_RUNNING_TASKS];
+static UINT g_nRunning = 0;
+static DeviceSlots g_DeviceSlots;
+static HANDLE g_hBackgroundJob = NULL;
+static QosPolicy g_Qos;
+static ULONGLONG g_LastIdle = 0, g_LastTotal = 0;
+static ULONGLONG g_LastSampleTick = 0;
+
+static inline wchar_t FoldChar(wchar_t c)
+{
+    return (c >= L'A' && c <= L'Z') ? (wchar_t)(c + (L'a' - L'A')) : c;
+}
+
+static DWORD HashString(const wchar_t* s)
+{
+    DWORD h = 2166136261u;
+    while (*s)
+        h = (h ^ FoldChar(*s++)) * 16777619u;
+    return h;
+}
+
+static BOOL QueryDevice(const wchar_t* volumeRoot, DeviceKey* dev)
+{
+    wchar_t volumeName[MAX_PATH];
+    wchar_t drivePath[32];
+    VOLUME_DISK_EXTENTS extents;
+    STORAGE_PROPERTY_QUERY query = {0};
+    DEVICE_SEEK_PENALTY_DESCRIPTOR seek = {0};
+    DWORD bytes;
+
+    if ((volumeRoot[0] == L'\\' && volumeRoot[1] == L'\\' && volumeRoot[2] != L'?') ||
+        GetDriveTypeW(volumeRoot) == DRIVE_REMOTE)
+    {
+        dev->kind = DEVICE_NETWORK;
+        dev->id = 0x80000000 | (HashString(volumeRoot) & 0x3FFFFFFF);
+        return TRUE;
+    }
+
+    // Unknown hardware is treated like a spinning disk
+    dev->kind = DEVICE_HDD;
+    if (!GetVolumeNameForVolumeMountPointW(volumeRoot, volumeName, MAX_PATH))
+        return FALSE;
+    dev->id = 0xC0000000 | (HashString(volumeName) & 0x3FFFFFFF);
+
+    // Volume -> physical disk, so partitions of one disk share its slots
+    PathRemoveBackslashW(volumeName);
+    HANDLE hVolume = CreateFileW(volumeName, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                 OPEN_EXISTING, 0, NULL);
+    if (hVolume == INVALID_HANDLE_VALUE)
+        return TRUE;
+    BOOL ok = DeviceIoControl(hVolume, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, NULL, 0,
+                              &extents, sizeof(extents), &bytes, NULL);
+    CloseHandle(hVolume);
+    if (!ok)
+        return TRUE;  // Volumes spanning several disks keep the per-volume id
+    dev->id = extents.Extents[0].DiskNumber;
+
+    StringCchPrintfW(drivePath, ARRAYSIZE(drivePath), L"\\\\.\\PhysicalDrive%u", dev->id);
+    HANDLE hDisk = CreateFileW(drivePath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                               OPEN_EXISTING, 0, NULL);
+    if (hDisk == INVALID_HANDLE_VALUE)
+        return TRUE;
+
+    query.PropertyId = StorageDeviceSeekPenaltyProperty;
+    query.QueryType = PropertyStandardQuery;
+    if (DeviceIoControl(hDisk, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+                        &seek, sizeof(seek), &bytes, NULL) && bytes >= sizeof(seek))
+    {
+        dev->kind = seek.IncursSeekPenalty ? DEVICE_HDD : DEVICE_SSD;
+    }
+    CloseHandle(hDisk);
+    return TRUE;
+}
+
+// Physical device a path lives on; resolved once per volume. The
+// DeviceResolver of the core's scheduling, never fails.
+static int ResolveDevice(void* context, const wchar_t* path, DeviceKey* dev)
+{
+    wchar_t volumeRoot[MAX_PATH];
+    BOOL found = FALSE;
+
+    if (!GetVolumePathNameW(path, volumeRoot, MAX_PATH))
+        StringCchCopyW(volumeRoot, MAX_PATH, path);
+
+    AcquireSRWLockShared(&g_DeviceCacheLock);
+    for (UINT i = 0; i < g_nDeviceCache && !found; i++)
+    {
+        if (_wcsicmp(g_DeviceCache[i].szVolume, volumeRoot) == 0)
+        {
+            *dev = g_DeviceCache[i].dev;
+            found = TRUE;
+        }
+    }
+    ReleaseSRWLockShared(&g_DeviceCacheLock);
+    if (found) return TRUE;
+
+    if (!QueryDevice(volumeRoot, dev))
+        dev->id = 0xC0000000 | (HashString(volumeRoot) & 0x3FFFFFFF);
+
+    AcquireSRWLockExclusive(&g_DeviceCacheLock);
+    if (g_nDeviceCache < DEVICE_MAX)
+    {
+        StringCchCopyW(g_DeviceCache[g_nDeviceCache].szVolume, MAX_PATH, volumeRoot);
+        g_DeviceCache[g_nDeviceCache].dev = *dev;
+        g_nDeviceCache++;
+    }
+    ReleaseSRWLockExclusive(&g_DeviceCacheLock);
+    return TRUE;
+}
+
+// Record the devices a task reads from and writes to
+static void SetTaskDevices(WinRARTask* task, const wchar_t* sourcePath, const wchar_t* destPath)
+{
+    unsigned limits[DEVICE_KINDS];
+
+    limits[DEVICE_HDD] = GetSettingInt(L"Schedule", L"HddJobs", 1);
+    limits[DEVICE_SSD] = GetSettingInt(L"Schedule", L"SsdJobs", 4);
+    limits[DEVICE_NETWORK] = GetSettingInt(L"Schedule", L"NetJobs", 2);
+    task->nDevices = ResolveTaskDevices(ResolveDevice, NULL, limits, sourcePath, destPath, task->devices);
+}
+
+static ULONGLONG FileTimeToU64(const FILETIME* ft)
+{
+    return ((ULONGLONG)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+}
+
+// Busy percentage of all CPUs since the previous sample
+static UINT SampleSystemLoad(void)
+{
+    FILETIME idleTime, kernelTime, userTime;
+    UINT load = 0;
+
+    if (!GetSystemTimes(&idleTime, &kernelTime, &userTime))
+        return 0;
+
+    // Kernel time includes idle time
+    ULONGLONG idle = FileTimeToU64(&idleTime);
+    ULONGLONG total = FileTimeToU64(&kernelTime) + FileTimeToU64(&userTime);
+    if (g_LastTotal && total > g_LastTotal)
+        load = (UINT)(100 - (idle - g_LastIdle) * 100 / (total - g_LastTotal));
+    g_LastIdle = idle;
+    g_LastTotal = total;
+    return load;
+}
+
+static void SetBackgroundCpuRate(UINT percent)
+{
+    JOBOBJECT_CPU_RATE_CONTROL_INFORMATION rate = {0};
+
+    if (percent == 0 || percent >= 100)
+        return;
+    rate.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE | JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+    rate.CpuRate = percent * 100;
+    SetInformationJobObject(g_hBackgroundJob, JobObjectCpuRateControlInformation, &rate, sizeof(rate));
+}
+
+// Settings are re-read as the load is sampled, so changes apply to running batches
+static void ConfigureQos(void)
+{
+    QosConfigure(&g_Qos, GetSettingInt(L"QoS", L"LoadThreshold", 75), LOAD_HYSTERESIS,
+                 GetSettingInt(L"QoS", L"CpuRate", 50));
+}
+
+static DWORD PriorityClassOf(QosPriority priority)
+{
+    switch (priority)
+    {
+    case QOS_PRIORITY_IDLE: return IDLE_PRIORITY_CLASS;
+    case QOS_PRIORITY_LOW:  return BELOW_NORMAL_PRIORITY_CLASS;
+    default:                return NORMAL_PRIORITY_CLASS;
+    }
+}
+
+// Job object shared by all running background tasks, created on first use
+static HANDLE GetBackgroundJob(void)
+{
+    if (g_hBackgroundJob)
+        return g_hBackgroundJob;
+
+    g_hBackgroundJob = CreateJobObjectW(NULL, NULL);
+    if (!g_hBackgroundJob)
+        return NULL;
+
+    UINT memoryMB = GetSettingInt(L"QoS", L"MemoryMB", 0);
+    if (memoryMB)
+    {
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {0};
+        limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_JOB_MEMORY;
+        limits.JobMemoryLimit = (SIZE_T)memoryMB << 20;
+        SetInformationJobObject(g_hBackgroundJob, JobObjectExtendedLimitInformation,
+                                &limits, sizeof(limits));
+    }
+
+    ConfigureQos();
+    SetBackgroundCpuRate(QosCpuRate(&g_Qos));
+    return g_hBackgroundJob;
+}
+
+// Tighten or relax the background limits as the system load crosses the threshold
+static void UpdateThrottle(void)
+{
+    ULONGLONG now = GetTickCount64();
+    if (now - g_LastSampleTick < LOAD_SAMPLE_MS)
+        return;
+    g_LastSampleTick = now;
+
+    UINT load = SampleSystemLoad();
+    ConfigureQos();
+    if (!QosUpdate(&g_Qos, load))
+        return;
+
+    if (g_hBackgroundJob)
+        SetBackgroundCpuRate(QosCpuRate(&g_Qos));
+    for (UINT i = 0; i < g_nRunning; i++)
+    {
+        if (g_Running[i]->qos == QOS_BACKGROUND)
+            SetPriorityClass(g_Running[i]->hProcess, PriorityClassOf(QosPriorityOf(&g_Qos, QOS_BACKGROUND)));
+    }
+}
+
+// The archive's size and the file update happen on the stats worker
+static void RecordTaskStats(const WinRARTask* t, DWORD exitCode)
+{
+    StatsJob* job = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(StatsJob));
+    FILETIME finished;
+    if (!job) return;
+
+    GetSystemTimeAsFileTime(&finished);
+    job->rec.finished = FileTimeToU64(&finished);
+    job->rec.exitCode = exitCode;
+    job->rec.wallMs = t->wallMs;
+    if (t->pszArchivePath)
+    {
+        StringCchCopyW((wchar_t*)job->rec.archive, ARRAYSIZE(job->rec.archive), t->pszArchivePath);
+        job->rec.inBytes = t->bArchiveIsOutput ? t->inBytes : 0;
+        job->bArchiveIsOutput = t->bArchiveIsOutput;
+    }
+
+    // The first record queued starts the worker. If it can't start, what's
+    // queued is dropped, as the worker would on a lock timeout.
+    BOOL first = (InterlockedIncrement(&g_nStatsQueued) == 1);
+    InterlockedPushEntrySList(&g_StatsQueue, &job->entry);
+    if (first && !StartBackgroundThread(StatsThreadProc, NULL))
+        DrainStatsQueue(FALSE);
+}
+
+static DWORD WINAPI DispatcherThreadProc(LPVOID param)
+{
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+
+    for (;;)
+    {
+        WinRARTask* startHead = NULL;
+        WinRARTask** startTail = &startHead;
+
+        UINT nBackground = 0;
+        for (UINT i = 0; i < g_nRunning; i++)
+            nBackground += (g_Running[i]->qos == QOS_BACKGROUND);
+
+        // Pick every queued task whose devices have room: foreground ones
+        // first, so a freed slot never goes to a batch while the user waits,
+        // then background ones, oldest first. Under load background tasks
+        // trickle through one at a time.
+        AcquireSRWLockExclusive(&g_SchedLock);
+        UINT nStarting = 0;
+        BOOL backgroundWaiting = FALSE;
+        for (int qos = QOS_FOREGROUND; qos <= QOS_BACKGROUND; qos++)
+        {
+            WinRARTask* prev = NULL;
+            for (WinRARTask* t = g_PendingHead; t && g_nRunning + nStarting < MAX_RUNNING_TASKS; )
+            {
+                WinRARTask* next = t->next;
+                BOOL held = (t->qos != (QosClass)qos);
+                if (!held && !QosMayStart(&g_Qos, t->qos, nBackground))
+                    held = backgroundWaiting = TRUE;
+                if (!held && TryAcquireDevices(&g_DeviceSlots, t->devices, t->nDevices))
+                {
+                    nBackground += (t->qos == QOS_BACKGROUND);
+                    if (prev) prev->next = next; else g_PendingHead = next;
+                    if (g_PendingTail == t) g_PendingTail = prev;
+                    t->next = NULL;
+                    *startTail = t;
+                    startTail = &t->next;
+                    nStarting++;
+                }
+                else
+                {
+                    prev = t;
+                }
+                t = next;
+            }
+        }
+
+        if (!startHead && g_nRunning == 0 && !g_PendingHead)
+        {
+            // Idle - let the DLL unload. The next queued task starts a new dispatcher.
+            g_DispatcherActive = FALSE;
+            ReleaseSRWLockExclusive(&g_SchedLock);
+            if (g_hBackgroundJob)
+            {
+                CloseHandle(g_hBackgroundJob);
+                g_hBackgroundJob = NULL;
+            }
+            break;
+        }
+        ReleaseSRWLockExclusive(&g_SchedLock);
+
+        while (startHead)
+        {
+            WinRARTask* t = startHead;
+            startHead = t->next;
+
+            HANDLE hJob = (t->qos == QOS_BACKGROUND) ? GetBackgroundJob() : NULL;
+            if (LaunchWinRAR(t->szCmdLine, t->szWorkDir[0] ? t->szWorkDir : NULL, hJob, &t->hProcess))
+            {
+                if (hJob && QosPriorityOf(&g_Qos, t->qos) == QOS_PRIORITY_IDLE)
+                    SetPriorityClass(t->hProcess, IDLE_PRIORITY_CLASS);
+                t->startTick = GetTickCount64();
+                g_Running[g_nRunning++] = t;
+            }
+            else
+            {
+                ReleaseDevices(&g_DeviceSlots, t->devices, t->nDevices);
+                t->onExit(t, (DWORD)-1);
+            }
+        }
+
+        if (g_nRunning == 0)
+            continue;
+
+        for (UINT i = 0; i < g_nRunning; i++)
+            handles[i] = g_Running[i]->hProcess;
+        handles[g_nRunning] = g_hSchedEvent;
+
+        // Watch the load while background work is around
+        DWORD wait = WaitForMultipleObjects(g_nRunning + 1, handles, FALSE,
+                                            (nBackground || backgroundWaiting) ? LOAD_SAMPLE_MS : INFINITE);
+        if (nBackground || backgroundWaiting)
+            UpdateThrottle();
+        if (wait >= WAIT_OBJECT_0 && wait < WAIT_OBJECT_0 + g_nRunning)
+        {
+            WinRARTask* t = g_Running[wait - WAIT_OBJECT_0];
+            DWORD exitCode = (DWORD)-1;
+
+            g_Running[wait - WAIT_OBJECT_0] = g_Running[--g_nRunning];
+            GetExitCodeProcess(t->hProcess, &exitCode);
+            CloseHandle(t->hProcess);
+            t->hProcess = NULL;
+            t->wallMs = (DWORD)(GetTickCount64() - t->startTick);
+            ReleaseDevices(&g_DeviceSlots, t->devices, t->nDevices);
+            RecordTaskStats(t, exitCode);
+            t->onExit(t, exitCode);
+        }
+    }
+
+    ExitBackgroundThread();
+    return 0;
+}
+
+// Queue a task; the dispatcher starts it once its devices are free and calls
+// task->onExit when it's done. The task must stay valid until then.
+static void QueueWinRARTask(WinRARTask* task)
+{
+    task->next = NULL;
+    task->hProcess = NULL;
+
+    AcquireSRWLockExclusive(&g_SchedLock);
+    if (g_PendingTail) g_PendingTail->next = task; else g_PendingHead = task;
+    g_PendingTail = task;
+
+    BOOL startDispatcher = !g_DispatcherActive;
+    g_DispatcherActive = TRUE;
+    ReleaseSRWLockExclusive(&g_SchedLock);
+
+    SetEvent(g_hSchedEvent);
+    if (startDispatcher && !StartBackgroundThread(DispatcherThreadProc, NULL))
+    {
+        // No dispatcher - fail everything that's queued
+        AcquireSRWLockExclusive(&g_SchedLock);
+        WinRARTask* head = g_PendingHead;
+        g_PendingHead = g_PendingTail = NULL;
+        g_DispatcherActive = FALSE;
+        ReleaseSRWLockExclusive(&g_SchedLock);
+
+        while (head)
+        {
+            WinRARTask* t = head;
+            head = t->next;
+            t->onExit(t, (DWORD)-1);
+        }
+    }
+}
+
+//=============================================================================
+// Compression profiles
+//=============================================================================
+// Switches for each zip job are picked from what the walk found: the
+// compression level from the total size and how much of it is already
+// compressed (media, archives), the thread count from the cores left per
+// job of the batch. Only RAR gets the thread count, WinRAR doesn't document
+// -mt for zip. [Profile] Level / Threads in settings.ini override the
+// guess. The archive type is the user's pick: the Zip entries always make
+// zips, and Format=rar adds "RAR to" entries that make solid RAR archives.
+#define PROFILE_AUTO        ((UINT)-1)
+#define PROFILE_MAX_THREADS 32
+
+static INIT_ONCE g_ProfileInit = INIT_ONCE_STATIC_INIT;
+static BOOL g_RarVerb = FALSE;
+
+static BOOL CALLBACK LoadProfileSettings(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+    wchar_t format[8];
+
+    GetSettingString(L"Profile", L"Format", L"zip", format, ARRAYSIZE(format));
+    g_RarVerb = _wcsicmp(format, L"rar") == 0;
+    return TRUE;
+}
+
+// Read once, like the extension list: the menu is built on Explorer's thread
+static BOOL IsRarVerbEnabled(void)
+{
+    InitOnceExecuteOnce(&g_ProfileInit, LoadProfileSettings, NULL, NULL);
+    return g_RarVerb;
+}
+
+typedef struct {
+    UINT level;             // -m0 (store) .. -m5 (best)
+    UINT threads;           // -mt, RAR only
+    BOOL bRar;              // Solid RAR instead of zip
+} ZipProfile;
+
+static const wchar_t g_CompressedExtensions[][EXTENSION_CHARS] = {
+    L".jpg", L".jpeg", L".png", L".gif", L".webp", L".heic", L".avif",
+    L".mp3", L".aac", L".ogg", L".opus", L".flac", L".m4a",
+    L".mp4", L".m4v", L".mkv", L".webm", L".avi", L".mov", L".wmv",
+    L".docx", L".xlsx", L".pptx", L".odt", L".epub", L".jar", L".apk",
+    L".msi", L".cab", L".woff2"
+};
+
+static BOOL IsCompressedFile(const wchar_t* path)
+{
+    return MatchesExtension(path, g_CompressedExtensions, (int)ARRAYSIZE(g_CompressedExtensions)) ||
+           IsArchiveFile(path);
+}
+
+// nParallel: jobs of the batch that may compress at the same time
+static void ChooseZipProfile(const Manifest* m, UINT nParallel, BOOL bRar, ZipProfile* profile)
+{
+    ULONGLONG compressedBytes = 0;
+    SYSTEM_INFO si;
+
+    for (UINT i = 0; i < m->count; i++)
+    {
+        if (!m->entries[i].isDir && IsCompressedFile(m->entries[i].path))
+            compressedBytes += m->entries[i].size;
+    }
+
+    // Mostly compressed data: don't spend time on it. Otherwise trade ratio
+    // for speed as the input grows.
+    if (m->totalBytes && compressedBytes >= m->totalBytes / 10 * 9)
+        profile->level = 0;
+    else if (m->totalBytes < 64ull << 20)
+        profile->level = 5;
+    else if (m->totalBytes < 1ull << 30)
+        profile->level = 3;
+    else if (m->totalBytes < 8ull << 30)
+        profile->level = 2;
+    else
+        profile->level = 1;
+
+    // Small inputs are done before extra threads would pay off
+    GetSystemInfo(&si);
+    profile->threads = max(si.dwNumberOfProcessors / max(nParallel, 1), 1);
+    if (m->totalBytes < 4ull << 20)
+        profile->threads = 1;
+
+    profile->bRar = bRar;
+
+    UINT level = GetSettingInt(L"Profile", L"Level", PROFILE_AUTO);
+    UINT threads = GetSettingInt(L"Profile", L"Threads", 0);
+    if (level <= 5)
+        profile->level = level;
+    if (threads)
+        profile->threads = threads;
+    profile->threads = min(profile->threads, PROFILE_MAX_THREADS);
+}
+
+//=============================================================================
+// Archive check
+//=============================================================================
+// With [Zip] Verify=1 each finished zip is read back before it counts as
+// done: every entry is decompressed from the mapped archive and its CRC
+// compared with the central directory. An entry that can't be read (in-page
+// error) counts as bad. Entries are handed out one at a time
+// to a thread per core, so a few big files don't leave the others idle.
+#define WINRAR_EXIT_CRC 3   // WinRAR's exit code for a CRC error
+
+typedef struct {
+    const ZipReader* zr;
+    const ZipEntry* entries;
+    UINT count;
+    volatile LONG next;
+    volatile LONG nBad;
+} ZipCheck;
+
+typedef struct {
+    DWORD crc;
+    ULONGLONG size;
+} CrcSink;
+
+static int CrcSinkWrite(void* context, const uint8_t* data, size_t len)
+{
+    CrcSink* s = context;
+    s->crc = Crc32Update(s->crc, data, len);
+    s->size += len;
+    return 1;
+}
+
+// *z is allocated on the first deflated entry. Entries that can't be checked
+// here (encrypted, or other methods) pass.
+static BOOL CheckZipEntry(const ZipReader* zr, const ZipEntry* e, Inflater** z)
+{
+    if (e->flags & 1) return TRUE;
+    if (e->method != 0 && e->method != 8) return TRUE;
+
+    // The local header's name and extra field can differ from the central copy
+    ULONGLONG local = e->localOffset;
+    if (local + 30 > zr->cdOffset || ReadLE32(zr->base + local) != 0x04034b50)
+        return FALSE;
+    ULONGLONG data = local + 30 + ReadLE16(zr->base + local + 26) + ReadLE16(zr->base + local + 28);
+    if (data > zr->cdOffset || e->compSize > zr->cdOffset - data)
+        return FALSE;
+
+    if (e->method == 0)
+        return e->compSize == e->size && Crc32Update(0, zr->base + data, (SIZE_T)e->size) == e->crc;
+
+    if (!*z && !(*z = HeapAlloc(GetProcessHeap(), 0, sizeof(Inflater))))
+        return FALSE;
+
+    CrcSink sink = { 0, 0 };
+    return Inflate(*z, zr->base + data, (size_t)e->compSize, NULL, CrcSinkWrite, &sink) == INFLATE_DONE &&
+           sink.size == e->size && sink.crc == e->crc;
+}
+
+static DWORD WINAPI ZipCheckProc(LPVOID param)
+{
+    ZipCheck* check = param;
+    Inflater* z = NULL;
+    LONG i;
+
+    while ((i = InterlockedIncrement(&check->next) - 1) < (LONG)check->count)
+    {
+        BOOL good;
+        __try
+        {
+            good = CheckZipEntry(check->zr, &check->entries[i], &z);
+        }
+        __except (InPageErrorFilter(GetExceptionCode()))
+        {
+            good = FALSE;
+        }
+        if (!good)
+            InterlockedIncrement(&check->nBad);
+    }
+
+    if (z) HeapFree(GetProcessHeap(), 0, z);
+    return 0;
+}
+
+// Returns TRUE if every entry matches; warns with a tray balloon if not
+static BOOL VerifyZipArchive(const wchar_t* archivePath)
+{
+    ZipReader zr;
+    ZipCheck check = {0};
+    ZipEntry* entries = NULL;
+    UINT cap = 0;
+    BOOL ok;
+
+    EnsureCrcTables();
+    TraceBegin("VerifyZip");
+
+    ok = ZipOpen(archivePath, &zr);
+    if (ok)
+    {
+        ULONGLONG pos = zr.cdOffset;
+        ZipEntry e;
+
+        __try
+        {
+            while (ok && pos < zr.cdEnd)
+            {
+                if (!ZipNextEntry(&zr, &pos, &e))
+                {
+                    ok = FALSE;
+                    break;
+                }
+                if (check.count == cap)
+                {
+                    UINT newCap = cap ? cap * 2 : 256;
+                    ZipEntry* grown = entries
+                        ? HeapReAlloc(GetProcessHeap(), 0, entries, newCap * sizeof(ZipEntry))
+                        : HeapAlloc(GetProcessHeap(), 0, newCap * sizeof(ZipEntry));
+                    if (!grown)
+                    {
+                        ok = FALSE;
+                        break;
+                    }
+                    entries = grown;
+                    cap = newCap;
+                }
+                entries[check.count++] = e;
+            }
+        }
+        __except (InPageErrorFilter(GetExceptionCode()))
+        {
+            ok = FALSE;
+        }
+    }
+
+    if (ok && check.count)
+    {
+        HANDLE threads[MAX_WALK_THREADS] = {0};
+        UINT nThreads = min(GetWalkThreadCount(), check.count);
+
+        check.zr = &zr;
+        check.entries = entries;
+
+        // Checker 0 runs on this thread
+        for (UINT t = 1; t < nThreads; t++)
+            threads[t] = CreateThread(NULL, 0, ZipCheckProc, &check, 0, NULL);
+        ZipCheckProc(&check);
+
+        for (UINT t = 1; t < nThreads; t++)
+        {
+            if (threads[t])
+            {
+                WaitForSingleObject(threads[t], INFINITE);
+                CloseHandle(threads[t]);
+            }
+        }
+        ok = (check.nBad == 0);
+    }
+
+    if (entries) HeapFree(GetProcessHeap(), 0, entries);
+    ZipClose(&zr);
+    TraceEnd("VerifyZip");
+
+    if (!ok)
+    {
+        wchar_t text[256];
+        if (check.nBad)
+            StringCchPrintfW(text, ARRAYSIZE(text), L"%s: %u of %u files don't match. Keep the originals.",
+                             FindFileName(archivePath), (UINT)check.nBad, check.count);
+        else
+            StringCchPrintfW(text, ARRAYSIZE(text), L"%s couldn't be read back. Keep the originals.",
+                             FindFileName(archivePath));
+        ShowNotification(L"WinRAR archive check failed", text, TRUE);
+    }
+    return ok;
+}
+
+//=============================================================================
+// Zip jobs
+//=============================================================================
+// Zip commands run on a background thread: walk the sources, write the
+// manifest as a list file and queue WinRAR. The scheduler cleans up once
+// WinRAR exits.
+struct ZipBatch;
+
+// Items from one parent folder, for selections spanning several (search
+// results, libraries). Each part is a WinRAR run in its own folder, adding
+// to the same archive.
+typedef struct {
+    wchar_t szBaseDir[MAX_PATH];
+    UINT firstRoot;                     // Into the job's szRoots
+    UINT nRoots;
+    ListChannel list;
+    ULONGLONG inBytes;
+} ZipPart;
+
+typedef struct {
+    struct ZipBatch* batch;
+    wchar_t szArchivePath[MAX_PATH];
+    wchar_t szBaseDir[MAX_PATH];        // WinRAR's working folder, manifest paths are relative to it
+    wchar_t (*szRoots)[MAX_PATH];       // Selected items relative to szBaseDir
+    UINT nRoots;
+    ZipPart* parts;                     // NULL if every root is in szBaseDir
+    UINT nParts;
+    UINT iPart;                         // Part being added
+    ListChannel list;
+    ListChannel deleteList;             // Incremental: entries to drop once the update is done
+    BOOL bRar;                          // "RAR to": solid RAR instead of zip
+    BOOL bIncremental;
+    BOOL bVerify;                       // Read the zip back once WinRAR is done
+    Manifest manifest;                  // Incremental: becomes the new sidecar
+    wchar_t szAddCommand[32];           // "a" plus the switches of the job's profile
+    WinRARTask task;
+} ZipJob;
+
+typedef struct ZipBatch {
+    ZipJob* jobs;
+    UINT nJobs;
+    volatile LONG nPending;             // Unfinished jobs, plus one for the batch thread
+    volatile LONG nFailed;
+    volatile LONG nUpToDate;            // Incremental jobs with nothing to do
+    volatile LONG64 inBytes;            // Totals of the jobs that succeeded
+    volatile LONG64 outBytes;
+    ULONGLONG startTick;
+} ZipBatch;
+
+static ZipBatch* AllocZipBatch(UINT nJobs)
+{
+    ZipBatch* batch = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(ZipBatch));
+    if (!batch) return NULL;
+
+    batch->jobs = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, nJobs * sizeof(ZipJob));
+    if (!batch->jobs)
+    {
+        HeapFree(GetProcessHeap(), 0, batch);
+        return NULL;
+    }
+    batch->nJobs = nJobs;
+    for (UINT i = 0; i < nJobs; i++)
+        batch->jobs[i].batch = batch;
+    return batch;
+}
+
+static void FreeZipBatch(ZipBatch* batch)
+{
+    for (UINT i = 0; i < batch->nJobs; i++)
+    {
+        if (batch->jobs[i].szRoots)
+            HeapFree(GetProcessHeap(), 0, batch->jobs[i].szRoots);
+        if (batch->jobs[i].parts)
+            HeapFree(GetProcessHeap(), 0, batch->jobs[i].parts);
+        ManifestFree(&batch->jobs[i].manifest);
+    }
+    HeapFree(GetProcessHeap(), 0, batch->jobs);
+    HeapFree(GetProcessHeap(), 0, batch);
+}
+
+static void ReleaseZipBatch(ZipBatch* batch)
+{
+    if (InterlockedDecrement(&batch->nPending) != 0)
+        return;
+
+    if (batch->nJobs > 1)
+        ShowBatchSummary(batch->nJobs, batch->nFailed, batch->nUpToDate, batch->inBytes,
+                         batch->outBytes, GetTickCount64() - batch->startTick);
+    FreeZipBatch(batch);
+}
+
+static void OnZipTaskExit(WinRARTask* task, DWORD exitCode);
+
+// What StartZipJob did
+#define ZIP_QUEUED     0  // WinRAR is queued, OnZipTaskExit takes it from there
+#define ZIP_EMPTY      1  // Nothing to add, everything was filtered out
+#define ZIP_FAILED     2  // The walk, the list or the command line failed; nothing ran
+#define ZIP_UP_TO_DATE 3  // Incremental, and nothing changed since the sidecar
+
+// Queue "WinRAR <command> <archive> @<job->list>" to run in the job's base folder
+// inBytes: size of what the list adds, for the stats. FALSE if the command
+// line doesn't fit.
+static BOOL QueueZipCommand(ZipJob* job, const wchar_t* command, ULONGLONG inBytes)
+{
+    WinRARTask* task = &job->task;
+
+    // Batches ("zip each folder") yield to whatever the user is doing,
+    // down to their disk I/O: WinRAR's lowest I/O priority with [QoS]
+    // IoSleepMs between its reads and writes
+    wchar_t ioPriority[32] = L"";
+    task->qos = (job->batch->nJobs > 1 && GetSettingInt(L"QoS", L"Background", 1))
+        ? QOS_BACKGROUND : QOS_FOREGROUND;
+    if (task->qos == QOS_BACKGROUND)
+        StringCchPrintfW(ioPriority, ARRAYSIZE(ioPriority), L" -ri1:%u",
+                         min(GetSettingInt(L"QoS", L"IoSleepMs", 10), 1000));
+
+    // Paths in the list are relative to the working folder, so no -ep1. The
+    // list names every file: -r- keeps WinRAR from recursing into the
+    // folders listed as empty, which would bring filtered files back.
+    wchar_t fullCommand[96];
+    if (FAILED(StringCchPrintfW(fullCommand, ARRAYSIZE(fullCommand), L"%s -r-%s", command, ioPriority)) ||
+        !FormatListCommand(task->szCmdLine, ARRAYSIZE(task->szCmdLine),
+                           g_WinRARPath, fullCommand, job->szArchivePath, job->list.szPath))
+        return FALSE;
+    StringCchCopyW(task->szWorkDir, MAX_PATH, job->szBaseDir);
+    task->pszArchivePath = job->szArchivePath;
+    task->bArchiveIsOutput = TRUE;
+    task->inBytes = inBytes;
+    task->onExit = OnZipTaskExit;
+    task->context = job;
+    QueueWinRARTask(task);
+    return TRUE;
+}
+
+// Picks the job's devices and its add command from the walked manifest.
+// Returns TRUE if it's a RAR archive.
+static BOOL ChooseZipCommand(ZipJob* job)
+{
+    ZipProfile profile;
+
+    // Jobs of a batch on the same disks share the cores
+    UINT nParallel = job->batch->nJobs;
+    SetTaskDevices(&job->task, job->szBaseDir, job->szArchivePath);
+    for (UINT i = 0; i < job->task.nDevices; i++)
+        nParallel = min(nParallel, job->task.devices[i].limit);
+    ChooseZipProfile(&job->manifest, nParallel, job->bRar, &profile);
+
+    if (profile.bRar)
+    {
+        StringCchPrintfW(job->szAddCommand, ARRAYSIZE(job->szAddCommand),
+            L"a -s -m%u -mt%u", profile.level, profile.threads);
+    }
+    else
+    {
+        StringCchPrintfW(job->szAddCommand, ARRAYSIZE(job->szAddCommand),
+            L"a -afzip -m%u", profile.level);
+    }
+    job->bVerify = !profile.bRar && GetSettingInt(L"Zip", L"Verify", 0) != 0;
+    return profile.bRar;
+}
+
+static BOOL HasNextZipPart(ZipJob* job)
+{
+    // Skip parts whose items were all filtered out
+    while (job->iPart < job->nParts && !job->parts[job->iPart].list.szPath[0])
+        job->iPart++;
+    return job->iPart < job->nParts;
+}
+
+// Queue the part HasNextZipPart found
+static BOOL QueueNextZipPart(ZipJob* job)
+{
+    ZipPart* part = &job->parts[job->iPart++];
+
+    CloseListChannel(&job->list);
+    job->list = part->list;
+    ZeroMemory(&part->list, sizeof(part->list));
+    StringCchCopyW(job->szBaseDir, MAX_PATH, part->szBaseDir);
+    return QueueZipCommand(job, job->szAddCommand, part->inBytes);
+}
+
+// Every part is walked and listed up front, so moving on to the next one
+// is quick enough for the dispatcher thread
+static DWORD StartZipParts(ZipJob* job)
+{
+    for (UINT i = 0; i < job->nParts; i++)
+    {
+        ZipPart* part = &job->parts[i];
+        Manifest m;
+
+        if (!BuildManifest(part->szBaseDir, job->szRoots + part->firstRoot, part->nRoots,
+                           GetPathFilter(), &m))
+            return ZIP_FAILED;
+
+        part->inBytes = m.totalBytes;
+        BOOL ok = (m.count == 0 || OpenListChannel(&part->list, &m)) && ManifestMerge(&job->manifest, &m);
+        ManifestFree(&m);
+        if (!ok) return ZIP_FAILED;
+    }
+    if (job->manifest.count == 0)
+        return ZIP_EMPTY;
+
+    // No sidecar: its paths would be relative to a single folder
+    ChooseZipCommand(job);
+    job->iPart = 0;
+    return (HasNextZipPart(job) && QueueNextZipPart(job)) ? ZIP_QUEUED : ZIP_FAILED;
+}
+
+// Returns one of the ZIP_* results
+static DWORD StartZipJob(ZipJob* job)
+{
+    Manifest old, changed, deleted;
+    BOOL touched;
+
+    if (job->parts)
+        return StartZipParts(job);
+
+    if (!BuildManifest(job->szBaseDir, job->szRoots, job->nRoots, GetPathFilter(), &job->manifest))
+        return ZIP_FAILED;
+    if (job->manifest.count == 0)
+        return ZIP_EMPTY;
+
+    // Sidecars are checked against the zip central directory
+    job->bIncremental = !ChooseZipCommand(job) && GetSettingInt(L"Zip", L"Incremental", 0) != 0;
+    if (job->bIncremental)
+        ManifestSort(&job->manifest);
+
+    if (!job->bIncremental || !LoadSidecar(job->szArchivePath, &old))
+    {
+        return (OpenListChannel(&job->list, &job->manifest) &&
+                QueueZipCommand(job, job->szAddCommand, job->manifest.totalBytes))
+            ? ZIP_QUEUED : ZIP_FAILED;
+    }
+
+    const wchar_t* command = job->szAddCommand;
+    ULONGLONG inBytes = 0;
+    DWORD result = ZIP_FAILED;
+    BOOL ok = DiffManifests(job->szBaseDir, &job->manifest, &old, &changed, &deleted, &touched);
+    if (ok && changed.count == 0 && deleted.count == 0)
+    {
+        // Up to date - just remember new timestamps so the CRCs aren't redone next time
+        if (touched)
+            SaveSidecar(job->szArchivePath, &job->manifest);
+        result = ZIP_UP_TO_DATE;
+        ok = FALSE;
+    }
+    else if (ok)
+    {
+        // Changed entries are re-added (replacing the old copies), then vanished ones deleted
+        inBytes = changed.totalBytes;
+        if (changed.count)
+            ok = OpenListChannel(&job->list, &changed);
+        if (ok && deleted.count)
+            ok = OpenListChannel(&job->deleteList, &deleted);
+
+        if (ok && !changed.count)
+        {
+            job->list = job->deleteList;
+            ZeroMemory(&job->deleteList, sizeof(job->deleteList));
+            command = L"d";
+        }
+    }
+
+    ManifestFree(&changed);
+    ManifestFree(&deleted);
+    ManifestFree(&old);
+
+    if (ok)
+        result = QueueZipCommand(job, command, inBytes) ? ZIP_QUEUED : ZIP_FAILED;
+    return result;
+}
+
+// Cleanup once the job's last WinRAR run is over (ran = FALSE if there was
+// none; a non-zero exitCode then means the job couldn't be started)
+static void FinishZipJob(ZipJob* job, BOOL ran, DWORD exitCode)
+{
+    // A sidecar that doesn't match the archive is worse than none
+    if (ran && job->bIncremental)
+    {
+        wchar_t sidecarPath[MAX_PATH];
+        if (exitCode != 0 || !FillCrcsFromArchive(job->szArchivePath, &job->manifest) ||
+            !SaveSidecar(job->szArchivePath, &job->manifest))
+        {
+            GetSidecarPath(job->szArchivePath, sidecarPath);
+            SetFileAttributesW(sidecarPath, FILE_ATTRIBUTE_NORMAL);
+            DeleteFileW(sidecarPath);
+        }
+    }
+
+    if (exitCode != 0)
+    {
+        InterlockedIncrement(&job->batch->nFailed);
+    }
+    else if (ran)
+    {
+        InterlockedAdd64(&job->batch->inBytes, job->manifest.totalBytes);
+        InterlockedAdd64(&job->batch->outBytes, GetFileSize64(job->szArchivePath));
+    }
+
+    CloseListChannel(&job->list);
+    CloseListChannel(&job->deleteList);
+    for (UINT i = 0; i < job->nParts; i++)
+        CloseListChannel(&job->parts[i].list);
+    ManifestFree(&job->manifest);
+    ReleaseZipBatch(job->batch);
+}
+
+static DWORD WINAPI VerifyZipThreadProc(LPVOID param)
+{
+    ZipJob* job = param;
+
+    // A bad archive counts as failed, like WinRAR's own CRC error
+    FinishZipJob(job, TRUE, VerifyZipArchive(job->szArchivePath) ? 0 : WINRAR_EXIT_CRC);
+    ExitBackgroundThread();
+    return 0;
+}
+
+static void OnZipTaskExit(WinRARTask* task, DWORD exitCode)
+{
+    ZipJob* job = task->context;
+
+    // A selection spanning folders is added one folder at a time.
+    // A follow-up run that can't be queued fails the job.
+    if (exitCode == 0 && job->parts && HasNextZipPart(job))
+    {
+        if (QueueNextZipPart(job))
+            return;
+        exitCode = (DWORD)-1;
+    }
+
+    // Deletions go second, on the updated archive
+    if (exitCode == 0 && job->deleteList.szPath[0])
+    {
+        CloseListChannel(&job->list);
+        job->list = job->deleteList;
+        ZeroMemory(&job->deleteList, sizeof(job->deleteList));
+        if (QueueZipCommand(job, L"d", 0))
+            return;
+        exitCode = (DWORD)-1;
+    }
+
+    // Reading the whole archive back is slow, keep it off the dispatcher
+    if (exitCode == 0 && job->bVerify && StartBackgroundThread(VerifyZipThreadProc, job))
+        return;
+
+    FinishZipJob(job, TRUE, exitCode);
+}
+
+static DWORD WINAPI ZipBatchThreadProc(LPVOID param)
+{
+    ZipBatch* batch = param;
+
+    // Each job is queued as soon as its tree is walked; the scheduler decides
+    // how many run at once
+    batch->nPending = batch->nJobs + 1;
+    batch->startTick = GetTickCount64();
+    for (UINT i = 0; i < batch->nJobs; i++)
+    {
+        ZipJob* job = &batch->jobs[i];
+        DWORD result = StartZipJob(job);
+
+        if (result == ZIP_FAILED)
+        {
+            // WinRAR reports its own errors, this one would go unnoticed.
+            // Batches count it in their summary.
+            if (batch->nJobs == 1)
+            {
+                wchar_t text[MAX_PATH + 64];
+                StringCchPrintfW(text, ARRAYSIZE(text),
+                    L"%s wasn't made: not everything selected could be listed.",
+                    FindFileName(job->szArchivePath));
+                ShowNotification(L"WinRAR", text, TRUE);
+            }
+            FinishZipJob(job, FALSE, (DWORD)-1);
+        }
+        else if (result == ZIP_UP_TO_DATE)
+        {
+            // No WinRAR window either, so say why nothing seems to happen
+            if (batch->nJobs == 1)
+            {
+                wchar_t text[MAX_PATH + 64];
+                StringCchPrintfW(text, ARRAYSIZE(text),
+                    L"%s is up to date: nothing changed since it was made.",
+                    FindFileName(job->szArchivePath));
+                ShowNotification(L"WinRAR", text, FALSE);
+            }
+            InterlockedIncrement(&batch->nUpToDate);
+            FinishZipJob(job, FALSE, 0);
+        }
+        else if (result != ZIP_QUEUED)
+        {
+            FinishZipJob(job, FALSE, 0);
+        }
+    }
+    ReleaseZipBatch(batch);
+
+    ExitBackgroundThread();
+    return 0;
+}
+
+// Roots of a job adding the selected items under their own names. Items
+// from several folders are grouped into parts, one per parent folder.
+static BOOL SetZipRoots(ZipJob* job, const wchar_t** paths, UINT count)
+{
+    wchar_t (*parents)[MAX_PATH] = HeapAlloc(GetProcessHeap(), 0, count * sizeof(wchar_t[MAX_PATH]));
+    BYTE* placed = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, count);
+    UINT nParts = 0, nPlaced = 0;
+    BOOL oneFolder = TRUE, ok = FALSE;
+
+    job->szRoots = HeapAlloc(GetProcessHeap(), 0, count * sizeof(wchar_t[MAX_PATH]));
+    if (!parents || !placed || !job->szRoots)
+        goto done;
+
+    for (UINT i = 0; i < count; i++)
+    {
+        StringCchCopyW(parents[i], MAX_PATH, paths[i]);
+        PathRemoveFileSpecW(parents[i]);
+        oneFolder = oneFolder && _wcsicmp(parents[i], parents[0]) == 0;
+    }
+
+    if (oneFolder)
+    {
+        StringCchCopyW(job->szBaseDir, MAX_PATH, parents[0]);
+        for (UINT i = 0; i < count; i++)
+            StringCchCopyW(job->szRoots[i], MAX_PATH, FindFileName(paths[i]));
+        job->nRoots = count;
+        ok = TRUE;
+        goto done;
+    }
+
+    // Parts in the order their first item was selected
+    job->parts = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, count * sizeof(ZipPart));
+    if (!job->parts)
+        goto done;
+
+    for (UINT i = 0; i < count; i++)
+    {
+        if (placed[i]) continue;
+
+        ZipPart* part = &job->parts[nParts++];
+        StringCchCopyW(part->szBaseDir, MAX_PATH, parents[i]);
+        part->firstRoot = nPlaced;
+        for (UINT j = i; j < count; j++)
+        {
+            if (!placed[j] && _wcsicmp(parents[j], parents[i]) == 0)
+            {
+                StringCchCopyW(job->szRoots[nPlaced++], MAX_PATH, FindFileName(paths[j]));
+                placed[j] = TRUE;
+            }
+        }
+        part->nRoots = nPlaced - part->firstRoot;
+    }
+    job->nParts = nParts;
+    job->nRoots = count;
+    StringCchCopyW(job->szBaseDir, MAX_PATH, job->parts[0].szBaseDir);
+    ok = TRUE;
+
+done:
+    if (parents) HeapFree(GetProcessHeap(), 0, parents);
+    if (placed) HeapFree(GetProcessHeap(), 0, placed);
+    return ok;
+}
+
+// Hand the batch to a background thread; takes ownership of batch
+static HRESULT StartZipBatch(ZipBatch* batch)
+{
+    if (!StartBackgroundThread(ZipBatchThreadProc, batch))
+    {
+        FreeZipBatch(batch);
+        return E_FAIL;
+    }
+    return S_OK;
+}
+
+//=============================================================================
+// Extraction ledger
+//=============================================================================
+// "Extract to" records what each archive produced, keyed by the archive's
+// identity: volume serial, file ID, size, mtime and, with [Extract]
+// HashArchive=1, a CRC of the whole archive. Extracting the same archive
+// into the same folder again only restores what is missing or modified
+// there, or does nothing at all. A stat sweep is enough to tell, the
+// extracted data isn't read back. After such a restore only the entries
+// WinRAR actually rewrote are updated in the record: files the user added
+// stay out of it, and an overwrite the user declined stays stale.
+// Each destination of an archive has its own record. Records not used for
+// LEDGER_MAX_AGE_DAYS, or whose folder is gone, are pruned once a session.
+// [Extract] Ledger=0 turns this off.
+#define LEDGER_MAGIC      0x314C5851  // "QXL1"
+#define LEDGER_MAX_AGE_DAYS 90
+#define PARALLEL_STAT_MIN 256
+
+typedef struct {
+    DWORD magic;
+    DWORD count;
+    DWORD volumeSerial;
+    DWORD fileIndexHigh;
+    DWORD fileIndexLow;
+    DWORD contentCrc;
+    ULONGLONG archiveSize;
+    FILETIME archiveMtime;
+    wchar_t szDestFolder[MAX_PATH];
+} LedgerHeader;
+
+// What a recorded entry looked like on disk
+typedef struct {
+    ULONGLONG size;
+    FILETIME mtime;
+    BOOL exists;
+    BOOL isDir;
+} DiskState;
+
+typedef struct {
+    wchar_t szArchivePath[MAX_PATH];
+    wchar_t szDestFolder[MAX_PATH];
+    ListChannel list;           // Entries to restore, if the ledger knows the folder
+    BOOL bRecord;               // Save the output to the ledger once WinRAR succeeds
+    LedgerHeader key;
+    Manifest recorded;          // Restore: the ledger's entries, updated once WinRAR is done
+    DiskState* states;          // Restore: each recorded entry before WinRAR ran
+    WinRARTask task;
+} ExtractJob;
+
+typedef struct {
+    const wchar_t* root;
+    const Manifest* m;
+    DiskState* states;
+    UINT first;
+    UINT last;
+} StatSweep;
+
+static BOOL GetArchiveIdentity(const wchar_t* archivePath, LedgerHeader* key)
+{
+    BY_HANDLE_FILE_INFORMATION info;
+    HANDLE hFile = CreateFileW(archivePath, FILE_READ_ATTRIBUTES,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    BOOL ok = GetFileInformationByHandle(hFile, &info);
+    CloseHandle(hFile);
+    if (!ok) return FALSE;
+
+    ZeroMemory(key, sizeof(*key));
+    key->magic = LEDGER_MAGIC;
+    key->volumeSerial = info.dwVolumeSerialNumber;
+    key->fileIndexHigh = info.nFileIndexHigh;
+    key->fileIndexLow = info.nFileIndexLow;
+    key->archiveSize = ((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    key->archiveMtime = info.ftLastWriteTime;
+
+    if (GetSettingInt(L"Extract", L"HashArchive", 0))
+        return Crc32File(archivePath, &key->contentCrc);
+    return TRUE;
+}
+
+static BOOL LedgerKeyMatches(const LedgerHeader* key, const LedgerHeader* rec)
+{
+    return rec->volumeSerial == key->volumeSerial &&
+           rec->fileIndexHigh == key->fileIndexHigh &&
+           rec->fileIndexLow == key->fileIndexLow &&
+           rec->contentCrc == key->contentCrc &&
+           rec->archiveSize == key->archiveSize &&
+           CompareFileTime(&rec->archiveMtime, &key->archiveMtime) == 0 &&
+           _wcsicmp(rec->szDestFolder, key->szDestFolder) == 0;
+}
+
+// One ledger file per archive and destination:
+// %APPDATA%\...\ledger\<serial><file id>-<folder hash>.ledger
+static BOOL GetLedgerPath(const LedgerHeader* key, BOOL create, wchar_t* out)
+{
+    wchar_t name[40];
+
+    if (!GetSettingsPath(L"ledger", out))
+        return FALSE;
+    if (create)
+        SHCreateDirectoryExW(NULL, out, NULL);
+
+    StringCchPrintfW(name, ARRAYSIZE(name), L"%08X%08X%08X-%08X.ledger",
+        key->volumeSerial, key->fileIndexHigh, key->fileIndexLow, HashString(key->szDestFolder));
+    return PathAppendW(out, name);
+}
+
+// A record that's used again is kept from pruning
+static void TouchLedger(const wchar_t* ledgerPath)
+{
+    HANDLE hFile = CreateFileW(ledgerPath, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                               NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return;
+
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    SetFileTime(hFile, NULL, NULL, &now);
+    CloseHandle(hFile);
+}
+
+// Delete records unused for LEDGER_MAX_AGE_DAYS or whose destination
+// folder no longer exists. Records of other formats go too.
+static void PruneLedgers(void)
+{
+    static volatile LONG pruned;
+    wchar_t dir[MAX_PATH], path[MAX_PATH];
+    WIN32_FIND_DATAW fd;
+    ULARGE_INTEGER now, cutoff;
+
+    if (InterlockedExchange(&pruned, 1) || !GetSettingsPath(L"ledger", dir) ||
+        FAILED(StringCchPrintfW(path, ARRAYSIZE(path), L"%s\\*.ledger", dir)))
+        return;
+
+    GetSystemTimeAsFileTime((FILETIME*)&now);
+    cutoff.QuadPart = now.QuadPart - (ULONGLONG)LEDGER_MAX_AGE_DAYS * 24 * 3600 * 10000000;
+
+    HANDLE hFind = FindFirstFileW(path, &fd);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+    do
+    {
+        ULARGE_INTEGER written;
+        LedgerHeader hdr;
+        DWORD read = 0;
+
+        if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+            FAILED(StringCchPrintfW(path, ARRAYSIZE(path), L"%s\\%s", dir, fd.cFileName)))
+            continue;
+
+        written.LowPart = fd.ftLastWriteTime.dwLowDateTime;
+        written.HighPart = fd.ftLastWriteTime.dwHighDateTime;
+        BOOL keep = written.QuadPart >= cutoff.QuadPart;
+        if (keep)
+        {
+            HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+            if (hFile == INVALID_HANDLE_VALUE) continue;   // In use
+            keep = ReadFile(hFile, &hdr, sizeof(hdr), &read, NULL) && read == sizeof(hdr) &&
+                   hdr.magic == LEDGER_MAGIC;
+            CloseHandle(hFile);
+            hdr.szDestFolder[MAX_PATH - 1] = L'\0';
+            keep = keep && PathIsDirectoryW(hdr.szDestFolder);
+        }
+        if (!keep)
+            DeleteFileW(path);
+    } while (FindNextFileW(hFind, &fd));
+    FindClose(hFind);
+}
+
+// root is the long-path form of the output folder
+static void StatEntry(const wchar_t* root, const ManifestEntry* e, DiskState* state)
+{
+    wchar_t path[WALK_PATH_CHARS];
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+
+    ZeroMemory(state, sizeof(*state));
+    StringCchPrintfW(path, ARRAYSIZE(path), L"%s\\%s", root, e->path);
+    if (GetFileAttributesExW(path, GetFileExInfoStandard, &fad))
+    {
+        state->exists = TRUE;
+        state->isDir = (fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        state->size = ((ULONGLONG)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+        state->mtime = fad.ftLastWriteTime;
+    }
+}
+
+// Folders only need to exist, files must have the recorded size and time
+static BOOL StateMatches(const DiskState* state, ULONGLONG size, FILETIME mtime, BOOL isDir)
+{
+    return state->exists && state->isDir == isDir &&
+           (isDir || (state->size == size && CompareFileTime(&state->mtime, &mtime) == 0));
+}
+
+static DWORD WINAPI StatSweepProc(LPVOID param)
+{
+    StatSweep* sweep = param;
+
+    for (UINT i = sweep->first; i < sweep->last; i++)
+        StatEntry(sweep->root, &sweep->m->entries[i], &sweep->states[i]);
+    return 0;
+}
+
+// Stat every recorded entry under destFolder, spread across cores for big
+// outputs, and collect the missing or modified ones into stale. *pStates
+// gets what each entry looked like.
+static BOOL FindStaleEntries(const wchar_t* destFolder, const Manifest* m, Manifest* stale,
+                             DiskState** pStates)
+{
+    wchar_t* root = HeapAlloc(GetProcessHeap(), 0, WALK_PATH_CHARS * sizeof(wchar_t));
+    DiskState* states = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, (m->count + 1) * sizeof(DiskState));
+    StatSweep sweeps[MAX_WALK_THREADS];
+    HANDLE threads[MAX_WALK_THREADS] = {0};
+    BOOL ok = (root && states);
+
+    ZeroMemory(stale, sizeof(*stale));
+    *pStates = NULL;
+
+    if (ok)
+    {
+        UINT nThreads = (m->count >= PARALLEL_STAT_MIN) ? GetWalkThreadCount() : 1;
+        UINT chunk = (m->count + nThreads - 1) / nThreads;
+
+        GetLongPath(destFolder, root, WALK_PATH_CHARS);
+        for (UINT t = 0; t < nThreads; t++)
+        {
+            sweeps[t].root = root;
+            sweeps[t].m = m;
+            sweeps[t].states = states;
+            sweeps[t].first = min(t * chunk, m->count);
+            sweeps[t].last = min((t + 1) * chunk, m->count);
+        }
+
+        // Sweep 0 runs on this thread, as does any sweep that didn't get one
+        for (UINT t = 1; t < nThreads; t++)
+        {
+            threads[t] = CreateThread(NULL, 0, StatSweepProc, &sweeps[t], 0, NULL);
+            if (!threads[t])
+                StatSweepProc(&sweeps[t]);
+        }
+        StatSweepProc(&sweeps[0]);
+
+        for (UINT t = 1; t < nThreads; t++)
+        {
+            if (threads[t])
+            {
+                WaitForSingleObject(threads[t], INFINITE);
+                CloseHandle(threads[t]);
+            }
+        }
+
+        for (UINT i = 0; i < m->count && ok; i++)
+        {
+            const ManifestEntry* e = &m->entries[i];
+            if (!StateMatches(&states[i], e->size, e->mtime, e->isDir))
+                ok = ManifestAddRef(stale, e);
+        }
+    }
+
+    if (root) HeapFree(GetProcessHeap(), 0, root);
+    if (ok)
+        *pStates = states;
+    else if (states)
+        HeapFree(GetProcessHeap(), 0, states);
+    return ok;
+}
+
+// After a restore: take on the new state of the entries that were stale
+// and that WinRAR rewrote. Entries it skipped keep their recorded state.
+static void UpdateRestoredEntries(ExtractJob* job)
+{
+    wchar_t* root = HeapAlloc(GetProcessHeap(), 0, WALK_PATH_CHARS * sizeof(wchar_t));
+    if (!root) return;
+
+    GetLongPath(job->szDestFolder, root, WALK_PATH_CHARS);
+    for (UINT i = 0; i < job->recorded.count; i++)
+    {
+        ManifestEntry* e = &job->recorded.entries[i];
+        const DiskState* before = &job->states[i];
+        DiskState now;
+
+        if (StateMatches(before, e->size, e->mtime, e->isDir))
+            continue;
+        StatEntry(root, e, &now);
+        if (now.exists && now.isDir == e->isDir &&
+            (!before->exists || !StateMatches(before, now.size, now.mtime, now.isDir)))
+        {
+            job->recorded.totalBytes += now.size - e->size;
+            e->size = now.size;
+            e->mtime = now.mtime;
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, root);
+}
+
+static void FreeExtractJob(ExtractJob* job)
+{
+    CloseListChannel(&job->list);
+    ManifestFree(&job->recorded);
+    if (job->states) HeapFree(GetProcessHeap(), 0, job->states);
+    HeapFree(GetProcessHeap(), 0, job);
+}
+
+static DWORD WINAPI RecordLedgerThreadProc(LPVOID param)
+{
+    ExtractJob* job = param;
+    wchar_t ledgerPath[MAX_PATH];
+
+    if (job->states)
+    {
+        // Restore: the recorded output, with what WinRAR put back
+        UpdateRestoredEntries(job);
+        if (GetLedgerPath(&job->key, TRUE, ledgerPath))
+            SaveManifestFile(ledgerPath, &job->key, sizeof(job->key), &job->recorded, FILE_ATTRIBUTE_NORMAL);
+    }
+    else if (GetLedgerPath(&job->key, TRUE, ledgerPath))
+    {
+        wchar_t root[1][MAX_PATH] = { L"" };
+        Manifest output;
+
+        if (BuildManifest(job->szDestFolder, root, 1, NULL, &output))
+        {
+            SaveManifestFile(ledgerPath, &job->key, sizeof(job->key), &output, FILE_ATTRIBUTE_NORMAL);
+            ManifestFree(&output);
+        }
+    }
+
+    PruneLedgers();
+    FreeExtractJob(job);
+    ExitBackgroundThread();
+    return 0;
+}
+
+static void OnExtractTaskExit(WinRARTask* task, DWORD exitCode)
+{
+    ExtractJob* job = task->context;
+
+    // Walking the output is slow, keep it off the dispatcher
+    if (exitCode == 0 && job->bRecord &&
+        StartBackgroundThread(RecordLedgerThreadProc, job))
+        return;
+
+    FreeExtractJob(job);
+}
+
+static DWORD WINAPI ExtractThreadProc(LPVOID param)
+{
+    ExtractJob* job = param;
+    LedgerHeader rec;
+    wchar_t ledgerPath[MAX_PATH];
+    Manifest stale = {0};
+    BOOL queued = FALSE;
+
+    BOOL useLedger = GetSettingInt(L"Extract", L"Ledger", 1) &&
+                     GetArchiveIdentity(job->szArchivePath, &job->key);
+    if (useLedger)
+        StringCchCopyW(job->key.szDestFolder, MAX_PATH, job->szDestFolder);
+
+    // Only an output folder that held nothing else can be recorded as the archive's output
+    BOOL fresh = !PathFileExistsW(job->szDestFolder) || PathIsDirectoryEmptyW(job->szDestFolder);
+    BOOL known = useLedger && !fresh &&
+                 GetLedgerPath(&job->key, FALSE, ledgerPath) &&
+                 LoadManifestFile(ledgerPath, LEDGER_MAGIC, &rec, sizeof(rec), &job->recorded) &&
+                 LedgerKeyMatches(&job->key, &rec);
+
+    if (known)
+    {
+        if (!FindStaleEntries(job->szDestFolder, &job->recorded, &stale, &job->states))
+            known = FALSE;
+        else if (stale.count == 0)
+        {
+            // Folder still holds exactly what this archive gives. No
+            // WinRAR window either, so say why nothing seems to happen.
+            wchar_t text[2 * MAX_PATH + 64];
+            StringCchPrintfW(text, ARRAYSIZE(text), L"%s is already extracted to %s, unchanged.",
+                FindFileName(job->szArchivePath), job->szDestFolder);
+            ShowNotification(L"WinRAR", text, FALSE);
+            TouchLedger(ledgerPath);
+            goto done;
+        }
+        else if (!OpenListChannel(&job->list, &stale))
+            known = FALSE;
+    }
+
+    // With a ledger, restore just the missing/modified entries. No -o+:
+    // WinRAR still asks before overwriting files that were edited since.
+    if (!FormatExtractCommand(job->task.szCmdLine, ARRAYSIZE(job->task.szCmdLine),
+            g_WinRARPath, job->szArchivePath, known ? job->list.szPath : NULL, job->szDestFolder))
+        goto done;
+    CreateDirectoryW(job->szDestFolder, NULL);
+
+    job->bRecord = useLedger && (fresh || known);
+    if (!known)
+    {
+        // A full run is recorded from a walk of the output
+        ManifestFree(&job->recorded);
+        if (job->states) HeapFree(GetProcessHeap(), 0, job->states);
+        job->states = NULL;
+    }
+    SetTaskDevices(&job->task, job->szArchivePath, job->szDestFolder);
+    job->task.pszArchivePath = job->szArchivePath;
+    job->task.onExit = OnExtractTaskExit;
+    job->task.context = job;
+    QueueWinRARTask(&job->task);
+    queued = TRUE;
+
+done:
+    ManifestFree(&stale);
+    if (!queued)
+        FreeExtractJob(job);
+    ExitBackgroundThread();
+    return 0;
+}
+
+//=============================================================================
+// Convert to zip
+//=============================================================================
+// "Convert to .zip" for .tar, .tar.gz/.tgz and .gz archives, done in-process
+// with nothing extracted to disk. One thread reads the archive (gunzip, tar)
+// while another deflates into the zip; entries pass between them through a
+// few fixed-size slots, so whichever side is faster waits for the other.
+// The zip is written under a temporary name, renamed once complete, and
+// never replaces an existing file.
+#define CONVERT_SLOTS       8
+#define CONVERT_CHUNK       (256 * 1024)
+#define ZIP_WRITE_BUFFER    (1024 * 1024)
+#define ZIP64_THRESHOLD     0xC0000000ULL   // Bigger entries might not fit 32-bit sizes once deflated
+#define ZIP_EXTRA_RESERVE   0x5157          // Private extra field ID: room for a zip64 one
+#define CONVERT_SIZE_UNKNOWN ((ULONGLONG)-1)
+
+static const wchar_t g_ConvertExtensions[][EXTENSION_CHARS] = { L".tar", L".tgz", L".gz" };
+
+typedef enum {
+    CONVERT_BEGIN,          // data: entry name
+    CONVERT_DATA,
+    CONVERT_END,
+    CONVERT_DONE,           // Last item of a complete archive
+    CONVERT_FAILED          // Last item otherwise
+} ConvertItemType;
+
+typedef struct {
+    ConvertItemType type;
+    BOOL isDir;
+    ULONGLONG size;         // BEGIN: entry size, or CONVERT_SIZE_UNKNOWN
+    LONGLONG mtime;         // BEGIN: Unix time
+    UINT len;
+    BYTE* data;             // CONVERT_CHUNK bytes
+} ConvertItem;
+
+// Zip output. Local headers are followed by data descriptors, since the
+// CRC and compressed size are only known after the data.
+typedef struct {
+    HANDLE hFile;
+    BOOL ok;
+    BYTE* buf;
+    UINT used;
+    ULONGLONG offset;               // Bytes written so far
+    BYTE* cd;                       // Central directory, written at the end
+    SIZE_T cdSize;
+    SIZE_T cdCap;
+    ULONGLONG count;
+    Deflater* deflater;
+
+    // Entry being written
+    char name[TAR_NAME_MAX + 2];
+    UINT nameLen;
+    WORD flags;
+    WORD method;
+    DWORD dosTime;                  // Date in the high word
+    BOOL isDir;
+    BOOL zip64;
+    BOOL sizeUnknown;               // Local header has room to turn zip64
+    ULONGLONG localOffset;
+    ULONGLONG dataStart;
+    ULONGLONG size;
+    DWORD crc;
+} ZipWriter;
+
+typedef struct {
+    wchar_t szArchivePath[MAX_PATH];
+    wchar_t szZipPath[MAX_PATH];
+    wchar_t szTempPath[MAX_PATH];
+    BOOL bTar;
+    BOOL bGzip;
+
+    // Slots from the reader to the writer
+    SRWLOCK lock;
+    CONDITION_VARIABLE notFull;
+    CONDITION_VARIABLE notEmpty;
+    ConvertItem items[CONVERT_SLOTS];
+    UINT head;
+    UINT count;
+    BYTE* slotData;
+
+    // Reader
+    ConvertItem* open;              // DATA item being filled
+    TarReader* tar;                 // NULL for a plain .gz
+    Inflater* inflater;             // NULL for a plain .tar
+    DWORD gzCrc;                    // Current gzip member
+    ULONGLONG gzSize;
+
+    // Writer
+    volatile LONG cancelled;        // The writer failed, the reader stops early
+    BOOL writeOk;
+    ZipWriter zw;
+} ConvertJob;
+
+static inline void PutLE16(BYTE* p, WORD v) { p[0] = (BYTE)v; p[1] = (BYTE)(v >> 8); }
+static inline void PutLE32(BYTE* p, DWORD v) { PutLE16(p, (WORD)v); PutLE16(p + 2, (WORD)(v >> 16)); }
+static inline void PutLE64(BYTE* p, ULONGLONG v) { PutLE32(p, (DWORD)v); PutLE32(p + 4, (DWORD)(v >> 32)); }
+
+// "<dir>\name.tar.gz" -> "<dir>\name.zip". FALSE if Convert doesn't handle
+// the archive. pbTar/pbGzip (may be NULL) get the layers to undo.
+static BOOL GetConvertZipPath(const wchar_t* archivePath, wchar_t* zipPath, BOOL* pbTar, BOOL* pbGzip)
+{
+    PathSpans spans;
+    wchar_t dir[MAX_PATH], name[MAX_PATH];
+
+    if (!MatchesExtension(archivePath, g_ConvertExtensions, (int)ARRAYSIZE(g_ConvertExtensions)))
+        return FALSE;
+
+    SplitPath(archivePath, &spans);
+    const wchar_t* ext = archivePath + spans.extStart;
+    size_t stemLen = spans.extStart - spans.nameStart;
+    BOOL bGzip = _wcsicmp(ext, L".tar") != 0;
+    BOOL bTar = !bGzip || _wcsicmp(ext, L".tgz") == 0;
+
+    // "name.tar.gz" loses both extensions
+    if (!bTar && stemLen > 4 && EqualsIgnoreCase(ext - 4, L".tar", 4))
+    {
+        bTar = TRUE;
+        stemLen -= 4;
+    }
+    if (spans.nameStart >= MAX_PATH || stemLen >= MAX_PATH)
+        return FALSE;
+
+    wmemcpy(dir, archivePath, spans.nameStart);
+    dir[spans.nameStart] = L'\0';
+    wmemcpy(name, archivePath + spans.nameStart, stemLen);
+    name[stemLen] = L'\0';
+
+    if (pbTar) *pbTar = bTar;
+    if (pbGzip) *pbGzip = bGzip;
+    return MakeZipPath(dir, name, zipPath);
+}
+
+// Zip times are local. The conversion goes by the daylight saving rules of
+// that date, not today's (FileTimeToLocalFileTime would be an hour off for
+// half the year).
+static DWORD UnixToDosTime(LONGLONG t)
+{
+    ULARGE_INTEGER ticks;
+    FILETIME utc;
+    SYSTEMTIME st, local;
+
+    // Zip can't go before 1980
+    if (t < 315532800)
+        return 0x21 << 16;
+
+    ticks.QuadPart = (ULONGLONG)(t + 11644473600LL) * 10000000;
+    utc.dwLowDateTime = ticks.LowPart;
+    utc.dwHighDateTime = ticks.HighPart;
+    if (!FileTimeToSystemTime(&utc, &st) || !SystemTimeToTzSpecificLocalTime(NULL, &st, &local) ||
+        local.wYear < 1980 || local.wYear > 2107)
+        return 0x21 << 16;
+
+    DWORD date = ((DWORD)(local.wYear - 1980) << 9) | ((DWORD)local.wMonth << 5) | local.wDay;
+    DWORD time = ((DWORD)local.wHour << 11) | ((DWORD)local.wMinute << 5) | (local.wSecond / 2u);
+    return (date << 16) | time;
+}
+
+//-----------------------------------------------------------------------------
+// Slots
+//-----------------------------------------------------------------------------
+// Reader: the next free slot, to fill and then publish
+static ConvertItem* AcquireSlot(ConvertJob* job, ConvertItemType type)
+{
+    AcquireSRWLockExclusive(&job->lock);
+    while (job->count == CONVERT_SLOTS)
+        SleepConditionVariableSRW(&job->notFull, &job->lock, INFINITE, 0);
+    ConvertItem* item = &job->items[(job->head + job->count) % CONVERT_SLOTS];
+    ReleaseSRWLockExclusive(&job->lock);
+
+    item->type = type;
+    item->len = 0;
+    return item;
+}
+
+static void PublishSlot(ConvertJob* job)
+{
+    AcquireSRWLockExclusive(&job->lock);
+    job->count++;
+    ReleaseSRWLockExclusive(&job->lock);
+    WakeConditionVariable(&job->notEmpty);
+}
+
+// Writer: the oldest published slot, released once it's been used
+static ConvertItem* NextSlot(ConvertJob* job)
+{
+    AcquireSRWLockExclusive(&job->lock);
+    while (job->count == 0)
+        SleepConditionVariableSRW(&job->notEmpty, &job->lock, INFINITE, 0);
+    ConvertItem* item = &job->items[job->head];
+    ReleaseSRWLockExclusive(&job->lock);
+    return item;
+}
+
+static void ReleaseSlot(ConvertJob* job)
+{
+    AcquireSRWLockExclusive(&job->lock);
+    job->head = (job->head + 1) % CONVERT_SLOTS;
+    job->count--;
+    ReleaseSRWLockExclusive(&job->lock);
+    WakeConditionVariable(&job->notFull);
+}
+
+static void PublishData(ConvertJob* job)
+{
+    if (job->open)
+    {
+        PublishSlot(job);
+        job->open = NULL;
+    }
+}
+
+// TarHandler callbacks, also used for a plain .gz's single entry
+static int ConvertBegin(void* context, const char* name, size_t nameLen, uint64_t size,
+                        int64_t mtime, int isDir)
+{
+    ConvertJob* job = context;
+
+    // Never stored under a cut name
+    if (job->cancelled || nameLen > TAR_NAME_MAX) return 0;
+
+    PublishData(job);
+    ConvertItem* item = AcquireSlot(job, CONVERT_BEGIN);
+    item->isDir = isDir;
+    item->size = size;
+    item->mtime = mtime;
+    item->len = (UINT)nameLen;
+    CopyMemory(item->data, name, item->len);
+    PublishSlot(job);
+    return 1;
+}
+
+static int ConvertData(void* context, const uint8_t* data, size_t len)
+{
+    ConvertJob* job = context;
+
+    while (len)
+    {
+        if (job->cancelled) return 0;
+        if (!job->open)
+            job->open = AcquireSlot(job, CONVERT_DATA);
+
+        UINT n = (UINT)min(len, (size_t)(CONVERT_CHUNK - job->open->len));
+        CopyMemory(job->open->data + job->open->len, data, n);
+        job->open->len += n;
+        data += n;
+        len -= n;
+
+        if (job->open->len == CONVERT_CHUNK)
+            PublishData(job);
+    }
+    return 1;
+}
+
+static int ConvertEnd(void* context)
+{
+    ConvertJob* job = context;
+
+    PublishData(job);
+    AcquireSlot(job, CONVERT_END);
+    PublishSlot(job);
+    return !job->cancelled;
+}
+
+//-----------------------------------------------------------------------------
+// Zip writer
+//-----------------------------------------------------------------------------
+static BOOL ZipWriterFlush(ZipWriter* zw)
+{
+    DWORD written;
+
+    if (zw->ok && zw->used)
+        zw->ok = WriteFile(zw->hFile, zw->buf, zw->used, &written, NULL) && written == zw->used;
+    zw->used = 0;
+    return zw->ok;
+}
+
+static int ZipWriterOut(void* context, const uint8_t* data, size_t len)
+{
+    ZipWriter* zw = context;
+
+    zw->offset += len;
+    while (len && zw->ok)
+    {
+        UINT n = (UINT)min(len, (size_t)(ZIP_WRITE_BUFFER - zw->used));
+        CopyMemory(zw->buf + zw->used, data, n);
+        zw->used += n;
+        data += n;
+        len -= n;
+
+        if (zw->used == ZIP_WRITE_BUFFER)
+            ZipWriterFlush(zw);
+    }
+    return zw->ok;
+}
+
+static BOOL ZipWriterOpen(ZipWriter* zw, const wchar_t* path)
+{
+    zw->hFile = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    zw->buf = HeapAlloc(GetProcessHeap(), 0, ZIP_WRITE_BUFFER);
+    zw->deflater = HeapAlloc(GetProcessHeap(), 0, sizeof(Deflater));
+    zw->ok = zw->hFile != INVALID_HANDLE_VALUE && zw->buf && zw->deflater;
+    return zw->ok;
+}
+
+static void ZipWriterClose(ZipWriter* zw)
+{
+    if (zw->hFile != INVALID_HANDLE_VALUE) CloseHandle(zw->hFile);
+    if (zw->buf) HeapFree(GetProcessHeap(), 0, zw->buf);
+    if (zw->cd) HeapFree(GetProcessHeap(), 0, zw->cd);
+    if (zw->deflater) HeapFree(GetProcessHeap(), 0, zw->deflater);
+}
+
+// The 30 fixed bytes of the current entry's local header
+static void ZipLocalHeader(const ZipWriter* zw, BYTE* header)
+{
+    PutLE32(header, 0x04034b50);
+    PutLE16(header + 4, zw->zip64 ? 45 : 20);
+    PutLE16(header + 6, zw->flags);
+    PutLE16(header + 8, zw->method);
+    PutLE32(header + 10, zw->dosTime);
+    PutLE32(header + 14, 0);
+    PutLE32(header + 18, zw->zip64 ? 0xFFFFFFFF : 0);
+    PutLE32(header + 22, zw->zip64 ? 0xFFFFFFFF : 0);
+    PutLE16(header + 26, (WORD)zw->nameLen);
+    PutLE16(header + 28, (zw->zip64 || zw->sizeUnknown) ? 20 : 0);
+}
+
+// An entry of unknown size outgrew 32 bits: rewrite its local header as
+// zip64, the reserved extra field becoming the zip64 one
+static BOOL ZipPromoteZip64(ZipWriter* zw)
+{
+    BYTE header[30], id[2];
+    LARGE_INTEGER pos, end = {0};
+    DWORD written;
+
+    zw->zip64 = TRUE;
+    ZipLocalHeader(zw, header);
+    PutLE16(id, 0x0001);
+    if (!ZipWriterFlush(zw))
+        return FALSE;
+
+    pos.QuadPart = (LONGLONG)zw->localOffset;
+    zw->ok = SetFilePointerEx(zw->hFile, pos, NULL, FILE_BEGIN) &&
+             WriteFile(zw->hFile, header, 30, &written, NULL) && written == 30;
+    pos.QuadPart += 30 + zw->nameLen;
+    zw->ok = zw->ok && SetFilePointerEx(zw->hFile, pos, NULL, FILE_BEGIN) &&
+             WriteFile(zw->hFile, id, 2, &written, NULL) && written == 2 &&
+             SetFilePointerEx(zw->hFile, end, NULL, FILE_END);
+    return zw->ok;
+}
+
+static BOOL ZipBeginEntry(ZipWriter* zw, const ConvertItem* item)
+{
+    BYTE header[30 + 20];
+    wchar_t wideName[MAX_PATH];
+
+    CopyMemory(zw->name, item->data, item->len);
+    zw->nameLen = item->len;
+    if (item->isDir)
+        zw->name[zw->nameLen++] = '/';
+
+    // Bit 11 if the name is UTF-8 beyond ASCII; other bytes are left as they are
+    int wideLen = MultiByteToWideChar(CP_UTF8, 0, zw->name, zw->nameLen, wideName, MAX_PATH - 1);
+    wideName[wideLen] = L'\0';
+    zw->flags = 0x0008;
+    for (UINT i = 0; i < zw->nameLen; i++)
+    {
+        if ((BYTE)zw->name[i] >= 0x80)
+        {
+            if (MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, zw->name, zw->nameLen, NULL, 0))
+                zw->flags |= 0x0800;
+            break;
+        }
+    }
+
+    // Already compressed data is stored, like the zip profiles do
+    zw->isDir = item->isDir;
+    zw->method = (item->isDir || IsCompressedFile(wideName)) ? 0 : 8;
+    zw->sizeUnknown = (item->size == CONVERT_SIZE_UNKNOWN);
+    zw->zip64 = !zw->sizeUnknown && item->size >= ZIP64_THRESHOLD;
+    zw->dosTime = UnixToDosTime(item->mtime);
+    zw->localOffset = zw->offset;
+    zw->size = 0;
+    zw->crc = 0;
+
+    ZipLocalHeader(zw, header);
+    ZipWriterOut(zw, header, 30);
+    ZipWriterOut(zw, (const BYTE*)zw->name, zw->nameLen);
+    if (zw->zip64 || zw->sizeUnknown)
+    {
+        // Sizes follow in the (64-bit) data descriptor. Without a size to go
+        // by, the field is only reserved (readers skip unknown IDs) and made
+        // zip64 by ZipEndEntry if the entry needs it.
+        ZeroMemory(header + 30, 20);
+        PutLE16(header + 30, zw->zip64 ? 0x0001 : ZIP_EXTRA_RESERVE);
+        PutLE16(header + 32, 16);
+        ZipWriterOut(zw, header + 30, 20);
+    }
+
+    zw->dataStart = zw->offset;
+    if (zw->method == 8)
+        DeflateInit(zw->deflater, ZipWriterOut, zw);
+    return zw->ok;
+}
+
+static BOOL ZipEntryData(ZipWriter* zw, const BYTE* data, UINT len)
+{
+    zw->crc = Crc32Update(zw->crc, data, len);
+    zw->size += len;
+    if (zw->method == 8)
+        DeflateWrite(zw->deflater, data, len);
+    else
+        ZipWriterOut(zw, data, len);
+    return zw->ok;
+}
+
+static BOOL ZipEndEntry(ZipWriter* zw)
+{
+    BYTE record[46 + 28];
+
+    if (zw->method == 8)
+        DeflateFinish(zw->deflater);
+
+    ULONGLONG compSize = zw->offset - zw->dataStart;
+    if (!zw->zip64 && (zw->size > 0xFFFFFFFF || compSize > 0xFFFFFFFF) &&
+        (!zw->sizeUnknown || !ZipPromoteZip64(zw)))
+        return FALSE;
+
+    // Data descriptor
+    PutLE32(record, 0x08074b50);
+    PutLE32(record + 4, zw->crc);
+    if (zw->zip64)
+    {
+        PutLE64(record + 8, compSize);
+        PutLE64(record + 16, zw->size);
+        ZipWriterOut(zw, record, 24);
+    }
+    else
+    {
+        PutLE32(record + 8, (DWORD)compSize);
+        PutLE32(record + 12, (DWORD)zw->size);
+        ZipWriterOut(zw, record, 16);
+    }
+
+    // Central directory record, zip64 extra field for whatever overflows
+    BOOL bigOffset = zw->localOffset >= 0xFFFFFFFF;
+    WORD extraLen = (WORD)((zw->zip64 ? 16 : 0) + (bigOffset ? 8 : 0));
+    if (extraLen) extraLen += 4;
+
+    SIZE_T need = zw->cdSize + 46 + zw->nameLen + extraLen;
+    if (need > zw->cdCap)
+    {
+        SIZE_T cap = max(need, max(zw->cdCap * 2, 65536));
+        BYTE* grown = zw->cd ? HeapReAlloc(GetProcessHeap(), 0, zw->cd, cap)
+                             : HeapAlloc(GetProcessHeap(), 0, cap);
+        if (!grown) return FALSE;
+        zw->cd = grown;
+        zw->cdCap = cap;
+    }
+
+    BYTE* p = zw->cd + zw->cdSize;
+    PutLE32(p, 0x02014b50);
+    PutLE16(p + 4, extraLen ? 45 : 20);
+    PutLE16(p + 6, extraLen ? 45 : 20);
+    PutLE16(p + 8, zw->flags);
+    PutLE16(p + 10, zw->method);
+    PutLE32(p + 12, zw->dosTime);
+    PutLE32(p + 16, zw->crc);
+    PutLE32(p + 20, zw->zip64 ? 0xFFFFFFFF : (DWORD)compSize);
+    PutLE32(p + 24, zw->zip64 ? 0xFFFFFFFF : (DWORD)zw->size);
+    PutLE16(p + 28, (WORD)zw->nameLen);
+    PutLE16(p + 30, extraLen);
+    PutLE16(p + 32, 0);     // Comment
+    PutLE16(p + 34, 0);     // Disk
+    PutLE16(p + 36, 0);     // Internal attributes
+    PutLE32(p + 38, zw->isDir ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_ARCHIVE);
+    PutLE32(p + 42, bigOffset ? 0xFFFFFFFF : (DWORD)zw->localOffset);
+    CopyMemory(p + 46, zw->name, zw->nameLen);
+
+    p += 46 + zw->nameLen;
+    if (extraLen)
+    {
+        PutLE16(p, 0x0001);
+        PutLE16(p + 2, (WORD)(extraLen - 4));
+        p += 4;
+        if (zw->zip64)
+        {
+            PutLE64(p, zw->size);
+            PutLE64(p + 8, compSize);
+            p += 16;
+        }
+        if (bigOffset)
+            PutLE64(p, zw->localOffset);
+    }
+
+    zw->cdSize = need;
+    zw->count++;
+    return zw->ok;
+}
+
+// Central directory and end records, then whatever is still buffered
+static BOOL ZipWriterFinish(ZipWriter* zw)
+{
+    BYTE record[56 + 20 + 22];
+    ULONGLONG cdOffset = zw->offset;
+
+    if (zw->cdSize)
+        ZipWriterOut(zw, zw->cd, zw->cdSize);
+
+    if (zw->count >= 0xFFFF || cdOffset >= 0xFFFFFFFF || zw->cdSize >= 0xFFFFFFFF)
+    {
+        ULONGLONG eocd64 = zw->offset;
+
+        ZeroMemory(record, 76);
+        PutLE32(record, 0x06064b50);
+        PutLE64(record + 4, 44);
+        PutLE16(record + 12, 45);
+        PutLE16(record + 14, 45);
+        PutLE64(record + 24, zw->count);
+        PutLE64(record + 32, zw->count);
+        PutLE64(record + 40, zw->cdSize);
+        PutLE64(record + 48, cdOffset);
+
+        PutLE32(record + 56, 0x07064b50);
+        PutLE64(record + 64, eocd64);
+        PutLE32(record + 72, 1);
+        ZipWriterOut(zw, record, 76);
+    }
+
+    ZeroMemory(record, 22);
+    PutLE32(record, 0x06054b50);
+    PutLE16(record + 8, (WORD)min(zw->count, 0xFFFF));
+    PutLE16(record + 10, (WORD)min(zw->count, 0xFFFF));
+    PutLE32(record + 12, (DWORD)min(zw->cdSize, 0xFFFFFFFF));
+    PutLE32(record + 16, (DWORD)min(cdOffset, 0xFFFFFFFF));
+    ZipWriterOut(zw, record, 22);
+    return ZipWriterFlush(zw);
+}
+
+static DWORD WINAPI ConvertWriterProc(LPVOID param)
+{
+    ConvertJob* job = param;
+    BOOL failed = !ZipWriterOpen(&job->zw, job->szTempPath);
+    ConvertItemType type;
+
+    // After a failure the slots are still drained, so the reader never blocks
+    do
+    {
+        ConvertItem* item = NextSlot(job);
+        type = item->type;
+
+        if (!failed)
+        {
+            switch (type)
+            {
+            case CONVERT_BEGIN: failed = !ZipBeginEntry(&job->zw, item); break;
+            case CONVERT_DATA:  failed = !ZipEntryData(&job->zw, item->data, item->len); break;
+            case CONVERT_END:   failed = !ZipEndEntry(&job->zw); break;
+            case CONVERT_DONE:  failed = !ZipWriterFinish(&job->zw); break;
+            default:            failed = TRUE; break;
+            }
+            if (failed)
+                InterlockedExchange(&job->cancelled, TRUE);
+        }
+        ReleaseSlot(job);
+    } while (type != CONVERT_DONE && type != CONVERT_FAILED);
+
+    job->writeOk = !failed;
+    ZipWriterClose(&job->zw);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Reader
+//-----------------------------------------------------------------------------
+static int GzipSink(void* context, const uint8_t* data, size_t len)
+{
+    ConvertJob* job = context;
+
+    job->gzCrc = Crc32Update(job->gzCrc, data, len);
+    job->gzSize += len;
+    return job->tar ? TarFeed(job->tar, data, len) : ConvertData(job, data, len);
+}
+
+// A plain .gz becomes one entry named after the archive ("log.txt.gz" -> "log.txt")
+static BOOL BeginGzipEntry(ConvertJob* job, const BYTE* base)
+{
+    PathSpans spans;
+    char name[MAX_PATH * 3];
+    LONGLONG mtime = ReadLE32(base + 4);
+
+    SplitPath(job->szArchivePath, &spans);
+    int nameLen = WideCharToMultiByte(CP_UTF8, 0, job->szArchivePath + spans.nameStart,
+                                      (int)(spans.extStart - spans.nameStart), name, sizeof(name), NULL, NULL);
+    if (nameLen <= 0) return FALSE;
+
+    // No timestamp in the header: use the archive's
+    if (mtime == 0)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA fad;
+        if (GetFileAttributesExW(job->szArchivePath, GetFileExInfoStandard, &fad))
+        {
+            ULARGE_INTEGER t;
+            t.LowPart = fad.ftLastWriteTime.dwLowDateTime;
+            t.HighPart = fad.ftLastWriteTime.dwHighDateTime;
+            mtime = (LONGLONG)(t.QuadPart / 10000000) - 11644473600LL;
+        }
+    }
+
+    // The trailer only has the last member's size modulo 4 GB: the entry
+    // starts out plain and turns zip64 if it gets that big
+    return ConvertBegin(job, name, nameLen, CONVERT_SIZE_UNKNOWN, mtime, FALSE);
+}
+
+static BOOL DecodeArchive(ConvertJob* job, const BYTE* base, SIZE_T size)
+{
+    Inflater* z = job->inflater;
+    BOOL ok = TRUE;
+
+    if (job->tar)
+    {
+        TarHandler handler = { ConvertBegin, ConvertData, ConvertEnd, job };
+        TarInit(job->tar, &handler);
+    }
+
+    if (!job->bGzip)
+    {
+        ok = TarFeed(job->tar, base, size);
+    }
+    else
+    {
+        SIZE_T pos = 0;
+
+        ok = GzipHeaderSize(base, size) && (job->tar || BeginGzipEntry(job, base));
+
+        // Concatenated members make one stream; anything after them is ignored, like gzip does
+        while (ok && pos < size)
+        {
+            SIZE_T header = GzipHeaderSize(base + pos, size - pos), used;
+            if (!header) break;
+
+            job->gzCrc = 0;
+            job->gzSize = 0;
+            ok = Inflate(z, base + pos + header, size - pos - header, &used, GzipSink, job) == INFLATE_DONE;
+            pos += header + used;
+
+            ok = ok && size - pos >= 8 &&
+                 ReadLE32(base + pos) == job->gzCrc && ReadLE32(base + pos + 4) == (DWORD)job->gzSize;
+            pos += 8;
+        }
+    }
+
+    if (ok)
+        ok = job->tar ? TarFinish(job->tar) : ConvertEnd(job);
+    return ok && !job->cancelled;
+}
+
+// The archive is read through a mapped view, where an I/O error (network
+// share, removed drive) raises EXCEPTION_IN_PAGE_ERROR instead of failing
+// a read. It fails the conversion rather than taking Explorer down.
+static BOOL DecodeMappedArchive(ConvertJob* job, const BYTE* base, SIZE_T size)
+{
+    BOOL ok = FALSE;
+
+    __try
+    {
+        ok = DecodeArchive(job, base, size);
+    }
+    __except (InPageErrorFilter(GetExceptionCode()))
+    {
+        ok = FALSE;
+    }
+    return ok;
+}
+
+static DWORD WINAPI ConvertThreadProc(LPVOID param)
+{
+    ConvertJob* job = param;
+    HANDLE hFile, hMap = NULL, hWriter = NULL;
+    const BYTE* base = NULL;
+    LARGE_INTEGER size = {0};
+    BOOL ok = FALSE, exists = FALSE;
+
+    TraceBegin("Convert");
+    InitializeSRWLock(&job->lock);
+    InitializeConditionVariable(&job->notFull);
+    InitializeConditionVariable(&job->notEmpty);
+    job->zw.hFile = INVALID_HANDLE_VALUE;
+
+    hFile = CreateFileW(job->szArchivePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile != INVALID_HANDLE_VALUE && GetFileSizeEx(hFile, &size) && size.QuadPart > 0 &&
+        (ULONGLONG)size.QuadPart <= (SIZE_T)-1 &&
+        (hMap = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL)) != NULL &&
+        (base = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0)) != NULL &&
+        (job->slotData = HeapAlloc(GetProcessHeap(), 0, CONVERT_SLOTS * CONVERT_CHUNK)) != NULL &&
+        (!job->bTar || (job->tar = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(TarReader))) != NULL) &&
+        (!job->bGzip || (job->inflater = HeapAlloc(GetProcessHeap(), 0, sizeof(Inflater))) != NULL) &&
+        SUCCEEDED(StringCchPrintfW(job->szTempPath, MAX_PATH, L"%s.part", job->szZipPath)))
+    {
+        for (UINT i = 0; i < CONVERT_SLOTS; i++)
+            job->items[i].data = job->slotData + i * CONVERT_CHUNK;
+
+        hWriter = CreateThread(NULL, 0, ConvertWriterProc, job, 0, NULL);
+        if (hWriter)
+        {
+            ok = DecodeMappedArchive(job, base, (SIZE_T)size.QuadPart);
+
+            PublishData(job);
+            AcquireSlot(job, ok ? CONVERT_DONE : CONVERT_FAILED);
+            PublishSlot(job);
+            WaitForSingleObject(hWriter, INFINITE);
+            CloseHandle(hWriter);
+            ok = ok && job->writeOk;
+        }
+    }
+
+    if (base) UnmapViewOfFile(base);
+    if (hMap) CloseHandle(hMap);
+    if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+
+    // Never replaces an existing zip
+    if (ok && !MoveFileExW(job->szTempPath, job->szZipPath, 0))
+    {
+        exists = (GetLastError() == ERROR_ALREADY_EXISTS);
+        ok = FALSE;
+    }
+    if (!ok && job->szTempPath[0])
+        DeleteFileW(job->szTempPath);
+    TraceEnd("Convert");
+
+    wchar_t text[256];
+    if (!ok)
+    {
+        if (exists)
+            StringCchPrintfW(text, ARRAYSIZE(text), L"%s already exists.", FindFileName(job->szZipPath));
+        else if (job->tar && job->tar->nameTooLong)
+            StringCchPrintfW(text, ARRAYSIZE(text), L"%s couldn't be converted: a name in it is longer than %u bytes.",
+                             FindFileName(job->szArchivePath), TAR_NAME_MAX - 1);
+        else
+            StringCchPrintfW(text, ARRAYSIZE(text), L"%s couldn't be converted.", FindFileName(job->szArchivePath));
+        ShowNotification(L"WinRAR conversion failed", text, TRUE);
+    }
+    else if (GetSettingInt(L"Stats", L"Notify", 1))
+    {
+        wchar_t inSize[32], outSize[32];
+        StrFormatByteSizeW(size.QuadPart, inSize, ARRAYSIZE(inSize));
+        StrFormatByteSizeW(GetFileSize64(job->szZipPath), outSize, ARRAYSIZE(outSize));
+        StringCchPrintfW(text, ARRAYSIZE(text), L"%s (%s) -> %s (%s)",
+                         FindFileName(job->szArchivePath), inSize, FindFileName(job->szZipPath), outSize);
+        ShowNotification(L"WinRAR conversion finished", text, FALSE);
+    }
+
+    if (job->slotData) HeapFree(GetProcessHeap(), 0, job->slotData);
+    if (job->tar) HeapFree(GetProcessHeap(), 0, job->tar);
+    if (job->inflater) HeapFree(GetProcessHeap(), 0, job->inflater);
+    HeapFree(GetProcessHeap(), 0, job);
+    ExitBackgroundThread();
+    return 0;
+}
+
+static HRESULT STDMETHODCALLTYPE Menu_InvokeCommand(
+    IContextMenu3* This, CMINVOKECOMMANDINFO* pici)
+{
+    ExtractContextMenu* self = impl_from_IContextMenu3(This);
+
+    if (HIWORD(pici->lpVerb) != 0)
+        return E_INVALIDARG;
+
+    UINT cmd = LOWORD(pici->lpVerb);
+    ZipBatch* batch;
+
+    TraceMark("InvokeCommand", 'i');
+
+    switch (cmd)
+    {
+    case IDM_EXTRACT:
+    {
+        // Extract to folder, skipping what an earlier run already put there
+        ExtractJob* job = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(ExtractJob));
+        if (!job) return E_OUTOFMEMORY;
+
+        StringCchCopyW(job->szArchivePath, MAX_PATH, self->pszFilePath);
+        StringCchCopyW(job->szDestFolder, MAX_PATH, self->pszDestFolder);
+        if (!StartBackgroundThread(ExtractThreadProc, job))
+        {
+            HeapFree(GetProcessHeap(), 0, job);
+            return E_FAIL;
+        }
+        return S_OK;
+    }
+
+    case IDM_ZIP_TO_SINGLE:
+    case IDM_ZIP_ALL_FOLDERS:
+    case IDM_RAR_TO_SINGLE:
+    {
+        // Zip all selected files/folders to a single archive named after parent folder.
+        // Selected items keep their names: FolderA/contents, FolderB/contents, file.txt
+        batch = AllocZipBatch(1);
+        if (!batch) return E_OUTOFMEMORY;
+
+        ZipJob* job = &batch->jobs[0];
+        if (!SetZipRoots(job, self->ppszSelectedPaths, self->nSelectedCount))
+        {
+            FreeZipBatch(batch);
+            return E_OUTOFMEMORY;
+        }
+
+        if (!MakeZipPath(self->pszParentFolder, self->pszParentName, job->szArchivePath))
+        {
+            FreeZipBatch(batch);
+            return E_FAIL;
+        }
+        if (cmd == IDM_RAR_TO_SINGLE)
+        {
+            job->bRar = TRUE;
+            PathRenameExtensionW(job->szArchivePath, L".rar");
+        }
+        return StartZipBatch(batch);
+    }
+
+    case IDM_ZIP_EACH_FOLDER:
+        // Zip each folder to its own archive concurrently (non-blocking)
+        // Each folder's contents go to root of archive (no double folder)
+        batch = AllocZipBatch(self->nSelectedCount);
+        if (!batch) return E_OUTOFMEMORY;
+
+        for (UINT i = 0; i < self->nSelectedCount; i++)
+        {
+            ZipJob* job = &batch->jobs[i];
+            const wchar_t* folderPath = self->ppszSelectedPaths[i];
+
+            // Archive named after the folder, next to it
+            const wchar_t* folderName = FindFileName(folderPath);
+            wchar_t parentDir[MAX_PATH];
+            StringCchCopyW(parentDir, MAX_PATH, folderPath);
+            PathRemoveFileSpecW(parentDir);
+
+            if (!MakeZipPath(parentDir, folderName, job->szArchivePath))
+            {
+                FreeZipBatch(batch);
+                return E_FAIL;
+            }
+
+            // The folder itself is the base, its contents are the single root
+            job->szRoots = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(wchar_t[MAX_PATH]));
+            if (!job->szRoots)
+            {
+                FreeZipBatch(batch);
+                return E_OUTOFMEMORY;
+            }
+            StringCchCopyW(job->szBaseDir, MAX_PATH, folderPath);
+            job->nRoots = 1;
+        }
+
+        return StartZipBatch(batch);
+
+    case IDM_CONVERT_ZIP:
+    {
+        // Stream the .tar/.gz into a new zip next to it
+        ConvertJob* job = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(ConvertJob));
+        if (!job) return E_OUTOFMEMORY;
+
+        StringCchCopyW(job->szArchivePath, MAX_PATH, self->pszFilePath);
+        if (!GetConvertZipPath(job->szArchivePath, job->szZipPath, &job->bTar, &job->bGzip) ||
+            !StartBackgroundThread(ConvertThreadProc, job))
+        {
+            HeapFree(GetProcessHeap(), 0, job);
+            return E_FAIL;
+        }
+        return S_OK;
+    }
+
+    default:
+        return E_INVALIDARG;
+    }
+}
+
+static HRESULT STDMETHODCALLTYPE Menu_GetCommandString(
+    IContextMenu3* This, UINT_PTR idCmd, UINT uType, UINT* pReserved, LPSTR pszName, UINT cchMax)
+{
+    const wchar_t* helpTextW = NULL;
+    const char* helpTextA = NULL;
+    const wchar_t* verbW = NULL;
+    const char* verbA = NULL;
+
+    switch (idCmd)
+    {
+    case IDM_EXTRACT:
+        helpTextW = L"Extract archive to folder";
+        helpTextA = "Extract archive to folder";
+        verbW = L"WinRARExtractTo";
+        verbA = "WinRARExtractTo";
+        break;
+    case IDM_ZIP_TO_SINGLE:
+        helpTextW = L"Zip selected items to archive";
+        helpTextA = "Zip selected items to archive";
+        verbW = L"WinRARZipToSingle";
+        verbA = "WinRARZipToSingle";
+        break;
+    case IDM_ZIP_EACH_FOLDER:
+        helpTextW = L"Zip each folder to its own archive";
+        helpTextA = "Zip each folder to its own archive";
+        verbW = L"WinRARZipEachFolder";
+        verbA = "WinRARZipEachFolder";
+        break;
+    case IDM_ZIP_ALL_FOLDERS:
+        helpTextW = L"Zip all folders to single archive";
+        helpTextA = "Zip all folders to single archive";
+        verbW = L"WinRARZipAllFolders";
+        verbA = "WinRARZipAllFolders";
+        break;
+    case IDM_CONVERT_ZIP:
+        helpTextW = L"Convert archive to zip";
+        helpTextA = "Convert archive to zip";
+        verbW = L"WinRARConvertToZip";
+        verbA = "WinRARConvertToZip";
+        break;
+    case IDM_RAR_TO_SINGLE:
+        helpTextW = L"Add selected items to a solid RAR archive";
+        helpTextA = "Add selected items to a solid RAR archive";
+        verbW = L"WinRARRarToSingle";
+        verbA = "WinRARRarToSingle";
+        break;
+    default:
+        return E_INVALIDARG;
+    }
+
+    if (uType == GCS_HELPTEXTW)
+    {
+        StringCchCopyW((LPWSTR)pszName, cchMax, helpTextW);
+        return S_OK;
+    }
+    else if (uType == GCS_HELPTEXTA)
+    {
+        StringCchCopyA(pszName, cchMax, helpTextA);
+        return S_OK;
+    }
+    else if (uType == GCS_VERBW)
+    {
+        StringCchCopyW((LPWSTR)pszName, cchMax, verbW);
+        return S_OK;
+    }
+    else if (uType == GCS_VERBA)
+    {
+        StringCchCopyA(pszName, cchMax, verbA);
+        return S_OK;
+    }
+
+    return E_INVALIDARG;
+}
+
+//=============================================================================
+// IContextMenu2/3
+//=============================================================================
+static HRESULT STDMETHODCALLTYPE Menu_HandleMenuMsg(
+    IContextMenu3* This, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    return S_OK;
+}
+
+static HRESULT STDMETHODCALLTYPE Menu_HandleMenuMsg2(
+    IContextMenu3* This, UINT uMsg, WPARAM wParam, LPARAM lParam, LRESULT* plResult)
+{
+    if (plResult) *plResult = 0;
+    return S_OK;
+}
+
+static IContextMenu3Vtbl MenuVtbl = {
+    Menu_QueryInterface,
+    Menu_AddRef,
+    Menu_Release,
+    Menu_QueryContextMenu,
+    Menu_InvokeCommand,
+    Menu_GetCommandString,
+    Menu_HandleMenuMsg,
+    Menu_HandleMenuMsg2
+};
 
 //=============================================================================
-// IShellExtInit
-//=============================================================================
+// IShellExtInit
+//=============================================================================
 static HRESULT STDMETHODCALLTYPE Init_QueryInterface(IShellExtInit* This, REFIID riid, void** ppv)
 {
     ExtractContextMenu* self = impl_from_IShellExtInit(This);
@@ -647,134 +4891,141 @@ static ULONG STDMETHODCALLTYPE Init_Release(IShellExtInit* This)
     return Menu_Release(&self->IContextMenu3_iface);
 }
 
-static HRESULT STDMETHODCALLTYPE Init_Initialize(
-    IShellExtInit* This, PCIDLIST_ABSOLUTE pidlFolder, IDataObject* pdtobj, HKEY hkeyProgID)
+// Name for archives made in a drive root
+static void GetRootName(const wchar_t* root, wchar_t* out, UINT cch)
 {
-    ExtractContextMenu* self = impl_from_IShellExtInit(This);
+    wchar_t label[MAX_PATH + 1];
 
-    if (!pdtobj) return E_INVALIDARG;
+    if (GetVolumeInformationW(root, label, ARRAYSIZE(label), NULL, NULL, NULL, NULL, 0) && label[0])
+        StringCchCopyW(out, cch, label);
+    else if (root[0] && root[1] == L':')
+        StringCchPrintfW(out, cch, L"%c", root[0]);
+    else
+        StringCchCopyW(out, cch, L"Archive");
+}
 
+static HRESULT ReadSelection(ExtractContextMenu* self, IDataObject* pdtobj)
+{
     FORMATETC fmt = { CF_HDROP, NULL, DVASPECT_CONTENT, -1, TYMED_HGLOBAL };
     STGMEDIUM stg = {0};
 
+    self->selType = SEL_NONE;
+    self->nSelectedCount = self->nFileCount = self->nFolderCount = 0;
+
     HRESULT hr = IDataObject_GetData(pdtobj, &fmt, &stg);
     if (FAILED(hr)) return hr;
 
-    UINT nFiles = DragQueryFileW((HDROP)stg.hGlobal, 0xFFFFFFFF, NULL, 0);
+    HDROP hDrop = (HDROP)stg.hGlobal;
+    UINT nFiles = DragQueryFileW(hDrop, 0xFFFFFFFF, NULL, 0);
     if (nFiles == 0)
     {
         ReleaseStgMedium(&stg);
-        self->selType = SEL_NONE;
         return S_OK;
     }
 
-    // Get first file path for parent folder detection
-    wchar_t firstPath[MAX_PATH];
-    DragQueryFileW((HDROP)stg.hGlobal, 0, firstPath, MAX_PATH);
-
-    // Get parent folder
-    StringCchCopyW(self->szParentFolder, MAX_PATH, firstPath);
-    PathRemoveFileSpecW(self->szParentFolder);
-
-    // Get parent folder name
-    wchar_t* parentName = PathFindFileNameW(self->szParentFolder);
-    StringCchCopyW(self->szParentName, MAX_PATH, parentName);
+    // Size the arena: pointer table, every path, the parent folder, folder
+    // name and destination derived from the first one, and a root name. Paths are
+    // cut at MAX_PATH like the buffers they end up in.
+    UINT maxItems = (nFiles > MAX_SELECTED_ITEMS) ? MAX_SELECTED_ITEMS : nFiles;
+    size_t lens[MAX_SELECTED_ITEMS];
+    for (UINT i = 0; i < maxItems; i++)
+        lens[i] = min(DragQueryFileW(hDrop, i, NULL, 0), MAX_PATH - 1);
+    UINT firstLen = (UINT)lens[0];
 
-    // Single file case - check for archive extraction
-    if (nFiles == 1)
+    SIZE_T bytes = SelectionArenaSize(lens, maxItems, 3, ROOT_NAME_CHARS);
+    if (bytes > self->arena.size)
     {
-        StringCchCopyW(self->szFilePath, MAX_PATH, firstPath);
-
-        if (IsArchiveFile(firstPath))
+        if (self->arena.base) HeapFree(GetProcessHeap(), 0, self->arena.base);
+        self->arena.base = HeapAlloc(GetProcessHeap(), 0, bytes);
+        self->arena.size = self->arena.base ? bytes : 0;
+        if (!self->arena.base)
         {
-            self->selType = SEL_SINGLE_ARCHIVE;
-
-            // Extract folder name from filename (without extension)
-            wchar_t* fileName = PathFindFileNameW(self->szFilePath);
-            StringCchCopyW(self->szFolderName, MAX_PATH, fileName);
-            PathRemoveExtensionW(self->szFolderName);
-
-            // Build full destination path: parent folder + archive name (no ext)
-            StringCchCopyW(self->szDestFolder, MAX_PATH, self->szFilePath);
-            PathRemoveFileSpecW(self->szDestFolder);
-            PathAppendW(self->szDestFolder, self->szFolderName);
+            ReleaseStgMedium(&stg);
+            return E_OUTOFMEMORY;
         }
-        else if (PathIsDirectoryW(firstPath))
-        {
-            // Single folder - treat as folders only
-            self->selType = SEL_FOLDERS_ONLY;
-            self->nFolderCount = 1;
-            self->nFileCount = 0;
-            self->nSelectedCount = 1;
+    }
+    self->arena.used = 0;
 
-            self->szSelectedPaths = HeapAlloc(GetProcessHeap(), 0, sizeof(wchar_t[MAX_PATH]));
-            if (self->szSelectedPaths)
-            {
-                StringCchCopyW(self->szSelectedPaths[0], MAX_PATH, firstPath);
-            }
-        }
-        else
-        {
-            // Single non-archive file - no menu
-            self->selType = SEL_NONE;
-        }
+    self->ppszSelectedPaths = ArenaAlloc(&self->arena, maxItems * sizeof(wchar_t*));
+    TraceBegin("ClassifySelection");
+    for (UINT i = 0; i < maxItems; i++)
+    {
+        UINT len = (UINT)lens[i];
+        wchar_t* path = ArenaAlloc(&self->arena, (len + 1) * sizeof(wchar_t));
+        DragQueryFileW(hDrop, i, path, len + 1);
+        self->ppszSelectedPaths[self->nSelectedCount++] = path;
 
-        ReleaseStgMedium(&stg);
-        return S_OK;
+        // A single item is checked for being an archive first
+        if (nFiles == 1 && IsArchiveFile(path))
+            break;
+        if (PathIsDirectoryW(path))
+            self->nFolderCount++;
+        else
+            self->nFileCount++;
     }
+    TraceEnd("ClassifySelection");
+    ReleaseStgMedium(&stg);
 
-    // Multiple files selected - allocate storage and count types
-    UINT maxItems = (nFiles > MAX_SELECTED_ITEMS) ? MAX_SELECTED_ITEMS : nFiles;
-    self->szSelectedPaths = HeapAlloc(GetProcessHeap(), 0, maxItems * sizeof(wchar_t[MAX_PATH]));
-    if (!self->szSelectedPaths)
+    self->pszFilePath = self->ppszSelectedPaths[0];
+
+    // Parent folder, and its name for naming archives
+    wchar_t* parentFolder = ArenaAlloc(&self->arena, (firstLen + 1) * sizeof(wchar_t));
+    StringCchCopyW(parentFolder, firstLen + 1, self->pszFilePath);
+    PathRemoveFileSpecW(parentFolder);
+    self->pszParentFolder = parentFolder;
+    self->pszParentName = FindFileName(parentFolder);
+
+    // "C:\" has no name to go by: use the volume label, or the drive letter
+    if (!self->pszParentName[0])
     {
-        ReleaseStgMedium(&stg);
-        return E_OUTOFMEMORY;
+        wchar_t* rootName = ArenaAlloc(&self->arena, ROOT_NAME_CHARS * sizeof(wchar_t));
+        GetRootName(parentFolder, rootName, ROOT_NAME_CHARS);
+        self->pszParentName = rootName;
     }
 
-    self->nFileCount = 0;
-    self->nFolderCount = 0;
-    self->nSelectedCount = 0;
+    BOOL singleIsArchive = (nFiles == 1 && self->nFileCount + self->nFolderCount == 0);
+    self->selType = (nFiles == 1)
+        ? ClassifySelection(!self->nFolderCount, self->nFolderCount, singleIsArchive)
+        : ClassifySelection(self->nFileCount, self->nFolderCount, FALSE);
 
-    for (UINT i = 0; i < maxItems; i++)
+    if (self->selType == SEL_SINGLE_ARCHIVE)
     {
-        wchar_t path[MAX_PATH];
-        DragQueryFileW((HDROP)stg.hGlobal, i, path, MAX_PATH);
-
-        StringCchCopyW(self->szSelectedPaths[self->nSelectedCount], MAX_PATH, path);
-        self->nSelectedCount++;
+        // Destination: parent folder + archive name (no ext). Both are no
+        // longer than the archive path.
+        wchar_t folderName[MAX_PATH], destFolder[MAX_PATH];
 
-        if (PathIsDirectoryW(path))
+        if (MakeExtractDestination(self->pszFilePath, folderName, destFolder))
         {
-            self->nFolderCount++;
+            wchar_t* name = ArenaAlloc(&self->arena, (firstLen + 1) * sizeof(wchar_t));
+            wchar_t* dest = ArenaAlloc(&self->arena, (firstLen + 1) * sizeof(wchar_t));
+            StringCchCopyW(name, firstLen + 1, folderName);
+            StringCchCopyW(dest, firstLen + 1, destFolder);
+            self->pszFolderName = name;
+            self->pszDestFolder = dest;
         }
         else
         {
-            self->nFileCount++;
+            self->selType = SEL_NONE;
         }
     }
 
-    ReleaseStgMedium(&stg);
+    return S_OK;
+}
 
-    // Determine selection type
-    if (self->nFileCount > 0 && self->nFolderCount == 0)
-    {
-        self->selType = SEL_FILES_ONLY;
-    }
-    else if (self->nFolderCount > 0 && self->nFileCount == 0)
-    {
-        self->selType = SEL_FOLDERS_ONLY;
-    }
-    else if (self->nFileCount > 0 && self->nFolderCount > 0)
-    {
-        self->selType = SEL_MIXED;
-    }
-    else
-    {
-        self->selType = SEL_NONE;
-    }
+static HRESULT STDMETHODCALLTYPE Init_Initialize(
+    IShellExtInit* This, PCIDLIST_ABSOLUTE pidlFolder, IDataObject* pdtobj, HKEY hkeyProgID)
+{
+    ExtractContextMenu* self = impl_from_IShellExtInit(This);
+    LARGE_INTEGER now;
 
-    return S_OK;
+    if (!pdtobj) return E_INVALIDARG;
+
+    QueryPerformanceCounter(&now);
+    self->traceStart = now.QuadPart;
+    TraceBegin("Initialize");
+    HRESULT hr = ReadSelection(self, pdtobj);
+    TraceEnd("Initialize");
+    return hr;
 }
 
 static IShellExtInitVtbl InitVtbl = {
@@ -821,17 +5072,26 @@ static HRESULT STDMETHODCALLTYPE Factory_CreateInstance(
     *ppv = NULL;
     if (pUnkOuter) return CLASS_E_NOAGGREGATION;
 
-    pMenu = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(ExtractContextMenu));
-    if (!pMenu) return E_OUTOFMEMORY;
+    // Reuse a pooled instance, keeping its arena
+    pMenu = (ExtractContextMenu*)InterlockedPopEntrySList(&g_MenuPool);
+    if (pMenu)
+    {
+        InterlockedDecrement(&g_MenuPoolCount);
+
+        Arena arena = pMenu->arena;
+        ZeroMemory(pMenu, sizeof(*pMenu));
+        pMenu->arena = arena;
+    }
+    else
+    {
+        pMenu = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(ExtractContextMenu));
+        if (!pMenu) return E_OUTOFMEMORY;
+    }
 
     pMenu->IContextMenu3_iface.lpVtbl = &MenuVtbl;
     pMenu->IShellExtInit_iface.lpVtbl = &InitVtbl;
     pMenu->cRef = 1;
     pMenu->selType = SEL_NONE;
-    pMenu->szSelectedPaths = NULL;
-    pMenu->nSelectedCount = 0;
-    pMenu->nFileCount = 0;
-    pMenu->nFolderCount = 0;
 
     InterlockedIncrement(&g_cRef);
 
@@ -878,8 +5138,41 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
             RegCloseKey(hKey);
         }
         
+        g_TraceFls = FlsAlloc(TraceThreadExit);
+        InitializeSListHead(&g_MenuPool);
+        InitializeSListHead(&g_StatsQueue);
+
         // Load archive extensions from WinRAR's registry
+        TraceBegin("LoadArchiveExtensions");
         LoadArchiveExtensions();
+        TraceEnd("LoadArchiveExtensions");
+
+        g_hSchedEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+    }
+    else if (fdwReason == DLL_PROCESS_DETACH)
+    {
+        if (g_hSchedEvent) CloseHandle(g_hSchedEvent);
+
+        PSLIST_ENTRY entry = InterlockedFlushSList(&g_MenuPool);
+        while (entry)
+        {
+            ExtractContextMenu* pMenu = CONTAINING_RECORD(entry, ExtractContextMenu, poolEntry);
+            entry = entry->Next;
+            if (pMenu->arena.base) HeapFree(GetProcessHeap(), 0, pMenu->arena.base);
+            HeapFree(GetProcessHeap(), 0, pMenu);
+        }
+
+        // Buffers are only freed on FreeLibrary, at process exit nothing's left to care
+        if (g_TraceFls != FLS_OUT_OF_INDEXES && !lpvReserved)
+        {
+            FlsFree(g_TraceFls);
+            while (g_TraceBuffers)
+            {
+                TraceBuffer* next = g_TraceBuffers->next;
+                HeapFree(GetProcessHeap(), 0, g_TraceBuffers);
+                g_TraceBuffers = next;
+            }
+        }
     }
     return TRUE;
 }
@@ -0,0 +1,1483 @@
+/*
+ * WinRAR Shell Extension - core tests
+ *
+ * Checks the portable core (core.c) against plain reference versions and
+ * known vectors. Built by CMakeLists.txt and run by ctest; no Windows needed.
+ *
+ * With CORE_TESTS_PATHS_ONLY the file is built with a 16-bit wchar_t
+ * (-fshort-wchar) to reach the SSE2/AVX2 path scans on Linux. The C
+ * library's wide functions assume a 32-bit wchar_t there, so only the tests
+ * that don't end up in them are run.
+ */
+
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE  // fork(), syscall()
+#endif
+
+#include "../core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+static int g_failures;
+static int g_checks;
+
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        g_checks++;                                                              \
+        if (!(cond))                                                             \
+        {                                                                        \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            g_failures++;                                                        \
+        }                                                                        \
+    } while (0)
+
+// Fixed seed: a failure reproduces on every run
+static uint32_t g_seed = 0x2545F491u;
+
+static uint32_t Random(void)
+{
+    g_seed ^= g_seed << 13;
+    g_seed ^= g_seed >> 17;
+    g_seed ^= g_seed << 5;
+    return g_seed;
+}
+
+// wcslen stand-in that works with either wchar_t size
+static size_t WideLength(const wchar_t* s)
+{
+    size_t n = 0;
+    while (s[n]) n++;
+    return n;
+}
+
+//=============================================================================
+// Paths and extensions
+//=============================================================================
+static void ReferenceSplit(const wchar_t* path, PathSpans* spans)
+{
+    size_t length = WideLength(path);
+    size_t nameStart = 0, extStart = length;
+
+    for (size_t i = 0; i < length; i++)
+        if (path[i] == L'\\' || path[i] == L'/' || path[i] == L':') nameStart = i + 1;
+
+    // The last '.' of the name, unless a space comes after it
+    for (size_t i = length; i > nameStart; i--)
+    {
+        if (path[i - 1] == L' ') break;
+        if (path[i - 1] == L'.') { extStart = i - 1; break; }
+    }
+
+    spans->length = length;
+    spans->nameStart = nameStart;
+    spans->extStart = extStart;
+}
+
+static void TestSplitPath(void)
+{
+    static const struct { const wchar_t* path; size_t nameStart, extStart; } cases[] = {
+        { L"",                       0,  0 },
+        { L"file",                   0,  4 },
+        { L"C:\\dir\\name.tar.gz",   7,  15 },
+        { L"C:name.rar",             2,  6 },
+        { L"a/b\\c.d",               4,  5 },
+        { L".hidden",                0,  0 },
+        { L"dir.d\\file",            6,  10 },
+        { L"name.part 1",            0,  11 },
+        { L"name. rar.zip",          0,  9 },
+        { L"trailing\\",             9,  9 },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        PathSpans spans;
+        SplitPath(cases[i].path, &spans);
+        CHECK(spans.length == WideLength(cases[i].path));
+        CHECK(spans.nameStart == cases[i].nameStart);
+        CHECK(spans.extStart == cases[i].extStart);
+    }
+
+    // Random paths at every alignment, so the vector scans see the
+    // terminator and the separators in every lane and across blocks
+    static const wchar_t alphabet[] = { L'a', L'Z', L'.', L' ', L'\\', L'/', L':', L'-',
+                                        0x00E9, 0x4E2D, 0x7FFF, 0xFFFD };
+    wchar_t buffer[320 + 16];
+
+    for (int round = 0; round < 20000; round++)
+    {
+        size_t offset = Random() % 16;
+        size_t length = Random() % 300;
+        wchar_t* path = buffer + offset;
+
+        for (size_t i = 0; i < length; i++)
+            path[i] = alphabet[Random() % (sizeof(alphabet) / sizeof(alphabet[0]))];
+        path[length] = L'\0';
+
+        PathSpans expected, actual;
+        ReferenceSplit(path, &expected);
+        SplitPath(path, &actual);
+        CHECK(actual.length == expected.length);
+        CHECK(actual.nameStart == expected.nameStart);
+        CHECK(actual.extStart == expected.extStart);
+        CHECK(FindFileName(path) == path + expected.nameStart);
+        CHECK(FindExtension(path) == path + expected.extStart);
+    }
+}
+
+static wchar_t ReferenceFold(wchar_t c)
+{
+    return (c >= L'A' && c <= L'Z') ? (wchar_t)(c + 32) : c;
+}
+
+static void TestEqualsIgnoreCase(void)
+{
+    // The neighbours of 'A'..'Z' and 'a'..'z' must not fold
+    static const wchar_t alphabet[] = { L'@', L'A', L'M', L'Z', L'[', L'`', L'a', L'm', L'z', L'{',
+                                        0x00C0, 0x00E0, 0x8041, 0xFF21 };
+    wchar_t a[80], b[80];
+
+    for (int round = 0; round < 50000; round++)
+    {
+        size_t n = Random() % 40;
+        size_t offset = Random() % 8;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            wchar_t c = alphabet[Random() % (sizeof(alphabet) / sizeof(alphabet[0]))];
+            a[offset + i] = c;
+            // Mostly the same character, its case flipped half the time
+            if (Random() % 8 == 0)
+                c = alphabet[Random() % (sizeof(alphabet) / sizeof(alphabet[0]))];
+            else if ((Random() & 1) && c >= L'A' && c <= L'Z')
+                c = (wchar_t)(c + 32);
+            else if ((Random() & 1) && c >= L'a' && c <= L'z')
+                c = (wchar_t)(c - 32);
+            b[offset + i] = c;
+        }
+
+        int expected = 1;
+        for (size_t i = 0; i < n; i++)
+            if (ReferenceFold(a[offset + i]) != ReferenceFold(b[offset + i])) expected = 0;
+
+        CHECK(EqualsIgnoreCase(a + offset, b + offset, n) == expected);
+    }
+
+    CHECK(EqualsIgnoreCase(L"WinRAR.EXE", L"winrar.exe", 10));
+    CHECK(!EqualsIgnoreCase(L"[", L"{", 1));
+    CHECK(!EqualsIgnoreCase(L"@", L"`", 1));
+}
+
+static void TestMatchesExtension(void)
+{
+    static const wchar_t extensions[][EXTENSION_CHARS] = { L".rar", L".zip", L".7z", L".tar.gz" };
+    int count = (int)(sizeof(extensions) / sizeof(extensions[0]));
+
+    CHECK(MatchesExtension(L"C:\\dir\\a.rar", extensions, count));
+    CHECK(MatchesExtension(L"C:\\dir\\A.ZiP", extensions, count));
+    CHECK(MatchesExtension(L"x.7z", extensions, count));
+    CHECK(!MatchesExtension(L"x.7zz", extensions, count));
+    CHECK(!MatchesExtension(L"x.7", extensions, count));
+    CHECK(!MatchesExtension(L"x.rar.txt", extensions, count));
+    CHECK(!MatchesExtension(L"rar", extensions, count));
+    CHECK(!MatchesExtension(L"x.", extensions, count));
+    CHECK(!MatchesExtension(L"x.rar\\file", extensions, count));
+    CHECK(!MatchesExtension(L"x.abcdefghijklmnopq", extensions, count));
+    // Only the last extension counts
+    CHECK(!MatchesExtension(L"x.tar.gz", extensions, count));
+}
+
+//=============================================================================
+// Selection, naming, list files and command lines
+//=============================================================================
+static void TestClassifySelection(void)
+{
+    CHECK(ClassifySelection(0, 0, 0) == SEL_NONE);
+    CHECK(ClassifySelection(1, 0, 1) == SEL_SINGLE_ARCHIVE);
+    CHECK(ClassifySelection(1, 0, 0) == SEL_NONE);
+    CHECK(ClassifySelection(0, 1, 0) == SEL_FOLDERS_ONLY);
+    CHECK(ClassifySelection(2, 0, 0) == SEL_FILES_ONLY);
+    CHECK(ClassifySelection(0, 3, 0) == SEL_FOLDERS_ONLY);
+    CHECK(ClassifySelection(1, 1, 0) == SEL_MIXED);
+}
+
+static void TestSelectionArena(void)
+{
+    static void* block[4096 / sizeof(void*)];
+    size_t lens[64];
+
+    // Sized exactly to what ReadSelection takes from it, whatever the lengths
+    for (int round = 0; round < 200; round++)
+    {
+        unsigned n = 1 + (unsigned)(Random() % 64);
+        for (unsigned i = 0; i < n; i++)
+            lens[i] = Random() % 40;
+        size_t bytes = SelectionArenaSize(lens, n, 3, 33);
+        if (bytes > sizeof(block))
+            continue;
+
+        Arena arena = { (uint8_t*)block, bytes, 0 };
+        int ok = ArenaAlloc(&arena, n * sizeof(wchar_t*)) != NULL;
+        for (unsigned i = 0; i < n; i++)
+        {
+            uint8_t* p = ArenaAlloc(&arena, (lens[i] + 1) * sizeof(wchar_t));
+            ok = ok && p && ((uintptr_t)p % sizeof(void*)) == 0;
+        }
+        for (int copy = 0; copy < 3; copy++)
+            ok = ok && ArenaAlloc(&arena, (lens[0] + 1) * sizeof(wchar_t));
+        ok = ok && ArenaAlloc(&arena, 33 * sizeof(wchar_t));
+        CHECK(ok && arena.used == bytes);
+        CHECK(!ArenaAlloc(&arena, 1));
+    }
+
+    Arena empty = { NULL, 0, 0 };
+    CHECK(!ArenaAlloc(&empty, 1));
+}
+
+static void TestEncodeListLine(void)
+{
+    uint16_t out[16];
+
+    CHECK(EncodeListLine(L"a\\b", out, 16) == 5);
+    CHECK(out[0] == 'a' && out[1] == '\\' && out[2] == 'b' && out[3] == '\r' && out[4] == '\n');
+    CHECK(EncodeListLine(L"", out, 16) == 2);
+    CHECK(EncodeListLine(L"a\\b", out, 5) == 5);
+    CHECK(EncodeListLine(L"a\\b", out, 4) == 0);
+    CHECK(EncodeListLine(L"", out, 1) == 0);
+
+#if WCHAR_MAX > 0xFFFF
+    // U+1F600 as a surrogate pair
+    static const wchar_t emoji[] = { 0x1F600, 0 };
+    CHECK(EncodeListLine(emoji, out, 16) == 4);
+    CHECK(out[0] == 0xD83D && out[1] == 0xDE00);
+    CHECK(EncodeListLine(emoji, out, 3) == 0);
+#endif
+}
+
+#if !defined(CORE_TESTS_PATHS_ONLY)
+static int WideEquals(const wchar_t* a, const wchar_t* b)
+{
+    while (*a && *a == *b) { a++; b++; }
+    return *a == *b;
+}
+
+static void TestNaming(void)
+{
+    wchar_t folderName[CORE_MAX_PATH], destFolder[CORE_MAX_PATH], out[CORE_MAX_PATH];
+
+    CHECK(MakeExtractDestination(L"C:\\dir\\name.rar", folderName, destFolder));
+    CHECK(WideEquals(folderName, L"name"));
+    CHECK(WideEquals(destFolder, L"C:\\dir\\name"));
+
+    CHECK(MakeExtractDestination(L"C:\\name.tar.gz", folderName, destFolder));
+    CHECK(WideEquals(folderName, L"name.tar"));
+    CHECK(WideEquals(destFolder, L"C:\\name.tar"));
+
+    CHECK(MakeExtractDestination(L"archive", folderName, destFolder));
+    CHECK(WideEquals(folderName, L"archive"));
+    CHECK(WideEquals(destFolder, L"archive"));
+
+    CHECK(MakeZipPath(L"C:\\dir", L"x", out));
+    CHECK(WideEquals(out, L"C:\\dir\\x.zip"));
+    CHECK(MakeZipPath(L"C:\\", L"x", out));
+    CHECK(WideEquals(out, L"C:\\x.zip"));
+    CHECK(MakeZipPath(L"\\\\server\\share/", L"y", out));
+    CHECK(WideEquals(out, L"\\\\server\\share/y.zip"));
+
+    // Too long for CORE_MAX_PATH: refused, never truncated
+    wchar_t longPath[CORE_MAX_PATH + 32];
+    wmemcpy(longPath, L"C:\\", 3);
+    for (size_t i = 3; i < CORE_MAX_PATH + 20; i++) longPath[i] = L'n';
+    wmemcpy(longPath + CORE_MAX_PATH + 20, L".rar", 5);
+    CHECK(!MakeExtractDestination(longPath, folderName, destFolder));
+
+    longPath[CORE_MAX_PATH - 5] = L'\0';  // Fits alone, not with "\x.zip"
+    CHECK(!MakeZipPath(longPath, L"x", out));
+    CHECK(out[0] == L'\0');
+    longPath[CORE_MAX_PATH - 7] = L'\0';  // 253 + "\x.zip" = 259
+    CHECK(MakeZipPath(longPath, L"x", out));
+}
+
+static void TestCommands(void)
+{
+    wchar_t out[512];
+
+    CHECK(FormatListCommand(out, 512, L"C:\\WinRAR\\WinRAR.exe", L"a -afzip -ep1", L"C:\\x.zip", L"C:\\t\\l.lst"));
+    CHECK(WideEquals(out, L"\"C:\\WinRAR\\WinRAR.exe\" a -afzip -ep1 \"C:\\x.zip\" @\"C:\\t\\l.lst\""));
+
+    CHECK(FormatExtractCommand(out, 512, L"W.exe", L"C:\\a.rar", NULL, L"C:\\a"));
+    CHECK(WideEquals(out, L"\"W.exe\" x \"C:\\a.rar\" \"C:\\a\\\""));
+    CHECK(FormatExtractCommand(out, 512, L"W.exe", L"C:\\a.rar", L"\\\\.\\pipe\\l", L"C:\\a"));
+    CHECK(WideEquals(out, L"\"W.exe\" x \"C:\\a.rar\" @\"\\\\.\\pipe\\l\" \"C:\\a\\\""));
+
+    // Exactly full (the terminator fits) and one character short
+    size_t length = WideLength(L"\"W.exe\" x \"C:\\a.rar\" \"C:\\a\\\"");
+    CHECK(FormatExtractCommand(out, length + 1, L"W.exe", L"C:\\a.rar", NULL, L"C:\\a"));
+    out[0] = L'?';
+    CHECK(!FormatExtractCommand(out, length, L"W.exe", L"C:\\a.rar", NULL, L"C:\\a"));
+    CHECK(out[0] == L'\0');
+    out[0] = L'?';
+    CHECK(!FormatListCommand(out, 8, L"W.exe", L"a", L"x.zip", L"l.lst"));
+    CHECK(out[0] == L'\0');
+}
+
+#if defined(__linux__)
+// A child reads h->path the way an archiver would, by name, and exits 0
+// if it got exactly size bytes with the given CRC
+static int ReadInChild(ListHandoff* h, size_t size, uint32_t crc)
+{
+    pid_t child = fork();
+    if (child == 0)
+    {
+        static uint8_t buffer[65536];
+        uint32_t got = 0;
+        size_t total = 0;
+        ssize_t n;
+
+        if (h->writeFd >= 0) close(h->writeFd);  // exec would have closed it
+        int fd = open(h->path, O_RDONLY);
+        if (fd < 0) _exit(2);
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+        {
+            got = Crc32Update(got, buffer, (size_t)n);
+            total += (size_t)n;
+        }
+        _exit(n == 0 && total == size && got == crc ? 0 : 1);
+    }
+    if (child < 0) return 0;
+
+    int status = 0;
+    int served = ListHandoffServe(h);
+    waitpid(child, &status, 0);
+    return served && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void TestListHandoff(void)
+{
+    static const ListTransport transports[3] = { LIST_FILE, LIST_PIPE, LIST_MEMFD };
+    const char* tempDir = getenv("TMPDIR");
+    size_t big = 3 * 1024 * 1024 / 2;   // Past a pipe's buffer, even at LIST_PIPE_BUFFER
+    uint8_t* data = malloc(big);
+    ListHandoff h;
+
+    CHECK(data != NULL);
+    if (!data) return;
+    if (!tempDir || !tempDir[0]) tempDir = "/tmp";
+    for (size_t i = 0; i < big; i++)
+        data[i] = (uint8_t)Random();
+
+    for (int t = 0; t < 3; t++)
+    {
+        CHECK(ListHandoffOpen(&h, transports[t], data, 100, tempDir));
+        CHECK(h.pendingSize == 0 && h.writeFd < 0);
+        CHECK(ReadInChild(&h, 100, Crc32Update(0, data, 100)));
+        ListHandoffClose(&h);
+
+        CHECK(ListHandoffOpen(&h, transports[t], data, big, tempDir));
+        CHECK(ReadInChild(&h, big, Crc32Update(0, data, big)));
+        ListHandoffClose(&h);
+
+        // Empty lists are fine too
+        CHECK(ListHandoffOpen(&h, transports[t], data, 0, tempDir));
+        CHECK(ReadInChild(&h, 0, 0));
+        ListHandoffClose(&h);
+    }
+
+    // /dev/fd paths for pipe and memfd, a temp file that's gone once closed
+    CHECK(ListHandoffOpen(&h, LIST_MEMFD, data, 10, tempDir));
+    CHECK(strncmp(h.path, "/dev/fd/", 8) == 0 && h.fd >= 0);
+    ListHandoffClose(&h);
+    CHECK(h.fd < 0 && !h.path[0]);
+
+    char path[CORE_MAX_PATH];
+    CHECK(ListHandoffOpen(&h, LIST_FILE, data, 10, tempDir));
+    CHECK(h.fd < 0 && strncmp(h.path, tempDir, strlen(tempDir)) == 0);
+    strcpy(path, h.path);
+    CHECK(access(path, R_OK) == 0);
+    ListHandoffClose(&h);
+    CHECK(access(path, F_OK) != 0);
+
+    // A child that goes away without reading fails the serve, not the parent
+    void (*old)(int) = signal(SIGPIPE, SIG_IGN);
+    CHECK(ListHandoffOpen(&h, LIST_PIPE, data, big, tempDir));
+    CHECK(h.pendingSize > 0);
+    pid_t child = fork();
+    if (child == 0)
+        _exit(0);
+    CHECK(!ListHandoffServe(&h));
+    waitpid(child, NULL, 0);
+    ListHandoffClose(&h);
+    signal(SIGPIPE, old);
+
+    // Temp folder paths that don't fit leave nothing behind
+    char longDir[CORE_MAX_PATH + 16];
+    memset(longDir, 'a', sizeof(longDir) - 1);
+    longDir[sizeof(longDir) - 1] = '\0';
+    CHECK(!ListHandoffOpen(&h, LIST_FILE, data, 10, longDir));
+    CHECK(h.fd < 0 && h.writeFd < 0 && !h.path[0]);
+
+    free(data);
+}
+#endif
+
+//=============================================================================
+// Path filter
+//=============================================================================
+// The reference takes the rules one at a time and matches each with a
+// backtracking glob, the last matching rule deciding
+typedef struct {
+    wchar_t glob[64];
+    int include;
+    int floating;
+} ReferenceRule;
+
+static int IsSep(wchar_t c)
+{
+    return c == L'\\' || c == L'/';
+}
+
+// 0 for a rule that's empty once its '!' and separators are stripped
+static int ReferenceParse(const wchar_t* line, ReferenceRule* r)
+{
+    wchar_t buf[64];
+    size_t n = 0;
+
+    r->include = (*line == L'!');
+    if (r->include) line++;
+    for (; *line && n < 63; line++)
+        buf[n++] = (*line == L'/') ? L'\\' : *line;
+    while (n && buf[n - 1] == L'\\') n--;
+    buf[n] = L'\0';
+
+    const wchar_t* glob = buf;
+    if (*glob == L'\\')
+    {
+        r->floating = 0;
+        while (*glob == L'\\') glob++;
+    }
+    else if (glob[0] == L'*' && glob[1] == L'*' && glob[2] == L'\\')
+    {
+        r->floating = 1;
+        glob += 3;
+    }
+    else
+    {
+        r->floating = 1;
+        for (const wchar_t* p = glob; *p; p++)
+            if (*p == L'\\') r->floating = 0;
+    }
+
+    for (n = 0; glob[n]; n++) r->glob[n] = glob[n];
+    r->glob[n] = L'\0';
+    return n != 0;
+}
+
+// Whole of s against p: '*' within a component, '**' across them, and
+// "\**\" may stand for a single separator
+static int ReferenceGlob(const wchar_t* p, const wchar_t* s)
+{
+    if (!*p) return !*s;
+
+    if (*p == L'*')
+    {
+        size_t run = 0;
+        while (p[run] == L'*') run++;
+        for (size_t k = 0; ; k++)
+        {
+            if (ReferenceGlob(p + run, s + k)) return 1;
+            if (!s[k] || (run == 1 && IsSep(s[k]))) return 0;
+        }
+    }
+    if (!*s) return 0;
+    if (*p == L'?') return !IsSep(*s) && ReferenceGlob(p + 1, s + 1);
+    if (*p == L'\\')
+    {
+        size_t run = 0;
+        if (!IsSep(*s)) return 0;
+        while (p[1 + run] == L'*') run++;
+        if (run >= 2 && p[1 + run] == L'\\' && ReferenceGlob(p + 2 + run, s + 1)) return 1;
+        return ReferenceGlob(p + 1, s + 1);
+    }
+    return ReferenceFold(*p) == ReferenceFold(*s) && ReferenceGlob(p + 1, s + 1);
+}
+
+static int ReferenceAllows(const ReferenceRule* rules, int nRules, const wchar_t* path)
+{
+    int allowed = 1;
+
+    for (int i = 0; i < nRules; i++)
+    {
+        int matched = ReferenceGlob(rules[i].glob, path);
+        // Floating rules also match from the start of every component
+        for (size_t k = 1; path[k - 1] && rules[i].floating && !matched; k++)
+            matched = IsSep(path[k - 1]) && ReferenceGlob(rules[i].glob, path + k);
+        if (matched) allowed = rules[i].include;
+    }
+    return allowed;
+}
+
+static int FilterAllowsPath(const PathFilter* f, const wchar_t* path)
+{
+    StateSet s;
+    FilterStart(f, &s);
+    FilterFeed(f, &s, path, WideLength(path));
+    return FilterAllows(f, &s);
+}
+
+static PathFilter g_Filter;
+
+static void TestPathFilter(void)
+{
+    static const struct { const wchar_t* path; int allowed; } cases[] = {
+        { L"node_modules",                  0 },
+        { L"src\\node_modules",             0 },
+        { L"src\\node_modules2",            1 },
+        { L"a.TMP",                         0 },
+        { L"dir\\keep.tmp",                 1 },   // Re-included by a later rule
+        { L"build\\out",                    0 },
+        { L"build/out",                     0 },
+        { L"src\\build\\out",               1 },   // Anchored
+        { L"x\\bin\\Debug",                 0 },
+        { L"bin\\Debug",                    0 },   // "**/" also matches at the root
+        { L"docs\\a\\b",                    0 },   // "/**/" as one folder...
+        { L"docs\\b",                       0 },   // ...and as none
+        { L"docs\\ab",                      1 },
+        { L"docsb",                         1 },
+        { L"file?.c",                       1 },
+        { L"data\\x1",                      0 },
+        { L"data\\x12",                     1 },
+        { L"data\\x\\1",                    1 },   // '?' doesn't match a separator
+    };
+    wchar_t text[] = L"# comment\r\n"
+                     L"  node_modules  \n"
+                     L"*.tmp\n"
+                     L"!keep.tmp\n"
+                     L"build/out/\n"
+                     L"**/bin/Debug\n"
+                     L"\n"
+                     L"docs/**/b\n"
+                     L"/data/x?\n"
+                     L"!\n";
+    unsigned skipped = 99;
+
+    CHECK(CompileFilter(&g_Filter, text, &skipped) == 7);
+    CHECK(skipped == 0);
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        CHECK(FilterAllowsPath(&g_Filter, cases[i].path) == cases[i].allowed);
+
+    // Folder path first, then each name on top of it, like the walker
+    StateSet dir, child;
+    FilterStart(&g_Filter, &dir);
+    FilterFeed(&g_Filter, &dir, L"src\\lib", 7);
+    FilterFeed(&g_Filter, &dir, L"\\", 1);
+    child = dir;
+    FilterFeed(&g_Filter, &child, L"node_modules", 12);
+    CHECK(!FilterAllows(&g_Filter, &child));
+    child = dir;
+    FilterFeed(&g_Filter, &child, L"main.c", 6);
+    CHECK(FilterAllows(&g_Filter, &child));
+
+    wchar_t none[] = L"# nothing\n\n   \n/\n";
+    CHECK(CompileFilter(&g_Filter, none, NULL) == 0);
+    CHECK(FilterAllowsPath(&g_Filter, L"anything"));
+
+    // Random rule sets against the reference, on paths built from the
+    // same few characters so that rules match often
+    static const wchar_t* pieces[] = { L"a", L"b", L"B", L".", L"*", L"**", L"?", L"/", L"\\", L"\x00E9" };
+    static const wchar_t* names[] = { L"a", L"b", L"ab", L"A", L".", L"\x00E9", L"ba.b", L"bb" };
+
+    for (int round = 0; round < 3000; round++)
+    {
+        ReferenceRule rules[8];
+        wchar_t ruleText[8 * 64], line[64];
+        size_t used = 0;
+        int nRules = 0, nLines = 1 + (int)(Random() % 6);
+
+        for (int r = 0; r < nLines; r++)
+        {
+            size_t n = 0;
+            if (Random() % 3 == 0) line[n++] = L'!';
+            if (Random() % 5 == 0) line[n++] = L'/';
+            for (int k = 1 + (int)(Random() % 6); k > 0; k--)
+                for (const wchar_t* p = pieces[Random() % 10]; *p; p++) line[n++] = *p;
+            line[n] = L'\0';
+
+            if (ReferenceParse(line, &rules[nRules])) nRules++;
+            for (size_t k = 0; k < n; k++) ruleText[used++] = line[k];
+            ruleText[used++] = L'\n';
+        }
+        ruleText[used] = L'\0';
+
+        unsigned compiled = CompileFilter(&g_Filter, ruleText, &skipped);
+        CHECK(compiled == (unsigned)nRules);
+        CHECK(skipped == 0);
+
+        for (int trial = 0; trial < 20; trial++)
+        {
+            wchar_t path[64];
+            size_t n = 0;
+            for (int d = 1 + (int)(Random() % 4); d > 0; d--)
+            {
+                for (const wchar_t* p = names[Random() % 8]; *p; p++) path[n++] = *p;
+                if (d > 1) path[n++] = (Random() % 4) ? L'\\' : L'/';
+            }
+            path[n] = L'\0';
+
+            int expected = ReferenceAllows(rules, nRules, path);
+            CHECK(FilterAllowsPath(&g_Filter, path) == expected);
+
+            // Fed in two pieces
+            StateSet s;
+            size_t cut = Random() % (n + 1);
+            FilterStart(&g_Filter, &s);
+            FilterFeed(&g_Filter, &s, path, cut);
+            FilterFeed(&g_Filter, &s, path + cut, n - cut);
+            CHECK(FilterAllows(&g_Filter, &s) == expected);
+        }
+    }
+}
+
+// Rule sets that don't fit leave out whole rules, never part of one
+static void TestPathFilterLimits(void)
+{
+    static wchar_t text[FILTER_MAX_STATES * 4 + 64];
+    unsigned skipped;
+    size_t n = 0;
+
+    // One rule longer than all the states there are, between two that fit
+    for (const wchar_t* p = L"first\n"; *p; p++) text[n++] = *p;
+    for (int i = 0; i < FILTER_MAX_STATES + 10; i++) text[n++] = L'x';
+    for (const wchar_t* p = L"\nlast\n"; *p; p++) text[n++] = *p;
+    text[n] = L'\0';
+    CHECK(CompileFilter(&g_Filter, text, &skipped) == 2);
+    CHECK(skipped == 1);
+    CHECK(!FilterAllowsPath(&g_Filter, L"first"));
+    CHECK(!FilterAllowsPath(&g_Filter, L"dir\\last"));
+    CHECK(FilterAllowsPath(&g_Filter, L"xxxxxxxx"));
+
+    // More short rules than states: the ones that fit still work
+    n = 0;
+    for (int i = 0; i < 400; i++)
+    {
+        text[n++] = L'a' + i % 26;
+        text[n++] = L'a' + i / 26;
+        text[n++] = L'\n';
+    }
+    text[n] = L'\0';
+    unsigned compiled = CompileFilter(&g_Filter, text, &skipped);
+    CHECK(compiled + skipped == 400);
+    CHECK(skipped > 0);
+    CHECK(compiled * 3 <= FILTER_MAX_STATES);
+    CHECK(!FilterAllowsPath(&g_Filter, L"x\\aa"));
+    CHECK(FilterAllowsPath(&g_Filter, L"x\\aq"));     // Would be rule 416
+
+    // More distinct characters than classes: a skipped rule's character
+    // must not end up matching as "any other character"
+    n = 0;
+    for (int i = 0; i < 300; i++)
+    {
+        text[n++] = (wchar_t)(0x4E00 + i);
+        text[n++] = L'\n';
+    }
+    text[n] = L'\0';
+    compiled = CompileFilter(&g_Filter, text, &skipped);
+    CHECK(compiled + skipped == 300);
+    CHECK(skipped > 0);
+    CHECK(!FilterAllowsPath(&g_Filter, L"\x4E00"));
+    CHECK(FilterAllowsPath(&g_Filter, L"\x4F2B"));     // 0x4E00 + 299
+    CHECK(FilterAllowsPath(&g_Filter, L"z"));
+}
+
+//=============================================================================
+// Device scheduling
+//=============================================================================
+// "<id><kind letter>...", anything else can't be placed
+static int FakeResolve(void* context, const wchar_t* path, DeviceKey* dev)
+{
+    ++*(int*)context;
+    if (path[0] < L'0' || path[0] > L'9') return 0;
+    dev->id = (uint32_t)(path[0] - L'0');
+    dev->kind = (path[1] == L's') ? DEVICE_SSD : (path[1] == L'n') ? DEVICE_NETWORK : DEVICE_HDD;
+    return 1;
+}
+
+static void TestDevices(void)
+{
+    static const unsigned limits[DEVICE_KINDS] = { 1, 3, 0 };
+    static DeviceSlots slots;
+    DeviceKey a[2], b[2], c[2], d[2];
+    int calls = 0;
+
+    CHECK(ResolveTaskDevices(FakeResolve, &calls, limits, L"1h\\x", L"1h\\y", a) == 1);
+    CHECK(calls == 2);
+    CHECK(a[0].id == 1 && a[0].kind == DEVICE_HDD && a[0].limit == 1);
+    CHECK(ResolveTaskDevices(FakeResolve, &calls, limits, L"2s\\x", L"3n\\y", b) == 2);
+    CHECK(b[0].kind == DEVICE_SSD && b[0].limit == 3);
+    CHECK(b[1].kind == DEVICE_NETWORK && b[1].limit == 1);     // 0 means 1
+
+    // Unplaced paths get a device each, the same one for the same path
+    CHECK(ResolveTaskDevices(FakeResolve, &calls, limits, L"C:\\a", L"c:\\A", c) == 1);
+    CHECK(ResolveTaskDevices(FakeResolve, &calls, limits, L"C:\\a", L"C:\\b", c) == 2);
+    CHECK(c[0].kind == DEVICE_HDD && c[0].limit == 1);
+
+    // One task per hard disk, three on the SSD
+    memset(&slots, 0, sizeof(slots));
+    CHECK(TryAcquireDevices(&slots, a, 1));
+    CHECK(!TryAcquireDevices(&slots, a, 1));
+    ResolveTaskDevices(FakeResolve, &calls, limits, L"2s\\x", L"1h\\y", d);
+    CHECK(!TryAcquireDevices(&slots, d, 2));
+    CHECK(slots.slots[0].running == 1);                         // Nothing taken on the SSD
+    for (unsigned i = 0; i < slots.nSlots; i++)
+        CHECK(slots.slots[i].id != 2 || slots.slots[i].running == 0);
+    ReleaseDevices(&slots, a, 1);
+    CHECK(TryAcquireDevices(&slots, d, 2));
+    CHECK(TryAcquireDevices(&slots, b, 1));
+    CHECK(TryAcquireDevices(&slots, b, 1));
+    CHECK(!TryAcquireDevices(&slots, b, 1));
+    ReleaseDevices(&slots, d, 2);
+    ReleaseDevices(&slots, b, 1);
+    ReleaseDevices(&slots, b, 1);
+    ReleaseDevices(&slots, b, 1);                               // One too many is ignored
+    CHECK(TryAcquireDevices(&slots, a, 1));
+    ReleaseDevices(&slots, a, 1);
+
+    // A full table drops idle devices; with DEVICE_MAX busy ones a new
+    // device runs unlimited rather than never
+    memset(&slots, 0, sizeof(slots));
+    for (uint32_t i = 0; i < DEVICE_MAX + 8; i++)
+    {
+        DeviceKey k = { 100 + i, DEVICE_HDD, 1 };
+        CHECK(TryAcquireDevices(&slots, &k, 1));
+        if (i < 8) ReleaseDevices(&slots, &k, 1);
+    }
+    CHECK(slots.nSlots == DEVICE_MAX);
+    DeviceKey extra = { 99, DEVICE_HDD, 1 };
+    CHECK(TryAcquireDevices(&slots, &extra, 1));
+    CHECK(TryAcquireDevices(&slots, &extra, 1));
+
+#if defined(__linux__)
+    // Whatever disk this runs on, the same device twice, and a path that
+    // doesn't exist isn't placed
+    DeviceKey root, tmp, dir;
+    CHECK(ResolveDevicePosix(NULL, L"/", &root));
+    CHECK(ResolveDevicePosix(NULL, L"/.", &dir));
+    CHECK(root.id == dir.id && root.kind == dir.kind);
+    CHECK(ResolveDevicePosix(NULL, L"/tmp", &tmp));
+    CHECK(!ResolveDevicePosix(NULL, L"/nonexistent\x00E9/x", &dir));
+    CHECK(ResolveTaskDevices(ResolveDevicePosix, NULL, limits, L"/", L"/.", a) == 1);
+#endif
+}
+
+//=============================================================================
+// QoS policy
+//=============================================================================
+// A synthetic load trace: quiet, a burst, noise around the threshold, a
+// long busy stretch, quiet again. Each sample lists the throttle state
+// expected after it.
+static void TestQos(void)
+{
+    static const struct { unsigned load; int throttled; } trace[] = {
+        { 10, 0 }, { 40, 0 }, { 74, 0 },
+        { 75, 1 },                          // Reaches the threshold
+        { 74, 1 }, { 61, 1 }, { 60, 1 },    // Hysteresis: holds down to 60
+        { 59, 0 },
+        { 74, 0 }, { 76, 1 }, { 65, 1 }, { 77, 1 }, { 62, 1 },    // Noise doesn't flap
+        { 100, 1 }, { 100, 1 }, { 95, 1 },
+        { 0, 0 }, { 0, 0 },
+    };
+    QosPolicy p;
+    unsigned switches = 0;
+
+    memset(&p, 0, sizeof(p));
+    QosConfigure(&p, 75, 15, 40);
+    CHECK(p.niceLow == 10 && p.niceIdle == 19);
+    for (size_t i = 0; i < sizeof(trace) / sizeof(trace[0]); i++)
+    {
+        int was = p.throttled;
+        int changed = QosUpdate(&p, trace[i].load);
+
+        CHECK(p.throttled == trace[i].throttled);
+        CHECK(changed == (was != p.throttled));
+        switches += (unsigned)changed;
+
+        // Foreground work is never held back or slowed
+        CHECK(QosPriorityOf(&p, QOS_FOREGROUND) == QOS_PRIORITY_NORMAL);
+        CHECK(QosMayStart(&p, QOS_FOREGROUND, 5));
+        CHECK(QosPriorityOf(&p, QOS_BACKGROUND) == (p.throttled ? QOS_PRIORITY_IDLE : QOS_PRIORITY_LOW));
+        CHECK(QosCpuRate(&p) == (p.throttled ? 10u : 40u));
+        CHECK(QosMayStart(&p, QOS_BACKGROUND, 0));
+        CHECK(QosMayStart(&p, QOS_BACKGROUND, 2) == !p.throttled);
+
+        // Reconfiguring keeps the state
+        QosConfigure(&p, 75, 15, 40);
+        CHECK(p.throttled == trace[i].throttled);
+    }
+    CHECK(switches == 4);
+
+    // Random load: the throttle only switches on crossing a bound
+    for (int i = 0; i < 10000; i++)
+    {
+        unsigned load = Random() % 101;
+        int was = p.throttled;
+        QosUpdate(&p, load);
+        if (!was && p.throttled) CHECK(load >= 75);
+        if (was && !p.throttled) CHECK(load < 60);
+        if (was == p.throttled) CHECK(was ? load >= 60 : load < 75);
+    }
+
+    // No threshold never throttles; a small cap doesn't drop to 0
+    QosConfigure(&p, 0, 15, 4);
+    QosUpdate(&p, 100);
+    CHECK(!p.throttled);
+    QosConfigure(&p, 50, 15, 4);
+    QosUpdate(&p, 100);
+    CHECK(p.throttled && QosCpuRate(&p) == 1);
+    QosConfigure(&p, 50, 15, 0);
+    CHECK(QosCpuRate(&p) == 0);
+
+#if defined(__linux__)
+    // The knobs on a real process: a child lowered to LOW, then IDLE
+    QosConfigure(&p, 75, 15, 40);
+    pid_t child = fork();
+    if (child == 0)
+    {
+        pause();
+        _exit(0);
+    }
+    CHECK(child > 0);
+    if (child > 0)
+    {
+        CHECK(QosApplyPosix(child, QOS_PRIORITY_LOW, &p));
+        errno = 0;
+        CHECK(getpriority(PRIO_PROCESS, (id_t)child) == 10 && errno == 0);
+        CHECK(syscall(SYS_ioprio_get, 1, child) == ((2 << 13) | 7));
+        CHECK(QosApplyPosix(child, QOS_PRIORITY_IDLE, &p));
+        CHECK(getpriority(PRIO_PROCESS, (id_t)child) == 19);
+        CHECK(syscall(SYS_ioprio_get, 1, child) == (3 << 13));
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+    }
+#endif
+}
+
+//=============================================================================
+// Run statistics
+//=============================================================================
+static void TestStats(void)
+{
+    static uint8_t file[STATS_FILE_SIZE];
+    const StatsHeader* h = (const StatsHeader*)file;
+    const StatsRecord* records = (const StatsRecord*)(h + 1);
+    StatsSummary sum;
+
+    // The layout stats.bin has always had
+    CHECK(sizeof(StatsHeader) == 16);
+    CHECK(sizeof(StatsRecord) == 552);
+    CHECK(offsetof(StatsRecord, inBytes) == 16);
+    CHECK(offsetof(StatsRecord, archive) == 32);
+
+    CHECK(!StatsSummarize(file, 0, &sum));
+    CHECK(sum.runs == 0);
+
+    // Run i finishes at time i, fails if i % 10 == 0, takes i ms and
+    // turns 1000 bytes into i bytes
+    for (uint32_t i = 1; i <= STATS_CAPACITY + 300; i++)
+    {
+        StatsRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.finished = i;
+        rec.exitCode = (i % 10 == 0) ? 3 : 0;
+        rec.wallMs = i;
+        rec.inBytes = 1000;
+        rec.outBytes = i;
+        rec.archive[0] = 'a';
+        StatsAppend(file, &rec);
+
+        if (i == 5)
+        {
+            CHECK(StatsSummarize(file, 0, &sum));
+            CHECK(sum.runs == 5 && sum.failed == 0 && sum.inBytes == 5000 && sum.outBytes == 15);
+            CHECK(sum.wallMs == 15 && sum.longestMs == 5);
+        }
+    }
+
+    // The ring keeps the last STATS_CAPACITY runs: 301 .. 1324
+    CHECK(h->count == STATS_CAPACITY && h->next == 300);
+    CHECK(records[h->next].finished == 301);
+    CHECK(StatsSummarize(file, 0, &sum));
+    CHECK(sum.runs == STATS_CAPACITY);
+    CHECK(sum.longestMs == STATS_CAPACITY + 300);
+
+    uint64_t in = 0, out = 0, wall = 0;
+    unsigned failed = 0;
+    for (uint32_t i = 1001; i <= STATS_CAPACITY + 300; i++)
+    {
+        wall += i;
+        if (i % 10 == 0) { failed++; continue; }
+        in += 1000;
+        out += i;
+    }
+    CHECK(StatsSummarize(file, 1001, &sum));
+    CHECK(sum.runs == STATS_CAPACITY + 300 - 1000);
+    CHECK(sum.failed == failed && sum.inBytes == in && sum.outBytes == out && sum.wallMs == wall);
+    CHECK(StatsSummarize(file, 5000, &sum) && sum.runs == 0);
+
+    // A foreign file starts over
+    memset(file, 0xAB, sizeof(StatsHeader));
+    CHECK(!StatsSummarize(file, 0, &sum));
+    StatsRecord one;
+    memset(&one, 0, sizeof(one));
+    one.inBytes = 10;
+    StatsAppend(file, &one);
+    CHECK(h->magic == STATS_MAGIC && h->count == 1 && h->next == 1);
+    CHECK(StatsSummarize(file, 0, &sum) && sum.runs == 1 && sum.inBytes == 10);
+
+    CHECK(StatsRatioPercent(0, 5) == 100);
+    CHECK(StatsRatioPercent(200, 50) == 25);
+    CHECK(StatsRatioPercent(3, 1) == 33);
+    CHECK(StatsRatioPercent(UINT64_MAX / 2, UINT64_MAX / 4) == 50);
+}
+
+//=============================================================================
+// Pixels
+//=============================================================================
+static void TestPremultiplyAlpha(void)
+{
+    // Every (c, a) pair, through the vector path and the tail
+    static uint8_t pixels[256 * 256 * 4];
+    size_t n = 0;
+    for (unsigned a = 0; a < 256; a++)
+        for (unsigned c = 0; c < 256; c++, n++)
+        {
+            pixels[n * 4 + 0] = (uint8_t)c;
+            pixels[n * 4 + 1] = (uint8_t)(255 - c);
+            pixels[n * 4 + 2] = (uint8_t)(c ^ 0x5A);
+            pixels[n * 4 + 3] = (uint8_t)a;
+        }
+    PremultiplyAlpha(pixels, n);
+
+    int ok = 1;
+    n = 0;
+    for (unsigned a = 0; a < 256; a++)
+        for (unsigned c = 0; c < 256; c++, n++)
+        {
+            ok &= pixels[n * 4 + 0] == c * a / 255;
+            ok &= pixels[n * 4 + 1] == (255 - c) * a / 255;
+            ok &= pixels[n * 4 + 2] == (c ^ 0x5A) * a / 255;
+            ok &= pixels[n * 4 + 3] == a;
+        }
+    CHECK(ok);
+
+    // Every short length, so each tail size is covered
+    for (size_t count = 0; count < 70; count++)
+    {
+        uint8_t before[70 * 4 + 4], after[70 * 4 + 4];
+        for (size_t i = 0; i < sizeof(before); i++) before[i] = (uint8_t)Random();
+        memcpy(after, before, sizeof(before));
+        PremultiplyAlpha(after, count);
+
+        ok = 1;
+        for (size_t i = 0; i < count * 4; i++)
+            ok &= after[i] == ((i & 3) == 3 ? before[i] : before[i] * before[(i | 3)] / 255);
+        for (size_t i = count * 4; i < sizeof(before); i++)
+            ok &= after[i] == before[i];  // Nothing past the end
+        CHECK(ok);
+    }
+}
+
+//=============================================================================
+// CRC-32, inflate, deflate, gzip
+//=============================================================================
+static uint32_t ReferenceCrc32(const uint8_t* p, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+    return ~crc;
+}
+
+static void TestCrc32(void)
+{
+    static uint8_t data[4096 + 16];
+
+    CHECK(Crc32Update(0, "123456789", 9) == 0xCBF43926u);
+    CHECK(Crc32Update(0, "", 0) == 0);
+
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t)Random();
+    for (int round = 0; round < 200; round++)
+    {
+        size_t offset = Random() % 16;
+        size_t len = Random() % 4096;
+        size_t split = len ? Random() % len : 0;
+        uint32_t expected = ReferenceCrc32(data + offset, len);
+
+        CHECK(Crc32Update(0, data + offset, len) == expected);
+        CHECK(Crc32Update(Crc32Update(0, data + offset, split), data + offset + split, len - split) == expected);
+    }
+}
+
+// Growable output for the codecs
+typedef struct {
+    uint8_t* data;
+    size_t len;
+    size_t cap;
+    size_t limit;               // Stop after this much, 0 for no limit
+} Buffer;
+
+static int BufferSink(void* context, const uint8_t* data, size_t len)
+{
+    Buffer* b = context;
+
+    if (b->len + len > b->cap)
+    {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + len) cap *= 2;
+        uint8_t* grown = realloc(b->data, cap);
+        if (!grown) return 0;
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return !b->limit || b->len < b->limit;
+}
+
+static const char g_Text[] =
+    "The quick brown fox jumps over the lazy dog. The quick brown fox jumps over the lazy dog. "
+    "The quick brown fox jumps over the lazy dog. The quick brown fox jumps over the lazy dog. "
+    "Pack my box with five dozen liquor jugs.\n";
+
+// zlib's raw deflate of g_Text: level 9, then Z_FIXED, then the first 40
+// bytes stored at level 0
+static const uint8_t g_DynamicStream[] = {
+    0xcd, 0xcb, 0xd1, 0x01, 0x80, 0x10, 0x14, 0x46, 0xe1, 0xf7, 0xa6, 0xf8, 0x27, 0x30, 0x4b, 0x0f,
+    0x16, 0x50, 0x11, 0x15, 0x37, 0x84, 0x98, 0xbe, 0x3b, 0x46, 0xcf, 0xe7, 0x3b, 0xd2, 0x6a, 0xc4,
+    0xe2, 0xd6, 0x13, 0x4b, 0xa2, 0x16, 0x60, 0xe8, 0xc5, 0x51, 0xfc, 0x9d, 0x41, 0x55, 0x27, 0x3c,
+    0x9c, 0x2f, 0x35, 0x3a, 0x36, 0xda, 0x05, 0xe4, 0x3f, 0xf0, 0xac, 0xd8, 0xf9, 0x8e, 0x85, 0x51,
+    0x73, 0x8f, 0x85, 0x71, 0x55, 0x73, 0x1a, 0x3a, 0xe0, 0x72, 0xb1, 0x50, 0xe2, 0x77, 0xcf, 0x62,
+    0xfa, 0x00,
+};
+static const uint8_t g_FixedStream[] = {
+    0x0b, 0xc9, 0x48, 0x55, 0x28, 0x2c, 0xcd, 0x4c, 0xce, 0x56, 0x48, 0x2a, 0xca, 0x2f, 0xcf, 0x53,
+    0x48, 0xcb, 0xaf, 0x50, 0xc8, 0x2a, 0xcd, 0x2d, 0x28, 0x56, 0xc8, 0x2f, 0x4b, 0x2d, 0x52, 0x28,
+    0x01, 0x4a, 0xe7, 0x24, 0x56, 0x55, 0x2a, 0xa4, 0xe4, 0xa7, 0xeb, 0x29, 0x84, 0x0c, 0x0e, 0xc5,
+    0x01, 0x89, 0x40, 0x75, 0xb9, 0x95, 0x0a, 0x49, 0x40, 0x45, 0xe5, 0x99, 0x25, 0x19, 0x0a, 0x69,
+    0x99, 0x65, 0xa9, 0x40, 0xa9, 0xaa, 0xd4, 0x3c, 0x85, 0x9c, 0xcc, 0xc2, 0xd2, 0xfc, 0x22, 0xa0,
+    0xde, 0xf4, 0x62, 0x3d, 0x2e, 0x00,
+};
+static const uint8_t g_StoredStream[] = {
+    0x01, 0x28, 0x00, 0xd7, 0xff, 0x54, 0x68, 0x65, 0x20, 0x71, 0x75, 0x69, 0x63, 0x6b, 0x20, 0x62,
+    0x72, 0x6f, 0x77, 0x6e, 0x20, 0x66, 0x6f, 0x78, 0x20, 0x6a, 0x75, 0x6d, 0x70, 0x73, 0x20, 0x6f,
+    0x76, 0x65, 0x72, 0x20, 0x74, 0x68, 0x65, 0x20, 0x6c, 0x61, 0x7a, 0x79, 0x20,
+};
+
+static Inflater g_Inflater;
+static Deflater g_Deflater;
+
+static void CheckKnownStream(const uint8_t* stream, size_t len, const char* expected, size_t expectedLen)
+{
+    Buffer out = { 0 };
+    size_t used = 0;
+
+    CHECK(Inflate(&g_Inflater, stream, len, &used, BufferSink, &out) == INFLATE_DONE);
+    CHECK(used == len);
+    CHECK(out.len == expectedLen && memcmp(out.data, expected, expectedLen) == 0);
+
+    // Every truncation is an error, never a crash or a hang
+    for (size_t cut = 0; cut < len; cut++)
+    {
+        out.len = 0;
+        CHECK(Inflate(&g_Inflater, stream, cut, NULL, BufferSink, &out) == INFLATE_ERROR);
+    }
+    free(out.data);
+}
+
+// Deflate in random sized writes, inflate, compare
+static void RoundTrip(const uint8_t* data, size_t len)
+{
+    Buffer packed = { 0 }, unpacked = { 0 };
+    size_t used = 0;
+
+    DeflateInit(&g_Deflater, BufferSink, &packed);
+    for (size_t pos = 0; pos < len; )
+    {
+        size_t n = 1 + Random() % 70000;
+        if (n > len - pos) n = len - pos;
+        CHECK(DeflateWrite(&g_Deflater, data + pos, n));
+        pos += n;
+    }
+    CHECK(DeflateFinish(&g_Deflater));
+
+    CHECK(Inflate(&g_Inflater, packed.data, packed.len, &used, BufferSink, &unpacked) == INFLATE_DONE);
+    CHECK(used == packed.len);
+    CHECK(unpacked.len == len && (len == 0 || memcmp(unpacked.data, data, len) == 0));
+    free(packed.data);
+    free(unpacked.data);
+}
+
+static void TestCodecs(void)
+{
+    size_t textLen = sizeof(g_Text) - 1;
+
+    CheckKnownStream(g_DynamicStream, sizeof(g_DynamicStream), g_Text, textLen);
+    CheckKnownStream(g_FixedStream, sizeof(g_FixedStream), g_Text, textLen);
+    CheckKnownStream(g_StoredStream, sizeof(g_StoredStream), g_Text, 40);
+
+    // A sink that stops is reported as such
+    Buffer limited = { 0 };
+    limited.limit = 10;
+    CHECK(Inflate(&g_Inflater, g_DynamicStream, sizeof(g_DynamicStream), NULL, BufferSink, &limited) == INFLATE_STOPPED);
+    free(limited.data);
+
+    size_t size = 3 * 1024 * 1024;
+    uint8_t* data = malloc(size);
+    if (!data) { CHECK(data != NULL); return; }
+
+    RoundTrip(data, 0);
+    data[0] = 'x';
+    RoundTrip(data, 1);
+
+    // Incompressible, all zeros, repeated text, and text with random
+    // edits (long and short matches at every distance)
+    for (size_t i = 0; i < size; i++) data[i] = (uint8_t)Random();
+    RoundTrip(data, size);
+    memset(data, 0, size);
+    RoundTrip(data, size);
+    for (size_t i = 0; i < size; i++) data[i] = (uint8_t)g_Text[i % textLen];
+    RoundTrip(data, size);
+    for (size_t i = 0; i < size / 16; i++) data[Random() % size] = (uint8_t)Random();
+    RoundTrip(data, size);
+    for (int round = 0; round < 50; round++)
+        RoundTrip(data + Random() % 1000, Random() % 100000);
+
+    // Garbage, and valid streams with flipped bits: any result but a crash
+    Buffer out = { 0 };
+    out.limit = 1 << 20;
+    for (int round = 0; round < 3000; round++)
+    {
+        size_t len = Random() % 512;
+        for (size_t i = 0; i < len; i++) data[i] = (uint8_t)Random();
+        out.len = 0;
+        int result = Inflate(&g_Inflater, data, len, NULL, BufferSink, &out);
+        CHECK(result == INFLATE_DONE || result == INFLATE_STOPPED || result == INFLATE_ERROR);
+
+        memcpy(data, g_DynamicStream, sizeof(g_DynamicStream));
+        data[Random() % sizeof(g_DynamicStream)] ^= (uint8_t)(1u << (Random() % 8));
+        out.len = 0;
+        result = Inflate(&g_Inflater, data, sizeof(g_DynamicStream), NULL, BufferSink, &out);
+        CHECK(result == INFLATE_DONE || result == INFLATE_STOPPED || result == INFLATE_ERROR);
+    }
+    free(out.data);
+    free(data);
+}
+
+static void TestGzipHeader(void)
+{
+    static const uint8_t plain[] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 3 };
+    static const uint8_t named[] = { 0x1F, 0x8B, 8, 8, 0, 0, 0, 0, 0, 3, 'a', '.', 't', 'x', 't', 0 };
+    static const uint8_t extra[] = { 0x1F, 0x8B, 8, 4 | 2, 0, 0, 0, 0, 0, 3, 2, 0, 'x', 'y', 0xAA, 0xBB };
+    static const uint8_t badMethod[] = { 0x1F, 0x8B, 7, 0, 0, 0, 0, 0, 0, 3 };
+    static const uint8_t reserved[] = { 0x1F, 0x8B, 8, 0x20, 0, 0, 0, 0, 0, 3 };
+
+    CHECK(GzipHeaderSize(plain, sizeof(plain)) == 10);
+    CHECK(GzipHeaderSize(plain, 9) == 0);
+    CHECK(GzipHeaderSize(named, sizeof(named)) == 16);
+    CHECK(GzipHeaderSize(named, sizeof(named) - 1) == 0);  // Name not terminated
+    CHECK(GzipHeaderSize(extra, sizeof(extra)) == 16);
+    CHECK(GzipHeaderSize(extra, sizeof(extra) - 1) == 0);
+    CHECK(GzipHeaderSize(badMethod, sizeof(badMethod)) == 0);
+    CHECK(GzipHeaderSize(reserved, sizeof(reserved)) == 0);
+}
+
+//=============================================================================
+// Tar
+//=============================================================================
+// What the handler saw, one "name|size|mtime|isDir|crc" line per member
+typedef struct {
+    char log[4096];
+    size_t logLen;
+    char name[TAR_NAME_MAX + 1];
+    uint64_t size;
+    int64_t mtime;
+    int isDir;
+    uint64_t got;
+    uint32_t crc;
+} TarLog;
+
+static int TarBegin(void* context, const char* name, size_t nameLen, uint64_t size, int64_t mtime, int isDir)
+{
+    TarLog* l = context;
+    memcpy(l->name, name, nameLen);
+    l->name[nameLen] = '\0';
+    l->size = size;
+    l->mtime = mtime;
+    l->isDir = isDir;
+    l->got = 0;
+    l->crc = 0;
+    return 1;
+}
+
+static int TarData(void* context, const uint8_t* data, size_t len)
+{
+    TarLog* l = context;
+    l->crc = Crc32Update(l->crc, data, len);
+    l->got += len;
+    return 1;
+}
+
+static int TarEnd(void* context)
+{
+    TarLog* l = context;
+    int n = snprintf(l->log + l->logLen, sizeof(l->log) - l->logLen, "%s|%llu|%lld|%d|%08x\n",
+                     l->name, (unsigned long long)l->got, (long long)l->mtime, l->isDir, (unsigned)l->crc);
+    if (n > 0 && (size_t)n < sizeof(l->log) - l->logLen) l->logLen += (size_t)n;
+    return l->got == l->size;
+}
+
+// Minimal ustar writer
+typedef struct {
+    uint8_t data[64 * 1024];
+    size_t len;
+} TarImage;
+
+static void TarOctal(uint8_t* field, size_t width, uint64_t value)
+{
+    // width - 1 digits and a terminator
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i > 0; i--, value >>= 3)
+        field[i - 1] = (uint8_t)('0' + (value & 7));
+}
+
+static void TarAdd(TarImage* tar, const char* name, const char* prefix, char type,
+                   const void* data, size_t size, uint64_t mtime)
+{
+    uint8_t* h = tar->data + tar->len;
+    memset(h, 0, 512);
+    memcpy(h, name, strlen(name) < 100 ? strlen(name) : 100);
+    TarOctal(h + 100, 8, 0644);
+    TarOctal(h + 108, 8, 0);
+    TarOctal(h + 116, 8, 0);
+    TarOctal(h + 124, 12, size);
+    TarOctal(h + 136, 12, mtime);
+    h[156] = (uint8_t)type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    if (prefix) memcpy(h + 345, prefix, strlen(prefix));
+
+    unsigned sum = 0;
+    memset(h + 148, ' ', 8);
+    for (int i = 0; i < 512; i++) sum += h[i];
+    TarOctal(h + 148, 7, sum);
+    h[155] = ' ';
+
+    tar->len += 512;
+    memcpy(tar->data + tar->len, data, size);
+    tar->len += (size + 511) & ~(size_t)511;
+}
+
+static void TarAddPax(TarImage* tar, const char* records)
+{
+    TarAdd(tar, "PaxHeaders/x", NULL, 'x', records, strlen(records), 0);
+}
+
+static void TarAddLongName(TarImage* tar, const char* name)
+{
+    TarAdd(tar, "././@LongLink", NULL, 'L', name, strlen(name) + 1, 0);
+}
+
+static void TarClose(TarImage* tar)
+{
+    memset(tar->data + tar->len, 0, 1024);
+    tar->len += 1024;
+}
+
+// Feeds the image in random pieces; returns TarFinish, or -1 if TarFeed failed
+static int TarRun(const TarImage* tar, size_t len, TarLog* log)
+{
+    static TarReader reader;
+    TarHandler handler = { TarBegin, TarData, TarEnd, log };
+
+    memset(log, 0, sizeof(*log));
+    TarInit(&reader, &handler);
+    for (size_t pos = 0; pos < len; )
+    {
+        size_t n = 1 + Random() % 700;
+        if (n > len - pos) n = len - pos;
+        if (!TarFeed(&reader, tar->data + pos, n)) return -1;
+        pos += n;
+    }
+    return TarFinish(&reader);
+}
+
+static void TestTar(void)
+{
+    static TarImage tar;
+    static TarLog log;
+    char longName[160];
+    char line[256];
+
+    // ustar prefix, folder, long names, and the names that must be skipped
+    memset(longName, 'n', sizeof(longName) - 1);
+    longName[sizeof(longName) - 1] = '\0';
+
+    tar.len = 0;
+    TarAdd(&tar, "dir/", NULL, '5', NULL, 0, 100);
+    TarAdd(&tar, "file.txt", "dir/sub", '0', "hello", 5, 200);
+    TarAdd(&tar, "./dot.txt", NULL, '0', "x", 1, 1);
+    TarAddLongName(&tar, longName);
+    TarAdd(&tar, "trunc", NULL, '0', "long", 4, 2);
+    TarAdd(&tar, "..\\..\\evil.txt", NULL, '0', "e", 1, 3);
+    TarAdd(&tar, "a/../../evil.txt", NULL, '0', "e", 1, 3);
+    TarAdd(&tar, "C:\\evil.txt", NULL, '0', "e", 1, 3);
+    TarAdd(&tar, "/abs.txt", NULL, '0', "a", 1, 4);
+    TarAdd(&tar, "win\\path.txt", NULL, '0', "w", 1, 5);
+    TarClose(&tar);
+
+    CHECK(TarRun(&tar, tar.len, &log) == 1);
+    snprintf(line, sizeof(line), "%s|4|2|0|%08x\n", longName, (unsigned)Crc32Update(0, "long", 4));
+    {
+        char expected[1024];
+        snprintf(expected, sizeof(expected),
+                 "dir|0|100|1|00000000\n"
+                 "dir/sub/file.txt|5|200|0|%08x\n"
+                 "dot.txt|1|1|0|%08x\n"
+                 "%s"
+                 "abs.txt|1|4|0|%08x\n"
+                 "win/path.txt|1|5|0|%08x\n",
+                 (unsigned)Crc32Update(0, "hello", 5), (unsigned)Crc32Update(0, "x", 1), line,
+                 (unsigned)Crc32Update(0, "a", 1), (unsigned)Crc32Update(0, "w", 1));
+        CHECK(strcmp(log.log, expected) == 0);
+    }
+
+    // A long name or pax header in front of a skipped member (a symlink)
+    // must not rename the next member
+    tar.len = 0;
+    TarAddLongName(&tar, longName);
+    TarAdd(&tar, "link", NULL, '2', NULL, 0, 0);
+    TarAdd(&tar, "short.txt", NULL, '0', "s", 1, 6);
+    TarAddPax(&tar, "20 path=paxlink.txt\n");
+    TarAdd(&tar, "link2", NULL, '2', NULL, 0, 0);
+    TarAdd(&tar, "short2.txt", NULL, '0', "t", 1, 7);
+    TarClose(&tar);
+
+    CHECK(TarRun(&tar, tar.len, &log) == 1);
+    snprintf(line, sizeof(line), "short.txt|1|6|0|%08x\nshort2.txt|1|7|0|%08x\n",
+             (unsigned)Crc32Update(0, "s", 1), (unsigned)Crc32Update(0, "t", 1));
+    CHECK(strcmp(log.log, line) == 0);
+
+    // pax path, size and mtime override the ustar fields
+    tar.len = 0;
+    TarAddPax(&tar, "24 path=pax/renamed.txt\n10 size=3\n20 mtime=1700000000\n");
+    TarAdd(&tar, "ignored", NULL, '0', "abc", 3, 9);
+    TarClose(&tar);
+
+    CHECK(TarRun(&tar, tar.len, &log) == 1);
+    snprintf(line, sizeof(line), "pax/renamed.txt|3|1700000000|0|%08x\n", (unsigned)Crc32Update(0, "abc", 3));
+    CHECK(strcmp(log.log, line) == 0);
+
+    // No end blocks is fine; a cut inside a member or a header isn't
+    tar.len = 0;
+    TarAdd(&tar, "a.txt", NULL, '0', "hello", 5, 1);
+    CHECK(TarRun(&tar, tar.len, &log) == 1);
+    CHECK(TarRun(&tar, 512 + 3, &log) == 0);
+    CHECK(TarRun(&tar, 100, &log) == 0);
+
+    // A bad checksum fails the feed
+    tar.data[0] ^= 1;
+    CHECK(TarRun(&tar, tar.len, &log) == -1);
+
+    // Names up to TAR_NAME_MAX - 1 bytes come through whole; longer ones
+    // fail rather than turning up cut or under the ustar name
+    static TarReader reader;
+    static char hugeName[TAR_NAME_MAX + 2];
+    static char paxRecord[TAR_NAME_MAX + 32];
+    TarHandler handler = { TarBegin, TarData, TarEnd, &log };
+
+    memset(hugeName, 'h', TAR_NAME_MAX - 1);
+    tar.len = 0;
+    TarAddLongName(&tar, hugeName);
+    TarAdd(&tar, "cut", NULL, '0', "h", 1, 8);
+    TarClose(&tar);
+    CHECK(TarRun(&tar, tar.len, &log) == 1);
+    CHECK(strlen(log.name) == TAR_NAME_MAX - 1);
+
+    hugeName[TAR_NAME_MAX - 1] = 'h';
+    tar.len = 0;
+    TarAdd(&tar, "fine.txt", NULL, '0', "f", 1, 8);
+    TarAddLongName(&tar, hugeName);
+    TarAdd(&tar, "cut", NULL, '0', "h", 1, 8);
+    TarClose(&tar);
+    CHECK(TarRun(&tar, tar.len, &log) == -1);
+    CHECK(strncmp(log.log, "fine.txt|", 9) == 0 && !strstr(log.log, "cut"));
+    memset(&log, 0, sizeof(log));
+    TarInit(&reader, &handler);
+    CHECK(!TarFeed(&reader, tar.data, tar.len) && reader.nameTooLong);
+
+    // "<4 digits> path=<name>\n"
+    snprintf(paxRecord, sizeof(paxRecord), "%d path=%s\n", (int)(4 + 6 + strlen(hugeName) + 1), hugeName);
+    tar.len = 0;
+    TarAddPax(&tar, paxRecord);
+    TarAdd(&tar, "cut", NULL, '0', "h", 1, 8);
+    TarClose(&tar);
+    CHECK(TarRun(&tar, tar.len, &log) == -1);
+    CHECK(log.logLen == 0);
+    TarInit(&reader, &handler);
+    CHECK(!TarFeed(&reader, tar.data, tar.len) && reader.nameTooLong);
+
+    // Before a skipped member it doesn't matter
+    tar.len = 0;
+    TarAddLongName(&tar, hugeName);
+    TarAdd(&tar, "link", NULL, '2', NULL, 0, 0);
+    TarAdd(&tar, "after.txt", NULL, '0', "a", 1, 8);
+    TarClose(&tar);
+    CHECK(TarRun(&tar, tar.len, &log) == 1);
+    CHECK(strncmp(log.log, "after.txt|", 10) == 0);
+}
+#endif
+
+int main(void)
+{
+    Crc32Init();
+
+    TestSplitPath();
+    TestEqualsIgnoreCase();
+    TestMatchesExtension();
+    TestClassifySelection();
+    TestSelectionArena();
+    TestEncodeListLine();
+#if !defined(CORE_TESTS_PATHS_ONLY)
+    TestNaming();
+    TestCommands();
+#if defined(__linux__)
+    TestListHandoff();
+#endif
+    TestPathFilter();
+    TestPathFilterLimits();
+    TestDevices();
+    TestQos();
+    TestStats();
+    TestPremultiplyAlpha();
+    TestCrc32();
+    TestCodecs();
+    TestGzipHeader();
+    TestTar();
+#endif
+
+    printf("%d checks, %d failed\n", g_checks, g_failures);
+    return g_failures ? 1 : 0;
+}
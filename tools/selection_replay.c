@@ -0,0 +1,344 @@
+/*
+ * WinRAR Shell Extension - selection replay
+ *
+ * Runs a selection captured with [Trace] DumpMs (selection.txt, next to
+ * trace.json) through the same portable steps the extension takes for it:
+ * classification, archive and destination naming, list lines and WinRAR
+ * command lines. Prints what the menu would offer and the time each step
+ * takes, so a slow right-click can be profiled away from Explorer:
+ *
+ *   selection_replay selection.txt [iterations]
+ *
+ * Folders and archives are known from the capture, nothing is read from
+ * disk. The zip jobs' folder walks and WinRAR itself aren't replayed.
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L  // clock_gettime
+#endif
+
+#include "../core.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define MAX_ITEMS  16384          // Same as the extension's MAX_SELECTED_ITEMS
+#define WINRAR_EXE L"C:\\Program Files\\WinRAR\\WinRAR.exe"
+#define LIST_PATH  L"C:\\Users\\user\\AppData\\Local\\Temp\\wrq0000.lst"
+
+static double Now(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+//=============================================================================
+// Capture file
+//=============================================================================
+typedef struct {
+    wchar_t extensions[MAX_EXTENSIONS][EXTENSION_CHARS];
+    int nExtensions;
+    wchar_t* paths[MAX_ITEMS];
+    int isDir[MAX_ITEMS];
+    unsigned nPaths;
+} Capture;
+
+// UTF-8 to wchar_t (UTF-16 where wchar_t is 16-bit); returns 0 if it
+// doesn't fit in cch
+static int DecodeUtf8(const char* s, wchar_t* out, size_t cch)
+{
+    size_t n = 0;
+
+    while (*s)
+    {
+        uint32_t c = (uint8_t)*s++;
+        int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+        if (extra) c &= 0x3F >> extra;
+        for (; extra && (*s & 0xC0) == 0x80; extra--)
+            c = (c << 6) | ((uint8_t)*s++ & 0x3F);
+
+        if (c > 0xFFFF && WCHAR_MAX <= 0xFFFF)
+        {
+            if (n + 2 >= cch) return 0;
+            c -= 0x10000;
+            out[n++] = (wchar_t)(0xD800 | (c >> 10));
+            out[n++] = (wchar_t)(0xDC00 | (c & 0x3FF));
+        }
+        else
+        {
+            if (n + 1 >= cch) return 0;
+            out[n++] = (wchar_t)c;
+        }
+    }
+    out[n] = L'\0';
+    return 1;
+}
+
+static void PrintWide(const char* label, const wchar_t* s)
+{
+    char text[CORE_MAX_PATH * 8];
+    size_t n = 0;
+
+    for (; *s && n + 4 < sizeof(text); s++)
+    {
+        uint32_t c = (uint32_t)*s;
+        if (c >= 0xD800 && c < 0xDC00 && s[1] >= 0xDC00 && s[1] < 0xE000)
+            c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)*++s - 0xDC00);
+
+        if (c < 0x80) text[n++] = (char)c;
+        else if (c < 0x800) { text[n++] = (char)(0xC0 | (c >> 6)); text[n++] = (char)(0x80 | (c & 0x3F)); }
+        else if (c < 0x10000)
+        {
+            text[n++] = (char)(0xE0 | (c >> 12));
+            text[n++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            text[n++] = (char)(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            text[n++] = (char)(0xF0 | (c >> 18));
+            text[n++] = (char)(0x80 | ((c >> 12) & 0x3F));
+            text[n++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            text[n++] = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    text[n] = '\0';
+    printf("%-16s %s\n", label, text);
+}
+
+static int LoadCapture(const char* fileName, Capture* cap)
+{
+    FILE* f = fopen(fileName, "rb");
+    char line[CORE_MAX_PATH * 4 + 16];
+    wchar_t wide[CORE_MAX_PATH];
+
+    if (!f)
+    {
+        fprintf(stderr, "can't open %s\n", fileName);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        size_t len = strlen(line);
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+
+        if (strncmp(line, "ext ", 4) == 0)
+        {
+            if (cap->nExtensions < MAX_EXTENSIONS &&
+                DecodeUtf8(line + 4, cap->extensions[cap->nExtensions], EXTENSION_CHARS))
+                cap->nExtensions++;
+        }
+        else if (strncmp(line, "file ", 5) == 0 || strncmp(line, "dir ", 4) == 0)
+        {
+            int isDir = line[0] == 'd';
+            // Cut at MAX_PATH like the extension does
+            if (cap->nPaths >= MAX_ITEMS || !DecodeUtf8(line + (isDir ? 4 : 5), wide, CORE_MAX_PATH))
+                continue;
+
+            size_t n = 0;
+            while (wide[n]) n++;
+            wchar_t* path = malloc((n + 1) * sizeof(wchar_t));
+            if (!path) break;
+            memcpy(path, wide, (n + 1) * sizeof(wchar_t));
+            cap->paths[cap->nPaths] = path;
+            cap->isDir[cap->nPaths] = isDir;
+            cap->nPaths++;
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+//=============================================================================
+// The extension's steps, as in ReadSelection and InvokeCommand
+//=============================================================================
+typedef struct {
+    SelectionType selType;
+    wchar_t parentFolder[CORE_MAX_PATH];
+    const wchar_t* parentName;
+    wchar_t rootName[8];
+    wchar_t folderName[CORE_MAX_PATH];
+    wchar_t destFolder[CORE_MAX_PATH];
+    wchar_t zipPath[CORE_MAX_PATH];
+    wchar_t command[4 * CORE_MAX_PATH];
+    size_t listUnits;
+    int ok;
+} Plan;
+
+static uint16_t* g_List;
+static size_t g_ListCap;
+
+static void Classify(const Capture* cap, Plan* plan)
+{
+    unsigned nFiles = 0, nFolders = 0;
+    int singleIsArchive = 0;
+
+    for (unsigned i = 0; i < cap->nPaths; i++)
+    {
+        if (cap->nPaths == 1 && MatchesExtension(cap->paths[i], cap->extensions, cap->nExtensions))
+        {
+            singleIsArchive = 1;
+            break;
+        }
+        if (cap->isDir[i]) nFolders++;
+        else nFiles++;
+    }
+
+    plan->selType = (cap->nPaths == 1)
+        ? ClassifySelection(!nFolders, nFolders, singleIsArchive)
+        : ClassifySelection(nFiles, nFolders, 0);
+}
+
+// PathRemoveFileSpec: drop the last component, keep "C:\"
+static void ParentOf(const wchar_t* path, wchar_t* out)
+{
+    PathSpans spans;
+    SplitPath(path, &spans);
+
+    size_t len = spans.nameStart;
+    if (len > 1 && (path[len - 1] == L'\\' || path[len - 1] == L'/') && path[len - 2] != L':')
+        len--;
+    memcpy(out, path, len * sizeof(wchar_t));
+    out[len] = L'\0';
+}
+
+static void Name(const Capture* cap, Plan* plan)
+{
+    ParentOf(cap->paths[0], plan->parentFolder);
+    plan->parentName = FindFileName(plan->parentFolder);
+
+    // Drive root: the extension asks for the volume label first, which
+    // isn't in the capture, so go by the drive letter
+    if (!plan->parentName[0])
+    {
+        if (plan->parentFolder[0] && plan->parentFolder[1] == L':')
+        {
+            plan->rootName[0] = plan->parentFolder[0];
+            plan->rootName[1] = L'\0';
+        }
+        else
+        {
+            memcpy(plan->rootName, L"Archive", sizeof(L"Archive"));
+        }
+        plan->parentName = plan->rootName;
+    }
+
+    if (plan->selType == SEL_SINGLE_ARCHIVE)
+        plan->ok = MakeExtractDestination(cap->paths[0], plan->folderName, plan->destFolder);
+    else
+        plan->ok = MakeZipPath(plan->parentFolder, plan->parentName, plan->zipPath);
+}
+
+// Names relative to the parent folder, as the zip job's list holds them
+static void List(const Capture* cap, Plan* plan)
+{
+    size_t skip = 0, used = 0;
+    while (plan->parentFolder[skip]) skip++;
+
+    for (unsigned i = 0; i < cap->nPaths; i++)
+    {
+        const wchar_t* path = cap->paths[i];
+        size_t n = 0;
+        while (n < skip && path[n]) n++;
+        if (path[n] == L'\\' || path[n] == L'/') n++;
+        used += EncodeListLine(path + n, g_List + used, g_ListCap - used);
+    }
+    plan->listUnits = used;
+}
+
+static void Command(const Capture* cap, Plan* plan)
+{
+    if (plan->selType == SEL_SINGLE_ARCHIVE)
+        plan->ok &= FormatExtractCommand(plan->command, sizeof(plan->command) / sizeof(wchar_t),
+                                         WINRAR_EXE, cap->paths[0], NULL, plan->destFolder);
+    else
+        plan->ok &= FormatListCommand(plan->command, sizeof(plan->command) / sizeof(wchar_t),
+                                      WINRAR_EXE, L"a -afzip -m5 -mt8", plan->zipPath, LIST_PATH);
+}
+
+int main(int argc, char** argv)
+{
+    static Capture cap;
+    static Plan plan;
+    static const char* selNames[] = { "none", "single archive", "files", "folders", "mixed" };
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s selection.txt [iterations]\n", argv[0]);
+        return 2;
+    }
+    long iterations = argc > 2 ? atol(argv[2]) : 10000;
+    if (iterations < 1) iterations = 1;
+
+    if (!LoadCapture(argv[1], &cap))
+        return 1;
+    if (cap.nPaths == 0)
+    {
+        fprintf(stderr, "%s: no file or dir lines\n", argv[1]);
+        return 1;
+    }
+
+    g_ListCap = (size_t)cap.nPaths * (CORE_MAX_PATH * 2 + 2);
+    g_List = malloc(g_ListCap * sizeof(uint16_t));
+    if (!g_List) return 1;
+
+    // What the menu would show and run
+    Classify(&cap, &plan);
+    Name(&cap, &plan);
+    List(&cap, &plan);
+    Command(&cap, &plan);
+
+    printf("%u items, %d archive extensions\n", cap.nPaths, cap.nExtensions);
+    printf("%-16s %s\n", "selection", selNames[plan.selType]);
+    PrintWide("parent", plan.parentFolder);
+    if (plan.selType == SEL_SINGLE_ARCHIVE)
+    {
+        PrintWide("extract to", plan.folderName);
+        PrintWide("destination", plan.destFolder);
+    }
+    else if (plan.selType != SEL_NONE)
+    {
+        PrintWide("zip to", plan.zipPath);
+        printf("%-16s %zu bytes\n", "list file", plan.listUnits * 2 + 2);
+    }
+    PrintWide("command", plan.command);
+    if (!plan.ok)
+        printf("%-16s a name or the command line doesn't fit; the job would fail\n", "note");
+
+    // Each step on its own, then all of them as one right-click + invoke
+    static const struct { const char* name; void (*fn)(const Capture*, Plan*); } steps[] = {
+        { "classify", Classify }, { "name", Name }, { "list", List }, { "command", Command },
+    };
+    double total = 0;
+
+    printf("\n%-16s %12s  (%ld iterations)\n", "step", "us/selection", iterations);
+    for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); s++)
+    {
+        double start = Now();
+        for (long i = 0; i < iterations; i++)
+            steps[s].fn(&cap, &plan);
+        double us = (Now() - start) * 1e6 / (double)iterations;
+        total += us;
+        printf("%-16s %12.3f\n", steps[s].name, us);
+    }
+    printf("%-16s %12.3f\n", "total", total);
+
+    for (unsigned i = 0; i < cap.nPaths; i++) free(cap.paths[i]);
+    free(g_List);
+    return plan.ok ? 0 : 1;
+}